@@ -19,6 +19,7 @@
 #include "valent-packet.h"
 #include "valent-task-queue.h"
 #include "valent-transfer.h"
+#include "valent-transfer-scheduler.h"
 #include "valent-utils.h"
 
 #undef VALENT_CORE_INSIDE
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#pragma once
+
+#include <glib.h>
+
+#include "valent-channel.h"
+#include "valent-packet-private.h"
+
+#if defined (__AVX2__)
+# include <immintrin.h>
+#elif defined (__SSE2__)
+# include <emmintrin.h>
+#elif defined (__ARM_NEON) && defined (__aarch64__)
+# include <arm_neon.h>
+#endif
+
+G_BEGIN_DECLS
+
+/**
+ * ValentChannelFilterFunc:
+ * @channel: a #ValentChannel
+ * @header: a #ValentPacketHeader
+ * @user_data: user supplied data
+ *
+ * A function to decide whether a packet should be parsed and returned.
+ *
+ * Returns: %TRUE to parse the packet, %FALSE to discard it
+ */
+typedef gboolean (*ValentChannelFilterFunc) (ValentChannel            *channel,
+                                             const ValentPacketHeader *header,
+                                             gpointer                  user_data);
+
+GArray * valent_channel_read_views_finish    (ValentChannel            *channel,
+                                             GAsyncResult             *result,
+                                             GError                  **error);
+void     valent_channel_set_packet_filter    (ValentChannel            *channel,
+                                             ValentChannelFilterFunc   filter_func,
+                                             gpointer                  filter_data);
+void     valent_channel_write_packet_replace (ValentChannel            *channel,
+                                             JsonNode                 *packet,
+                                             const char               *key,
+                                             GCancellable             *cancellable,
+                                             GAsyncReadyCallback       callback,
+                                             gpointer                  user_data);
+
+/**
+ * valent_channel_buffer_find_lf: (skip)
+ * @buffer: a byte buffer
+ * @start: the offset to start scanning from
+ * @end: the offset to stop scanning at
+ *
+ * Find the first LF (`\n`) in @buffer between @start and @end.
+ *
+ * On x86 and aarch64 the buffer is scanned in 16 or 32 byte blocks, with the
+ * remainder handled one byte at a time.
+ *
+ * Returns: the offset of the LF, or @end if not found
+ */
+static inline gsize
+valent_channel_buffer_find_lf (const guint8 *buffer,
+                               gsize         start,
+                               gsize         end)
+{
+  gsize i = start;
+
+#if defined (__AVX2__)
+  const __m256i lf = _mm256_set1_epi8 ('\n');
+
+  for (; i + 32 <= end; i += 32)
+    {
+      __m256i block = _mm256_loadu_si256 ((const __m256i *)(buffer + i));
+      guint32 mask = (guint32)_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (block, lf));
+
+      if G_UNLIKELY (mask != 0)
+        return i + g_bit_nth_lsf (mask, -1);
+    }
+#elif defined (__SSE2__)
+  const __m128i lf = _mm_set1_epi8 ('\n');
+
+  for (; i + 16 <= end; i += 16)
+    {
+      __m128i block = _mm_loadu_si128 ((const __m128i *)(buffer + i));
+      guint32 mask = (guint32)_mm_movemask_epi8 (_mm_cmpeq_epi8 (block, lf));
+
+      if G_UNLIKELY (mask != 0)
+        return i + g_bit_nth_lsf (mask, -1);
+    }
+#elif defined (__ARM_NEON) && defined (__aarch64__)
+  const uint8x16_t lf = vdupq_n_u8 ('\n');
+
+  for (; i + 16 <= end; i += 16)
+    {
+      uint8x16_t block = vld1q_u8 (buffer + i);
+
+      /* Fall through to the byte loop to locate the match */
+      if G_UNLIKELY (vmaxvq_u8 (vceqq_u8 (block, lf)) != 0)
+        break;
+    }
+#endif
+
+  for (; i < end; i++)
+    {
+      if G_UNLIKELY (buffer[i] == '\n')
+        return i;
+    }
+
+  return end;
+}
+
+G_END_DECLS
+
@@ -336,6 +336,18 @@ valent_channel_service_real_build_identity (ValentChannelService *service)
 
     json_builder_end_array (builder);
 
+    /* Packet Compression (see ValentChannel) */
+    json_builder_set_member_name (builder, "valentCompression");
+    json_builder_begin_array (builder);
+    json_builder_add_string_value (builder, "deflate");
+    json_builder_end_array (builder);
+
+    /* Resumable Payloads (see ValentTransfer) */
+    json_builder_set_member_name (builder, "valentPayload");
+    json_builder_begin_array (builder);
+    json_builder_add_string_value (builder, "resume");
+    json_builder_end_array (builder);
+
   /* End Body, Packet */
   json_builder_end_object (builder);
   json_builder_end_object (builder);
@@ -9,13 +9,24 @@
 #include <json-glib/json-glib.h>
 
 #include "valent-channel.h"
+#include "valent-channel-private.h"
 #include "valent-data.h"
 #include "valent-debug.h"
 #include "valent-macros.h"
 #include "valent-packet.h"
+#include "valent-packet-private.h"
 #include "valent-task-queue.h"
 
 #define BUFFER_SIZE 4096
+#define OUTPUT_BATCH_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_MAX (1024 * 1024)
+#define OUTPUT_QUEUE_LIMIT 1024
+#define OUTPUT_WRITE_TIMEOUT 15
+
+#define COMPRESS_MIN        (4 * 1024)
+#define COMPRESS_PREFIX     '~'
+#define COMPRESS_BUFFER_MAX (256 * 1024)
+#define DECOMPRESS_MAX      (64 * 1024 * 1024)
 
 
 /**
@@ -49,10 +60,33 @@ typedef struct
   gsize            buffer_size;
   gsize            pos;
   gsize            end;
+  gsize            scan;
+
+  ValentChannelFilterFunc filter_func;
+  gpointer                filter_data;
+
+  /* Packet Compression */
+  gboolean         compress;
+  GConverter      *compressor;
+  GByteArray      *compress_buffer;
+  GConverter      *decompressor;
+  GByteArray      *decompress_buffer;
+  GByteArray      *decode_buffer;
 
   /* Output Buffer */
   ValentTaskQueue *output;
-  JsonGenerator   *generator;
+  GByteArray      *output_buffer;
+  GMutex           output_lock;
+  GQueue           output_tasks;
+  unsigned int     output_limit;
+  unsigned int     output_closed : 1;
+  unsigned int     output_flush : 1;
+  int              output_notify;
+
+  /* Payload Transfers */
+  unsigned int     transfer_limit;
+
+  GCancellable    *cancellable;
 } ValentChannelPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ValentChannel, valent_channel, G_TYPE_OBJECT)
@@ -72,41 +106,442 @@ enum {
   PROP_BASE_STREAM,
   PROP_IDENTITY,
   PROP_PEER_IDENTITY,
+  PROP_QUEUE_LENGTH,
+  PROP_QUEUE_LIMIT,
+  PROP_TRANSFER_LIMIT,
   PROP_URI,
   N_PROPERTIES
 };
 
 static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 
+enum {
+  CLOSED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS] = { 0, };
+
+
+/*
+ * Packet Compression
+ *
+ * If both identity packets list `deflate` in the `valentCompression` field,
+ * packets larger than %COMPRESS_MIN are sent as a line starting with
+ * %COMPRESS_PREFIX, followed by the zlib-compressed packet in base64. A JSON
+ * packet never starts with %COMPRESS_PREFIX, so the line framing is unchanged.
+ */
+static gboolean
+identity_supports_deflate (JsonNode *identity)
+{
+  JsonObject *body;
+  JsonArray *methods;
+
+  if (identity == NULL || !JSON_NODE_HOLDS_OBJECT (identity))
+    return FALSE;
+
+  if ((body = valent_packet_get_body (identity)) == NULL)
+    return FALSE;
+
+  if (!json_object_has_member (body, "valentCompression") ||
+      (methods = json_object_get_array_member (body, "valentCompression")) == NULL)
+    return FALSE;
+
+  for (unsigned int i = 0, len = json_array_get_length (methods); i < len; i++)
+    {
+      JsonNode *method = json_array_get_element (methods, i);
+
+      if (json_node_get_value_type (method) == G_TYPE_STRING &&
+          g_strcmp0 (json_node_get_string (method), "deflate") == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static inline gboolean
+channel_convert_grow (GByteArray  *output,
+                      gsize        max_length,
+                      GError     **error)
+{
+  if G_UNLIKELY (output->len >= max_length)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_MESSAGE_TOO_LARGE,
+                           "Packet too large");
+      return FALSE;
+    }
+
+  g_byte_array_set_size (output, MIN (output->len * 2, max_length));
+
+  return TRUE;
+}
+
+/**
+ * channel_convert_release:
+ * @buffer: (inout): a #GByteArray
+ *
+ * Replace @buffer with a new array if the last packet grew it past
+ * %COMPRESS_BUFFER_MAX, so an unusually large packet doesn't hold on to its
+ * memory for the lifetime of the channel.
+ */
+static inline void
+channel_convert_release (GByteArray **buffer)
+{
+  if G_UNLIKELY (*buffer != NULL && (*buffer)->len > COMPRESS_BUFFER_MAX)
+    {
+      g_byte_array_unref (*buffer);
+      *buffer = g_byte_array_sized_new (BUFFER_SIZE);
+    }
+}
+
+/**
+ * channel_convert:
+ * @converter: a #GConverter
+ * @data: input data
+ * @length: length of @data
+ * @output: a #GByteArray to hold the result
+ * @max_length: maximum length of the result
+ * @error: (nullable): a #GError
+ *
+ * Run @data through @converter in one pass, replacing the contents of @output.
+ *
+ * Returns: %TRUE or %FALSE with @error set
+ */
+static gboolean
+channel_convert (GConverter    *converter,
+                 const guint8  *data,
+                 gsize          length,
+                 GByteArray    *output,
+                 gsize          max_length,
+                 GError       **error)
+{
+  GConverterResult result = G_CONVERTER_CONVERTED;
+  gsize output_len = 0;
+
+  g_converter_reset (converter);
+  g_byte_array_set_size (output, MAX (output->len, BUFFER_SIZE));
+
+  while (result != G_CONVERTER_FINISHED)
+    {
+      g_autoptr (GError) convert_error = NULL;
+      gsize n_read = 0;
+      gsize n_written = 0;
+
+      if (output_len == output->len &&
+          !channel_convert_grow (output, max_length, error))
+        return FALSE;
+
+      result = g_converter_convert (converter,
+                                    data, length,
+                                    output->data + output_len,
+                                    output->len - output_len,
+                                    G_CONVERTER_INPUT_AT_END,
+                                    &n_read,
+                                    &n_written,
+                                    &convert_error);
+
+      if (result == G_CONVERTER_ERROR)
+        {
+          if (!g_error_matches (convert_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+            {
+              g_propagate_error (error, g_steal_pointer (&convert_error));
+              return FALSE;
+            }
+
+          if (!channel_convert_grow (output, max_length, error))
+            return FALSE;
+
+          continue;
+        }
+
+      data += n_read;
+      length -= n_read;
+      output_len += n_written;
+    }
+
+  g_byte_array_set_size (output, output_len);
+
+  return TRUE;
+}
+
+/**
+ * channel_compress_line:
+ * @channel: a #ValentChannel
+ * @start: the offset of the line in the output buffer
+ *
+ * Replace the serialized packet starting at @start in the output buffer with a
+ * compressed line, if it is large enough and compression reduces its size.
+ */
+static void
+channel_compress_line (ValentChannel *channel,
+                       gsize          start)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  gsize packet_len = priv->output_buffer->len - start - 1;
+  gsize encoded_max, encoded_len;
+  int state = 0, save = 0;
+  char *out;
+
+  if (!priv->compress || packet_len < COMPRESS_MIN)
+    return;
+
+  if (priv->compressor == NULL)
+    {
+      priv->compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1));
+      priv->compress_buffer = g_byte_array_sized_new (BUFFER_SIZE);
+    }
+
+  if (!channel_convert (priv->compressor,
+                        priv->output_buffer->data + start,
+                        packet_len,
+                        priv->compress_buffer,
+                        G_MAXSIZE,
+                        NULL))
+    goto out;
+
+  /* Only send the compressed line if it's actually smaller */
+  encoded_max = (priv->compress_buffer->len / 3 + 1) * 4 + 4;
+
+  if (encoded_max + 2 >= packet_len + 1)
+    goto out;
+
+  g_byte_array_set_size (priv->output_buffer, start + 1 + encoded_max + 1);
+  out = (char *)priv->output_buffer->data + start;
+  out[0] = COMPRESS_PREFIX;
+
+  encoded_len = g_base64_encode_step (priv->compress_buffer->data,
+                                      priv->compress_buffer->len,
+                                      FALSE,
+                                      out + 1,
+                                      &state,
+                                      &save);
+  encoded_len += g_base64_encode_close (FALSE, out + 1 + encoded_len, &state, &save);
+  out[1 + encoded_len] = '\n';
+
+  g_byte_array_set_size (priv->output_buffer, start + 1 + encoded_len + 1);
+
+out:
+  channel_convert_release (&priv->compress_buffer);
+}
+
+/**
+ * channel_decompress_line:
+ * @channel: a #ValentChannel
+ * @line: (inout): a compressed line
+ * @line_len: (inout): the length of @line
+ * @error: (nullable): a #GError
+ *
+ * Decompress a line starting with %COMPRESS_PREFIX, replacing @line and
+ * @line_len with the decompressed packet.
+ *
+ * The result is held in a buffer owned by @channel, which the caller should
+ * pass to channel_convert_release() when it is done with @line.
+ *
+ * Returns: %TRUE or %FALSE with @error set
+ */
+static gboolean
+channel_decompress_line (ValentChannel  *channel,
+                         const char    **line,
+                         gssize         *line_len,
+                         GError        **error)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  gsize decoded_len;
+  int state = 0;
+  unsigned int save = 0;
+  gboolean ret;
+
+  if G_UNLIKELY (!priv->compress)
+    {
+      g_set_error_literal (error,
+                           VALENT_PACKET_ERROR,
+                           VALENT_PACKET_ERROR_MALFORMED,
+                           "Unexpected compressed packet");
+      return FALSE;
+    }
+
+  if (priv->decompressor == NULL)
+    {
+      priv->decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+      priv->decompress_buffer = g_byte_array_sized_new (BUFFER_SIZE);
+      priv->decode_buffer = g_byte_array_sized_new (BUFFER_SIZE);
+    }
+
+  g_byte_array_set_size (priv->decode_buffer, (*line_len / 4) * 3 + 3);
+  decoded_len = g_base64_decode_step (*line + 1,
+                                      *line_len - 1,
+                                      priv->decode_buffer->data,
+                                      &state,
+                                      &save);
+
+  ret = channel_convert (priv->decompressor,
+                         priv->decode_buffer->data,
+                         decoded_len,
+                         priv->decompress_buffer,
+                         DECOMPRESS_MAX,
+                         error);
+  channel_convert_release (&priv->decode_buffer);
+
+  if (!ret)
+    {
+      channel_convert_release (&priv->decompress_buffer);
+      return FALSE;
+    }
+
+  *line = (const char *)priv->decompress_buffer->data;
+  *line_len = priv->decompress_buffer->len;
+
+  return TRUE;
+}
 
 /*
  * Packet Buffer
  */
-static inline gsize
+static inline gboolean
 channel_buffer_find_lf (ValentChannelPrivate *priv,
-                        gsize                *cursor_out)
+                        gsize                *lf_out)
 {
-  for (gsize cursor = *cursor_out; cursor < priv->end; cursor++)
+  gsize lf_pos;
+
+  /* Resume scanning where the last scan stopped */
+  lf_pos = valent_channel_buffer_find_lf (priv->buffer,
+                                          MAX (priv->scan, priv->pos),
+                                          priv->end);
+
+  if (lf_pos == priv->end)
     {
-      if G_UNLIKELY (priv->buffer[cursor] == '\n')
-        return cursor;
+      priv->scan = priv->end;
+      return FALSE;
     }
 
-  return 0;
+  priv->scan = lf_pos + 1;
+  *lf_out = lf_pos;
+
+  return TRUE;
 }
 
-static JsonNode *
-valent_channel_read_packet_internal (ValentChannel  *channel,
-                                     GCancellable   *cancellable,
-                                     GError        **error)
+static void
+channel_view_clear (gpointer data)
+{
+  ValentPacketView *view = data;
+
+  g_clear_pointer (&view->packet, json_node_unref);
+}
+
+/**
+ * channel_buffer_parse_packet:
+ * @channel: a #ValentChannel
+ * @packet_str: a serialized packet
+ * @packet_len: the length of @packet_str
+ * @blocking: whether this is a blocking read
+ * @view: (out): a #ValentPacketView
+ * @error: (nullable): a #GError
+ *
+ * Parse and validate @packet_str. On success @view holds a reference to the
+ * packet, which is released by channel_view_clear(), or %NULL if the packet
+ * filter rejected it.
+ *
+ * Returns: %TRUE or %FALSE with @error set
+ */
+static inline gboolean
+channel_buffer_parse_packet (ValentChannel     *channel,
+                             const char        *packet_str,
+                             gssize             packet_len,
+                             gboolean           blocking,
+                             ValentPacketView  *view,
+                             GError           **error)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  g_autoptr (JsonNode) packet = NULL;
+
+  /* The packet filter is only invoked in the main context of non-blocking
+   * reads. If it rejects the packet, the line is discarded unparsed. */
+  if (!blocking && priv->filter_func != NULL)
+    {
+      ValentPacketHeader header;
+
+      if (valent_packet_peek_header (packet_str, packet_len, &header) &&
+          !priv->filter_func (channel, &header, priv->filter_data))
+        {
+          view->packet = NULL;
+          return TRUE;
+        }
+    }
+
+  /* Try to parse the line as JSON */
+  if (!json_parser_load_from_data (priv->parser, packet_str, packet_len, error))
+    return FALSE;
+
+  packet = json_parser_steal_root (priv->parser);
+
+  /* Simple packet validation, in a single pass over the root object. The view
+   * is handed to the caller, so the packet is only walked once. */
+  if (!valent_packet_view_init (view, packet, error))
+    {
+      view->packet = NULL;
+      return FALSE;
+    }
+
+  g_steal_pointer (&packet);
+
+  return TRUE;
+}
+
+static inline gboolean
+channel_buffer_parse_line (ValentChannel     *channel,
+                           gsize              lf_pos,
+                           gboolean           blocking,
+                           ValentPacketView  *view,
+                           GError           **error)
 {
   ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
-  GInputStream *input_stream;
-  gsize lf_pos;
-  gsize cursor;
   const char *packet_str;
   gssize packet_len;
-  g_autoptr (JsonNode) packet = NULL;
+  gboolean ret;
+
+  /* Size the line and compact buffer */
+  packet_str = (const char *)priv->buffer + priv->pos;
+  packet_len = lf_pos - priv->pos;
+  priv->pos = lf_pos + 1;
+
+  if (packet_len == 0 || packet_str[0] != COMPRESS_PREFIX)
+    {
+      return channel_buffer_parse_packet (channel,
+                                          packet_str,
+                                          packet_len,
+                                          blocking,
+                                          view,
+                                          error);
+    }
+
+  if (!channel_decompress_line (channel, &packet_str, &packet_len, error))
+    return FALSE;
+
+  ret = channel_buffer_parse_packet (channel,
+                                     packet_str,
+                                     packet_len,
+                                     blocking,
+                                     view,
+                                     error);
+  channel_convert_release (&priv->decompress_buffer);
+
+  return ret;
+}
+
+static gboolean
+valent_channel_read_packet_internal (ValentChannel     *channel,
+                                     gboolean           blocking,
+                                     GCancellable      *cancellable,
+                                     ValentPacketView  *view,
+                                     GError           **error)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  GInputStream *input_stream;
+  gsize lf_pos;
+
+  view->packet = NULL;
 
   if (priv->base_stream == NULL || g_io_stream_is_closed (priv->base_stream))
     {
@@ -114,17 +549,24 @@ valent_channel_read_packet_internal (ValentChannel  *channel,
                    G_IO_ERROR,
                    G_IO_ERROR_NOT_CONNECTED,
                    "Channel is closed");
-      return NULL;
+      return FALSE;
     }
 
   input_stream = g_io_stream_get_input_stream (priv->base_stream);
 
-  cursor = priv->pos;
-
-  while ((lf_pos = channel_buffer_find_lf (priv, &cursor)) == 0)
+  while (view->packet == NULL)
     {
       gssize n_read;
 
+      /* Parse the next complete line, if any */
+      if (channel_buffer_find_lf (priv, &lf_pos))
+        {
+          if (!channel_buffer_parse_line (channel, lf_pos, blocking, view, error))
+            return FALSE;
+
+          continue;
+        }
+
       /* Compact or extend the buffer */
       if G_UNLIKELY (priv->buffer_size - priv->end == 0)
         {
@@ -135,7 +577,7 @@ valent_channel_read_packet_internal (ValentChannel  *channel,
               n_used = priv->end - priv->pos;
 
               memmove (priv->buffer, priv->buffer + priv->pos, n_used);
-              cursor = cursor - priv->pos;
+              priv->scan = priv->scan - priv->pos;
               priv->end = priv->end - priv->pos;
               priv->pos = 0;
             }
@@ -147,11 +589,24 @@ valent_channel_read_packet_internal (ValentChannel  *channel,
         }
 
       /* Fill the buffer */
-      n_read = g_input_stream_read (input_stream,
-                                    priv->buffer + priv->end,
-                                    priv->buffer_size - priv->end,
-                                    cancellable,
-                                    error);
+      if (blocking)
+        {
+          n_read = g_input_stream_read (input_stream,
+                                        priv->buffer + priv->end,
+                                        priv->buffer_size - priv->end,
+                                        cancellable,
+                                        error);
+        }
+      else
+        {
+          GPollableInputStream *pollable = G_POLLABLE_INPUT_STREAM (input_stream);
+
+          n_read = g_pollable_input_stream_read_nonblocking (pollable,
+                                                             priv->buffer + priv->end,
+                                                             priv->buffer_size - priv->end,
+                                                             cancellable,
+                                                             error);
+        }
 
       /* Success; loop to check for an LF */
       if (n_read > 0)
@@ -164,30 +619,95 @@ valent_channel_read_packet_internal (ValentChannel  *channel,
                        G_IO_ERROR,
                        G_IO_ERROR_CONNECTION_CLOSED,
                        "Channel is closed");
-          return NULL;
+          return FALSE;
         }
 
-      /* There was a genuine error */
+      /* There was a genuine error, or %G_IO_ERROR_WOULD_BLOCK */
       else
-        return NULL;
+        return FALSE;
     }
 
-  /* Size the line and compact buffer */
-  packet_str = (const char *)priv->buffer + priv->pos;
-  packet_len = lf_pos - priv->pos;
-  priv->pos = lf_pos + 1;
+  return TRUE;
+}
 
-  /* Try to parse the line as JSON */
-  if (!json_parser_load_from_data (priv->parser, packet_str, packet_len, error))
-    return NULL;
+/**
+ * valent_channel_read_buffered:
+ * @channel: a #ValentChannel
+ *
+ * Try to parse the next packet from the input buffer, without reading from the
+ * base stream.
+ *
+ * If there is no complete line in the buffer or parsing fails, %FALSE is
+ * returned. In the case of a malformed packet, the line is left in the buffer
+ * so that the error is reported by the next read.
+ *
+ * Returns: %TRUE if @view holds a packet
+ */
+static gboolean
+valent_channel_read_buffered (ValentChannel    *channel,
+                              gboolean          blocking,
+                              ValentPacketView *view)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  gsize lf_pos;
+  gsize pos;
 
-  packet = json_parser_steal_root (priv->parser);
+  view->packet = NULL;
 
-  /* Simple packet validation */
-  if (!valent_packet_validate (packet, error))
-    return NULL;
+  while (view->packet == NULL)
+    {
+      pos = priv->pos;
+
+      if (!channel_buffer_find_lf (priv, &lf_pos))
+        return FALSE;
+
+      if (!channel_buffer_parse_line (channel, lf_pos, blocking, view, NULL))
+        {
+          priv->pos = priv->scan = pos;
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/*
+ * Return the packet in @view for @task, which may be a task for
+ * valent_channel_read_packet() or valent_channel_read_packets().
+ *
+ * For batched reads, any other complete packets already in the input buffer
+ * are returned with it, up to the limit passed by the caller. Batches are
+ * returned as a #GArray of #ValentPacketView, so the views built while
+ * validating the packets can be used by the device.
+ */
+static void
+valent_channel_return_packet (GTask            *task,
+                              ValentPacketView *view,
+                              gboolean          blocking)
+{
+  ValentChannel *channel = g_task_get_source_object (task);
+  GArray *views;
+  unsigned int n_max;
+
+  if (g_task_get_source_tag (task) != valent_channel_read_packets)
+    return g_task_return_pointer (task, view->packet, (GDestroyNotify)json_node_unref);
+
+  n_max = GPOINTER_TO_UINT (g_task_get_task_data (task));
+  views = g_array_sized_new (FALSE, FALSE, sizeof (ValentPacketView), 1);
+  g_array_set_clear_func (views, channel_view_clear);
+  g_array_append_vals (views, view, 1);
+
+  while (views->len < n_max)
+    {
+      ValentPacketView next;
+
+      if (!valent_channel_read_buffered (channel, blocking, &next))
+        break;
+
+      g_array_append_vals (views, &next, 1);
+    }
 
-  return g_steal_pointer (&packet);
+  g_task_return_pointer (task, views, (GDestroyNotify)g_array_unref);
 }
 
 static void
@@ -197,41 +717,105 @@ valent_channel_read_packet_task (GTask        *task,
                                  GCancellable *cancellable)
 {
   ValentChannel *channel = source_object;
+  ValentPacketView view;
   GError *error = NULL;
-  JsonNode *packet;
 
   if (g_task_return_error_if_cancelled (task))
     return;
 
-  packet = valent_channel_read_packet_internal (channel, cancellable, &error);
-
-  if (packet == NULL)
+  if (!valent_channel_read_packet_internal (channel,
+                                            TRUE,
+                                            cancellable,
+                                            &view,
+                                            &error))
     return g_task_return_error (task, error);
 
-  g_task_return_pointer (task, packet, (GDestroyNotify)json_node_unref);
+  valent_channel_return_packet (task, &view, TRUE);
 }
 
+/*
+ * Non-blocking reads
+ *
+ * If the input stream of the base stream is pollable, packets are read from the
+ * main context of the caller by a #GSource, without handing the task off to the
+ * GTask thread pool. Streams that can't be polled fall back to
+ * valent_channel_read_packet_task().
+ */
 static gboolean
-valent_channel_write_packet_internal (ValentChannel  *channel,
-                                      JsonNode       *packet,
-                                      GCancellable   *cancellable,
-                                      GError        **error)
+valent_channel_read_packet_try (GTask *task)
 {
+  ValentChannel *channel = g_task_get_source_object (task);
   ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
-  JsonObject *root;
-  g_autofree char *packet_str = NULL;
-  gsize packet_len;
-  GOutputStream *output_stream;
+  ValentPacketView view;
+  GError *error = NULL;
 
-  if (priv->base_stream == NULL || g_io_stream_is_closed (priv->base_stream))
+  if (g_task_return_error_if_cancelled (task))
+    return TRUE;
+
+  if (g_cancellable_set_error_if_cancelled (priv->cancellable, &error))
     {
-      g_set_error (error,
-                   G_IO_ERROR,
-                   G_IO_ERROR_NOT_CONNECTED,
-                   "Channel is closed");
+      g_task_return_error (task, error);
+      return TRUE;
+    }
+
+  if (valent_channel_read_packet_internal (channel,
+                                           FALSE,
+                                           g_task_get_cancellable (task),
+                                           &view,
+                                           &error))
+    {
+      valent_channel_return_packet (task, &view, FALSE);
+      return TRUE;
+    }
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+    {
+      g_clear_error (&error);
       return FALSE;
     }
 
+  g_task_return_error (task, error);
+  return TRUE;
+}
+
+static gboolean
+valent_channel_read_packet_cb (GObject *pollable,
+                               GTask   *task)
+{
+  if (valent_channel_read_packet_try (task))
+    return G_SOURCE_REMOVE;
+
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Output Buffer
+ */
+typedef struct
+{
+  JsonNode *packet;
+  char     *key;
+} ChannelWrite;
+
+static void
+channel_write_free (gpointer data)
+{
+  ChannelWrite *write = data;
+
+  g_clear_pointer (&write->packet, json_node_unref);
+  g_clear_pointer (&write->key, g_free);
+  g_free (write);
+}
+
+static inline gboolean
+channel_output_append (ValentChannel  *channel,
+                       JsonNode       *packet,
+                       GError        **error)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  JsonObject *root;
+  gsize start = priv->output_buffer->len;
+
   /* Simple validation */
   if (!valent_packet_validate (packet, error))
     return FALSE;
@@ -240,42 +824,408 @@ valent_channel_write_packet_internal (ValentChannel  *channel,
   root = json_node_get_object (packet);
   json_object_set_int_member (root, "id", valent_timestamp_ms ());
 
-  /* Serialize the packet to a NULL-terminated string */
-  json_generator_set_root (priv->generator, packet);
-  packet_str = json_generator_to_data (priv->generator, &packet_len);
+  /* Serialize the packet straight into the output buffer */
+  valent_packet_serialize_to_buffer (packet, priv->output_buffer);
+  channel_compress_line (channel, start);
 
-  /* Replace the trailing NULL with an LF */
-  packet_str[packet_len] = '\n';
-  packet_len += 1;
+  return TRUE;
+}
 
-  output_stream = g_io_stream_get_output_stream (priv->base_stream);
-  return g_output_stream_write_all (output_stream,
-                                    packet_str,
-                                    packet_len,
-                                    NULL,
-                                    cancellable,
-                                    error);
+static inline void
+channel_output_return_error (GQueue       *tasks,
+                             const GError *error)
+{
+  GTask *task;
+
+  while ((task = g_queue_pop_head (tasks)) != NULL)
+    {
+      g_task_return_error (task, g_error_copy (error));
+      g_object_unref (task);
+    }
+}
+
+static inline GTask *
+channel_output_replace (ValentChannelPrivate *priv,
+                        GTask                *task)
+{
+  ChannelWrite *write = g_task_get_task_data (task);
+  const char *type;
+
+  if (write->key == NULL)
+    return NULL;
+
+  type = valent_packet_get_type (write->packet);
+
+  for (GList *iter = priv->output_tasks.head; iter; iter = iter->next)
+    {
+      ChannelWrite *queued = g_task_get_task_data (iter->data);
+
+      if (g_strcmp0 (queued->key, write->key) == 0 &&
+          g_strcmp0 (valent_packet_get_type (queued->packet), type) == 0)
+        {
+          GTask *replaced = iter->data;
+
+          /* The new packet takes the place of the old one in the queue */
+          iter->data = task;
+          return replaced;
+        }
+    }
+
+  return NULL;
+}
+
+static inline void
+channel_output_push (ValentChannelPrivate *priv,
+                     GTask                *task)
+{
+  int priority = g_task_get_priority (task);
+  GList *sibling = priv->output_tasks.tail;
+
+  /* Packets of equal priority stay in the order they were written */
+  while (sibling != NULL && g_task_get_priority (sibling->data) > priority)
+    sibling = sibling->prev;
+
+  if (sibling != NULL)
+    g_queue_insert_after (&priv->output_tasks, sibling, task);
+  else
+    g_queue_push_head (&priv->output_tasks, task);
+}
+
+static inline GTask *
+channel_output_pop (ValentChannelPrivate *priv)
+{
+  GTask *task;
+
+  g_mutex_lock (&priv->output_lock);
+
+  /* Packets queued after this schedule another flush */
+  if ((task = g_queue_pop_head (&priv->output_tasks)) == NULL)
+    priv->output_flush = FALSE;
+
+  g_mutex_unlock (&priv->output_lock);
+
+  return task;
+}
+
+static inline void
+channel_output_cancel (ValentChannelPrivate *priv,
+                       const GError         *error)
+{
+  GQueue pending = G_QUEUE_INIT;
+
+  g_mutex_lock (&priv->output_lock);
+  pending = priv->output_tasks;
+  g_queue_init (&priv->output_tasks);
+  priv->output_flush = FALSE;
+  g_mutex_unlock (&priv->output_lock);
+
+  channel_output_return_error (&pending, error);
+}
+
+/*
+ * Batch Cancellation
+ *
+ * A batch is written with a single call, so the write can only be cancelled as
+ * a whole. The batch gets its own #GCancellable, which is cancelled once every
+ * packet in the batch has been cancelled, or if the write takes longer than
+ * %OUTPUT_WRITE_TIMEOUT seconds.
+ *
+ * Writers share a bounded pool of threads, so the timeout keeps a peer that has
+ * stopped reading from holding a thread indefinitely.
+ */
+typedef struct
+{
+  GCancellable *cancellable;
+  GSource      *timeout;
+  gulong       *handlers;
+  int           remaining;
+} ChannelBatch;
+
+static void
+channel_batch_cancelled (GCancellable *cancellable,
+                         ChannelBatch *batch)
+{
+  if (g_atomic_int_dec_and_test (&batch->remaining))
+    g_cancellable_cancel (batch->cancellable);
+}
+
+static gboolean
+channel_batch_timeout_cb (gpointer data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (data));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+channel_batch_init (ChannelBatch *batch,
+                    GQueue       *tasks)
+{
+  unsigned int i = 0;
+
+  batch->cancellable = g_cancellable_new ();
+  batch->handlers = NULL;
+  batch->remaining = tasks->length;
+
+  /* The timeout holds its own reference, since it is dispatched in the main
+   * context and may still be running when the batch is cleared */
+  batch->timeout = g_timeout_source_new_seconds (OUTPUT_WRITE_TIMEOUT);
+  g_source_set_callback (batch->timeout,
+                         channel_batch_timeout_cb,
+                         g_object_ref (batch->cancellable),
+                         g_object_unref);
+  g_source_set_name (batch->timeout, "[valent-channel] write timeout");
+  g_source_attach (batch->timeout, NULL);
+
+  /* If any packet has no cancellable, the batch can't be cancelled by them */
+  for (const GList *iter = tasks->head; iter; iter = iter->next)
+    {
+      if (g_task_get_cancellable (iter->data) == NULL)
+        return;
+    }
+
+  batch->handlers = g_new0 (gulong, tasks->length);
+
+  for (const GList *iter = tasks->head; iter; iter = iter->next)
+    {
+      batch->handlers[i++] =
+        g_cancellable_connect (g_task_get_cancellable (iter->data),
+                               G_CALLBACK (channel_batch_cancelled),
+                               batch,
+                               NULL);
+    }
+}
+
+static gboolean
+channel_batch_timed_out (ChannelBatch *batch)
+{
+  return g_cancellable_is_cancelled (batch->cancellable) &&
+         g_atomic_int_get (&batch->remaining) > 0;
+}
+
+static void
+channel_batch_clear (ChannelBatch *batch,
+                     GQueue       *tasks)
+{
+  unsigned int i = 0;
+
+  g_source_destroy (batch->timeout);
+  g_clear_pointer (&batch->timeout, g_source_unref);
+
+  /* Waits for a handler running in another thread */
+  if (batch->handlers != NULL)
+    {
+      for (const GList *iter = tasks->head; iter; iter = iter->next)
+        {
+          g_cancellable_disconnect (g_task_get_cancellable (iter->data),
+                                    batch->handlers[i++]);
+        }
+    }
+
+  g_clear_pointer (&batch->handlers, g_free);
+  g_clear_object (&batch->cancellable);
 }
 
+/**
+ * valent_channel_flush_task:
+ *
+ * Write the packets queued since the last flush.
+ *
+ * Packets are taken in order of priority and serialized into a single buffer,
+ * so a burst of packets results in one write (and one TLS record, where
+ * possible) instead of one per packet.
+ *
+ * Each write is limited to roughly %OUTPUT_BATCH_SIZE bytes. Packets queued in
+ * the meantime are sorted into place, so a high priority packet waits for at
+ * most one batch of lower priority packets.
+ *
+ * A batch whose packets have all been cancelled is abandoned. If nothing was
+ * written yet the stream is still usable, otherwise the packets queued behind
+ * it fail too and the channel stops accepting packets, like any other error
+ * after a partial write.
+ *
+ * If a write times out, the batch and any queued packets fail with
+ * %G_IO_ERROR_TIMED_OUT and the channel stops accepting packets, since the peer
+ * is no longer reading and a partial write has broken the framing.
+ */
 static void
-valent_channel_write_packet_task (GTask        *task,
-                                  gpointer      source_object,
-                                  gpointer      task_data,
-                                  GCancellable *cancellable)
+valent_channel_flush_task (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
 {
   ValentChannel *channel = source_object;
-  JsonNode *packet = task_data;
-  GError *error = NULL;
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  GQueue written = G_QUEUE_INIT;
+  GTask *write_task = NULL;
+  GOutputStream *output_stream;
+  gsize buffer_max = 0;
+  g_autoptr (GError) error = NULL;
 
-  if (g_task_return_error_if_cancelled (task))
-    return;
+  if (priv->base_stream == NULL || g_io_stream_is_closed (priv->base_stream))
+    {
+      error = g_error_new_literal (G_IO_ERROR,
+                                   G_IO_ERROR_NOT_CONNECTED,
+                                   "Channel is closed");
+      channel_output_cancel (priv, error);
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
 
-  if (!valent_channel_write_packet_internal (channel, packet, cancellable, &error))
-    return g_task_return_error (task, error);
+  output_stream = g_io_stream_get_output_stream (priv->base_stream);
+
+  do
+    {
+      g_byte_array_set_size (priv->output_buffer, 0);
+
+      while (priv->output_buffer->len < OUTPUT_BATCH_SIZE &&
+             (write_task = channel_output_pop (priv)) != NULL)
+        {
+          ChannelWrite *write = g_task_get_task_data (write_task);
+          GError *packet_error = NULL;
+
+          if (g_task_return_error_if_cancelled (write_task))
+            {
+              g_object_unref (write_task);
+              continue;
+            }
+
+          if (!channel_output_append (channel, write->packet, &packet_error))
+            {
+              g_task_return_error (write_task, packet_error);
+              g_object_unref (write_task);
+              continue;
+            }
+
+          g_queue_push_tail (&written, write_task);
+        }
+
+      if (priv->output_buffer->len > 0)
+        {
+          ChannelBatch batch;
+          gsize n_written = 0;
+
+          buffer_max = MAX (buffer_max, priv->output_buffer->len);
+
+          channel_batch_init (&batch, &written);
+          g_output_stream_write_all (output_stream,
+                                     priv->output_buffer->data,
+                                     priv->output_buffer->len,
+                                     &n_written,
+                                     batch.cancellable,
+                                     &error);
+
+          if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+              channel_batch_timed_out (&batch))
+            {
+              g_clear_error (&error);
+              g_set_error (&error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_TIMED_OUT,
+                           "Timed out writing to channel");
+
+              g_mutex_lock (&priv->output_lock);
+              priv->output_closed = TRUE;
+              g_mutex_unlock (&priv->output_lock);
+            }
+          else if (n_written > 0 && error != NULL)
+            {
+              /* Anything written after a partial line would be corrupt */
+              g_mutex_lock (&priv->output_lock);
+              priv->output_closed = TRUE;
+              g_mutex_unlock (&priv->output_lock);
+            }
+
+          channel_batch_clear (&batch, &written);
+
+          if (n_written == 0 &&
+              g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              channel_output_return_error (&written, error);
+              g_clear_error (&error);
+              continue;
+            }
+        }
+
+      if (error != NULL)
+        {
+          channel_output_return_error (&written, error);
+          channel_output_cancel (priv, error);
+          break;
+        }
+
+      while ((write_task = g_queue_pop_head (&written)) != NULL)
+        {
+          g_task_return_boolean (write_task, TRUE);
+          g_object_unref (write_task);
+        }
+    }
+  while (priv->output_buffer->len >= OUTPUT_BATCH_SIZE);
+
+  /* Don't hold on to the memory from an unusually large packet */
+  if (buffer_max > OUTPUT_BUFFER_MAX)
+    {
+      g_byte_array_unref (priv->output_buffer);
+      priv->output_buffer = g_byte_array_sized_new (BUFFER_SIZE);
+    }
 
   g_task_return_boolean (task, TRUE);
 }
 
+static gboolean
+channel_notify_queue_length_cb (gpointer data)
+{
+  ValentChannel *channel = VALENT_CHANNEL (data);
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+
+  g_atomic_int_set (&priv->output_notify, FALSE);
+  g_object_notify_by_pspec (G_OBJECT (channel), properties [PROP_QUEUE_LENGTH]);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * channel_notify_queue_length:
+ * @channel: a #ValentChannel
+ *
+ * Emit #GObject::notify for #ValentChannel:queue-length in the default main
+ * context, where #ValentChannelService emits channels, since packets may be
+ * queued and written from any thread. Changes made before the notification is
+ * emitted are collapsed into one.
+ */
+static void
+channel_notify_queue_length (ValentChannel *channel)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  g_autoptr (GSource) source = NULL;
+
+  if (!g_atomic_int_compare_and_exchange (&priv->output_notify, FALSE, TRUE))
+    return;
+
+  if (g_main_context_is_owner (g_main_context_default ()))
+    {
+      channel_notify_queue_length_cb (channel);
+      return;
+    }
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source,
+                         channel_notify_queue_length_cb,
+                         g_object_ref (channel),
+                         g_object_unref);
+  g_source_set_name (source, "[valent-channel] queue-length");
+  g_source_attach (source, NULL);
+}
+
+static void
+valent_channel_flush_cb (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  channel_notify_queue_length (VALENT_CHANNEL (object));
+}
+
 static void
 valent_channel_close_task (GTask        *task,
                            gpointer      source_object,
@@ -284,14 +1234,25 @@ valent_channel_close_task (GTask        *task,
 {
   ValentChannel *channel = source_object;
   ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  g_autoptr (GError) pending_error = NULL;
   GError *error = NULL;
 
+  /* Fail any packets that missed the last flush */
+  pending_error = g_error_new_literal (G_IO_ERROR,
+                                       G_IO_ERROR_CLOSED,
+                                       "Channel is closed");
+  channel_output_cancel (priv, pending_error);
+
   if (g_task_return_error_if_cancelled (task))
     return;
 
   if (!g_io_stream_close (priv->base_stream, cancellable, &error))
-    return g_task_return_error (task, error);
+    {
+      g_signal_emit (G_OBJECT (channel), signals [CLOSED], 0);
+      return g_task_return_error (task, error);
+    }
 
+  g_signal_emit (G_OBJECT (channel), signals [CLOSED], 0);
   g_task_return_boolean (task, TRUE);
 }
 
@@ -356,16 +1317,39 @@ valent_channel_real_store_data (ValentChannel *channel,
 /*
  * GObject
  */
+static void
+valent_channel_constructed (GObject *object)
+{
+  ValentChannel *self = VALENT_CHANNEL (object);
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (self);
+
+  /* Compression is only used if both devices support it */
+  priv->compress = identity_supports_deflate (priv->identity) &&
+                   identity_supports_deflate (priv->peer_identity);
+
+  G_OBJECT_CLASS (valent_channel_parent_class)->constructed (object);
+}
+
 static void
 valent_channel_finalize (GObject *object)
 {
   ValentChannel *self = VALENT_CHANNEL (object);
   ValentChannelPrivate *priv = valent_channel_get_instance_private (self);
 
+  g_cancellable_cancel (priv->cancellable);
+  g_clear_object (&priv->cancellable);
+
   g_clear_pointer (&priv->buffer, g_free);
   g_clear_object (&priv->parser);
   g_clear_pointer (&priv->output, valent_task_queue_unref);
-  g_clear_object (&priv->generator);
+  g_clear_pointer (&priv->output_buffer, g_byte_array_unref);
+  g_clear_object (&priv->compressor);
+  g_clear_pointer (&priv->compress_buffer, g_byte_array_unref);
+  g_clear_object (&priv->decompressor);
+  g_clear_pointer (&priv->decompress_buffer, g_byte_array_unref);
+  g_clear_pointer (&priv->decode_buffer, g_byte_array_unref);
+  g_queue_clear_full (&priv->output_tasks, g_object_unref);
+  g_mutex_clear (&priv->output_lock);
 
   g_clear_object (&priv->base_stream);
   g_clear_pointer (&priv->identity, json_node_unref);
@@ -390,12 +1374,24 @@ valent_channel_get_property (GObject    *object,
       g_value_set_object (value, priv->base_stream);
       break;
 
-    case PROP_IDENTITY:
-      g_value_set_boxed (value, priv->identity);
+    case PROP_IDENTITY:
+      g_value_set_boxed (value, priv->identity);
+      break;
+
+    case PROP_PEER_IDENTITY:
+      g_value_set_boxed (value, priv->peer_identity);
+      break;
+
+    case PROP_QUEUE_LENGTH:
+      g_value_set_uint (value, valent_channel_get_queue_length (self));
+      break;
+
+    case PROP_QUEUE_LIMIT:
+      g_value_set_uint (value, valent_channel_get_queue_limit (self));
       break;
 
-    case PROP_PEER_IDENTITY:
-      g_value_set_boxed (value, priv->peer_identity);
+    case PROP_TRANSFER_LIMIT:
+      g_value_set_uint (value, valent_channel_get_transfer_limit (self));
       break;
 
     case PROP_URI:
@@ -430,6 +1426,14 @@ valent_channel_set_property (GObject      *object,
       priv->peer_identity = g_value_dup_boxed (value);
       break;
 
+    case PROP_QUEUE_LIMIT:
+      valent_channel_set_queue_limit (self, g_value_get_uint (value));
+      break;
+
+    case PROP_TRANSFER_LIMIT:
+      valent_channel_set_transfer_limit (self, g_value_get_uint (value));
+      break;
+
     case PROP_URI:
       priv->uri = g_value_dup_string (value);
       break;
@@ -444,6 +1448,7 @@ valent_channel_class_init (ValentChannelClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
+  object_class->constructed = valent_channel_constructed;
   object_class->finalize = valent_channel_finalize;
   object_class->get_property = valent_channel_get_property;
   object_class->set_property = valent_channel_set_property;
@@ -500,6 +1505,57 @@ valent_channel_class_init (ValentChannelClass *klass)
                          G_PARAM_EXPLICIT_NOTIFY |
                          G_PARAM_STATIC_STRINGS));
 
+  /**
+   * ValentChannel:queue-length:
+   *
+   * The number of outgoing packets waiting to be written.
+   *
+   * Changes are notified in the default main context.
+   */
+  properties [PROP_QUEUE_LENGTH] =
+    g_param_spec_uint ("queue-length",
+                       "Queue Length",
+                       "The number of outgoing packets waiting to be written",
+                       0, G_MAXUINT,
+                       0,
+                       (G_PARAM_READABLE |
+                        G_PARAM_EXPLICIT_NOTIFY |
+                        G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentChannel:queue-limit:
+   *
+   * The maximum number of outgoing packets waiting to be written. Packets
+   * written while the queue is full will fail with %G_IO_ERROR_WOULD_BLOCK.
+   */
+  properties [PROP_QUEUE_LIMIT] =
+    g_param_spec_uint ("queue-limit",
+                       "Queue Limit",
+                       "The maximum number of outgoing packets waiting to be written",
+                       1, G_MAXUINT,
+                       OUTPUT_QUEUE_LIMIT,
+                       (G_PARAM_READWRITE |
+                        G_PARAM_EXPLICIT_NOTIFY |
+                        G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentChannel:transfer-limit:
+   *
+   * The maximum number of payload transfers that may run at once.
+   *
+   * A channel that opens a new connection for each payload may allow several,
+   * while one that multiplexes a single connection may allow only one.
+   */
+  properties [PROP_TRANSFER_LIMIT] =
+    g_param_spec_uint ("transfer-limit",
+                       "Transfer Limit",
+                       "The maximum number of payload transfers that may run at once",
+                       1, G_MAXUINT,
+                       1,
+                       (G_PARAM_READWRITE |
+                        G_PARAM_EXPLICIT_NOTIFY |
+                        G_PARAM_STATIC_STRINGS));
+
   /**
    * ValentChannel:uri:
    *
@@ -515,6 +1571,26 @@ valent_channel_class_init (ValentChannelClass *klass)
                           G_PARAM_STATIC_STRINGS));
 
   g_object_class_install_properties (object_class, N_PROPERTIES, properties);
+
+  /**
+   * ValentChannel::closed:
+   * @channel: a #ValentChannel
+   *
+   * The "closed" signal is emitted when the base stream of @channel has been
+   * closed by valent_channel_close() or valent_channel_close_async().
+   *
+   * Implementations can use this to release resources shared by the payload
+   * connections of @channel. It may be emitted from a thread other than the
+   * main thread.
+   */
+  signals [CLOSED] =
+    g_signal_new ("closed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
 }
 
 static void
@@ -529,7 +1605,15 @@ valent_channel_init (ValentChannel *self)
 
   /* Output Buffer */
   priv->output = valent_task_queue_new ();
-  priv->generator = json_generator_new ();
+  priv->output_buffer = g_byte_array_sized_new (BUFFER_SIZE);
+  g_mutex_init (&priv->output_lock);
+  g_queue_init (&priv->output_tasks);
+  priv->output_limit = OUTPUT_QUEUE_LIMIT;
+
+  /* Payload Transfers */
+  priv->transfer_limit = 1;
+
+  priv->cancellable = g_cancellable_new ();
 }
 
 /**
@@ -632,6 +1716,149 @@ valent_channel_set_uri (ValentChannel *channel,
   g_object_notify_by_pspec (G_OBJECT (channel), properties [PROP_URI]);
 }
 
+/**
+ * valent_channel_get_queue_length:
+ * @channel: a #ValentChannel
+ *
+ * Get the number of outgoing packets waiting to be written.
+ *
+ * Returns: the number of queued packets
+ */
+unsigned int
+valent_channel_get_queue_length (ValentChannel *channel)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  unsigned int ret;
+
+  g_return_val_if_fail (VALENT_IS_CHANNEL (channel), 0);
+
+  g_mutex_lock (&priv->output_lock);
+  ret = priv->output_tasks.length;
+  g_mutex_unlock (&priv->output_lock);
+
+  return ret;
+}
+
+/**
+ * valent_channel_get_queue_limit:
+ * @channel: a #ValentChannel
+ *
+ * Get the maximum number of outgoing packets waiting to be written.
+ *
+ * Returns: the queue limit
+ */
+unsigned int
+valent_channel_get_queue_limit (ValentChannel *channel)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  unsigned int ret;
+
+  g_return_val_if_fail (VALENT_IS_CHANNEL (channel), 0);
+
+  g_mutex_lock (&priv->output_lock);
+  ret = priv->output_limit;
+  g_mutex_unlock (&priv->output_lock);
+
+  return ret;
+}
+
+/**
+ * valent_channel_set_queue_limit:
+ * @channel: a #ValentChannel
+ * @limit: the queue limit
+ *
+ * Set the maximum number of outgoing packets waiting to be written. Packets
+ * already queued are not affected.
+ */
+void
+valent_channel_set_queue_limit (ValentChannel *channel,
+                                unsigned int   limit)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  gboolean changed;
+
+  g_return_if_fail (VALENT_IS_CHANNEL (channel));
+  g_return_if_fail (limit > 0);
+
+  g_mutex_lock (&priv->output_lock);
+  changed = (priv->output_limit != limit);
+  priv->output_limit = limit;
+  g_mutex_unlock (&priv->output_lock);
+
+  if (changed)
+    g_object_notify_by_pspec (G_OBJECT (channel), properties [PROP_QUEUE_LIMIT]);
+}
+
+/**
+ * valent_channel_set_packet_filter: (skip)
+ * @channel: a #ValentChannel
+ * @filter_func: (nullable): a #ValentChannelFilterFunc
+ * @filter_data: (closure): user supplied data
+ *
+ * Set a function to decide whether incoming packets should be parsed, based on
+ * the routing fields found by valent_packet_peek_header().
+ *
+ * If @filter_func returns %FALSE, the packet is discarded without building a
+ * #JsonNode tree. Packets that can't be scanned are always parsed. The filter
+ * is only invoked for reads from a pollable stream, in the main context of the
+ * read.
+ */
+void
+valent_channel_set_packet_filter (ValentChannel           *channel,
+                                  ValentChannelFilterFunc  filter_func,
+                                  gpointer                 filter_data)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+
+  g_return_if_fail (VALENT_IS_CHANNEL (channel));
+
+  priv->filter_func = filter_func;
+  priv->filter_data = filter_data;
+}
+
+/**
+ * valent_channel_get_transfer_limit:
+ * @channel: a #ValentChannel
+ *
+ * Get the number of payload transfers that may run at once for @channel.
+ *
+ * Returns: the maximum number of concurrent transfers
+ */
+unsigned int
+valent_channel_get_transfer_limit (ValentChannel *channel)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+
+  g_return_val_if_fail (VALENT_IS_CHANNEL (channel), 1);
+
+  return g_atomic_int_get (&priv->transfer_limit);
+}
+
+/**
+ * valent_channel_set_transfer_limit:
+ * @channel: a #ValentChannel
+ * @limit: the transfer limit
+ *
+ * Set the number of payload transfers that may run at once for @channel.
+ * Transfers already in progress are not affected.
+ */
+void
+valent_channel_set_transfer_limit (ValentChannel *channel,
+                                   unsigned int   limit)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  unsigned int old_limit;
+
+  g_return_if_fail (VALENT_IS_CHANNEL (channel));
+  g_return_if_fail (limit > 0);
+
+  old_limit = g_atomic_int_get (&priv->transfer_limit);
+  g_atomic_int_set (&priv->transfer_limit, limit);
+
+  if (old_limit != limit)
+    g_object_notify_by_pspec (G_OBJECT (channel), properties [PROP_TRANSFER_LIMIT]);
+}
+
 /**
  * valent_channel_get_verification_key: (virtual get_verification_key)
  * @channel: a #ValentChannel
@@ -651,6 +1878,36 @@ valent_channel_get_verification_key (ValentChannel *channel)
   return VALENT_CHANNEL_GET_CLASS (channel)->get_verification_key (channel);
 }
 
+static void
+valent_channel_read_start (ValentChannel *channel,
+                           GTask         *task)
+{
+  ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
+  g_autoptr (GSource) source = NULL;
+  g_autoptr (GSource) closed_source = NULL;
+  GInputStream *input_stream = NULL;
+
+  if (priv->base_stream != NULL)
+    input_stream = g_io_stream_get_input_stream (priv->base_stream);
+
+  if (!G_IS_POLLABLE_INPUT_STREAM (input_stream) ||
+      !g_pollable_input_stream_can_poll (G_POLLABLE_INPUT_STREAM (input_stream)))
+    return g_task_run_in_thread (task, valent_channel_read_packet_task);
+
+  /* There may already be a packet in the buffer */
+  if (valent_channel_read_packet_try (task))
+    return;
+
+  /* Wait for the stream to become readable, or the channel to be closed */
+  source = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (input_stream),
+                                                  g_task_get_cancellable (task));
+  closed_source = g_cancellable_source_new (priv->cancellable);
+  g_source_set_dummy_callback (closed_source);
+  g_source_add_child_source (source, closed_source);
+
+  g_task_attach_source (task, source, (GSourceFunc)valent_channel_read_packet_cb);
+}
+
 /**
  * valent_channel_read_packet:
  * @channel: a #ValentChannel
@@ -660,6 +1917,10 @@ valent_channel_get_verification_key (ValentChannel *channel)
  *
  * Asynchronously read the next #JsonNode packet from @channel. Call
  * valent_channel_read_packet_finish() to get the result.
+ *
+ * If the base stream supports #GPollableInputStream, the packet will be read
+ * from the thread-default main context without blocking. Otherwise, the read
+ * will be run in a thread.
  */
 void
 valent_channel_read_packet (ValentChannel       *channel,
@@ -676,7 +1937,7 @@ valent_channel_read_packet (ValentChannel       *channel,
 
   task = g_task_new (channel, cancellable, callback, user_data);
   g_task_set_source_tag (task, valent_channel_read_packet);
-  g_task_run_in_thread (task, valent_channel_read_packet_task);
+  valent_channel_read_start (channel, task);
 
   VALENT_EXIT;
 }
@@ -709,6 +1970,118 @@ valent_channel_read_packet_finish (ValentChannel  *channel,
   VALENT_RETURN (ret);
 }
 
+/**
+ * valent_channel_read_packets:
+ * @channel: a #ValentChannel
+ * @n_max: the maximum number of packets to return
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback
+ * @user_data: (closure): user supplied data
+ *
+ * A batched variant of valent_channel_read_packet().
+ *
+ * Asynchronously read the next #JsonNode packet from @channel, along with any
+ * other complete packets already received, up to @n_max packets. Call
+ * valent_channel_read_packets_finish() to get the result.
+ */
+void
+valent_channel_read_packets (ValentChannel       *channel,
+                             unsigned int         n_max,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  VALENT_ENTRY;
+
+  g_return_if_fail (VALENT_IS_CHANNEL (channel));
+  g_return_if_fail (n_max > 0);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (channel, cancellable, callback, user_data);
+  g_task_set_source_tag (task, valent_channel_read_packets);
+  g_task_set_task_data (task, GUINT_TO_POINTER (n_max), NULL);
+  valent_channel_read_start (channel, task);
+
+  VALENT_EXIT;
+}
+
+/**
+ * valent_channel_read_packets_finish:
+ * @channel: a #ValentChannel
+ * @result: a #GAsyncResult
+ * @error: (nullable): a #GError
+ *
+ * Finishes an operation started by valent_channel_read_packets().
+ *
+ * Returns: (transfer container) (element-type Json.Node): a #GPtrArray of at
+ *   least one #JsonNode, or %NULL with @error set
+ */
+GPtrArray *
+valent_channel_read_packets_finish (ValentChannel  *channel,
+                                    GAsyncResult   *result,
+                                    GError        **error)
+{
+  g_autoptr (GArray) views = NULL;
+  GPtrArray *ret;
+
+  VALENT_ENTRY;
+
+  g_return_val_if_fail (VALENT_IS_CHANNEL (channel), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, channel), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  if ((views = g_task_propagate_pointer (G_TASK (result), error)) == NULL)
+    VALENT_RETURN (NULL);
+
+  ret = g_ptr_array_new_full (views->len, (GDestroyNotify)json_node_unref);
+
+  for (unsigned int i = 0; i < views->len; i++)
+    {
+      ValentPacketView *view = &g_array_index (views, ValentPacketView, i);
+
+      g_ptr_array_add (ret, g_steal_pointer (&view->packet));
+    }
+
+  VALENT_RETURN (ret);
+}
+
+/**
+ * valent_channel_read_views_finish: (skip)
+ * @channel: a #ValentChannel
+ * @result: a #GAsyncResult
+ * @error: (nullable): a #GError
+ *
+ * Finishes an operation started by valent_channel_read_packets(), like
+ * valent_channel_read_packets_finish().
+ *
+ * The packets are returned with the #ValentPacketView built while validating
+ * them, so the caller doesn't have to walk each packet again. Each view holds a
+ * reference on its packet, released when the array is freed.
+ *
+ * Returns: (transfer full) (element-type ValentPacketView): a #GArray of at
+ *   least one #ValentPacketView, or %NULL with @error set
+ */
+GArray *
+valent_channel_read_views_finish (ValentChannel  *channel,
+                                  GAsyncResult   *result,
+                                  GError        **error)
+{
+  GArray *ret;
+
+  VALENT_ENTRY;
+
+  g_return_val_if_fail (VALENT_IS_CHANNEL (channel), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, channel), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == valent_channel_read_packets, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  ret = g_task_propagate_pointer (G_TASK (result), error);
+
+  VALENT_RETURN (ret);
+}
+
 /**
  * valent_channel_write_packet:
  * @channel: a #ValentChannel
@@ -719,6 +2092,9 @@ valent_channel_read_packet_finish (ValentChannel  *channel,
  *
  * Asynchronously write the #JsonNode @packet to @channel. Call
  * valent_channel_write_packet_finish() to get the result.
+ *
+ * This is equivalent to calling valent_channel_write_packet_full() with
+ * %G_PRIORITY_DEFAULT.
  */
 void
 valent_channel_write_packet (ValentChannel       *channel,
@@ -726,23 +2102,183 @@ valent_channel_write_packet (ValentChannel       *channel,
                              GCancellable        *cancellable,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
+{
+  valent_channel_write_packet_full (channel,
+                                    packet,
+                                    G_PRIORITY_DEFAULT,
+                                    cancellable,
+                                    callback,
+                                    user_data);
+}
+
+static void
+valent_channel_write_packet_internal (ValentChannel       *channel,
+                                      JsonNode            *packet,
+                                      const char          *key,
+                                      int                  io_priority,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data)
 {
   ValentChannelPrivate *priv = valent_channel_get_instance_private (channel);
   g_autoptr (GTask) task = NULL;
+  g_autoptr (GTask) replaced = NULL;
+  ChannelWrite *write;
+
+  write = g_new0 (ChannelWrite, 1);
+  write->packet = json_node_ref (packet);
+  write->key = g_strdup (key);
+
+  task = g_task_new (channel, cancellable, callback, user_data);
+  g_task_set_source_tag (task, valent_channel_write_packet);
+  g_task_set_priority (task, io_priority);
+  g_task_set_task_data (task, write, channel_write_free);
+
+  /* Packets queued before the next flush are written together */
+  g_mutex_lock (&priv->output_lock);
+
+  if G_UNLIKELY (priv->output_closed)
+    {
+      g_mutex_unlock (&priv->output_lock);
+      g_task_return_new_error (task,
+                               G_IO_ERROR,
+                               G_IO_ERROR_NOT_CONNECTED,
+                               "Channel is closed");
+      return;
+    }
+
+  /* An unsent packet with the same key is stale, so this one takes its place */
+  if ((replaced = channel_output_replace (priv, task)) != NULL)
+    {
+      g_steal_pointer (&task);
+    }
+  else if G_UNLIKELY (priv->output_tasks.length >= priv->output_limit)
+    {
+      g_mutex_unlock (&priv->output_lock);
+      g_task_return_new_error (task,
+                               G_IO_ERROR,
+                               G_IO_ERROR_WOULD_BLOCK,
+                               "Channel queue is full");
+      return;
+    }
+  else
+    {
+      channel_output_push (priv, g_steal_pointer (&task));
+    }
+
+  if (!priv->output_flush)
+    {
+      g_autoptr (GTask) flush = NULL;
+
+      flush = g_task_new (channel, NULL, valent_channel_flush_cb, NULL);
+      g_task_set_source_tag (flush, valent_channel_flush_task);
+
+      priv->output_flush = TRUE;
+      valent_task_queue_run (priv->output, flush, valent_channel_flush_task);
+    }
+
+  g_mutex_unlock (&priv->output_lock);
+
+  /* Complete the replaced packet after releasing the lock, since the callback
+   * may queue another packet */
+  if (replaced != NULL)
+    {
+      g_task_return_new_error (replaced,
+                               G_IO_ERROR,
+                               G_IO_ERROR_CANCELLED,
+                               "Replaced by a newer packet");
+    }
+  else
+    {
+      channel_notify_queue_length (channel);
+    }
+}
 
+/**
+ * valent_channel_write_packet_full:
+ * @channel: a #ValentChannel
+ * @packet: a #JsonNode
+ * @io_priority: the I/O priority of the request
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback
+ * @user_data: (closure): user supplied data
+ *
+ * Asynchronously write the #JsonNode @packet to @channel. Call
+ * valent_channel_write_packet_finish() to get the result.
+ *
+ * Queued packets are written in order of @io_priority, then in the order they
+ * were queued. Interactive packets, such as input events, should use
+ * %G_PRIORITY_HIGH, while bulk packets, such as a contact list, may use
+ * %G_PRIORITY_LOW.
+ *
+ * If the number of queued packets has reached #ValentChannel:queue-limit, the
+ * operation will fail with %G_IO_ERROR_WOULD_BLOCK.
+ */
+void
+valent_channel_write_packet_full (ValentChannel       *channel,
+                                  JsonNode            *packet,
+                                  int                  io_priority,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
   VALENT_ENTRY;
 
   g_return_if_fail (VALENT_IS_CHANNEL (channel));
   g_return_if_fail (VALENT_IS_PACKET (packet));
   g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
 
-  task = g_task_new (channel, cancellable, callback, user_data);
-  g_task_set_source_tag (task, valent_channel_write_packet);
-  g_task_set_task_data (task,
-                        json_node_ref (packet),
-                        (GDestroyNotify)json_node_unref);
+  valent_channel_write_packet_internal (channel,
+                                        packet,
+                                        NULL,
+                                        io_priority,
+                                        cancellable,
+                                        callback,
+                                        user_data);
+
+  VALENT_EXIT;
+}
+
+/**
+ * valent_channel_write_packet_replace: (skip)
+ * @channel: a #ValentChannel
+ * @packet: a #JsonNode
+ * @key: a key identifying the state @packet describes
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback
+ * @user_data: (closure): user supplied data
+ *
+ * Asynchronously write the #JsonNode @packet to @channel, like
+ * valent_channel_write_packet().
+ *
+ * If a packet with the same type and @key is still waiting to be written, @packet
+ * takes its place in the queue and the old packet fails with
+ * %G_IO_ERROR_CANCELLED. This is useful
+ * for packets describing the latest state of something, such as the volume of
+ * an audio stream, where older packets are no longer useful.
+ */
+void
+valent_channel_write_packet_replace (ValentChannel       *channel,
+                                     JsonNode            *packet,
+                                     const char          *key,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
+{
+  VALENT_ENTRY;
 
-  valent_task_queue_run (priv->output, task, valent_channel_write_packet_task);
+  g_return_if_fail (VALENT_IS_CHANNEL (channel));
+  g_return_if_fail (VALENT_IS_PACKET (packet));
+  g_return_if_fail (key != NULL);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  valent_channel_write_packet_internal (channel,
+                                        packet,
+                                        key,
+                                        G_PRIORITY_DEFAULT,
+                                        cancellable,
+                                        callback,
+                                        user_data);
 
   VALENT_EXIT;
 }
@@ -801,6 +2337,14 @@ valent_channel_close (ValentChannel  *channel,
   if (priv->base_stream == NULL || g_io_stream_is_closed (priv->base_stream))
     return TRUE;
 
+  /* Stop any pending reads before the stream is closed */
+  g_cancellable_cancel (priv->cancellable);
+
+  /* Refuse new packets; those already queued are flushed first */
+  g_mutex_lock (&priv->output_lock);
+  priv->output_closed = TRUE;
+  g_mutex_unlock (&priv->output_lock);
+
   task = g_task_new (channel, cancellable, NULL, NULL);
   g_task_set_source_tag (task, valent_channel_close);
   valent_task_queue_run_close (priv->output, task, valent_channel_close_task);
@@ -840,6 +2384,14 @@ valent_channel_close_async (ValentChannel       *channel,
   if (priv->base_stream == NULL || g_io_stream_is_closed (priv->base_stream))
     return g_task_return_boolean (task, TRUE);
 
+  /* Stop any pending reads before the stream is closed */
+  g_cancellable_cancel (priv->cancellable);
+
+  /* Refuse new packets; those already queued are flushed first */
+  g_mutex_lock (&priv->output_lock);
+  priv->output_closed = TRUE;
+  g_mutex_unlock (&priv->output_lock);
+
   valent_task_queue_run_close (priv->output, task, valent_channel_close_task);
 }
 
@@ -40,6 +40,13 @@ struct _ValentChannelClass
 GIOStream  * valent_channel_get_base_stream      (ValentChannel        *channel);
 JsonNode   * valent_channel_get_identity         (ValentChannel        *channel);
 JsonNode   * valent_channel_get_peer_identity    (ValentChannel        *channel);
+unsigned int valent_channel_get_queue_length     (ValentChannel        *channel);
+unsigned int valent_channel_get_queue_limit      (ValentChannel        *channel);
+void         valent_channel_set_queue_limit      (ValentChannel        *channel,
+                                                  unsigned int          limit);
+unsigned int valent_channel_get_transfer_limit   (ValentChannel        *channel);
+void         valent_channel_set_transfer_limit   (ValentChannel        *channel,
+                                                  unsigned int          limit);
 const char * valent_channel_get_uri              (ValentChannel        *channel);
 void         valent_channel_set_uri              (ValentChannel        *channel,
                                                   const char           *uri);
@@ -61,11 +68,25 @@ void         valent_channel_read_packet          (ValentChannel        *channel,
 JsonNode   * valent_channel_read_packet_finish   (ValentChannel        *channel,
                                                   GAsyncResult         *result,
                                                   GError              **error);
+void         valent_channel_read_packets         (ValentChannel        *channel,
+                                                  unsigned int          n_max,
+                                                  GCancellable         *cancellable,
+                                                  GAsyncReadyCallback   callback,
+                                                  gpointer              user_data);
+GPtrArray  * valent_channel_read_packets_finish  (ValentChannel        *channel,
+                                                  GAsyncResult         *result,
+                                                  GError              **error);
 void         valent_channel_write_packet         (ValentChannel        *channel,
                                                   JsonNode             *packet,
                                                   GCancellable         *cancellable,
                                                   GAsyncReadyCallback   callback,
                                                   gpointer              user_data);
+void         valent_channel_write_packet_full    (ValentChannel        *channel,
+                                                  JsonNode             *packet,
+                                                  int                   io_priority,
+                                                  GCancellable         *cancellable,
+                                                  GAsyncReadyCallback   callback,
+                                                  gpointer              user_data);
 gboolean     valent_channel_write_packet_finish  (ValentChannel        *channel,
                                                   GAsyncResult         *result,
                                                   GError              **error);
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#pragma once
+
+#include <glib.h>
+
+#include "valent-device-plugin.h"
+#include "valent-packet-private.h"
+
+G_BEGIN_DECLS
+
+void   valent_device_plugin_handle_view (ValentDevicePlugin     *plugin,
+                                         const ValentPacketView *view);
+
+G_END_DECLS
+
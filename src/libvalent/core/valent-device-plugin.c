@@ -11,6 +11,7 @@
 
 #include "valent-device.h"
 #include "valent-device-plugin.h"
+#include "valent-device-plugin-private.h"
 #include "valent-packet.h"
 #include "valent-utils.h"
 
@@ -561,6 +562,28 @@ valent_device_plugin_handle_packet (ValentDevicePlugin *plugin,
   VALENT_DEVICE_PLUGIN_GET_IFACE (plugin)->handle_packet (plugin, type, packet);
 }
 
+/**
+ * valent_device_plugin_handle_view:
+ * @plugin: a #ValentDevicePlugin
+ * @view: a #ValentPacketView
+ *
+ * Like valent_device_plugin_handle_packet(), for a packet that has already been
+ * validated by valent_packet_view_init().
+ *
+ * The type is taken from @view, and the packet is not validated again.
+ */
+void
+valent_device_plugin_handle_view (ValentDevicePlugin     *plugin,
+                                  const ValentPacketView *view)
+{
+  g_assert (VALENT_IS_DEVICE_PLUGIN (plugin));
+  g_assert (view != NULL && view->packet != NULL && view->type != NULL);
+
+  VALENT_DEVICE_PLUGIN_GET_IFACE (plugin)->handle_packet (plugin,
+                                                          view->type,
+                                                          view->packet);
+}
+
 /**
  * valent_device_plugin_update_state: (virtual update_state)
  * @plugin: a #ValentDevicePlugin
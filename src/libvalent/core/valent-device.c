@@ -11,14 +11,17 @@
 #include "valent-core-enums.h"
 
 #include "valent-channel.h"
+#include "valent-channel-private.h"
 #include "valent-data.h"
 #include "valent-debug.h"
 #include "valent-device.h"
 #include "valent-device-plugin.h"
+#include "valent-device-plugin-private.h"
 #include "valent-device-private.h"
 #include "valent-macros.h"
 #include "valent-object-utils.h"
 #include "valent-packet.h"
+#include "valent-packet-private.h"
 #include "valent-transfer.h"
 #include "valent-utils.h"
 
@@ -28,6 +31,7 @@
 #define VALENT_DEVICE_TABLET     "tablet"
 #define VALENT_DEVICE_TELEVISION "tv"
 #define PAIR_REQUEST_TIMEOUT     30
+#define PACKET_BATCH_SIZE        32
 
 
 /**
@@ -76,10 +80,12 @@ struct _ValentDevice
   GMenu               *menu;
 };
 
-static void valent_device_set_connected  (ValentDevice *device,
-                                          gboolean      connected);
-static void valent_device_reload_plugins (ValentDevice *device);
-static void valent_device_update_plugins (ValentDevice *device);
+static void valent_device_handle_view    (ValentDevice           *device,
+                                          const ValentPacketView *view);
+static void valent_device_set_connected  (ValentDevice           *device,
+                                          gboolean                connected);
+static void valent_device_reload_plugins (ValentDevice           *device);
+static void valent_device_update_plugins (ValentDevice           *device);
 
 G_DEFINE_TYPE (ValentDevice, valent_device, G_TYPE_OBJECT)
 
@@ -1003,7 +1009,16 @@ queue_packet_cb (ValentChannel *channel,
       if G_UNLIKELY (error && error->domain != G_IO_ERROR)
         VALENT_DEBUG ("%s: %s", device->name, error->message);
 
-      if (device->channel == channel)
+      /* A full queue or a replaced packet is not a connection failure, but a
+       * full queue means the packet was lost */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        g_warning ("%s(): %s: packet dropped: %s",
+                   G_STRFUNC,
+                   device->name,
+                   error->message);
+      else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("%s: %s", device->name, error->message);
+      else if (device->channel == channel)
         valent_device_set_channel (device, NULL);
     }
 
@@ -1017,10 +1032,33 @@ queue_packet_cb (ValentChannel *channel,
  *
  * Push @packet onto the outgoing packet queue for the #ValentChannel of @device.
  * For cancellable or failable packet transfer, see valent_device_send_packet().
+ *
+ * This is equivalent to calling valent_device_queue_packet_full() with
+ * %G_PRIORITY_DEFAULT.
  */
 void
 valent_device_queue_packet (ValentDevice *device,
                             JsonNode     *packet)
+{
+  valent_device_queue_packet_full (device, packet, G_PRIORITY_DEFAULT);
+}
+
+/**
+ * valent_device_queue_packet_full:
+ * @device: a #ValentDevice
+ * @packet: a #JsonNode packet
+ * @io_priority: the I/O priority of the packet
+ *
+ * Push @packet onto the outgoing packet queue for the #ValentChannel of @device,
+ * ahead of any queued packets with a lower @io_priority.
+ *
+ * Interactive packets, such as input events, should use %G_PRIORITY_HIGH, while
+ * bulk packets, such as a contact list, may use %G_PRIORITY_LOW.
+ */
+void
+valent_device_queue_packet_full (ValentDevice *device,
+                                 JsonNode     *packet,
+                                 int           io_priority)
 {
   g_return_if_fail (VALENT_IS_DEVICE (device));
   g_return_if_fail (VALENT_IS_PACKET (packet));
@@ -1044,11 +1082,60 @@ valent_device_queue_packet (ValentDevice *device,
     }
 
   VALENT_DEBUG_PKT (packet, device->name);
-  valent_channel_write_packet (device->channel,
-                               packet,
-                               NULL,
-                               (GAsyncReadyCallback)queue_packet_cb,
-                               g_object_ref (device));
+  valent_channel_write_packet_full (device->channel,
+                                    packet,
+                                    io_priority,
+                                    NULL,
+                                    (GAsyncReadyCallback)queue_packet_cb,
+                                    g_object_ref (device));
+}
+
+/**
+ * valent_device_queue_packet_replace:
+ * @device: a #ValentDevice
+ * @packet: a #JsonNode packet
+ * @key: a key identifying the state @packet describes
+ *
+ * Push @packet onto the outgoing packet queue for the #ValentChannel of @device,
+ * replacing any packet of the same type and @key that has not been sent yet.
+ *
+ * This is useful for packets describing the latest state of something, such as
+ * the volume of an audio stream, where older packets are no longer useful.
+ */
+void
+valent_device_queue_packet_replace (ValentDevice *device,
+                                    JsonNode     *packet,
+                                    const char   *key)
+{
+  g_return_if_fail (VALENT_IS_DEVICE (device));
+  g_return_if_fail (VALENT_IS_PACKET (packet));
+  g_return_if_fail (key != NULL);
+
+  if G_UNLIKELY (!device->connected)
+    {
+      g_warning ("%s(): %s is disconnected, discarding \"%s\"",
+                 G_STRFUNC,
+                 device->name,
+                 valent_packet_get_type (packet));
+      return;
+    }
+
+  if G_UNLIKELY (!device->paired)
+    {
+      g_critical ("%s(): %s is unpaired, discarding \"%s\"",
+                  G_STRFUNC,
+                  device->name,
+                  valent_packet_get_type (packet));
+      return;
+    }
+
+  VALENT_DEBUG_PKT (packet, device->name);
+  valent_channel_write_packet_replace (device->channel,
+                                       packet,
+                                       key,
+                                       NULL,
+                                       (GAsyncReadyCallback)queue_packet_cb,
+                                       g_object_ref (device));
 }
 
 static void
@@ -1064,9 +1151,13 @@ send_packet_cb (ValentChannel *channel,
 
   if (!valent_channel_write_packet_finish (channel, result, &error))
     {
+      gboolean disconnect;
+
+      disconnect = !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK) &&
+                   !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
       g_task_return_error (task, error);
 
-      if (device->channel == channel)
+      if (disconnect && device->channel == channel)
         valent_device_set_channel (device, NULL);
     }
   else
@@ -1083,6 +1174,9 @@ send_packet_cb (ValentChannel *channel,
  *
  * Send @packet over the current packet channel. Call
  * valent_device_send_packet_finish() to get the result.
+ *
+ * This is equivalent to calling valent_device_send_packet_full() with
+ * %G_PRIORITY_DEFAULT.
  */
 void
 valent_device_send_packet (ValentDevice        *device,
@@ -1090,6 +1184,35 @@ valent_device_send_packet (ValentDevice        *device,
                            GCancellable        *cancellable,
                            GAsyncReadyCallback  callback,
                            gpointer             user_data)
+{
+  valent_device_send_packet_full (device,
+                                  packet,
+                                  G_PRIORITY_DEFAULT,
+                                  cancellable,
+                                  callback,
+                                  user_data);
+}
+
+/**
+ * valent_device_send_packet_full:
+ * @device: a #ValentDevice
+ * @packet: a #JsonNode packet
+ * @io_priority: the I/O priority of the packet
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback
+ * @user_data: (closure): user supplied data
+ *
+ * Send @packet over the current packet channel, ahead of any queued packets with
+ * a lower @io_priority. Call valent_device_send_packet_finish() to get the
+ * result.
+ */
+void
+valent_device_send_packet_full (ValentDevice        *device,
+                                JsonNode            *packet,
+                                int                  io_priority,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
 {
   g_autoptr (GTask) task = NULL;
 
@@ -1118,11 +1241,12 @@ valent_device_send_packet (ValentDevice        *device,
   g_task_set_source_tag (task, valent_device_send_packet);
 
   VALENT_DEBUG_PKT (packet, device->name);
-  valent_channel_write_packet (device->channel,
-                               packet,
-                               cancellable,
-                               (GAsyncReadyCallback)send_packet_cb,
-                               g_steal_pointer (&task));
+  valent_channel_write_packet_full (device->channel,
+                                    packet,
+                                    io_priority,
+                                    cancellable,
+                                    (GAsyncReadyCallback)send_packet_cb,
+                                    g_steal_pointer (&task));
 }
 
 /**
@@ -1235,28 +1359,57 @@ valent_device_get_channel (ValentDevice *device)
   return device->channel;
 }
 
+static gboolean
+packet_filter_func (ValentChannel            *channel,
+                    const ValentPacketHeader *header,
+                    gpointer                  user_data)
+{
+  ValentDevice *device = VALENT_DEVICE (user_data);
+
+  g_assert (VALENT_IS_CHANNEL (channel));
+  g_assert (header != NULL);
+
+  /* Keep this in sync with valent_device_handle_packet() */
+  if G_UNLIKELY (g_str_equal (header->type, "kdeconnect.identity") ||
+                 g_str_equal (header->type, "kdeconnect.pair"))
+    return TRUE;
+
+  if G_UNLIKELY (!device->paired)
+    return TRUE;
+
+  if (g_hash_table_contains (device->handlers, header->type))
+    return TRUE;
+
+  g_debug ("%s: Unsupported packet '%s'", device->name, header->type);
+
+  return FALSE;
+}
+
 static void
-read_packet_cb (ValentChannel *channel,
-                GAsyncResult  *result,
-                ValentDevice  *device)
+read_packets_cb (ValentChannel *channel,
+                 GAsyncResult  *result,
+                 ValentDevice  *device)
 {
   g_autoptr (GError) error = NULL;
-  g_autoptr (JsonNode) packet = NULL;
+  g_autoptr (GArray) views = NULL;
 
   g_assert (VALENT_IS_CHANNEL (channel));
   g_assert (VALENT_IS_DEVICE (device));
 
-  packet = valent_channel_read_packet_finish (channel, result, &error);
+  views = valent_channel_read_views_finish (channel, result, &error);
 
-  /* On success, queue another read before handling the packet */
-  if (packet != NULL)
+  /* On success, queue another read before handling the packets. The channel
+   * has already validated them, so the views are routed as they are. */
+  if (views != NULL)
     {
-      valent_channel_read_packet (channel,
-                                  NULL,
-                                  (GAsyncReadyCallback)read_packet_cb,
-                                  g_object_ref (device));
-
-      valent_device_handle_packet (device, packet);
+      valent_channel_read_packets (channel,
+                                   PACKET_BATCH_SIZE,
+                                   NULL,
+                                   (GAsyncReadyCallback)read_packets_cb,
+                                   g_object_ref (device));
+
+      for (unsigned int i = 0; i < views->len; i++)
+        valent_device_handle_view (device, &g_array_index (views, ValentPacketView, i));
     }
 
   /* On failure, drop our reference if it's still the active channel */
@@ -1293,6 +1446,7 @@ valent_device_set_channel (ValentDevice  *device,
    * reference so the task holds the final reference. */
   if (device->channel)
     {
+      valent_channel_set_packet_filter (device->channel, NULL, NULL);
       valent_channel_close_async (device->channel, NULL, NULL, NULL);
       g_clear_object (&device->channel);
     }
@@ -1307,11 +1461,13 @@ valent_device_set_channel (ValentDevice  *device,
       peer_identity = valent_channel_get_peer_identity (channel);
       valent_device_handle_identity (device, peer_identity);
 
-      /* Start receiving packets */
-      valent_channel_read_packet (channel,
-                                  NULL,
-                                  (GAsyncReadyCallback)read_packet_cb,
-                                  g_object_ref (device));
+      /* Start receiving packets, skipping those with no handler */
+      valent_channel_set_packet_filter (channel, packet_filter_func, device);
+      valent_channel_read_packets (channel,
+                                   PACKET_BATCH_SIZE,
+                                   NULL,
+                                   (GAsyncReadyCallback)read_packets_cb,
+                                   g_object_ref (device));
     }
 
   valent_device_set_connected (device, VALENT_IS_CHANNEL (device->channel));
@@ -1564,31 +1720,26 @@ valent_device_get_state (ValentDevice *device)
 }
 
 /**
- * valent_device_handle_packet:
+ * valent_device_handle_view:
  * @device: a #ValentDevice
- * @packet: a #JsonNode packet
- *
- * Take @packet and handle it as a packet from the remote device represented by
- * @device. Identity and pair packets are handled by @device, while all others
- * will be passed to plugins which claim to support the @packet type.
+ * @view: a #ValentPacketView
  *
- * Plugin handlers must hold their own reference on @packet if doing anything
- * asynchronous.
+ * Handle the packet in @view, which has already been validated by
+ * valent_packet_view_init(). The view is passed on to the plugin handling the
+ * packet type, so the packet is only walked once.
  */
-void
-valent_device_handle_packet (ValentDevice *device,
-                             JsonNode     *packet)
+static void
+valent_device_handle_view (ValentDevice           *device,
+                           const ValentPacketView *view)
 {
   ValentDevicePlugin *handler;
-  const char *type;
+  JsonNode *packet = view->packet;
+  const char *type = view->type;
 
   g_assert (VALENT_IS_DEVICE (device));
-  g_assert (VALENT_IS_PACKET (packet));
 
   VALENT_DEBUG_PKT (packet, device->name);
 
-  type = valent_packet_get_type (packet);
-
   /* Keep this order */
   if G_UNLIKELY (g_strcmp0 (type, "kdeconnect.identity") == 0)
     valent_device_handle_identity (device, packet);
@@ -1600,12 +1751,54 @@ valent_device_handle_packet (ValentDevice *device,
     valent_device_send_pair (device, FALSE);
 
   else if ((handler = g_hash_table_lookup (device->handlers, type)))
-    valent_device_plugin_handle_packet (handler, type, packet);
+    valent_device_plugin_handle_view (handler, view);
 
   else
     g_debug ("%s: Unsupported packet '%s'", device->name, type);
 }
 
+/**
+ * valent_device_handle_packet:
+ * @device: a #ValentDevice
+ * @packet: a #JsonNode packet
+ *
+ * Take @packet and handle it as a packet from the remote device represented by
+ * @device. Identity and pair packets are handled by @device, while all others
+ * will be passed to plugins which claim to support the @packet type.
+ *
+ * Malformed packets are logged and dropped.
+ *
+ * Plugin handlers must hold their own reference on @packet if doing anything
+ * asynchronous.
+ */
+void
+valent_device_handle_packet (ValentDevice *device,
+                             JsonNode     *packet)
+{
+  ValentPacketView view;
+  g_autoptr (GError) error = NULL;
+
+  g_assert (VALENT_IS_DEVICE (device));
+
+  /* Validate and find the type in a single pass over the packet */
+  if G_UNLIKELY (!valent_packet_view_init (&view, packet, &error))
+    {
+      g_autofree char *packet_str = NULL;
+
+      if (packet != NULL)
+        packet_str = json_to_string (packet, FALSE);
+
+      g_warning ("%s(): %s: dropping malformed packet: %s: %s",
+                 G_STRFUNC,
+                 device->name,
+                 error->message,
+                 packet_str);
+      return;
+    }
+
+  valent_device_handle_view (device, &view);
+}
+
 /**
  * valent_device_new_download_file:
  * @device: a #ValentDevice
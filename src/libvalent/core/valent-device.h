@@ -54,11 +54,23 @@ GPtrArray         * valent_device_get_plugins       (ValentDevice         *devic
 ValentDeviceState   valent_device_get_state         (ValentDevice         *device);
 void                valent_device_queue_packet      (ValentDevice         *device,
                                                      JsonNode             *packet);
+void                valent_device_queue_packet_full (ValentDevice         *device,
+                                                     JsonNode             *packet,
+                                                     int                   io_priority);
+void             valent_device_queue_packet_replace (ValentDevice         *device,
+                                                     JsonNode             *packet,
+                                                     const char           *key);
 void                valent_device_send_packet       (ValentDevice         *device,
                                                      JsonNode             *packet,
                                                      GCancellable         *cancellable,
                                                      GAsyncReadyCallback   callback,
                                                      gpointer              user_data);
+void                valent_device_send_packet_full  (ValentDevice         *device,
+                                                     JsonNode             *packet,
+                                                     int                   io_priority,
+                                                     GCancellable         *cancellable,
+                                                     GAsyncReadyCallback   callback,
+                                                     gpointer              user_data);
 gboolean           valent_device_send_packet_finish (ValentDevice         *device,
                                                      GAsyncResult         *result,
                                                      GError              **error);
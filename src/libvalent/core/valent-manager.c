@@ -18,6 +18,7 @@
 #include "valent-macros.h"
 #include "valent-manager.h"
 #include "valent-packet.h"
+#include "valent-transfer-scheduler.h"
 #include "valent-utils.h"
 
 
@@ -1079,6 +1080,25 @@ valent_manager_get_id (ValentManager *manager)
   return manager->id;
 }
 
+/**
+ * valent_manager_get_transfers:
+ * @manager: a #ValentManager
+ *
+ * Get a list of the transfers for all devices, either waiting or running.
+ *
+ * The list is the default #ValentTransferScheduler, which can also be used to
+ * limit the number of transfers running at once and their combined rate.
+ *
+ * Returns: (transfer none): a #GListModel of #ValentTransfer
+ */
+GListModel *
+valent_manager_get_transfers (ValentManager *manager)
+{
+  g_return_val_if_fail (VALENT_IS_MANAGER (manager), NULL);
+
+  return G_LIST_MODEL (valent_transfer_scheduler_get_default ());
+}
+
 /**
  * valent_manager_identify:
  * @manager: a #ValentManager
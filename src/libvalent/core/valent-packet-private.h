@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#pragma once
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+#define VALENT_PACKET_TYPE_MAX 128
+
+
+/**
+ * ValentPacketHeader:
+ * @type: the `type` field
+ * @id: the `id` field, or `0` if missing or not an integer
+ * @payload_size: the `payloadSize` field, or `-1` if missing
+ *
+ * A structure holding the routing fields of a serialized packet, as found by
+ * valent_packet_peek_header().
+ */
+typedef struct
+{
+  char   type[VALENT_PACKET_TYPE_MAX];
+  gint64 id;
+  gssize payload_size;
+} ValentPacketHeader;
+
+/**
+ * ValentPacketView:
+ * @packet: the #JsonNode
+ * @type: the `type` field
+ *
+ * A structure holding a validated packet and its type, as found by
+ * valent_packet_view_init(). The type is owned by @packet.
+ */
+typedef struct
+{
+  JsonNode   *packet;
+  const char *type;
+} ValentPacketView;
+
+gboolean   valent_packet_view_init   (ValentPacketView   *view,
+                                      JsonNode           *packet,
+                                      GError            **error);
+gboolean   valent_packet_peek_header (const char         *data,
+                                      gsize               length,
+                                      ValentPacketHeader *header);
+void       valent_packet_serialize_to_buffer (JsonNode           *packet,
+                                              GByteArray         *buffer);
+
+G_END_DECLS
+
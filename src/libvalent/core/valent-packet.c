@@ -5,10 +5,12 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <sys/time.h>
 #include <json-glib/json-glib.h>
 
 #include "valent-packet.h"
+#include "valent-packet-private.h"
 #include "valent-utils.h"
 
 
@@ -25,6 +27,536 @@
 G_DEFINE_QUARK (valent-packet-error, valent_packet_error)
 
 
+/*
+ * Packet Header
+ */
+static inline const char *
+header_skip_whitespace (const char *p,
+                        const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+
+  return p;
+}
+
+static inline const char *
+header_skip_string (const char *p,
+                    const char *end,
+                    gboolean   *escaped)
+{
+  /* Opening quote */
+  p++;
+
+  while (p < end)
+    {
+      if G_UNLIKELY (*p == '\\')
+        {
+          if (escaped != NULL)
+            *escaped = TRUE;
+
+          p += 2;
+          continue;
+        }
+
+      if (*p == '"')
+        return p + 1;
+
+      p++;
+    }
+
+  return NULL;
+}
+
+static inline const char *
+header_skip_value (const char *p,
+                   const char *end)
+{
+  unsigned int depth = 0;
+
+  while (p < end)
+    {
+      switch (*p)
+        {
+        case '"':
+          if ((p = header_skip_string (p, end, NULL)) == NULL)
+            return NULL;
+
+          if (depth == 0)
+            return p;
+
+          continue;
+
+        case '{':
+        case '[':
+          depth++;
+          break;
+
+        case '}':
+        case ']':
+          /* The end of the enclosing object */
+          if (depth == 0)
+            return p;
+
+          if (--depth == 0)
+            return p + 1;
+          break;
+
+        case ',':
+          if (depth == 0)
+            return p;
+          break;
+        }
+
+      p++;
+    }
+
+  return NULL;
+}
+
+/* Enough for the sign and digits of any 64-bit integer, and a NUL byte */
+#define HEADER_INT_MAX 21
+
+static inline const char *
+header_parse_int (const char *p,
+                  const char *end,
+                  gint64     *value)
+{
+  char digits[HEADER_INT_MAX];
+  const char *num_end = p;
+  gint64 num;
+  gsize len;
+
+  if (*p != '-' && !g_ascii_isdigit (*p))
+    return header_skip_value (p, end);
+
+  /* Find the extent of the number within @end, since @p is not NUL-terminated */
+  if (*num_end == '-')
+    num_end++;
+
+  while (num_end < end && g_ascii_isdigit (*num_end))
+    num_end++;
+
+  len = num_end - p;
+
+  if (len == 0 || (len == 1 && *p == '-'))
+    return NULL;
+
+  /* A double is not a valid integer field, so leave the default */
+  if (num_end < end && (*num_end == '.' || *num_end == 'e' || *num_end == 'E'))
+    return header_skip_value (num_end, end);
+
+  if (len >= sizeof (digits))
+    return NULL;
+
+  memcpy (digits, p, len);
+  digits[len] = '\0';
+
+  errno = 0;
+  num = g_ascii_strtoll (digits, NULL, 10);
+
+  if (errno == ERANGE)
+    return NULL;
+
+  *value = num;
+
+  return num_end;
+}
+
+/**
+ * valent_packet_peek_header:
+ * @data: a serialized packet
+ * @length: the length of @data
+ * @header: (out caller-allocates): a #ValentPacketHeader
+ *
+ * Scan the top-level members of the serialized packet @data, without building
+ * a #JsonNode tree, and fill @header with the routing fields.
+ *
+ * This is only a hint for deciding whether a packet is worth parsing. The
+ * packet is not validated, and %FALSE is returned if the scan encounters
+ * anything unexpected, such as an escaped `type` field.
+ *
+ * Returns: %TRUE if the `type` field was found
+ */
+gboolean
+valent_packet_peek_header (const char         *data,
+                           gsize               length,
+                           ValentPacketHeader *header)
+{
+  const char *p = data;
+  const char *end = data + length;
+
+  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_val_if_fail (header != NULL, FALSE);
+
+  header->type[0] = '\0';
+  header->id = 0;
+  header->payload_size = -1;
+
+  p = header_skip_whitespace (p, end);
+
+  if (p >= end || *p != '{')
+    return FALSE;
+
+  p++;
+
+  while (TRUE)
+    {
+      const char *key;
+      gsize key_len;
+      gboolean escaped = FALSE;
+
+      p = header_skip_whitespace (p, end);
+
+      if G_UNLIKELY (p >= end)
+        return FALSE;
+
+      if (*p == '}')
+        break;
+
+      if G_UNLIKELY (*p != '"')
+        return FALSE;
+
+      /* Member name */
+      key = p + 1;
+
+      if ((p = header_skip_string (p, end, &escaped)) == NULL)
+        return FALSE;
+
+      key_len = (p - 1) - key;
+      p = header_skip_whitespace (p, end);
+
+      if G_UNLIKELY (p >= end || *p != ':')
+        return FALSE;
+
+      p = header_skip_whitespace (p + 1, end);
+
+      if G_UNLIKELY (p >= end)
+        return FALSE;
+
+      /* Member value */
+      if (!escaped && key_len == 4 && memcmp (key, "type", 4) == 0)
+        {
+          const char *value = p + 1;
+          gsize value_len;
+
+          if (*p != '"')
+            return FALSE;
+
+          if ((p = header_skip_string (p, end, &escaped)) == NULL || escaped)
+            return FALSE;
+
+          value_len = (p - 1) - value;
+
+          if (value_len == 0 || value_len >= VALENT_PACKET_TYPE_MAX)
+            return FALSE;
+
+          memcpy (header->type, value, value_len);
+          header->type[value_len] = '\0';
+        }
+      else if (!escaped && key_len == 2 && memcmp (key, "id", 2) == 0)
+        {
+          if ((p = header_parse_int (p, end, &header->id)) == NULL)
+            return FALSE;
+        }
+      else if (!escaped && key_len == 11 && memcmp (key, "payloadSize", 11) == 0)
+        {
+          gint64 size = -1;
+
+          if ((p = header_parse_int (p, end, &size)) == NULL)
+            return FALSE;
+
+          header->payload_size = (gssize)size;
+        }
+      else if ((p = header_skip_value (p, end)) == NULL)
+        {
+          return FALSE;
+        }
+
+      p = header_skip_whitespace (p, end);
+
+      if G_UNLIKELY (p >= end)
+        return FALSE;
+
+      if (*p == ',')
+        p++;
+      else if (*p == '}')
+        break;
+      else
+        return FALSE;
+    }
+
+  return header->type[0] != '\0';
+}
+
+
+/*
+ * Packet View
+ */
+/**
+ * valent_packet_view_init:
+ * @view: a #ValentPacketView
+ * @packet: a #JsonNode
+ * @error: (nullable): a #GError
+ *
+ * Validate @packet like valent_packet_validate(), and keep the packet type in
+ * @view for routing.
+ *
+ * The root object is walked once, instead of looking up each field in turn, so
+ * this is cheaper than validating a packet and then calling
+ * valent_packet_get_type().
+ *
+ * Returns: %TRUE or %FALSE with @error set
+ */
+gboolean
+valent_packet_view_init (ValentPacketView  *view,
+                         JsonNode          *packet,
+                         GError           **error)
+{
+  JsonObjectIter iter;
+  const char *name;
+  JsonNode *node;
+  gboolean has_body = FALSE;
+  gboolean has_id = FALSE;
+
+  g_return_val_if_fail (view != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  *view = (ValentPacketView){
+    .packet = packet,
+  };
+
+  if G_UNLIKELY (packet == NULL || !JSON_NODE_HOLDS_OBJECT (packet))
+    return valent_packet_validate (packet, error);
+
+  json_object_iter_init (&iter, json_node_get_object (packet));
+
+  while (json_object_iter_next (&iter, &name, &node))
+    {
+      switch (name[0])
+        {
+        case 'b':
+          if (strcmp (name, "body") == 0)
+            has_body = JSON_NODE_HOLDS_OBJECT (node);
+          break;
+
+        /* FIXME: kdeconnect-kde stringifies this in identity packets */
+        case 'i':
+          if (strcmp (name, "id") == 0)
+            has_id = json_node_get_value_type (node) == G_TYPE_INT64 ||
+                     json_node_get_value_type (node) == G_TYPE_STRING;
+          break;
+
+        case 't':
+          if (strcmp (name, "type") == 0 &&
+              json_node_get_value_type (node) == G_TYPE_STRING)
+            view->type = json_node_get_string (node);
+          break;
+        }
+    }
+
+  if G_UNLIKELY (!has_id || !has_body || view->type == NULL)
+    return valent_packet_validate (packet, error);
+
+  return TRUE;
+}
+
+/*
+ * Packet Writer
+ */
+static inline void
+writer_append (GByteArray *buffer,
+               const char *data,
+               gsize       length)
+{
+  g_byte_array_append (buffer, (const guint8 *)data, length);
+}
+
+static void
+writer_append_string (GByteArray *buffer,
+                      const char *str)
+{
+  const char *run = str;
+  const char *p;
+
+  writer_append (buffer, "\"", 1);
+
+  for (p = str; *p != '\0'; p++)
+    {
+      guchar c = (guchar)*p;
+      char escape[7] = { '\\', 0, };
+      gsize escape_len = 2;
+
+      if G_LIKELY (c >= 0x20 && c != '"' && c != '\\')
+        continue;
+
+      switch (c)
+        {
+        case '"':
+        case '\\':
+          escape[1] = c;
+          break;
+
+        case '\b':
+          escape[1] = 'b';
+          break;
+
+        case '\f':
+          escape[1] = 'f';
+          break;
+
+        case '\n':
+          escape[1] = 'n';
+          break;
+
+        case '\r':
+          escape[1] = 'r';
+          break;
+
+        case '\t':
+          escape[1] = 't';
+          break;
+
+        default:
+          escape_len = g_snprintf (escape, sizeof (escape), "\\u%04x", c);
+          break;
+        }
+
+      /* Flush the unescaped run before the escape sequence */
+      writer_append (buffer, run, p - run);
+      writer_append (buffer, escape, escape_len);
+      run = p + 1;
+    }
+
+  writer_append (buffer, run, p - run);
+  writer_append (buffer, "\"", 1);
+}
+
+static void
+writer_append_value (GByteArray *buffer,
+                     JsonNode   *node)
+{
+  char number[G_ASCII_DTOSTR_BUF_SIZE];
+  gsize number_len;
+
+  switch (json_node_get_value_type (node))
+    {
+    case G_TYPE_INT64:
+      number_len = g_snprintf (number, sizeof (number),
+                               "%" G_GINT64_FORMAT,
+                               json_node_get_int (node));
+      writer_append (buffer, number, number_len);
+      break;
+
+    case G_TYPE_DOUBLE:
+      g_ascii_dtostr (number, sizeof (number), json_node_get_double (node));
+      writer_append (buffer, number, strlen (number));
+
+      /* Keep integral doubles as doubles (eg. `1.0` not `1`) */
+      if (strpbrk (number, ".eEn") == NULL)
+        writer_append (buffer, ".0", 2);
+      break;
+
+    case G_TYPE_BOOLEAN:
+      if (json_node_get_boolean (node))
+        writer_append (buffer, "true", 4);
+      else
+        writer_append (buffer, "false", 5);
+      break;
+
+    case G_TYPE_STRING:
+      writer_append_string (buffer, json_node_get_string (node));
+      break;
+
+    default:
+      writer_append (buffer, "null", 4);
+      break;
+    }
+}
+
+static void
+writer_append_node (GByteArray *buffer,
+                    JsonNode   *node)
+{
+  switch (JSON_NODE_TYPE (node))
+    {
+    case JSON_NODE_OBJECT:
+      {
+        JsonObjectIter iter;
+        const char *name;
+        JsonNode *member;
+        gboolean first = TRUE;
+
+        writer_append (buffer, "{", 1);
+
+        json_object_iter_init_ordered (&iter, json_node_get_object (node));
+
+        while (json_object_iter_next_ordered (&iter, &name, &member))
+          {
+            if (!first)
+              writer_append (buffer, ",", 1);
+
+            writer_append_string (buffer, name);
+            writer_append (buffer, ":", 1);
+            writer_append_node (buffer, member);
+            first = FALSE;
+          }
+
+        writer_append (buffer, "}", 1);
+      }
+      break;
+
+    case JSON_NODE_ARRAY:
+      {
+        JsonArray *array = json_node_get_array (node);
+        unsigned int n_elements = json_array_get_length (array);
+
+        writer_append (buffer, "[", 1);
+
+        for (unsigned int i = 0; i < n_elements; i++)
+          {
+            if (i > 0)
+              writer_append (buffer, ",", 1);
+
+            writer_append_node (buffer, json_array_get_element (array, i));
+          }
+
+        writer_append (buffer, "]", 1);
+      }
+      break;
+
+    case JSON_NODE_VALUE:
+      writer_append_value (buffer, node);
+      break;
+
+    case JSON_NODE_NULL:
+      writer_append (buffer, "null", 4);
+      break;
+    }
+}
+
+/**
+ * valent_packet_serialize_to_buffer:
+ * @packet: a #JsonNode
+ * @buffer: a #GByteArray
+ *
+ * Serialize @packet as compact JSON, followed by an LF, to the end of @buffer.
+ *
+ * Unlike valent_packet_serialize(), this does not timestamp the packet or
+ * allocate an intermediate string, so a buffer reused between calls will not
+ * allocate once it has grown large enough.
+ */
+void
+valent_packet_serialize_to_buffer (JsonNode   *packet,
+                                   GByteArray *buffer)
+{
+  g_return_if_fail (packet != NULL);
+  g_return_if_fail (buffer != NULL);
+
+  writer_append_node (buffer, packet);
+  writer_append (buffer, "\n", 1);
+}
+
 /**
  * valent_packet_from_stream:
  * @stream: a #GInputStream
@@ -555,7 +1087,6 @@ valent_packet_get_payload_size (JsonNode *packet)
   g_return_val_if_fail (VALENT_IS_PACKET (packet), 0);
 
   root = json_node_get_object (packet);
-  node = json_object_get_member (root, "payloadSize");
 
   if ((node = json_object_get_member (root, "payloadSize")) != NULL &&
       json_node_get_value_type (node) != G_TYPE_INT64)
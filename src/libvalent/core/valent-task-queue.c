@@ -19,19 +19,68 @@
  *
  * The #ValentTaskQueue class is an execution queue for #GTask operations.
  *
- * Each #ValentTaskQueue instance has a dedicated thread where tasks are
- * executed sequentially. Queued tasks are automatically sorted by priority, as
+ * Each #ValentTaskQueue instance is a logical queue where tasks are executed
+ * sequentially. Queues do not own a thread; instead a worker is borrowed from a
+ * pool shared by all queues while tasks are pending, and returned when the
+ * queue is drained. Queued tasks are automatically sorted by priority, as
  * reported by g_task_get_priority().
+ *
+ * Tasks queued with valent_task_queue_run_concurrent() are dispatched to
+ * workers of their own and may run in parallel with each other. Any other task
+ * acts as a barrier, waiting for concurrent tasks already started to complete
+ * before it runs.
  */
 
+/* The upper limit of workers shared by all queues, and the number of tasks a
+ * queue may run before yielding its worker to other queues. */
+#define WORKERS_MAX (16)
+#define WORKER_BATCH (32)
+
+/* Tasks are submitted to one of these lanes, by priority */
+enum {
+  LANE_HIGH,
+  LANE_DEFAULT,
+  LANE_IDLE,
+  LANE_LOW,
+  N_LANES
+};
+
+typedef struct _ValentTaskClosure ValentTaskClosure;
+
+/**
+ * ValentTaskLane: (skip)
+ * @inbox: (atomic): a LIFO stack of submitted tasks
+ * @tasks: a FIFO of tasks taken from @inbox, sorted by priority
+ *
+ * Producers push tasks onto @inbox with a compare-and-swap, so they don't
+ * contend with the worker running the queue; the worker takes the whole stack
+ * at once and moves the tasks to @tasks, which is only accessed by that worker.
+ */
+typedef struct
+{
+  ValentTaskClosure *inbox;
+  GQueue             tasks;
+} ValentTaskLane;
+
 struct _ValentTaskQueue
 {
-  GAsyncQueue  *tasks;
-  unsigned int  closed : 1;
+  ValentTaskLane  lanes[N_LANES];
+
+  /* (atomic) */
+  int             closed;
+  int             running;
+  int             waiting;
+  int             n_concurrent;
+
+  /* owned by the running worker */
+  unsigned int    terminated : 1;
 };
 
 G_DEFINE_BOXED_TYPE (ValentTaskQueue, valent_task_queue, valent_task_queue_ref, valent_task_queue_unref)
 
+static GThreadPool *workers = NULL;
+static GThreadPool *concurrent_workers = NULL;
+
 
 /**
  * ValentTaskMode:
@@ -56,19 +105,22 @@ typedef enum
 /*
  * ValentTaskClosure
  */
-typedef struct
+struct _ValentTaskClosure
 {
-  GTask           *task;
-  GTaskThreadFunc  task_func;
-  ValentTaskMode   task_mode;
-  int              priority;
-} ValentTaskClosure;
+  ValentTaskClosure *next;
+  ValentTaskQueue   *queue;
+  GTask             *task;
+  GTaskThreadFunc    task_func;
+  ValentTaskMode     task_mode;
+  int                priority;
+};
 
 static inline void
 valent_task_closure_free (gpointer data)
 {
   ValentTaskClosure *closure = data;
 
+  g_clear_pointer (&closure->queue, valent_task_queue_unref);
   g_clear_object (&closure->task);
   g_clear_pointer (&closure, g_free);
 }
@@ -89,18 +141,275 @@ valent_task_closure_cancel (gpointer data)
   g_clear_pointer (&closure, valent_task_closure_free);
 }
 
+static inline unsigned int
+valent_task_lane_for_priority (int priority)
+{
+  if (priority < G_PRIORITY_DEFAULT)
+    return LANE_HIGH;
+
+  if (priority < G_PRIORITY_HIGH_IDLE)
+    return LANE_DEFAULT;
+
+  if (priority < G_PRIORITY_LOW)
+    return LANE_IDLE;
+
+  return LANE_LOW;
+}
+
+/**
+ * valent_task_lane_push: (skip)
+ * @lane: a #ValentTaskLane
+ * @closure: (transfer full): a #ValentTaskClosure
+ *
+ * Push @closure onto the inbox of @lane. This is safe to call from any thread.
+ *
+ * Since the worker only ever takes the whole stack, a compare-and-swap of the
+ * head is sufficient and not subject to ABA problems.
+ */
+static inline void
+valent_task_lane_push (ValentTaskLane    *lane,
+                       ValentTaskClosure *closure)
+{
+  ValentTaskClosure *head;
+
+  do
+    {
+      head = g_atomic_pointer_get (&lane->inbox);
+      closure->next = head;
+    }
+  while (!g_atomic_pointer_compare_and_exchange (&lane->inbox, head, closure));
+}
+
+/**
+ * valent_task_lane_collect: (skip)
+ * @lane: a #ValentTaskLane
+ *
+ * Take the inbox of @lane and move its tasks to the lane's queue, preserving
+ * submission order within a priority. This must only be called by the worker
+ * running the queue.
+ *
+ * Returns: %TRUE if the lane has pending tasks
+ */
+static inline gboolean
+valent_task_lane_collect (ValentTaskLane *lane)
+{
+  ValentTaskClosure *head;
+  ValentTaskClosure *prev = NULL;
+
+  do
+    head = g_atomic_pointer_get (&lane->inbox);
+  while (head != NULL &&
+         !g_atomic_pointer_compare_and_exchange (&lane->inbox, head, NULL));
+
+  /* Reverse the stack into submission order */
+  while (head != NULL)
+    {
+      ValentTaskClosure *next = head->next;
+
+      head->next = prev;
+      prev = head;
+      head = next;
+    }
+
+  /* Insert after any task with an equal or higher priority; the queue is
+   * scanned from the tail, so tasks with the same priority are appended in
+   * constant time */
+  for (ValentTaskClosure *closure = prev; closure != NULL;)
+    {
+      ValentTaskClosure *next = closure->next;
+      GList *sibling = lane->tasks.tail;
+
+      while (sibling != NULL &&
+             ((ValentTaskClosure *)sibling->data)->priority > closure->priority)
+        sibling = sibling->prev;
+
+      closure->next = NULL;
+
+      if (sibling != NULL)
+        g_queue_insert_after (&lane->tasks, sibling, closure);
+      else
+        g_queue_push_head (&lane->tasks, closure);
+
+      closure = next;
+    }
+
+  return !g_queue_is_empty (&lane->tasks);
+}
+
+/**
+ * valent_task_queue_peek: (skip)
+ * @self: a #ValentTaskQueue
+ *
+ * Collect submitted tasks and return the highest priority task, if any. This
+ * must only be called by the worker running the queue.
+ *
+ * Returns: (transfer none) (nullable): a #ValentTaskClosure
+ */
+static inline ValentTaskClosure *
+valent_task_queue_peek (ValentTaskQueue *self)
+{
+  ValentTaskClosure *closure = NULL;
+
+  for (unsigned int i = 0; i < N_LANES; i++)
+    {
+      if (valent_task_lane_collect (&self->lanes[i]) && closure == NULL)
+        closure = g_queue_peek_head (&self->lanes[i].tasks);
+    }
+
+  return closure;
+}
+
+/**
+ * valent_task_queue_pop: (skip)
+ * @self: a #ValentTaskQueue
+ * @closure: a #ValentTaskClosure
+ *
+ * Remove @closure, as returned by valent_task_queue_peek(), from @self. This
+ * must only be called by the worker running the queue.
+ */
+static inline void
+valent_task_queue_pop (ValentTaskQueue   *self,
+                       ValentTaskClosure *closure)
+{
+  unsigned int lane = valent_task_lane_for_priority (closure->priority);
+
+  g_queue_pop_head (&self->lanes[lane].tasks);
+}
+
+/**
+ * valent_task_queue_has_inbox: (skip)
+ * @self: a #ValentTaskQueue
+ *
+ * Check if any tasks have been submitted since the last collection, without
+ * collecting them.
+ *
+ * Returns: %TRUE if there are submitted tasks
+ */
+static inline gboolean
+valent_task_queue_has_inbox (ValentTaskQueue *self)
+{
+  for (unsigned int i = 0; i < N_LANES; i++)
+    {
+      if (g_atomic_pointer_get (&self->lanes[i].inbox) != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * valent_task_queue_drain: (skip)
+ * @self: a #ValentTaskQueue
+ *
+ * Cancel any queued tasks. This must only be called by the worker running the
+ * queue, or when @self is being freed.
+ */
+static void
+valent_task_queue_drain (ValentTaskQueue *self)
+{
+  ValentTaskClosure *closure = NULL;
+
+  for (unsigned int i = 0; i < N_LANES; i++)
+    {
+      valent_task_lane_collect (&self->lanes[i]);
+
+      while ((closure = g_queue_pop_head (&self->lanes[i].tasks)) != NULL)
+        g_clear_pointer (&closure, valent_task_closure_cancel);
+    }
+}
+
 /*
- * GThreadFunc
+ * GFunc
  */
-static gpointer
-valent_task_queue_loop (gpointer data)
+static void
+valent_task_queue_run_concurrent_func (gpointer data,
+                                       gpointer user_data)
+{
+  ValentTaskClosure *closure = data;
+  ValentTaskQueue *self = closure->queue;
+
+  if (G_IS_TASK (closure->task) && !g_task_get_completed (closure->task))
+    {
+      closure->task_func (closure->task,
+                          g_task_get_source_object (closure->task),
+                          g_task_get_task_data (closure->task),
+                          g_task_get_cancellable (closure->task));
+    }
+
+  /* If this was the last concurrent task holding back a barrier, hand the
+   * dispatcher's reference back to a worker */
+  if (g_atomic_int_dec_and_test (&self->n_concurrent) &&
+      g_atomic_int_compare_and_exchange (&self->waiting, TRUE, FALSE))
+    g_thread_pool_push (workers, self, NULL);
+
+  g_clear_pointer (&closure, valent_task_closure_free);
+}
+
+static void
+valent_task_queue_dispatch (gpointer data,
+                            gpointer user_data)
 {
-  g_autoptr (GAsyncQueue) tasks = data;
+  ValentTaskQueue *self = data;
   ValentTaskClosure *closure = NULL;
+  unsigned int n_tasks = 0;
 
-  while ((closure = g_async_queue_pop (tasks)))
+  while (TRUE)
     {
-      unsigned int mode = closure->task_mode;
+      unsigned int mode;
+
+      /* Return the worker when the queue is empty. A producer may have pushed
+       * a task before seeing the queue stop, so check again after stopping;
+       * if another worker was borrowed in the meantime, it owns the queue. */
+      if ((closure = valent_task_queue_peek (self)) == NULL)
+        {
+          g_atomic_int_set (&self->running, FALSE);
+
+          if (!valent_task_queue_has_inbox (self) ||
+              !g_atomic_int_compare_and_exchange (&self->running, FALSE, TRUE))
+            break;
+
+          continue;
+        }
+
+      /* Yield the worker to other queues once this queue has had its share */
+      if (n_tasks++ == WORKER_BATCH)
+        {
+          g_thread_pool_push (workers, self, NULL);
+          return;
+        }
+
+      /* Tasks submitted after the queue was terminated are cancelled */
+      if (self->terminated)
+        {
+          valent_task_queue_pop (self, closure);
+          g_clear_pointer (&closure, valent_task_closure_cancel);
+          continue;
+        }
+
+      /* Concurrent tasks fan out to workers of their own */
+      if (closure->task_mode == VALENT_TASK_CONCURRENT)
+        {
+          valent_task_queue_pop (self, closure);
+          g_atomic_int_inc (&self->n_concurrent);
+
+          closure->queue = valent_task_queue_ref (self);
+          g_thread_pool_push (concurrent_workers, closure, NULL);
+          continue;
+        }
+
+      /* Any other task is a barrier; the worker is returned and the last
+       * concurrent task to complete resumes the queue with this reference */
+      if (g_atomic_int_get (&self->n_concurrent) > 0)
+        {
+          g_atomic_int_set (&self->waiting, TRUE);
+
+          if (g_atomic_int_get (&self->n_concurrent) > 0 ||
+              !g_atomic_int_compare_and_exchange (&self->waiting, TRUE, FALSE))
+            return;
+        }
+
+      valent_task_queue_pop (self, closure);
+      mode = closure->task_mode;
 
       if (G_IS_TASK (closure->task) && !g_task_get_completed (closure->task))
         {
@@ -116,29 +425,45 @@ valent_task_queue_loop (gpointer data)
       g_clear_pointer (&closure, valent_task_closure_free);
 
       if (mode == VALENT_TASK_TERMINAL)
-        break;
+        {
+          g_atomic_int_set (&self->closed, TRUE);
+          self->terminated = TRUE;
+          valent_task_queue_drain (self);
+        }
     }
 
-  /* Cancel any queued tasks */
-  g_async_queue_lock (tasks);
+  valent_task_queue_unref (self);
+}
 
-  while ((closure = g_async_queue_try_pop_unlocked (tasks)) != NULL)
-    g_clear_pointer (&closure, valent_task_closure_cancel);
+static gpointer
+valent_task_queue_workers_init (gpointer data)
+{
+  g_autoptr (GError) error = NULL;
+  int max_threads = CLAMP (g_get_num_processors () * 2, 4, WORKERS_MAX);
 
-  g_async_queue_unlock (tasks);
+  /* Both pools are shared, so idle threads are reused between them */
+  workers = g_thread_pool_new (valent_task_queue_dispatch,
+                               NULL,
+                               max_threads,
+                               FALSE,
+                               &error);
 
-  return NULL;
-}
+  if (workers != NULL)
+    {
+      concurrent_workers = g_thread_pool_new (valent_task_queue_run_concurrent_func,
+                                              NULL,
+                                              max_threads,
+                                              FALSE,
+                                              &error);
+    }
 
-static inline int
-valent_task_queue_sort (gconstpointer a,
-                        gconstpointer b,
-                        gpointer      user_data)
-{
-  const ValentTaskClosure *closure1 = a;
-  const ValentTaskClosure *closure2 = b;
+  if G_UNLIKELY (error != NULL)
+    {
+      g_critical ("%s: %s", G_STRFUNC, error->message);
+      return GINT_TO_POINTER (FALSE);
+    }
 
-  return closure1->priority - closure2->priority;
+  return GINT_TO_POINTER (TRUE);
 }
 
 static inline void
@@ -148,21 +473,9 @@ valent_task_queue_free (gpointer data)
 
   g_assert (VALENT_IS_TASK_QUEUE (self));
 
-  g_async_queue_lock (self->tasks);
-
-  if (!self->closed)
-    {
-      ValentTaskClosure *closure;
-
-      closure = g_new0 (ValentTaskClosure, 1);
-      closure->task_mode = VALENT_TASK_TERMINAL;
-
-      self->closed = TRUE;
-      g_async_queue_push_unlocked (self->tasks, closure);
-    }
-
-  g_async_queue_unlock (self->tasks);
-  g_clear_pointer (&self->tasks, g_async_queue_unref);
+  /* A queue with pending tasks holds a reference on itself while it has a
+   * worker, so there should be nothing left to cancel */
+  valent_task_queue_drain (self);
 }
 
 /**
@@ -175,22 +488,18 @@ valent_task_queue_free (gpointer data)
 ValentTaskQueue *
 valent_task_queue_new (void)
 {
+  static GOnce workers_once = G_ONCE_INIT;
   ValentTaskQueue *queue;
-  g_autoptr (GThread) thread = NULL;
-  g_autoptr (GError) error = NULL;
+  gboolean ready;
+
+  ready = GPOINTER_TO_INT (g_once (&workers_once, valent_task_queue_workers_init, NULL));
 
   queue = g_atomic_rc_box_new0 (ValentTaskQueue);
-  queue->tasks = g_async_queue_new_full (valent_task_closure_cancel);
-  thread = g_thread_try_new ("valent-task-queue",
-                             valent_task_queue_loop,
-                             g_async_queue_ref (queue->tasks),
-                             &error);
 
-  if G_UNLIKELY (error != NULL)
-    {
-      g_critical ("%s: %s", G_STRFUNC, error->message);
-      queue->closed = TRUE;
-    }
+  for (unsigned int i = 0; i < N_LANES; i++)
+    g_queue_init (&queue->lanes[i].tasks);
+
+  queue->closed = !ready;
 
   return queue;
 }
@@ -217,8 +526,8 @@ valent_task_queue_ref (ValentTaskQueue *queue)
  *
  * Decreases the reference count of @queue.
  *
- * When the reference count drops to 0, @queue will signal its dedicated thread
- * to exit and free any resources.
+ * When the reference count drops to 0, @queue will be freed. Tasks that are
+ * already queued hold a reference, so they will still be executed.
  */
 void
 valent_task_queue_unref (ValentTaskQueue *queue)
@@ -236,6 +545,10 @@ valent_task_queue_unref (ValentTaskQueue *queue)
  * @task_mode: a #ValentTaskMode
  *
  * Push @task and @task_func onto @queue with @task_mode.
+ *
+ * Pushing @task doesn't contend with the worker running @queue. If @queue is
+ * idle, a worker is borrowed with g_thread_pool_push(), which does take the
+ * lock of the shared pool.
  */
 static void
 valent_task_queue_run_full (ValentTaskQueue *self,
@@ -255,20 +568,21 @@ valent_task_queue_run_full (ValentTaskQueue *self,
   closure->task_mode = task_mode;
   closure->priority = g_task_get_priority (task);
 
-  g_async_queue_lock (self->tasks);
-
-  if (!self->closed)
+  /* Only the first terminal task may close the queue */
+  if (g_atomic_int_get (&self->closed) ||
+      (task_mode == VALENT_TASK_TERMINAL &&
+       !g_atomic_int_compare_and_exchange (&self->closed, FALSE, TRUE)))
     {
-      self->closed = (closure->task_mode == VALENT_TASK_TERMINAL);
-      g_async_queue_push_sorted_unlocked (self->tasks,
-                                          g_steal_pointer (&closure),
-                                          valent_task_queue_sort,
-                                          NULL);
+      g_clear_pointer (&closure, valent_task_closure_cancel);
+      return;
     }
 
-  g_async_queue_unlock (self->tasks);
+  valent_task_lane_push (&self->lanes[valent_task_lane_for_priority (closure->priority)],
+                         closure);
 
-  g_clear_pointer (&closure, valent_task_closure_cancel);
+  /* Borrow a worker, which holds a reference until the queue is drained */
+  if (g_atomic_int_compare_and_exchange (&self->running, FALSE, TRUE))
+    g_thread_pool_push (workers, valent_task_queue_ref (self), NULL);
 }
 
 /**
@@ -291,6 +605,30 @@ valent_task_queue_run (ValentTaskQueue *queue,
   valent_task_queue_run_full (queue, task, task_func, VALENT_TASK_SEQUENTIAL);
 }
 
+/**
+ * valent_task_queue_run_concurrent:
+ * @queue: a #ValentTaskQueue
+ * @task: a #GTask
+ * @task_func: (scope async): a #GTaskThreadFunc
+ *
+ * A variant of valent_task_queue_run() that may run in parallel with other
+ * concurrent tasks.
+ *
+ * Concurrent tasks are still started in order of priority, but any other task
+ * queued after @task will wait for it to complete before running.
+ */
+void
+valent_task_queue_run_concurrent (ValentTaskQueue *queue,
+                                  GTask           *task,
+                                  GTaskThreadFunc  task_func)
+{
+  g_return_if_fail (VALENT_IS_TASK_QUEUE (queue));
+  g_return_if_fail (G_IS_TASK (task));
+  g_return_if_fail (task_func != NULL);
+
+  valent_task_queue_run_full (queue, task, task_func, VALENT_TASK_CONCURRENT);
+}
+
 /**
  * valent_task_queue_run_check:
  * @queue: a #ValentTaskQueue
@@ -21,21 +21,24 @@ GType             valent_task_queue_get_type   (void) G_GNUC_CONST;
 
 #define VALENT_TYPE_TASK_QUEUE (valent_task_queue_get_type())
 
-ValentTaskQueue * valent_task_queue_new       (void);
-void              valent_task_queue_run       (ValentTaskQueue *queue,
-                                               GTask           *task,
-                                               GTaskThreadFunc  task_func);
-void              valent_task_queue_run_check (ValentTaskQueue *queue,
-                                               GTask           *task,
-                                               GTaskThreadFunc  task_func);
-void              valent_task_queue_run_close (ValentTaskQueue *queue,
-                                               GTask           *task,
-                                               GTaskThreadFunc  task_func);
-void              valent_task_queue_run_sync  (ValentTaskQueue *queue,
-                                               GTask           *task,
-                                               GTaskThreadFunc  task_func);
-ValentTaskQueue * valent_task_queue_ref       (ValentTaskQueue *queue);
-void              valent_task_queue_unref     (ValentTaskQueue *queue);
+ValentTaskQueue * valent_task_queue_new            (void);
+void              valent_task_queue_run            (ValentTaskQueue *queue,
+                                                    GTask           *task,
+                                                    GTaskThreadFunc  task_func);
+void              valent_task_queue_run_concurrent (ValentTaskQueue *queue,
+                                                    GTask           *task,
+                                                    GTaskThreadFunc  task_func);
+void              valent_task_queue_run_check      (ValentTaskQueue *queue,
+                                                    GTask           *task,
+                                                    GTaskThreadFunc  task_func);
+void              valent_task_queue_run_close      (ValentTaskQueue *queue,
+                                                    GTask           *task,
+                                                    GTaskThreadFunc  task_func);
+void              valent_task_queue_run_sync       (ValentTaskQueue *queue,
+                                                    GTask           *task,
+                                                    GTaskThreadFunc  task_func);
+ValentTaskQueue * valent_task_queue_ref            (ValentTaskQueue *queue);
+void              valent_task_queue_unref          (ValentTaskQueue *queue);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValentTaskQueue, g_atomic_rc_box_release)
 
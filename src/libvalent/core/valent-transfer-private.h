@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "valent-transfer.h"
+#include "valent-transfer-scheduler.h"
+
+G_BEGIN_DECLS
+
+/**
+ * ValentTransferProgressFunc:
+ * @n_bytes: the number of bytes written
+ * @user_data: user supplied data
+ *
+ * A function called each time a block of data has been written.
+ */
+typedef void (*ValentTransferProgressFunc) (gsize    n_bytes,
+                                            gpointer user_data);
+
+void       valent_transfer_set_state   (ValentTransfer              *transfer,
+                                        ValentTransferState          state);
+gboolean   valent_transfer_is_download (ValentTransfer              *transfer);
+void       valent_transfer_timeout     (ValentTransfer              *transfer);
+gboolean   valent_transfer_preallocate (GOutputStream               *target,
+                                        goffset                      offset,
+                                        goffset                      length);
+gboolean   valent_transfer_pipe        (GInputStream                *source,
+                                        GOutputStream               *target,
+                                        gsize                        buffer_size,
+                                        ValentTransferProgressFunc   progress_func,
+                                        gpointer                     progress_data,
+                                        goffset                     *transferred,
+                                        GCancellable                *cancellable,
+                                        GError                     **error);
+
+void       valent_transfer_scheduler_queue    (ValentTransferScheduler *scheduler,
+                                               GTask                   *task,
+                                               GTaskThreadFunc          task_func);
+void       valent_transfer_scheduler_throttle (ValentTransferScheduler *scheduler,
+                                               gsize                    n_bytes,
+                                               GCancellable            *cancellable);
+
+G_END_DECLS
+
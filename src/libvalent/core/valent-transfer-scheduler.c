@@ -0,0 +1,913 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#define G_LOG_DOMAIN "valent-transfer-scheduler"
+
+#include "config.h"
+
+#include <gio/gio.h>
+
+#include "valent-device.h"
+#include "valent-transfer.h"
+#include "valent-transfer-private.h"
+#include "valent-transfer-scheduler.h"
+
+
+/**
+ * SECTION:valenttransferscheduler
+ * @short_description: A scheduler for transfers
+ * @title: ValentTransferScheduler
+ * @stability: Unstable
+ * @include: libvalent-core.h
+ *
+ * #ValentTransferScheduler decides when each #ValentTransfer runs, so that
+ * transfers to several devices don't saturate the disk or the network and
+ * starve the packets sent to each device.
+ *
+ * Downloads and uploads are scheduled separately, so a download the peer is
+ * waiting to send never queues behind uploads. For each, at most
+ * #ValentTransferScheduler:max-active transfers run at once, and at most
+ * #ValentTransferScheduler:max-device-active for any one device. When a slot
+ * is free, the waiting transfer with the highest #ValentTransfer:priority runs
+ * next. Among transfers of equal priority, those for devices with the fewest
+ * running transfers go first, then in the order they were queued.
+ *
+ * A waiting transfer that is cancelled completes immediately. A running
+ * transfer that makes no progress for #ValentTransferScheduler:stall-timeout
+ * seconds fails with %G_IO_ERROR_TIMED_OUT.
+ *
+ * If #ValentTransferScheduler:max-rate is set, the data sent or received by all
+ * running transfers is limited to that many bytes per second.
+ *
+ * The scheduler is a #GListModel of the transfers it holds, either waiting or
+ * running, in the order they were queued.
+ */
+
+#define DEFAULT_MAX_ACTIVE        (4)
+#define DEFAULT_MAX_DEVICE_ACTIVE (2)
+#define DEFAULT_STALL_TIMEOUT     (60)
+#define STALL_INTERVAL            (250) /* ms */
+#define THROTTLE_BURST            (4)
+#define THROTTLE_SLICE            (G_USEC_PER_SEC / 10)
+
+enum {
+  SCHEDULE_UPLOAD,
+  SCHEDULE_DOWNLOAD,
+  N_SCHEDULES
+};
+
+typedef struct
+{
+  ValentTransferScheduler *scheduler;
+  GTask                   *task;
+  GTaskThreadFunc          task_func;
+  guint64                  sequence;
+  unsigned int             schedule;
+
+  /* Waiting */
+  GSource                 *cancelled_source;
+
+  /* Running */
+  guint64                  transferred;
+  gint64                   progress_time;
+} ScheduledTask;
+
+typedef struct
+{
+  unsigned int  n_active[N_SCHEDULES];
+} DeviceSlots;
+
+struct _ValentTransferScheduler
+{
+  GObject       parent_instance;
+
+  GPtrArray    *transfers;
+  GQueue        pending;
+  GQueue        active;
+  GHashTable   *devices;
+  unsigned int  n_active[N_SCHEDULES];
+  unsigned int  max_active;
+  unsigned int  max_device_active;
+  guint64       sequence;
+
+  /* Stalled Transfers */
+  unsigned int  stall_timeout;
+  unsigned int  stall_id;
+
+  /* Bandwidth */
+  GMutex        rate_lock;
+  guint64       max_rate;
+  gint64        tokens;
+  gint64        tokens_time;
+};
+
+static void   g_list_model_iface_init (GListModelInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (ValentTransferScheduler, valent_transfer_scheduler, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL, g_list_model_iface_init))
+
+enum {
+  PROP_0,
+  PROP_MAX_ACTIVE,
+  PROP_MAX_DEVICE_ACTIVE,
+  PROP_MAX_RATE,
+  PROP_STALL_TIMEOUT,
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+static ValentTransferScheduler *default_scheduler = NULL;
+
+
+/*
+ * GListModel
+ */
+static gpointer
+valent_transfer_scheduler_get_item (GListModel   *list,
+                                    unsigned int  position)
+{
+  ValentTransferScheduler *self = VALENT_TRANSFER_SCHEDULER (list);
+
+  if (position >= self->transfers->len)
+    return NULL;
+
+  return g_object_ref (g_ptr_array_index (self->transfers, position));
+}
+
+static GType
+valent_transfer_scheduler_get_item_type (GListModel *list)
+{
+  return VALENT_TYPE_TRANSFER;
+}
+
+static unsigned int
+valent_transfer_scheduler_get_n_items (GListModel *list)
+{
+  ValentTransferScheduler *self = VALENT_TRANSFER_SCHEDULER (list);
+
+  return self->transfers->len;
+}
+
+static void
+g_list_model_iface_init (GListModelInterface *iface)
+{
+  iface->get_item = valent_transfer_scheduler_get_item;
+  iface->get_item_type = valent_transfer_scheduler_get_item_type;
+  iface->get_n_items = valent_transfer_scheduler_get_n_items;
+}
+
+
+/*
+ * Scheduling
+ */
+static void
+scheduled_task_free (gpointer data)
+{
+  ScheduledTask *scheduled = data;
+
+  if (scheduled->cancelled_source != NULL)
+    {
+      g_source_destroy (scheduled->cancelled_source);
+      g_clear_pointer (&scheduled->cancelled_source, g_source_unref);
+    }
+
+  g_clear_object (&scheduled->task);
+  g_free (scheduled);
+}
+
+static int
+scheduled_task_find (gconstpointer a,
+                     gconstpointer b)
+{
+  const ScheduledTask *scheduled = a;
+
+  return (scheduled->task == (GTask *)b) ? 0 : 1;
+}
+
+static inline unsigned int
+valent_transfer_scheduler_get_device_active (ValentTransferScheduler *self,
+                                             ValentDevice            *device,
+                                             unsigned int             schedule)
+{
+  DeviceSlots *slots = g_hash_table_lookup (self->devices, device);
+
+  if (slots == NULL)
+    return 0;
+
+  if (schedule == N_SCHEDULES)
+    return slots->n_active[SCHEDULE_UPLOAD] + slots->n_active[SCHEDULE_DOWNLOAD];
+
+  return slots->n_active[schedule];
+}
+
+static inline void
+valent_transfer_scheduler_add_device_active (ValentTransferScheduler *self,
+                                             ValentDevice            *device,
+                                             unsigned int             schedule,
+                                             int                      n_active)
+{
+  DeviceSlots *slots = g_hash_table_lookup (self->devices, device);
+
+  if (slots == NULL)
+    {
+      slots = g_new0 (DeviceSlots, 1);
+      g_hash_table_insert (self->devices, device, slots);
+    }
+
+  slots->n_active[schedule] += n_active;
+
+  if (slots->n_active[SCHEDULE_UPLOAD] == 0 &&
+      slots->n_active[SCHEDULE_DOWNLOAD] == 0)
+    g_hash_table_remove (self->devices, device);
+}
+
+/**
+ * scheduled_task_compare:
+ * @self: a #ValentTransferScheduler
+ * @a: a #ScheduledTask
+ * @b: a #ScheduledTask
+ *
+ * Compare @a and @b by transfer priority, the number of running transfers for
+ * their devices and the order they were queued.
+ *
+ * Returns: a negative integer if @a should run before @b, otherwise positive
+ */
+static int
+scheduled_task_compare (ValentTransferScheduler *self,
+                        ScheduledTask           *a,
+                        ScheduledTask           *b)
+{
+  ValentTransfer *transfer_a = g_task_get_source_object (a->task);
+  ValentTransfer *transfer_b = g_task_get_source_object (b->task);
+  int priority_a, priority_b;
+  unsigned int active_a, active_b;
+
+  priority_a = valent_transfer_get_priority (transfer_a);
+  priority_b = valent_transfer_get_priority (transfer_b);
+
+  if (priority_a != priority_b)
+    return (priority_a < priority_b) ? -1 : 1;
+
+  active_a = valent_transfer_scheduler_get_device_active (self,
+               valent_transfer_get_device (transfer_a),
+               N_SCHEDULES);
+  active_b = valent_transfer_scheduler_get_device_active (self,
+               valent_transfer_get_device (transfer_b),
+               N_SCHEDULES);
+
+  if (active_a != active_b)
+    return (active_a < active_b) ? -1 : 1;
+
+  return (a->sequence < b->sequence) ? -1 : 1;
+}
+
+/**
+ * scheduled_task_can_run:
+ * @self: a #ValentTransferScheduler
+ * @scheduled: a #ScheduledTask
+ *
+ * Check if there is a free slot for @scheduled, both overall and for its
+ * device, in the schedule it belongs to.
+ *
+ * Returns: %TRUE if @scheduled can run now
+ */
+static inline gboolean
+scheduled_task_can_run (ValentTransferScheduler *self,
+                        ScheduledTask           *scheduled)
+{
+  ValentTransfer *transfer = g_task_get_source_object (scheduled->task);
+  unsigned int n_active;
+
+  if (self->n_active[scheduled->schedule] >= self->max_active)
+    return FALSE;
+
+  n_active = valent_transfer_scheduler_get_device_active (self,
+               valent_transfer_get_device (transfer),
+               scheduled->schedule);
+
+  return n_active < self->max_device_active;
+}
+
+static gboolean
+valent_transfer_scheduler_check_stalled (gpointer data)
+{
+  ValentTransferScheduler *self = VALENT_TRANSFER_SCHEDULER (data);
+  gint64 now = g_get_monotonic_time ();
+  gint64 timeout = (gint64)self->stall_timeout * G_USEC_PER_SEC;
+
+  for (const GList *iter = self->active.head; iter != NULL; iter = iter->next)
+    {
+      ScheduledTask *scheduled = iter->data;
+      ValentTransfer *transfer = g_task_get_source_object (scheduled->task);
+      guint64 transferred;
+
+      transferred = valent_transfer_get_transferred (transfer);
+
+      if (transferred != scheduled->transferred)
+        {
+          scheduled->transferred = transferred;
+          scheduled->progress_time = now;
+        }
+      else if (now - scheduled->progress_time >= timeout)
+        {
+          g_debug ("%s(): transfer %s stalled for %us",
+                   G_STRFUNC,
+                   valent_transfer_get_id (transfer),
+                   self->stall_timeout);
+
+          scheduled->progress_time = now;
+          valent_transfer_timeout (transfer);
+        }
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+valent_transfer_scheduler_update_stalled (ValentTransferScheduler *self)
+{
+  if (self->active.length > 0 && self->stall_timeout > 0)
+    {
+      if (self->stall_id == 0)
+        self->stall_id = g_timeout_add (STALL_INTERVAL,
+                                        valent_transfer_scheduler_check_stalled,
+                                        self);
+    }
+  else
+    {
+      g_clear_handle_id (&self->stall_id, g_source_remove);
+    }
+}
+
+static gboolean
+on_pending_cancelled (GCancellable *cancellable,
+                      gpointer      user_data)
+{
+  ScheduledTask *scheduled = user_data;
+  ValentTransfer *transfer = g_task_get_source_object (scheduled->task);
+
+  /* The task completes without ever running, so it's removed from the queue
+   * before it returns */
+  g_queue_remove (&scheduled->scheduler->pending, scheduled);
+  valent_transfer_set_state (transfer, VALENT_TRANSFER_STATE_COMPLETE);
+
+  g_task_return_error_if_cancelled (scheduled->task);
+  scheduled_task_free (scheduled);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+valent_transfer_scheduler_dispatch (ValentTransferScheduler *self)
+{
+  while (self->pending.length > 0)
+    {
+      GList *next = NULL;
+      ScheduledTask *scheduled;
+      ValentTransfer *transfer;
+
+      for (GList *iter = self->pending.head; iter != NULL; iter = iter->next)
+        {
+          if (!scheduled_task_can_run (self, iter->data))
+            continue;
+
+          if (next == NULL || scheduled_task_compare (self, iter->data, next->data) < 0)
+            next = iter;
+        }
+
+      if (next == NULL)
+        break;
+
+      scheduled = next->data;
+      g_queue_delete_link (&self->pending, next);
+      g_queue_push_tail (&self->active, scheduled);
+
+      if (scheduled->cancelled_source != NULL)
+        {
+          g_source_destroy (scheduled->cancelled_source);
+          g_clear_pointer (&scheduled->cancelled_source, g_source_unref);
+        }
+
+      transfer = g_task_get_source_object (scheduled->task);
+      valent_transfer_scheduler_add_device_active (self,
+                                                   valent_transfer_get_device (transfer),
+                                                   scheduled->schedule,
+                                                   1);
+      self->n_active[scheduled->schedule]++;
+
+      scheduled->transferred = valent_transfer_get_transferred (transfer);
+      scheduled->progress_time = g_get_monotonic_time ();
+
+      valent_transfer_set_state (transfer, VALENT_TRANSFER_STATE_ACTIVE);
+      g_task_run_in_thread (scheduled->task, scheduled->task_func);
+    }
+
+  valent_transfer_scheduler_update_stalled (self);
+}
+
+static void
+on_task_completed (GTask                   *task,
+                   GParamSpec              *pspec,
+                   ValentTransferScheduler *self)
+{
+  ValentTransfer *transfer = g_task_get_source_object (task);
+  GList *link;
+  unsigned int position;
+
+  g_signal_handlers_disconnect_by_func (task, on_task_completed, self);
+
+  /* Tasks cancelled while waiting have already been removed */
+  if ((link = g_queue_find_custom (&self->active, task, scheduled_task_find)) != NULL)
+    {
+      ScheduledTask *scheduled = link->data;
+
+      valent_transfer_scheduler_add_device_active (self,
+                                                   valent_transfer_get_device (transfer),
+                                                   scheduled->schedule,
+                                                   -1);
+      self->n_active[scheduled->schedule]--;
+
+      g_queue_delete_link (&self->active, link);
+      scheduled_task_free (scheduled);
+    }
+
+  valent_transfer_set_state (transfer, VALENT_TRANSFER_STATE_COMPLETE);
+
+  if (g_ptr_array_find (self->transfers, transfer, &position))
+    {
+      g_ptr_array_remove_index (self->transfers, position);
+      g_list_model_items_changed (G_LIST_MODEL (self), position, 1, 0);
+    }
+
+  valent_transfer_scheduler_dispatch (self);
+  g_object_unref (self);
+}
+
+
+/*
+ * GObject
+ */
+static void
+valent_transfer_scheduler_finalize (GObject *object)
+{
+  ValentTransferScheduler *self = VALENT_TRANSFER_SCHEDULER (object);
+
+  g_clear_handle_id (&self->stall_id, g_source_remove);
+  g_clear_pointer (&self->transfers, g_ptr_array_unref);
+  g_clear_pointer (&self->devices, g_hash_table_unref);
+  g_mutex_clear (&self->rate_lock);
+
+  G_OBJECT_CLASS (valent_transfer_scheduler_parent_class)->finalize (object);
+}
+
+static void
+valent_transfer_scheduler_get_property (GObject    *object,
+                                        guint       prop_id,
+                                        GValue     *value,
+                                        GParamSpec *pspec)
+{
+  ValentTransferScheduler *self = VALENT_TRANSFER_SCHEDULER (object);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_ACTIVE:
+      g_value_set_uint (value, self->max_active);
+      break;
+
+    case PROP_MAX_DEVICE_ACTIVE:
+      g_value_set_uint (value, self->max_device_active);
+      break;
+
+    case PROP_MAX_RATE:
+      g_value_set_uint64 (value, valent_transfer_scheduler_get_max_rate (self));
+      break;
+
+    case PROP_STALL_TIMEOUT:
+      g_value_set_uint (value, self->stall_timeout);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+valent_transfer_scheduler_set_property (GObject      *object,
+                                        guint         prop_id,
+                                        const GValue *value,
+                                        GParamSpec   *pspec)
+{
+  ValentTransferScheduler *self = VALENT_TRANSFER_SCHEDULER (object);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_ACTIVE:
+      valent_transfer_scheduler_set_max_active (self, g_value_get_uint (value));
+      break;
+
+    case PROP_MAX_DEVICE_ACTIVE:
+      valent_transfer_scheduler_set_max_device_active (self, g_value_get_uint (value));
+      break;
+
+    case PROP_MAX_RATE:
+      valent_transfer_scheduler_set_max_rate (self, g_value_get_uint64 (value));
+      break;
+
+    case PROP_STALL_TIMEOUT:
+      valent_transfer_scheduler_set_stall_timeout (self, g_value_get_uint (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+valent_transfer_scheduler_class_init (ValentTransferSchedulerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = valent_transfer_scheduler_finalize;
+  object_class->get_property = valent_transfer_scheduler_get_property;
+  object_class->set_property = valent_transfer_scheduler_set_property;
+
+  /**
+   * ValentTransferScheduler:max-active:
+   *
+   * The maximum number of downloads, and of uploads, running at once.
+   */
+  properties [PROP_MAX_ACTIVE] =
+    g_param_spec_uint ("max-active",
+                       "Max Active",
+                       "The maximum number of transfers running at once",
+                       1, G_MAXUINT,
+                       DEFAULT_MAX_ACTIVE,
+                       (G_PARAM_READWRITE |
+                        G_PARAM_EXPLICIT_NOTIFY |
+                        G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentTransferScheduler:max-device-active:
+   *
+   * The maximum number of downloads, and of uploads, running at once for any
+   * one device.
+   */
+  properties [PROP_MAX_DEVICE_ACTIVE] =
+    g_param_spec_uint ("max-device-active",
+                       "Max Device Active",
+                       "The maximum number of transfers running at once for a device",
+                       1, G_MAXUINT,
+                       DEFAULT_MAX_DEVICE_ACTIVE,
+                       (G_PARAM_READWRITE |
+                        G_PARAM_EXPLICIT_NOTIFY |
+                        G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentTransferScheduler:max-rate:
+   *
+   * The maximum combined rate of all transfers in bytes per second, or `0` for
+   * no limit.
+   */
+  properties [PROP_MAX_RATE] =
+    g_param_spec_uint64 ("max-rate",
+                         "Max Rate",
+                         "The maximum combined rate in bytes per second",
+                         0, G_MAXINT64 / G_USEC_PER_SEC,
+                         0,
+                         (G_PARAM_READWRITE |
+                          G_PARAM_EXPLICIT_NOTIFY |
+                          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentTransferScheduler:stall-timeout:
+   *
+   * The number of seconds a running transfer may go without progress before it
+   * fails with %G_IO_ERROR_TIMED_OUT, or `0` for no limit.
+   */
+  properties [PROP_STALL_TIMEOUT] =
+    g_param_spec_uint ("stall-timeout",
+                       "Stall Timeout",
+                       "The number of seconds a transfer may go without progress",
+                       0, G_MAXUINT / G_USEC_PER_SEC,
+                       DEFAULT_STALL_TIMEOUT,
+                       (G_PARAM_READWRITE |
+                        G_PARAM_EXPLICIT_NOTIFY |
+                        G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, properties);
+}
+
+static void
+valent_transfer_scheduler_init (ValentTransferScheduler *self)
+{
+  self->transfers = g_ptr_array_new_with_free_func (g_object_unref);
+  self->devices = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  self->max_active = DEFAULT_MAX_ACTIVE;
+  self->max_device_active = DEFAULT_MAX_DEVICE_ACTIVE;
+  self->stall_timeout = DEFAULT_STALL_TIMEOUT;
+  g_mutex_init (&self->rate_lock);
+}
+
+/**
+ * valent_transfer_scheduler_get_default:
+ *
+ * Get the default #ValentTransferScheduler, used by valent_transfer_execute().
+ *
+ * Returns: (transfer none): a #ValentTransferScheduler
+ */
+ValentTransferScheduler *
+valent_transfer_scheduler_get_default (void)
+{
+  if (default_scheduler == NULL)
+    {
+      default_scheduler = g_object_new (VALENT_TYPE_TRANSFER_SCHEDULER, NULL);
+
+      g_object_add_weak_pointer (G_OBJECT (default_scheduler),
+                                 (gpointer) &default_scheduler);
+    }
+
+  return default_scheduler;
+}
+
+/**
+ * valent_transfer_scheduler_get_max_active:
+ * @scheduler: a #ValentTransferScheduler
+ *
+ * Get the maximum number of downloads, and of uploads, running at once.
+ *
+ * Returns: the maximum number of running transfers
+ */
+unsigned int
+valent_transfer_scheduler_get_max_active (ValentTransferScheduler *scheduler)
+{
+  g_return_val_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler), 0);
+
+  return scheduler->max_active;
+}
+
+/**
+ * valent_transfer_scheduler_set_max_active:
+ * @scheduler: a #ValentTransferScheduler
+ * @max_active: the maximum number of running transfers
+ *
+ * Set the maximum number of downloads, and of uploads, running at once.
+ * Running transfers are never interrupted, but no more will start until there
+ * are fewer than @max_active.
+ */
+void
+valent_transfer_scheduler_set_max_active (ValentTransferScheduler *scheduler,
+                                          unsigned int             max_active)
+{
+  g_return_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler));
+  g_return_if_fail (max_active > 0);
+
+  if (scheduler->max_active == max_active)
+    return;
+
+  scheduler->max_active = max_active;
+  valent_transfer_scheduler_dispatch (scheduler);
+  g_object_notify_by_pspec (G_OBJECT (scheduler), properties [PROP_MAX_ACTIVE]);
+}
+
+/**
+ * valent_transfer_scheduler_get_max_device_active:
+ * @scheduler: a #ValentTransferScheduler
+ *
+ * Get the maximum number of downloads, and of uploads, running at once for any
+ * one device.
+ *
+ * Returns: the maximum number of running transfers for a device
+ */
+unsigned int
+valent_transfer_scheduler_get_max_device_active (ValentTransferScheduler *scheduler)
+{
+  g_return_val_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler), 0);
+
+  return scheduler->max_device_active;
+}
+
+/**
+ * valent_transfer_scheduler_set_max_device_active:
+ * @scheduler: a #ValentTransferScheduler
+ * @max_active: the maximum number of running transfers for a device
+ *
+ * Set the maximum number of downloads, and of uploads, running at once for any
+ * one device. Running transfers are never interrupted.
+ */
+void
+valent_transfer_scheduler_set_max_device_active (ValentTransferScheduler *scheduler,
+                                                 unsigned int             max_active)
+{
+  g_return_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler));
+  g_return_if_fail (max_active > 0);
+
+  if (scheduler->max_device_active == max_active)
+    return;
+
+  scheduler->max_device_active = max_active;
+  valent_transfer_scheduler_dispatch (scheduler);
+  g_object_notify_by_pspec (G_OBJECT (scheduler), properties [PROP_MAX_DEVICE_ACTIVE]);
+}
+
+/**
+ * valent_transfer_scheduler_get_max_rate:
+ * @scheduler: a #ValentTransferScheduler
+ *
+ * Get the maximum combined rate of all transfers in bytes per second.
+ *
+ * Returns: the maximum rate, or `0` for no limit
+ */
+guint64
+valent_transfer_scheduler_get_max_rate (ValentTransferScheduler *scheduler)
+{
+  guint64 ret;
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler), 0);
+
+  g_mutex_lock (&scheduler->rate_lock);
+  ret = scheduler->max_rate;
+  g_mutex_unlock (&scheduler->rate_lock);
+
+  return ret;
+}
+
+/**
+ * valent_transfer_scheduler_set_max_rate:
+ * @scheduler: a #ValentTransferScheduler
+ * @max_rate: the maximum rate, or `0` for no limit
+ *
+ * Set the maximum combined rate of all transfers in bytes per second.
+ */
+void
+valent_transfer_scheduler_set_max_rate (ValentTransferScheduler *scheduler,
+                                        guint64                  max_rate)
+{
+  g_return_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler));
+
+  g_mutex_lock (&scheduler->rate_lock);
+  if (scheduler->max_rate == max_rate)
+    {
+      g_mutex_unlock (&scheduler->rate_lock);
+      return;
+    }
+
+  scheduler->max_rate = max_rate;
+  scheduler->tokens = 0;
+  scheduler->tokens_time = g_get_monotonic_time ();
+  g_mutex_unlock (&scheduler->rate_lock);
+
+  g_object_notify_by_pspec (G_OBJECT (scheduler), properties [PROP_MAX_RATE]);
+}
+
+/**
+ * valent_transfer_scheduler_get_stall_timeout:
+ * @scheduler: a #ValentTransferScheduler
+ *
+ * Get the number of seconds a running transfer may go without progress.
+ *
+ * Returns: the timeout in seconds, or `0` for no limit
+ */
+unsigned int
+valent_transfer_scheduler_get_stall_timeout (ValentTransferScheduler *scheduler)
+{
+  g_return_val_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler), 0);
+
+  return scheduler->stall_timeout;
+}
+
+/**
+ * valent_transfer_scheduler_set_stall_timeout:
+ * @scheduler: a #ValentTransferScheduler
+ * @timeout: the timeout in seconds, or `0` for no limit
+ *
+ * Set the number of seconds a running transfer may go without progress before
+ * it fails with %G_IO_ERROR_TIMED_OUT.
+ */
+void
+valent_transfer_scheduler_set_stall_timeout (ValentTransferScheduler *scheduler,
+                                             unsigned int             timeout)
+{
+  g_return_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler));
+
+  if (scheduler->stall_timeout == timeout)
+    return;
+
+  scheduler->stall_timeout = timeout;
+  g_clear_handle_id (&scheduler->stall_id, g_source_remove);
+  valent_transfer_scheduler_update_stalled (scheduler);
+  g_object_notify_by_pspec (G_OBJECT (scheduler), properties [PROP_STALL_TIMEOUT]);
+}
+
+/**
+ * valent_transfer_scheduler_queue: (skip)
+ * @scheduler: a #ValentTransferScheduler
+ * @task: a #GTask
+ * @task_func: (scope async): a #GTaskThreadFunc
+ *
+ * Queue @task to be run in a thread with @task_func, once @scheduler has a free
+ * slot. The source object of @task must be a #ValentTransfer.
+ *
+ * This must be called from the main thread.
+ */
+void
+valent_transfer_scheduler_queue (ValentTransferScheduler *scheduler,
+                                 GTask                   *task,
+                                 GTaskThreadFunc          task_func)
+{
+  ValentTransfer *transfer;
+  ScheduledTask *scheduled;
+  GCancellable *cancellable;
+
+  g_return_if_fail (VALENT_IS_TRANSFER_SCHEDULER (scheduler));
+  g_return_if_fail (G_IS_TASK (task));
+  g_return_if_fail (VALENT_IS_TRANSFER (g_task_get_source_object (task)));
+  g_return_if_fail (task_func != NULL);
+
+  transfer = g_task_get_source_object (task);
+
+  /* The scheduler is held until the task completes */
+  g_signal_connect (task,
+                    "notify::completed",
+                    G_CALLBACK (on_task_completed),
+                    g_object_ref (scheduler));
+
+  scheduled = g_new0 (ScheduledTask, 1);
+  scheduled->scheduler = scheduler;
+  scheduled->task = g_object_ref (task);
+  scheduled->task_func = task_func;
+  scheduled->sequence = scheduler->sequence++;
+  scheduled->schedule = valent_transfer_is_download (transfer)
+                      ? SCHEDULE_DOWNLOAD
+                      : SCHEDULE_UPLOAD;
+  g_queue_push_tail (&scheduler->pending, scheduled);
+
+  /* A task cancelled while waiting completes without waiting for a slot */
+  if ((cancellable = g_task_get_cancellable (task)) != NULL)
+    {
+      scheduled->cancelled_source = g_cancellable_source_new (cancellable);
+      g_source_set_callback (scheduled->cancelled_source,
+                             (GSourceFunc)on_pending_cancelled,
+                             scheduled,
+                             NULL);
+      g_source_attach (scheduled->cancelled_source, g_task_get_context (task));
+    }
+
+  g_ptr_array_add (scheduler->transfers, g_object_ref (transfer));
+  g_list_model_items_changed (G_LIST_MODEL (scheduler),
+                              scheduler->transfers->len - 1,
+                              0,
+                              1);
+
+  valent_transfer_scheduler_dispatch (scheduler);
+}
+
+/**
+ * valent_transfer_scheduler_throttle: (skip)
+ * @scheduler: a #ValentTransferScheduler
+ * @n_bytes: the number of bytes transferred
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Account for @n_bytes transferred, and block until the combined rate of all
+ * transfers is under #ValentTransferScheduler:max-rate or @cancellable is
+ * triggered.
+ *
+ * A caller that finds the budget overdrawn waits until it would be repaid, so
+ * the combined rate never exceeds the limit. This function is thread-safe.
+ */
+void
+valent_transfer_scheduler_throttle (ValentTransferScheduler *scheduler,
+                                    gsize                    n_bytes,
+                                    GCancellable            *cancellable)
+{
+  gint64 delay = 0;
+
+  g_assert (VALENT_IS_TRANSFER_SCHEDULER (scheduler));
+
+  g_mutex_lock (&scheduler->rate_lock);
+  if (scheduler->max_rate > 0)
+    {
+      gint64 burst = scheduler->max_rate / THROTTLE_BURST;
+      gint64 now, elapsed;
+
+      /* Refill the bucket for the time elapsed, allowing a short burst */
+      now = g_get_monotonic_time ();
+      elapsed = MIN (now - scheduler->tokens_time, G_USEC_PER_SEC);
+      scheduler->tokens += elapsed * (gint64)scheduler->max_rate / G_USEC_PER_SEC;
+      scheduler->tokens = MIN (scheduler->tokens, burst);
+      scheduler->tokens_time = now;
+
+      scheduler->tokens -= (gint64)n_bytes;
+
+      if (scheduler->tokens < 0)
+        delay = -scheduler->tokens * G_USEC_PER_SEC / (gint64)scheduler->max_rate;
+    }
+  g_mutex_unlock (&scheduler->rate_lock);
+
+  while (delay > 0 && !g_cancellable_is_cancelled (cancellable))
+    {
+      g_usleep (MIN (delay, THROTTLE_SLICE));
+      delay -= THROTTLE_SLICE;
+    }
+}
+
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#pragma once
+
+#if !defined (VALENT_CORE_INSIDE) && !defined (VALENT_CORE_COMPILATION)
+# error "Only <libvalent-core.h> can be included directly."
+#endif
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define VALENT_TYPE_TRANSFER_SCHEDULER (valent_transfer_scheduler_get_type())
+
+G_DECLARE_FINAL_TYPE (ValentTransferScheduler, valent_transfer_scheduler, VALENT, TRANSFER_SCHEDULER, GObject)
+
+ValentTransferScheduler * valent_transfer_scheduler_get_default           (void);
+
+unsigned int              valent_transfer_scheduler_get_max_active        (ValentTransferScheduler *scheduler);
+void                      valent_transfer_scheduler_set_max_active        (ValentTransferScheduler *scheduler,
+                                                                           unsigned int             max_active);
+unsigned int              valent_transfer_scheduler_get_max_device_active (ValentTransferScheduler *scheduler);
+void                      valent_transfer_scheduler_set_max_device_active (ValentTransferScheduler *scheduler,
+                                                                           unsigned int             max_active);
+guint64                   valent_transfer_scheduler_get_max_rate          (ValentTransferScheduler *scheduler);
+void                      valent_transfer_scheduler_set_max_rate          (ValentTransferScheduler *scheduler,
+                                                                           guint64                  max_rate);
+unsigned int              valent_transfer_scheduler_get_stall_timeout     (ValentTransferScheduler *scheduler);
+void                      valent_transfer_scheduler_set_stall_timeout     (ValentTransferScheduler *scheduler,
+                                                                           unsigned int             timeout);
+
+G_END_DECLS
+
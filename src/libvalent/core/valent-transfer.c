@@ -5,13 +5,33 @@
 
 #include "config.h"
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <gio/gfiledescriptorbased.h>
+
+/* sendfile() needs the socket itself, so it is only used for unencrypted
+ * socket connections (e.g. the test channel). LAN payloads are sent over a
+ * GTlsConnection and always take the buffered path. */
+#if defined (HAVE_SENDFILE) && defined (__linux__)
+# include <sys/sendfile.h>
+# define TRANSFER_USE_SENDFILE
+#endif
+
 #include "valent-core-enums.h"
 
 #include "valent-channel.h"
 #include "valent-device.h"
 #include "valent-macros.h"
 #include "valent-packet.h"
+#include "valent-task-queue.h"
 #include "valent-transfer.h"
+#include "valent-transfer-private.h"
+#include "valent-transfer-scheduler.h"
 
 
 /**
@@ -22,17 +42,39 @@
  * @include: libvalent-core.h
  *
  * The #ValentTransfer object represents a data transfer to or from a device.
+ *
+ * When a transfer has more than one item, up to the number allowed by the
+ * device's channel are transferred at once, as reported by
+ * valent_channel_get_transfer_limit().
  */
 
+#define PROGRESS_INTERVAL   (G_USEC_PER_SEC / 4)
+#define TRANSFER_CHUNK_SIZE (64 * 1024)
+#define TRANSFER_FILE_CHUNK_SIZE (1024 * 1024)
+
+typedef struct _TransferOperation TransferOperation;
+
 typedef struct
 {
-  ValentDevice        *device;
-  GCancellable        *cancellable;
-  GPtrArray           *items;
+  ValentDevice            *device;
+  ValentTransferScheduler *scheduler;
+  GCancellable            *cancellable;
+  GPtrArray               *items;
+  unsigned int             n_completed;
+
+  /* Progress */
+  GMutex                   progress_lock;
+  TransferOperation       *operation;
+  guint64                  size;
+  guint64                  transferred;
+  guint64                  rate;
+  gint64                   rate_time;
+  guint64                  rate_transferred;
 
   /* Transfer Properties */
-  char                *id;
-  ValentTransferState  state;
+  char                    *id;
+  int                      priority;
+  ValentTransferState      state;
 } ValentTransferPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ValentTransfer, valent_transfer, G_TYPE_OBJECT)
@@ -42,7 +84,13 @@ enum {
   PROP_0,
   PROP_DEVICE,
   PROP_ID,
+  PROP_PRIORITY,
+  PROP_PROGRESS,
+  PROP_RATE,
+  PROP_REMAINING,
+  PROP_SIZE,
   PROP_STATE,
+  PROP_TRANSFERRED,
   N_PROPERTIES
 };
 
@@ -52,6 +100,9 @@ static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 /*
  * Transfer Item
  */
+#define RESUME_DIGEST_SIZE (32)
+#define TRANSFER_BYTES_MAX (64 * 1024 * 1024)
+
 typedef struct
 {
   JsonNode      *packet;
@@ -60,6 +111,13 @@ typedef struct
   GInputStream  *source;
   GOutputStream *target;
   gssize         size;
+  gboolean       to_bytes;
+
+  /* Resume */
+  GFile         *part;
+  GFile         *sidecar;
+  goffset        offset;
+  guint8         digest[RESUME_DIGEST_SIZE];
 } TransferItem;
 
 static void
@@ -72,18 +130,516 @@ transfer_item_free (gpointer data)
   g_clear_pointer (&item->bytes, g_bytes_unref);
   g_clear_object (&item->source);
   g_clear_object (&item->target);
+  g_clear_object (&item->part);
+  g_clear_object (&item->sidecar);
   g_free (item);
 }
 
-static gpointer
-stream_from_bytes (GBytes        *bytes,
-                   gssize        *size,
-                   GCancellable  *cancellable,
-                   GError       **error)
+/*
+ * Resumable Payloads
+ *
+ * If the peer lists `resume` in the `valentPayload` field of its identity, the
+ * uploader adds `"resume": true` to the `payloadTransferInfo` of seekable
+ * payloads. Before any payload data is sent, the downloader writes the offset
+ * it already holds as a 64-bit big-endian integer, followed by the SHA-256
+ * digest of the data up to that offset. The uploader replies with the offset
+ * it will send from, which is `0` if the digest does not match its own data.
+ *
+ * Resumable downloads to a file are written to a `.part` file next to it. If
+ * the transfer fails, a `.part.json` sidecar records the payload size and
+ * offset, so a later transfer of the same payload can continue. Packet ids
+ * change when a packet is resent, so the partial file is matched by its size
+ * and the digest of its data instead. Both files are removed when the download
+ * completes, when there is nothing to resume, or when the transfer is
+ * cancelled.
+ */
+static gboolean
+peer_supports_resume (ValentChannel *channel)
+{
+  JsonNode *identity;
+  JsonObject *body;
+  JsonNode *node;
+  JsonArray *features;
+
+  identity = valent_channel_get_peer_identity (channel);
+
+  if (identity == NULL || (body = valent_packet_get_body (identity)) == NULL)
+    return FALSE;
+
+  if ((node = json_object_get_member (body, "valentPayload")) == NULL ||
+      !JSON_NODE_HOLDS_ARRAY (node))
+    return FALSE;
+
+  features = json_node_get_array (node);
+
+  for (unsigned int i = 0, len = json_array_get_length (features); i < len; i++)
+    {
+      JsonNode *feature = json_array_get_element (features, i);
+
+      if (json_node_get_value_type (feature) == G_TYPE_STRING &&
+          g_strcmp0 (json_node_get_string (feature), "resume") == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static inline gboolean
+transfer_item_can_resume (TransferItem *item)
+{
+  JsonObject *info;
+
+  if (!valent_packet_has_payload (item->packet))
+    return FALSE;
+
+  info = valent_packet_get_payload_info (item->packet);
+
+  return json_object_get_boolean_member_with_default (info, "resume", FALSE);
+}
+
+/**
+ * transfer_hash_prefix:
+ * @stream: a #GInputStream
+ * @length: the number of bytes to hash
+ * @digest: (out caller-allocates): a buffer for the SHA-256 digest
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Read @length bytes from @stream and compute their SHA-256 digest.
+ *
+ * Returns: %TRUE, or %FALSE with @error set
+ */
+static gboolean
+transfer_hash_prefix (GInputStream  *stream,
+                      goffset        length,
+                      guint8        *digest,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  g_autoptr (GChecksum) checksum = NULL;
+  g_autofree guint8 *buffer = NULL;
+  gsize digest_len = RESUME_DIGEST_SIZE;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  buffer = g_malloc (TRANSFER_FILE_CHUNK_SIZE);
+
+  while (length > 0)
+    {
+      gsize n_read;
+
+      if (!g_input_stream_read_all (stream,
+                                    buffer,
+                                    MIN (length, TRANSFER_FILE_CHUNK_SIZE),
+                                    &n_read,
+                                    cancellable,
+                                    error))
+        return FALSE;
+
+      if (n_read == 0)
+        {
+          g_set_error_literal (error,
+                               G_IO_ERROR,
+                               G_IO_ERROR_PARTIAL_INPUT,
+                               "Unexpected end of stream");
+          return FALSE;
+        }
+
+      g_checksum_update (checksum, buffer, n_read);
+      length -= n_read;
+    }
+
+  g_checksum_get_digest (checksum, digest, &digest_len);
+
+  return TRUE;
+}
+
+/**
+ * transfer_item_load_sidecar:
+ * @item: a #TransferItem
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Get the offset recorded in the sidecar for @item, if it describes a payload
+ * of the same size and the partial file holds exactly that much data.
+ *
+ * Returns: the offset to resume from, or `0`
+ */
+static goffset
+transfer_item_load_sidecar (TransferItem *item,
+                            GCancellable *cancellable)
+{
+  g_autofree char *contents = NULL;
+  g_autoptr (JsonNode) node = NULL;
+  g_autoptr (GFileInfo) info = NULL;
+  JsonObject *sidecar;
+  gint64 offset;
+
+  if (!g_file_load_contents (item->sidecar, cancellable, &contents, NULL, NULL, NULL))
+    return 0;
+
+  if ((node = json_from_string (contents, NULL)) == NULL ||
+      !JSON_NODE_HOLDS_OBJECT (node))
+    return 0;
+
+  sidecar = json_node_get_object (node);
+  offset = json_object_get_int_member_with_default (sidecar, "offset", 0);
+
+  if (json_object_get_int_member_with_default (sidecar, "payloadSize", -1) != item->size ||
+      offset <= 0 || offset >= item->size)
+    return 0;
+
+  info = g_file_query_info (item->part,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            NULL);
+
+  if (info == NULL || g_file_info_get_size (info) != offset)
+    return 0;
+
+  return offset;
+}
+
+/**
+ * transfer_item_open_part:
+ * @item: a #TransferItem
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Open the partial file for @item, keeping any data that can be resumed from.
+ *
+ * Returns: (transfer full) (nullable): a #GFileOutputStream
+ */
+static GFileOutputStream *
+transfer_item_open_part (TransferItem  *item,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_autoptr (GFile) parent = NULL;
+  g_autofree char *basename = NULL;
+  g_autofree char *part_name = NULL;
+  g_autofree char *sidecar_name = NULL;
+  goffset offset;
+
+  item->offset = 0;
+
+  if ((parent = g_file_get_parent (item->file)) == NULL)
+    return g_file_replace (item->file,
+                           NULL,
+                           FALSE,
+                           G_FILE_CREATE_REPLACE_DESTINATION,
+                           cancellable,
+                           error);
+
+  basename = g_file_get_basename (item->file);
+  part_name = g_strconcat (basename, ".part", NULL);
+  sidecar_name = g_strconcat (basename, ".part.json", NULL);
+
+  g_clear_object (&item->part);
+  g_clear_object (&item->sidecar);
+  item->part = g_file_get_child (parent, part_name);
+  item->sidecar = g_file_get_child (parent, sidecar_name);
+
+  /* Hash the data already received, to be verified by the uploader */
+  if ((offset = transfer_item_load_sidecar (item, cancellable)) > 0)
+    {
+      g_autoptr (GFileInputStream) prefix = NULL;
+
+      prefix = g_file_read (item->part, cancellable, NULL);
+
+      if (prefix != NULL &&
+          transfer_hash_prefix (G_INPUT_STREAM (prefix),
+                                offset,
+                                item->digest,
+                                cancellable,
+                                NULL))
+        {
+          item->offset = offset;
+
+          return g_file_append_to (item->part,
+                                   G_FILE_CREATE_NONE,
+                                   cancellable,
+                                   error);
+        }
+    }
+
+  return g_file_replace (item->part,
+                         NULL,
+                         FALSE,
+                         G_FILE_CREATE_REPLACE_DESTINATION,
+                         cancellable,
+                         error);
+}
+
+/**
+ * transfer_item_resume_download:
+ * @item: a #TransferItem
+ * @stream: a #GIOStream
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Request that the payload for @item is sent from the offset already held, and
+ * restart the partial file if the uploader declines.
+ *
+ * Returns: %TRUE, or %FALSE with @error set
+ */
+static gboolean
+transfer_item_resume_download (TransferItem  *item,
+                               GIOStream     *stream,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  guint8 request[sizeof (guint64) + RESUME_DIGEST_SIZE] = { 0, };
+  GFileOutputStream *target;
+  guint64 offset_be;
+  gsize n_read;
+
+  offset_be = GUINT64_TO_BE ((guint64)item->offset);
+  memcpy (request, &offset_be, sizeof (guint64));
+
+  if (item->offset > 0)
+    memcpy (request + sizeof (guint64), item->digest, RESUME_DIGEST_SIZE);
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (stream),
+                                  request,
+                                  sizeof (request),
+                                  NULL,
+                                  cancellable,
+                                  error))
+    return FALSE;
+
+  if (!g_input_stream_read_all (g_io_stream_get_input_stream (stream),
+                                &offset_be,
+                                sizeof (guint64),
+                                &n_read,
+                                cancellable,
+                                error))
+    return FALSE;
+
+  if (n_read != sizeof (guint64))
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_PARTIAL_INPUT,
+                           "Unexpected end of stream");
+      return FALSE;
+    }
+
+  if (GUINT64_FROM_BE (offset_be) == (guint64)item->offset)
+    return TRUE;
+
+  if (GUINT64_FROM_BE (offset_be) != 0 || item->part == NULL)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_INVALID_DATA,
+                           "Invalid resume offset");
+      return FALSE;
+    }
+
+  /* The uploader's data differs from ours, so start over */
+  g_output_stream_close (item->target, NULL, NULL);
+  g_clear_object (&item->target);
+  item->offset = 0;
+
+  target = g_file_replace (item->part,
+                           NULL,
+                           FALSE,
+                           G_FILE_CREATE_REPLACE_DESTINATION,
+                           cancellable,
+                           error);
+
+  if (target == NULL)
+    return FALSE;
+
+  item->target = G_OUTPUT_STREAM (target);
+
+  return TRUE;
+}
+
+/**
+ * transfer_item_resume_upload:
+ * @item: a #TransferItem
+ * @stream: a #GIOStream
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Read the offset requested by the downloader and, if its digest matches the
+ * data in the source for @item, continue from there.
+ *
+ * Returns: %TRUE, or %FALSE with @error set
+ */
+static gboolean
+transfer_item_resume_upload (TransferItem  *item,
+                             GIOStream     *stream,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  guint8 request[sizeof (guint64) + RESUME_DIGEST_SIZE];
+  guint8 digest[RESUME_DIGEST_SIZE];
+  guint64 offset_be;
+  goffset offset;
+  gsize n_read;
+
+  if (!g_input_stream_read_all (g_io_stream_get_input_stream (stream),
+                                request,
+                                sizeof (request),
+                                &n_read,
+                                cancellable,
+                                error))
+    return FALSE;
+
+  if (n_read != sizeof (request))
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_PARTIAL_INPUT,
+                           "Unexpected end of stream");
+      return FALSE;
+    }
+
+  memcpy (&offset_be, request, sizeof (guint64));
+  offset = (goffset)GUINT64_FROM_BE (offset_be);
+  item->offset = 0;
+
+  /* Hashing the prefix leaves the source at the offset, so rewind it if the
+   * downloader's data doesn't match */
+  if (offset > 0 && offset < item->size)
+    {
+      if (!transfer_hash_prefix (item->source, offset, digest, cancellable, error))
+        return FALSE;
+
+      if (memcmp (digest, request + sizeof (guint64), RESUME_DIGEST_SIZE) == 0)
+        item->offset = offset;
+      else if (!g_seekable_seek (G_SEEKABLE (item->source), 0, G_SEEK_SET, cancellable, error))
+        return FALSE;
+    }
+
+  offset_be = GUINT64_TO_BE ((guint64)item->offset);
+
+  return g_output_stream_write_all (g_io_stream_get_output_stream (stream),
+                                    &offset_be,
+                                    sizeof (guint64),
+                                    NULL,
+                                    cancellable,
+                                    error);
+}
+
+/**
+ * transfer_item_finish_part:
+ * @item: a #TransferItem
+ * @offset: the number of bytes in the partial file
+ * @success: whether the payload was received in full
+ * @abandoned: whether the transfer was cancelled
+ * @error: (nullable): a #GError
+ *
+ * If @success is %TRUE, move the partial file for @item into place. If the
+ * transfer was abandoned, or no data was received, remove the partial file.
+ * Otherwise record @offset in the sidecar, so the download can be resumed.
+ *
+ * Returns: %TRUE, or %FALSE with @error set
+ */
+static gboolean
+transfer_item_finish_part (TransferItem  *item,
+                           goffset        offset,
+                           gboolean       success,
+                           gboolean       abandoned,
+                           GError       **error)
+{
+  g_autofree char *contents = NULL;
+
+  if (success)
+    {
+      g_file_delete (item->sidecar, NULL, NULL);
+
+      return g_file_move (item->part,
+                          item->file,
+                          G_FILE_COPY_OVERWRITE,
+                          NULL,
+                          NULL,
+                          NULL,
+                          error);
+    }
+
+  if (abandoned || offset <= 0)
+    {
+      g_file_delete (item->sidecar, NULL, NULL);
+      g_file_delete (item->part, NULL, NULL);
+
+      return TRUE;
+    }
+
+  contents = g_strdup_printf ("{"
+                              "\"payloadSize\":%"G_GSSIZE_FORMAT","
+                              "\"offset\":%"G_GOFFSET_FORMAT
+                              "}\n",
+                              item->size,
+                              offset);
+
+  return g_file_replace_contents (item->sidecar,
+                                  contents,
+                                  strlen (contents),
+                                  NULL,
+                                  FALSE,
+                                  G_FILE_CREATE_NONE,
+                                  NULL,
+                                  NULL,
+                                  error);
+}
+
+/**
+ * transfer_item_open_bytes:
+ * @item: a #TransferItem
+ * @error: (nullable): a #GError
+ *
+ * Open an in-memory target for the payload of @item, allocated up front from
+ * the payload size. The payload can be taken without copying once the stream
+ * is closed, with transfer_item_close_bytes().
+ *
+ * Returns: (transfer full) (nullable): a #GOutputStream
+ */
+static GOutputStream *
+transfer_item_open_bytes (TransferItem  *item,
+                          GError       **error)
+{
+  gpointer data = NULL;
+
+  if (item->size > TRANSFER_BYTES_MAX)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_MESSAGE_TOO_LARGE,
+                   "Payload of %"G_GSSIZE_FORMAT" bytes is too large for memory",
+                   item->size);
+      return NULL;
+    }
+
+  if (item->size > 0 && (data = g_try_malloc (item->size)) == NULL)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NO_SPACE,
+                   "Failed to allocate %"G_GSSIZE_FORMAT" bytes",
+                   item->size);
+      return NULL;
+    }
+
+  /* The buffer is fixed-size, so a peer can't send more than it announced */
+  return g_memory_output_stream_new (data, MAX (item->size, 0), NULL, g_free);
+}
+
+/**
+ * transfer_item_close_bytes:
+ * @item: a #TransferItem
+ *
+ * Take the payload received by the in-memory target of @item.
+ */
+static void
+transfer_item_close_bytes (TransferItem *item)
 {
-  gpointer out = NULL;
+  GMemoryOutputStream *stream = G_MEMORY_OUTPUT_STREAM (item->target);
 
-  return out;
+  g_clear_pointer (&item->bytes, g_bytes_unref);
+  item->bytes = g_memory_output_stream_steal_as_bytes (stream);
 }
 
 /**
@@ -94,7 +650,7 @@ stream_from_bytes (GBytes        *bytes,
  *
  * Execute the transfer described by @item.
  *
- * Returns: %TRUE, or %FAALSE with @error set
+ * Returns: %TRUE, or %FALSE with @error set
  */
 static gboolean
 transfer_item_prepare (TransferItem  *item,
@@ -110,18 +666,22 @@ transfer_item_prepare (TransferItem  *item,
         {
           GFileOutputStream *stream;
 
-          stream = g_file_replace (item->file,
-                                   NULL,
-                                   FALSE,
-                                   G_FILE_CREATE_REPLACE_DESTINATION,
-                                   cancellable,
-                                   error);
+          /* Resumable downloads are written to a partial file */
+          if (transfer_item_can_resume (item))
+            stream = transfer_item_open_part (item, cancellable, error);
+          else
+            stream = g_file_replace (item->file,
+                                     NULL,
+                                     FALSE,
+                                     G_FILE_CREATE_REPLACE_DESTINATION,
+                                     cancellable,
+                                     error);
 
           if (stream != NULL)
             item->target = G_OUTPUT_STREAM (stream);
         }
-      else if (item->bytes != NULL)
-        item->target = stream_from_bytes (item->bytes, NULL, cancellable, error);
+      else if (item->to_bytes)
+        item->target = transfer_item_open_bytes (item, error);
 
       return G_IS_OUTPUT_STREAM (item->target);
     }
@@ -146,6 +706,16 @@ transfer_item_prepare (TransferItem  *item,
 
           stream = g_file_read (item->file, cancellable, error);
 
+#ifdef HAVE_POSIX_FADVISE
+          /* Files are read once, front to back */
+          if (G_IS_FILE_DESCRIPTOR_BASED (stream))
+            {
+              int fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (stream));
+
+              posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+#endif
+
           if (stream != NULL)
             {
               item->size = g_file_info_get_size (info);
@@ -164,47 +734,696 @@ transfer_item_prepare (TransferItem  *item,
     }
 }
 
+/**
+ * transfer_item_get_size:
+ * @item: a #TransferItem
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Get the payload size of @item without opening it, or `0` if unknown.
+ *
+ * Returns: the payload size in bytes
+ */
+static goffset
+transfer_item_get_size (TransferItem *item,
+                        GCancellable *cancellable)
+{
+  if (valent_packet_has_payload (item->packet))
+    return MAX (valent_packet_get_payload_size (item->packet), 0);
+
+  if (item->size > 0)
+    return item->size;
+
+  if (item->bytes != NULL)
+    return g_bytes_get_size (item->bytes);
+
+  if (item->file != NULL)
+    {
+      g_autoptr (GFileInfo) info = NULL;
+
+      info = g_file_query_info (item->file,
+                                G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                G_FILE_QUERY_INFO_NONE,
+                                cancellable,
+                                NULL);
+
+      if (info != NULL)
+        return g_file_info_get_size (info);
+    }
+
+  return 0;
+}
+
+
+/*
+ * Pipelined Writes
+ *
+ * Downloads to disk read the next block from the network while the previous
+ * one is written, alternating between two large buffers. The reader and writer
+ * only wait on each other when the other side has fallen a full buffer behind.
+ */
+typedef struct
+{
+  GOutputStream              *target;
+  GCancellable               *cancellable;
+  ValentTransferProgressFunc  progress_func;
+  gpointer                    progress_data;
+
+  GMutex                      lock;
+  GCond                       cond;
+  guint8                     *buffers[2];
+  gsize                       lengths[2];
+  gboolean                    closed;
+  goffset                     written;
+  GError                     *error;
+} TransferPipe;
+
+static void
+transfer_pipe_set_error (TransferPipe *pipe,
+                         GError       *error)
+{
+  g_mutex_lock (&pipe->lock);
+  if (pipe->error == NULL)
+    pipe->error = g_steal_pointer (&error);
+  g_cond_signal (&pipe->cond);
+  g_mutex_unlock (&pipe->lock);
+
+  g_clear_error (&error);
+}
+
+static gpointer
+transfer_pipe_writer (gpointer data)
+{
+  TransferPipe *pipe = data;
+  unsigned int i = 0;
+
+  while (TRUE)
+    {
+      GError *error = NULL;
+      gsize length;
+
+      g_mutex_lock (&pipe->lock);
+      while (pipe->lengths[i] == 0 && !pipe->closed && pipe->error == NULL)
+        g_cond_wait (&pipe->cond, &pipe->lock);
+      length = (pipe->error == NULL) ? pipe->lengths[i] : 0;
+      g_mutex_unlock (&pipe->lock);
+
+      /* Closed and drained, or failed */
+      if (length == 0)
+        break;
+
+      if (!g_output_stream_write_all (pipe->target,
+                                      pipe->buffers[i],
+                                      length,
+                                      NULL,
+                                      pipe->cancellable,
+                                      &error))
+        {
+          transfer_pipe_set_error (pipe, error);
+          break;
+        }
+
+      pipe->written += length;
+
+      if (pipe->progress_func != NULL)
+        pipe->progress_func (length, pipe->progress_data);
+
+      g_mutex_lock (&pipe->lock);
+      pipe->lengths[i] = 0;
+      g_cond_signal (&pipe->cond);
+      g_mutex_unlock (&pipe->lock);
+
+      i ^= 1;
+    }
+
+  return NULL;
+}
+
+/**
+ * valent_transfer_preallocate:
+ * @target: a #GOutputStream
+ * @offset: the offset to allocate from
+ * @length: the number of bytes to allocate
+ *
+ * Reserve disk space for @length bytes from @offset, if @target is backed by a
+ * file and the platform supports it. This keeps large downloads contiguous on
+ * disk, without changing the apparent size of the file.
+ *
+ * Returns: %TRUE if the space was reserved
+ */
+gboolean
+valent_transfer_preallocate (GOutputStream *target,
+                             goffset        offset,
+                             goffset        length)
+{
+  g_assert (G_IS_OUTPUT_STREAM (target));
+
+#if defined (HAVE_FALLOCATE) && defined (__linux__)
+  if (length > 0 && G_IS_FILE_DESCRIPTOR_BASED (target))
+    {
+      int fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (target));
+
+      /* The size is kept, so a partial file reflects the data received */
+      if (fallocate (fd, FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return TRUE;
+
+      g_debug ("%s(): %s", G_STRFUNC, g_strerror (errno));
+    }
+#endif
+
+  return FALSE;
+}
+
+/**
+ * valent_transfer_pipe:
+ * @source: a #GInputStream
+ * @target: a #GOutputStream
+ * @buffer_size: the size of each buffer
+ * @progress_func: (scope call) (nullable): a #ValentTransferProgressFunc
+ * @progress_data: (closure progress_func): user supplied data
+ * @transferred: (out) (optional): the number of bytes written
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Copy @source to @target until the end of @source, writing each block of
+ * @buffer_size bytes from a separate thread while the next block is read.
+ *
+ * @progress_func is called from the writing thread.
+ *
+ * Returns: %TRUE, or %FALSE with @error set
+ */
+gboolean
+valent_transfer_pipe (GInputStream                *source,
+                      GOutputStream               *target,
+                      gsize                        buffer_size,
+                      ValentTransferProgressFunc   progress_func,
+                      gpointer                     progress_data,
+                      goffset                     *transferred,
+                      GCancellable                *cancellable,
+                      GError                     **error)
+{
+  TransferPipe pipe = {
+    .target = target,
+    .cancellable = cancellable,
+    .progress_func = progress_func,
+    .progress_data = progress_data,
+  };
+  GThread *writer;
+  unsigned int i = 0;
+
+  g_assert (G_IS_INPUT_STREAM (source));
+  g_assert (G_IS_OUTPUT_STREAM (target));
+  g_assert (buffer_size > 0);
+  g_assert (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+  g_assert (error == NULL || *error == NULL);
+
+  g_mutex_init (&pipe.lock);
+  g_cond_init (&pipe.cond);
+  pipe.buffers[0] = g_malloc (buffer_size);
+  pipe.buffers[1] = g_malloc (buffer_size);
+
+  writer = g_thread_new ("valent-transfer-pipe", transfer_pipe_writer, &pipe);
+
+  while (TRUE)
+    {
+      GError *read_error = NULL;
+      gsize n_read = 0;
+      gboolean failed;
+
+      /* Wait for the writer to release this buffer */
+      g_mutex_lock (&pipe.lock);
+      while (pipe.lengths[i] != 0 && pipe.error == NULL)
+        g_cond_wait (&pipe.cond, &pipe.lock);
+      failed = (pipe.error != NULL);
+      g_mutex_unlock (&pipe.lock);
+
+      if (failed)
+        break;
+
+      /* Fill the buffer, so the writer makes few large writes */
+      if (!g_input_stream_read_all (source,
+                                    pipe.buffers[i],
+                                    buffer_size,
+                                    &n_read,
+                                    cancellable,
+                                    &read_error))
+        {
+          transfer_pipe_set_error (&pipe, read_error);
+          break;
+        }
+
+      if (n_read == 0)
+        break;
+
+      g_mutex_lock (&pipe.lock);
+      pipe.lengths[i] = n_read;
+      g_cond_signal (&pipe.cond);
+      g_mutex_unlock (&pipe.lock);
+
+      if (n_read < buffer_size)
+        break;
+
+      i ^= 1;
+    }
+
+  g_mutex_lock (&pipe.lock);
+  pipe.closed = TRUE;
+  g_cond_signal (&pipe.cond);
+  g_mutex_unlock (&pipe.lock);
+
+  g_thread_join (writer);
+
+  if (transferred != NULL)
+    *transferred += pipe.written;
+
+  g_free (pipe.buffers[0]);
+  g_free (pipe.buffers[1]);
+  g_cond_clear (&pipe.cond);
+  g_mutex_clear (&pipe.lock);
+
+  if (pipe.error != NULL)
+    {
+      g_propagate_error (error, pipe.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * Transfer Operation
+ */
+struct _TransferOperation
+{
+  ValentTransfer *transfer;
+  GMainContext   *context;
+  GCancellable   *cancellable;
+  GCancellable   *abandon;
+  unsigned int    next;
+  GMutex          lock;
+  GError         *error;
+};
+
+static gboolean
+transfer_notify_progress (gpointer data)
+{
+  GObject *object = G_OBJECT (data);
+
+  g_object_freeze_notify (object);
+  g_object_notify_by_pspec (object, properties [PROP_PROGRESS]);
+  g_object_notify_by_pspec (object, properties [PROP_RATE]);
+  g_object_notify_by_pspec (object, properties [PROP_REMAINING]);
+  g_object_notify_by_pspec (object, properties [PROP_SIZE]);
+  g_object_notify_by_pspec (object, properties [PROP_TRANSFERRED]);
+  g_object_thaw_notify (object);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * transfer_operation_update:
+ * @op: a #TransferOperation
+ * @n_bytes: the number of bytes transferred
+ * @force: whether to notify regardless of the throttle
+ *
+ * Add @n_bytes to the transferred count of @op and update the transfer rate.
+ *
+ * The rate is sampled at most every %PROGRESS_INTERVAL, and properties are
+ * notified in the main context of the operation at the same rate, so this can
+ * be called for every chunk from any worker.
+ */
+static void
+transfer_operation_update (TransferOperation *op,
+                           gsize              n_bytes,
+                           gboolean           force)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (op->transfer);
+  gboolean notify = force;
+  gint64 now;
+
+  g_mutex_lock (&priv->progress_lock);
+  priv->transferred += n_bytes;
+  now = g_get_monotonic_time ();
+
+  if (now - priv->rate_time >= PROGRESS_INTERVAL)
+    {
+      guint64 sample;
+
+      /* Smooth the rate, so a single slow read doesn't swing the ETA */
+      sample = (priv->transferred - priv->rate_transferred) * G_USEC_PER_SEC /
+               (now - priv->rate_time);
+      priv->rate = (priv->rate == 0) ? sample : (priv->rate * 3 + sample) / 4;
+      priv->rate_time = now;
+      priv->rate_transferred = priv->transferred;
+      notify = TRUE;
+    }
+  g_mutex_unlock (&priv->progress_lock);
+
+  if (notify)
+    {
+      g_main_context_invoke_full (op->context,
+                                  G_PRIORITY_DEFAULT,
+                                  transfer_notify_progress,
+                                  g_object_ref (op->transfer),
+                                  g_object_unref);
+    }
+}
+
+static void
+transfer_operation_cancel (GCancellable *cancellable,
+                           gpointer      user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/**
+ * transfer_operation_set_error:
+ * @op: a #TransferOperation
+ * @error: (transfer full): a #GError
+ *
+ * Record @error as the result of @op, if it is the first, and cancel any items
+ * still in progress.
+ */
+static void
+transfer_operation_set_error (TransferOperation *op,
+                              GError            *error)
+{
+  g_mutex_lock (&op->lock);
+
+  if (op->error == NULL)
+    op->error = g_steal_pointer (&error);
+
+  g_mutex_unlock (&op->lock);
+
+  g_clear_error (&error);
+  g_cancellable_cancel (op->cancellable);
+}
+
+/**
+ * transfer_operation_throttle:
+ * @op: a #TransferOperation
+ * @n_bytes: the number of bytes transferred
+ *
+ * Report @n_bytes to the scheduler running @op, waiting if the combined rate of
+ * all transfers is over the limit.
+ */
+static inline void
+transfer_operation_throttle (TransferOperation *op,
+                             gsize              n_bytes)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (op->transfer);
+
+  valent_transfer_scheduler_throttle (priv->scheduler, n_bytes, op->cancellable);
+}
+
+static void
+transfer_operation_progress (gsize    n_bytes,
+                             gpointer user_data)
+{
+  TransferOperation *op = user_data;
+
+  transfer_operation_update (op, n_bytes, FALSE);
+  transfer_operation_throttle (op, n_bytes);
+}
+
+/**
+ * transfer_operation_copy:
+ * @op: a #TransferOperation
+ * @source: a #GInputStream
+ * @target: a #GOutputStream
+ * @transferred: (out): the number of bytes copied
+ * @error: (nullable): a #GError
+ *
+ * Copy @source to @target in chunks, reporting progress for each.
+ *
+ * Sources backed by a file descriptor are read in larger chunks, since reads
+ * from the page cache are cheap compared to the number of system calls.
+ *
+ * Returns: %TRUE, or %FALSE with @error set
+ */
+static gboolean
+transfer_operation_copy (TransferOperation  *op,
+                         GInputStream       *source,
+                         GOutputStream      *target,
+                         goffset            *transferred,
+                         GError            **error)
+{
+  g_autofree guint8 *buffer = NULL;
+  gsize buffer_size = TRANSFER_CHUNK_SIZE;
+  gssize n_read;
+
+  if (G_IS_FILE_DESCRIPTOR_BASED (source))
+    buffer_size = TRANSFER_FILE_CHUNK_SIZE;
+
+  buffer = g_malloc (buffer_size);
+
+  while ((n_read = g_input_stream_read (source,
+                                        buffer,
+                                        buffer_size,
+                                        op->cancellable,
+                                        error)) > 0)
+    {
+      if (!g_output_stream_write_all (target,
+                                      buffer,
+                                      n_read,
+                                      NULL,
+                                      op->cancellable,
+                                      error))
+        return FALSE;
+
+      *transferred += n_read;
+      transfer_operation_update (op, n_read, FALSE);
+      transfer_operation_throttle (op, n_read);
+    }
+
+  return (n_read == 0);
+}
+
+#ifdef TRANSFER_USE_SENDFILE
+/**
+ * transfer_operation_sendfile:
+ * @op: a #TransferOperation
+ * @source: a #GFileDescriptorBased
+ * @connection: a #GSocketConnection
+ * @offset: the offset to start from
+ * @size: the size of @source
+ * @transferred: (out): the number of bytes sent
+ * @error: (nullable): a #GError
+ *
+ * Send @source from @offset to @size to @connection with `sendfile()`, so the
+ * data goes from the page cache to the socket without being copied to
+ * userspace.
+ *
+ * Returns: %TRUE, or %FALSE with @error set
+ */
+static gboolean
+transfer_operation_sendfile (TransferOperation  *op,
+                             GInputStream       *source,
+                             GSocketConnection  *connection,
+                             goffset             offset,
+                             goffset             size,
+                             goffset            *transferred,
+                             GError            **error)
+{
+  GSocket *socket = g_socket_connection_get_socket (connection);
+  int in_fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (source));
+  int out_fd = g_socket_get_fd (socket);
+  off_t position = offset;
+
+  while (position < size)
+    {
+      ssize_t n_sent;
+
+      if (g_cancellable_set_error_if_cancelled (op->cancellable, error))
+        return FALSE;
+
+      n_sent = sendfile (out_fd,
+                         in_fd,
+                         &position,
+                         (size_t)MIN (size - position, TRANSFER_FILE_CHUNK_SIZE));
+
+      if (n_sent > 0)
+        {
+          *transferred += n_sent;
+          transfer_operation_update (op, n_sent, FALSE);
+          transfer_operation_throttle (op, n_sent);
+          continue;
+        }
+
+      /* The file is shorter than expected */
+      if (n_sent == 0)
+        break;
+
+      if (errno == EINTR)
+        continue;
+
+      /* GSocket is non-blocking, so wait for it to be writable */
+      if (errno == EAGAIN)
+        {
+          if (!g_socket_condition_wait (socket, G_IO_OUT, op->cancellable, error))
+            return FALSE;
+
+          continue;
+        }
+
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           g_io_error_from_errno (errno),
+                           g_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * transfer_item_can_sendfile:
+ * @item: a #TransferItem
+ * @stream: a #GIOStream
+ *
+ * Check if the source of @item can be sent to @stream with `sendfile()`.
+ *
+ * This is only the case for a file sent over an unencrypted
+ * #GSocketConnection. A #GTlsConnection does not expose the socket beneath it,
+ * so encrypted channels never take this path.
+ *
+ * Returns: %TRUE if `sendfile()` can be used
+ */
+static gboolean
+transfer_item_can_sendfile (TransferItem *item,
+                            GIOStream    *stream)
+{
+  GSocket *socket;
+
+  if (!G_IS_SOCKET_CONNECTION (stream) ||
+      !G_IS_FILE_DESCRIPTOR_BASED (item->source))
+    return FALSE;
+
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (stream));
+
+  return g_socket_get_socket_type (socket) == G_SOCKET_TYPE_STREAM;
+}
+#endif /* TRANSFER_USE_SENDFILE */
+
+/**
+ * transfer_item_abort_download:
+ * @item: a #TransferItem
+ * @op: a #TransferOperation
+ *
+ * Close the target opened for @item, after the download failed before any
+ * payload data was received. The partial file is kept or removed as it would
+ * be by transfer_item_finish_part().
+ *
+ * Returns: %FALSE
+ */
+static gboolean
+transfer_item_abort_download (TransferItem      *item,
+                              TransferOperation *op)
+{
+  if (item->file == NULL && !item->to_bytes)
+    return FALSE;
+
+  if (G_IS_OUTPUT_STREAM (item->target))
+    g_output_stream_close (item->target, NULL, NULL);
+
+  g_clear_object (&item->target);
+
+  if (item->part != NULL)
+    {
+      transfer_item_finish_part (item,
+                                 item->offset,
+                                 FALSE,
+                                 g_cancellable_is_cancelled (op->abandon),
+                                 NULL);
+    }
+
+  return FALSE;
+}
+
 /**
  * transfer_item_execute:
  * @item: a #TransferItem
  * @channel: a #ValentChannel
- * @cancellable: (nullable): a #GCancellable
+ * @op: a #TransferOperation
  * @error: (nullable): a #GError
  *
  * Execute the transfer described by @item.
  *
- * Returns: %TRUE, or %FAALSE with @error set
+ * Returns: %TRUE, or %FALSE with @error set
  */
 static gboolean
-transfer_item_execute (TransferItem   *item,
-                       ValentChannel  *channel,
-                       GCancellable   *cancellable,
-                       GError        **error)
+transfer_item_execute (TransferItem       *item,
+                       ValentChannel      *channel,
+                       TransferOperation  *op,
+                       GError            **error)
 {
   g_autoptr (GIOStream) stream = NULL;
+  GCancellable *cancellable = op->cancellable;
   GInputStream *source;
   GOutputStream *target;
-  gssize transferred;
-
-  if (!transfer_item_prepare (item, cancellable, error))
-    return FALSE;
+  goffset transferred = 0;
+  gboolean resume = FALSE;
+  gboolean pipelined = FALSE;
+  gboolean ret;
+#ifdef TRANSFER_USE_SENDFILE
+  gboolean zero_copy = FALSE;
+#endif
 
   if (valent_packet_has_payload (item->packet))
     {
       item->size = valent_packet_get_payload_size (item->packet);
+      item->offset = 0;
+
+      if (!transfer_item_prepare (item, cancellable, error))
+        return FALSE;
+
       stream = valent_channel_download (channel,
                                         item->packet,
                                         cancellable,
                                         error);
 
       if (stream == NULL)
-        return FALSE;
+        return transfer_item_abort_download (item, op);
+
+      /* The uploader waits for an offset, even if this side can't resume */
+      if (transfer_item_can_resume (item) &&
+          !transfer_item_resume_download (item, stream, cancellable, error))
+        return transfer_item_abort_download (item, op);
 
       source = g_io_stream_get_input_stream (stream);
       target = item->target;
+
+      /* Reserve space for the rest of the file, and overlap disk writes with
+       * network reads */
+      if (G_IS_FILE_DESCRIPTOR_BASED (target))
+        {
+          valent_transfer_preallocate (target,
+                                       item->offset,
+                                       item->size - item->offset);
+          pipelined = TRUE;
+        }
     }
   else
     {
+      item->offset = 0;
+
+      if (!transfer_item_prepare (item, cancellable, error))
+        return FALSE;
+
+      /* Only offer to resume if the peer understands it, and the source can be
+       * rewound if the peer's data turns out not to match */
+      if (item->size > 0 &&
+          G_IS_SEEKABLE (item->source) &&
+          g_seekable_can_seek (G_SEEKABLE (item->source)) &&
+          peer_supports_resume (channel))
+        {
+          JsonObject *info = json_object_new ();
+
+          json_object_set_boolean_member (info, "resume", TRUE);
+          valent_packet_set_payload_info (item->packet, info);
+          resume = TRUE;
+        }
+
       valent_packet_set_payload_size (item->packet, item->size);
       stream = valent_channel_upload (channel,
                                       item->packet,
@@ -214,18 +1433,142 @@ transfer_item_execute (TransferItem   *item,
       if (stream == NULL)
         return FALSE;
 
-      source = item->source;
-      target = g_io_stream_get_output_stream (stream);
+      if (resume &&
+          !transfer_item_resume_upload (item, stream, cancellable, error))
+        return FALSE;
+
+      source = item->source;
+      target = g_io_stream_get_output_stream (stream);
+
+#ifdef TRANSFER_USE_SENDFILE
+      zero_copy = transfer_item_can_sendfile (item, stream);
+#endif
+    }
+
+  /* Count data skipped by resuming as transferred */
+  if (item->offset > 0)
+    transfer_operation_update (op, item->offset, FALSE);
+
+  if (pipelined)
+    ret = valent_transfer_pipe (source,
+                                target,
+                                TRANSFER_FILE_CHUNK_SIZE,
+                                transfer_operation_progress,
+                                op,
+                                &transferred,
+                                cancellable,
+                                error);
+#ifdef TRANSFER_USE_SENDFILE
+  else if (zero_copy)
+    ret = transfer_operation_sendfile (op,
+                                       source,
+                                       G_SOCKET_CONNECTION (stream),
+                                       item->offset,
+                                       item->size,
+                                       &transferred,
+                                       error);
+#endif
+  else
+    ret = transfer_operation_copy (op, source, target, &transferred, error);
+
+  /* Close both streams, but only report the first error */
+  ret = g_input_stream_close (source, NULL, ret ? error : NULL) && ret;
+  ret = g_output_stream_close (target, NULL, ret ? error : NULL) && ret;
+
+  if (ret && item->size != item->offset + transferred)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_PARTIAL_INPUT,
+                   "Transferred %"G_GOFFSET_FORMAT" of %"G_GSSIZE_FORMAT" bytes",
+                   item->offset + transferred, item->size);
+      ret = FALSE;
+    }
+
+  if (item->part != NULL)
+    {
+      ret = transfer_item_finish_part (item,
+                                       item->offset + transferred,
+                                       ret,
+                                       g_cancellable_is_cancelled (op->abandon),
+                                       ret ? error : NULL) && ret;
+    }
+
+  if (ret && item->to_bytes)
+    transfer_item_close_bytes (item);
+
+  /* Streams opened for a file can be opened again to retry the transfer */
+  if (item->file != NULL || item->to_bytes)
+    {
+      g_clear_object (&item->source);
+      g_clear_object (&item->target);
+    }
+
+  return ret;
+}
+
+/*
+ * Workers
+ */
+static void
+transfer_operation_worker (TransferOperation *op)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (op->transfer);
+  unsigned int i;
+
+  while ((i = g_atomic_int_add (&op->next, 1)) < priv->items->len)
+    {
+      TransferItem *item = g_ptr_array_index (priv->items, i);
+      ValentChannel *channel;
+      GError *error = NULL;
+
+      if (g_cancellable_set_error_if_cancelled (op->cancellable, &error))
+        {
+          transfer_operation_set_error (op, error);
+          break;
+        }
+
+      /* If the device has no channel, that means it's disconnected and we can't
+       * tell it we're ready to download or upload via the packet channel */
+      channel = valent_device_get_channel (priv->device);
+
+      if (channel == NULL)
+        {
+          transfer_operation_set_error (op,
+                                        g_error_new_literal (G_IO_ERROR,
+                                                             G_IO_ERROR_CONNECTION_CLOSED,
+                                                             "Device is disconnected"));
+          break;
+        }
+
+      if (!transfer_item_execute (item, channel, op, &error))
+        {
+          transfer_operation_set_error (op, error);
+          break;
+        }
+
+      g_atomic_int_inc (&priv->n_completed);
+      transfer_operation_update (op, 0, TRUE);
     }
+}
 
-  transferred = g_output_stream_splice (target,
-                                        source,
-                                        (G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
-                                         G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET),
-                                        cancellable,
-                                        error);
+static void
+transfer_operation_worker_task (GTask        *task,
+                                gpointer      source_object,
+                                gpointer      task_data,
+                                GCancellable *cancellable)
+{
+  transfer_operation_worker (task_data);
+  g_task_return_boolean (task, TRUE);
+}
 
-  return (item->size == transferred);
+static void
+transfer_operation_join_task (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+  g_task_return_boolean (task, TRUE);
 }
 
 static void
@@ -236,30 +1579,107 @@ execute_task (GTask        *task,
 {
   ValentTransfer *self = source_object;
   ValentTransferPrivate *priv = valent_transfer_get_instance_private (self);
-  GError *error = NULL;
+  TransferOperation op = { 0, };
+  ValentChannel *channel;
+  unsigned long cancelled_id = 0;
+  unsigned int n_workers;
+  guint64 size = 0;
 
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  channel = valent_device_get_channel (priv->device);
+
+  if (channel == NULL)
+    return g_task_return_new_error (task,
+                                    G_IO_ERROR,
+                                    G_IO_ERROR_CONNECTION_CLOSED,
+                                    "Device is disconnected");
+
+  /* Reset the progress, with the total size known up front */
   for (unsigned int i = 0; i < priv->items->len; i++)
+    size += transfer_item_get_size (g_ptr_array_index (priv->items, i), cancellable);
+
+  g_mutex_lock (&priv->progress_lock);
+  priv->size = size;
+  priv->transferred = 0;
+  priv->rate = 0;
+  priv->rate_time = g_get_monotonic_time ();
+  priv->rate_transferred = 0;
+  g_mutex_unlock (&priv->progress_lock);
+  g_atomic_int_set (&priv->n_completed, 0);
+
+  /* Items share a cancellable, so the first failure stops the others. Partial
+   * files are only discarded if the transfer itself is cancelled. */
+  op.transfer = self;
+  op.context = g_task_get_context (task);
+  op.cancellable = g_cancellable_new ();
+  op.abandon = cancellable;
+  g_mutex_init (&op.lock);
+
+  if (cancellable != NULL)
+    cancelled_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (transfer_operation_cancel),
+                                          op.cancellable,
+                                          NULL);
+
+  g_mutex_lock (&priv->progress_lock);
+  priv->operation = &op;
+  g_mutex_unlock (&priv->progress_lock);
+
+  /* This thread is a worker. Any others run as concurrent tasks on a private
+   * queue, using the shared pool of workers, and a barrier task queued after
+   * them returns once they have all completed. */
+  n_workers = MIN (valent_channel_get_transfer_limit (channel), priv->items->len);
+
+  if (n_workers > 1)
     {
-      TransferItem *item = g_ptr_array_index (priv->items, i);
-      ValentChannel *channel;
+      ValentTaskQueue *queue;
+      g_autoptr (GMainContext) context = NULL;
+      g_autoptr (GTask) barrier = NULL;
 
-      if (g_task_return_error_if_cancelled (task))
-        return;
+      context = g_main_context_new ();
+      g_main_context_push_thread_default (context);
 
-      /* If the device has no channel, that means it's disconnected and we can't
-       * tell it we're ready to download or upload via the packet channel */
-      channel = valent_device_get_channel (priv->device);
+      queue = valent_task_queue_new ();
 
-      if (channel == NULL)
-        return g_task_return_new_error (task,
-                                        G_IO_ERROR,
-                                        G_IO_ERROR_CONNECTION_CLOSED,
-                                        "Device is disconnected");
+      for (unsigned int i = 1; i < n_workers; i++)
+        {
+          g_autoptr (GTask) worker = NULL;
+
+          worker = g_task_new (self, NULL, NULL, NULL);
+          g_task_set_source_tag (worker, transfer_operation_worker_task);
+          g_task_set_task_data (worker, &op, NULL);
+          valent_task_queue_run_concurrent (queue,
+                                            worker,
+                                            transfer_operation_worker_task);
+        }
 
-      if (!transfer_item_execute (item, channel, cancellable, &error))
-        return g_task_return_error (task, error);
+      transfer_operation_worker (&op);
+
+      barrier = g_task_new (self, NULL, NULL, NULL);
+      g_task_set_source_tag (barrier, transfer_operation_join_task);
+      valent_task_queue_run_sync (queue, barrier, transfer_operation_join_task);
+      valent_task_queue_unref (queue);
+
+      g_main_context_pop_thread_default (context);
+    }
+  else
+    {
+      transfer_operation_worker (&op);
     }
 
+  g_mutex_lock (&priv->progress_lock);
+  priv->operation = NULL;
+  g_mutex_unlock (&priv->progress_lock);
+
+  g_cancellable_disconnect (cancellable, cancelled_id);
+  g_clear_object (&op.cancellable);
+  g_mutex_clear (&op.lock);
+
+  if (op.error != NULL)
+    return g_task_return_error (task, op.error);
+
   return g_task_return_boolean (task, TRUE);
 }
 
@@ -284,9 +1704,11 @@ valent_transfer_finalize (GObject *object)
   ValentTransferPrivate *priv = valent_transfer_get_instance_private (self);
 
   g_clear_object (&priv->device);
+  g_clear_object (&priv->scheduler);
   g_clear_object (&priv->cancellable);
   g_clear_pointer (&priv->id, g_free);
   g_clear_pointer (&priv->items, g_ptr_array_unref);
+  g_mutex_clear (&priv->progress_lock);
 
   G_OBJECT_CLASS (valent_transfer_parent_class)->finalize (object);
 }
@@ -310,10 +1732,34 @@ valent_transfer_get_property (GObject    *object,
       g_value_set_string (value, valent_transfer_get_id (self));
       break;
 
+    case PROP_PRIORITY:
+      g_value_set_int (value, priv->priority);
+      break;
+
+    case PROP_PROGRESS:
+      g_value_set_double (value, valent_transfer_get_progress (self));
+      break;
+
+    case PROP_RATE:
+      g_value_set_uint64 (value, valent_transfer_get_rate (self));
+      break;
+
+    case PROP_REMAINING:
+      g_value_set_int64 (value, valent_transfer_get_remaining (self));
+      break;
+
+    case PROP_SIZE:
+      g_value_set_uint64 (value, valent_transfer_get_size (self));
+      break;
+
     case PROP_STATE:
       g_value_set_enum (value, priv->state);
       break;
 
+    case PROP_TRANSFERRED:
+      g_value_set_uint64 (value, valent_transfer_get_transferred (self));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -338,6 +1784,10 @@ valent_transfer_set_property (GObject      *object,
       valent_transfer_set_id (self, g_value_get_string (value));
       break;
 
+    case PROP_PRIORITY:
+      valent_transfer_set_priority (self, g_value_get_int (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -385,6 +1835,92 @@ valent_transfer_class_init (ValentTransferClass *klass)
                           G_PARAM_EXPLICIT_NOTIFY |
                           G_PARAM_STATIC_STRINGS));
 
+  /**
+   * ValentTransfer:priority:
+   *
+   * The I/O priority of the transfer, such as %G_PRIORITY_DEFAULT.
+   *
+   * Transfers with a higher priority (a lower value) are started first by the
+   * #ValentTransferScheduler. Transfers the user is waiting on should use
+   * %G_PRIORITY_HIGH, while background transfers should use %G_PRIORITY_LOW.
+   */
+  properties [PROP_PRIORITY] =
+    g_param_spec_int ("priority",
+                      "Priority",
+                      "The I/O priority of the transfer",
+                      G_MININT, G_MAXINT,
+                      G_PRIORITY_DEFAULT,
+                      (G_PARAM_READWRITE |
+                       G_PARAM_EXPLICIT_NOTIFY |
+                       G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentTransfer:progress:
+   *
+   * The progress of the transfer, from `0.0` to `1.0`.
+   *
+   * This is the fraction of bytes transferred if the size of the transfer is
+   * known, otherwise the fraction of items that have completed.
+   */
+  properties [PROP_PROGRESS] =
+    g_param_spec_double ("progress",
+                         "Progress",
+                         "The transfer progress",
+                         0.0, 1.0,
+                         0.0,
+                         (G_PARAM_READABLE |
+                          G_PARAM_EXPLICIT_NOTIFY |
+                          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentTransfer:rate:
+   *
+   * The transfer rate, in bytes per second.
+   *
+   * This is updated a few times per second while the transfer is in progress,
+   * along with #ValentTransfer:transferred and #ValentTransfer:progress.
+   */
+  properties [PROP_RATE] =
+    g_param_spec_uint64 ("rate",
+                         "Rate",
+                         "The transfer rate in bytes per second",
+                         0, G_MAXUINT64,
+                         0,
+                         (G_PARAM_READABLE |
+                          G_PARAM_EXPLICIT_NOTIFY |
+                          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentTransfer:remaining:
+   *
+   * The estimated time until the transfer completes, in seconds, or `-1` if
+   * unknown.
+   */
+  properties [PROP_REMAINING] =
+    g_param_spec_int64 ("remaining",
+                        "Remaining",
+                        "The estimated time remaining in seconds",
+                        -1, G_MAXINT64,
+                        -1,
+                        (G_PARAM_READABLE |
+                         G_PARAM_EXPLICIT_NOTIFY |
+                         G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ValentTransfer:size:
+   *
+   * The total size of the transfer, in bytes, or `0` if unknown.
+   */
+  properties [PROP_SIZE] =
+    g_param_spec_uint64 ("size",
+                         "Size",
+                         "The total size in bytes",
+                         0, G_MAXUINT64,
+                         0,
+                         (G_PARAM_READABLE |
+                          G_PARAM_EXPLICIT_NOTIFY |
+                          G_PARAM_STATIC_STRINGS));
+
   /**
    * ValentTransfer:state:
    *
@@ -400,6 +1936,21 @@ valent_transfer_class_init (ValentTransferClass *klass)
                         G_PARAM_EXPLICIT_NOTIFY |
                         G_PARAM_STATIC_STRINGS));
 
+  /**
+   * ValentTransfer:transferred:
+   *
+   * The number of bytes transferred.
+   */
+  properties [PROP_TRANSFERRED] =
+    g_param_spec_uint64 ("transferred",
+                         "Transferred",
+                         "The number of bytes transferred",
+                         0, G_MAXUINT64,
+                         0,
+                         (G_PARAM_READABLE |
+                          G_PARAM_EXPLICIT_NOTIFY |
+                          G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_properties (object_class, N_PROPERTIES, properties);
 }
 
@@ -410,6 +1961,8 @@ valent_transfer_init (ValentTransfer *self)
 
   priv->cancellable = g_cancellable_new ();
   priv->items = g_ptr_array_new_with_free_func (transfer_item_free);
+  g_mutex_init (&priv->progress_lock);
+  priv->priority = G_PRIORITY_DEFAULT;
   priv->state = VALENT_TRANSFER_STATE_NONE;
 }
 
@@ -435,9 +1988,13 @@ valent_transfer_new (ValentDevice *device)
  * valent_transfer_add_bytes:
  * @transfer: a #ValentTransfer
  * @packet: a #JsonNode
- * @bytes: a #GBytes
+ * @bytes: (nullable): a #GBytes
  *
- * Add @file to the transfer queue.
+ * Add @bytes to the transfer queue.
+ *
+ * If @packet describes a download, @bytes should be %NULL and the payload will
+ * be received into memory. Once the transfer completes, it can be retrieved
+ * with valent_transfer_get_bytes().
  */
 void
 valent_transfer_add_bytes (ValentTransfer *transfer,
@@ -449,11 +2006,15 @@ valent_transfer_add_bytes (ValentTransfer *transfer,
 
   g_return_if_fail (VALENT_IS_TRANSFER (transfer));
   g_return_if_fail (VALENT_IS_PACKET (packet));
-  g_return_if_fail (bytes != NULL);
+  g_return_if_fail ((bytes == NULL) == valent_packet_has_payload (packet));
 
   item = g_new0 (TransferItem, 1);
   item->packet = json_node_ref (packet);
-  item->bytes = g_bytes_ref (bytes);
+
+  if (bytes != NULL)
+    item->bytes = g_bytes_ref (bytes);
+  else
+    item->to_bytes = TRUE;
 
   g_ptr_array_add (priv->items, item);
 }
@@ -590,6 +2151,38 @@ valent_transfer_cancel (ValentTransfer *transfer)
   priv->cancellable = g_cancellable_new ();
 }
 
+/**
+ * valent_transfer_get_bytes:
+ * @transfer: a #ValentTransfer
+ * @packet: a #JsonNode
+ *
+ * Get the payload for @packet, added to @transfer with
+ * valent_transfer_add_bytes().
+ *
+ * For a download, this is %NULL until the payload has been received.
+ *
+ * Returns: (transfer full) (nullable): a #GBytes
+ */
+GBytes *
+valent_transfer_get_bytes (ValentTransfer *transfer,
+                           JsonNode       *packet)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), NULL);
+  g_return_val_if_fail (VALENT_IS_PACKET (packet), NULL);
+
+  for (unsigned int i = 0; i < priv->items->len; i++)
+    {
+      TransferItem *item = g_ptr_array_index (priv->items, i);
+
+      if (item->packet == packet && item->bytes != NULL)
+        return g_bytes_ref (item->bytes);
+    }
+
+  return NULL;
+}
+
 /**
  * valent_transfer_get_device:
  * @transfer: a #ValentTransfer
@@ -649,6 +2242,273 @@ valent_transfer_set_id (ValentTransfer *transfer,
   priv->id = g_strdup (id);
 }
 
+/**
+ * valent_transfer_get_priority:
+ * @transfer: a #ValentTransfer
+ *
+ * Get the I/O priority of @transfer.
+ *
+ * Returns: the I/O priority
+ */
+int
+valent_transfer_get_priority (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), G_PRIORITY_DEFAULT);
+
+  return priv->priority;
+}
+
+/**
+ * valent_transfer_set_priority:
+ * @transfer: a #ValentTransfer
+ * @priority: the I/O priority
+ *
+ * Set the I/O priority of @transfer. This only affects transfers that have not
+ * been started yet.
+ */
+void
+valent_transfer_set_priority (ValentTransfer *transfer,
+                              int             priority)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+
+  g_return_if_fail (VALENT_IS_TRANSFER (transfer));
+
+  if (priv->priority == priority)
+    return;
+
+  priv->priority = priority;
+  g_object_notify_by_pspec (G_OBJECT (transfer), properties [PROP_PRIORITY]);
+}
+
+/**
+ * valent_transfer_get_progress:
+ * @transfer: a #ValentTransfer
+ *
+ * Get the progress of @transfer, from `0.0` to `1.0`.
+ *
+ * Returns: the transfer progress
+ */
+double
+valent_transfer_get_progress (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+  double progress = 0.0;
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), 0.0);
+
+  g_mutex_lock (&priv->progress_lock);
+  if (priv->size > 0)
+    progress = (double)priv->transferred / (double)priv->size;
+  else if (priv->items->len > 0)
+    progress = (double)g_atomic_int_get (&priv->n_completed) / priv->items->len;
+  g_mutex_unlock (&priv->progress_lock);
+
+  return CLAMP (progress, 0.0, 1.0);
+}
+
+/**
+ * valent_transfer_get_rate:
+ * @transfer: a #ValentTransfer
+ *
+ * Get the transfer rate of @transfer, in bytes per second.
+ *
+ * Returns: the transfer rate
+ */
+guint64
+valent_transfer_get_rate (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+  guint64 ret;
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), 0);
+
+  g_mutex_lock (&priv->progress_lock);
+  ret = priv->rate;
+  g_mutex_unlock (&priv->progress_lock);
+
+  return ret;
+}
+
+/**
+ * valent_transfer_get_remaining:
+ * @transfer: a #ValentTransfer
+ *
+ * Get the estimated time until @transfer completes, in seconds, based on the
+ * current transfer rate.
+ *
+ * Returns: the remaining time in seconds, or `-1` if unknown
+ */
+gint64
+valent_transfer_get_remaining (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+  gint64 ret = -1;
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), -1);
+
+  g_mutex_lock (&priv->progress_lock);
+  if (priv->rate > 0 && priv->size >= priv->transferred)
+    ret = (priv->size - priv->transferred + priv->rate - 1) / priv->rate;
+  g_mutex_unlock (&priv->progress_lock);
+
+  return ret;
+}
+
+/**
+ * valent_transfer_get_size:
+ * @transfer: a #ValentTransfer
+ *
+ * Get the total size of @transfer, in bytes.
+ *
+ * Returns: the size in bytes, or `0` if unknown
+ */
+guint64
+valent_transfer_get_size (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+  guint64 ret;
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), 0);
+
+  g_mutex_lock (&priv->progress_lock);
+  ret = priv->size;
+  g_mutex_unlock (&priv->progress_lock);
+
+  return ret;
+}
+
+/**
+ * valent_transfer_get_state:
+ * @transfer: a #ValentTransfer
+ *
+ * Get the state of @transfer.
+ *
+ * Returns: a #ValentTransferState
+ */
+ValentTransferState
+valent_transfer_get_state (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), VALENT_TRANSFER_STATE_NONE);
+
+  return priv->state;
+}
+
+/**
+ * valent_transfer_set_state: (skip)
+ * @transfer: a #ValentTransfer
+ * @state: a #ValentTransferState
+ *
+ * Set the state of @transfer. This is called by #ValentTransferScheduler from
+ * the main thread, when @transfer starts and completes.
+ */
+void
+valent_transfer_set_state (ValentTransfer      *transfer,
+                           ValentTransferState  state)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+
+  g_return_if_fail (VALENT_IS_TRANSFER (transfer));
+
+  if (priv->state == state)
+    return;
+
+  priv->state = state;
+  g_object_notify_by_pspec (G_OBJECT (transfer), properties [PROP_STATE]);
+}
+
+/**
+ * valent_transfer_is_download: (skip)
+ * @transfer: a #ValentTransfer
+ *
+ * Check if @transfer receives payloads from the device, rather than sending
+ * them. This is called by #ValentTransferScheduler from the main thread.
+ *
+ * Returns: %TRUE if @transfer is a download
+ */
+gboolean
+valent_transfer_is_download (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), FALSE);
+
+  for (unsigned int i = 0; i < priv->items->len; i++)
+    {
+      TransferItem *item = g_ptr_array_index (priv->items, i);
+
+      if (valent_packet_has_payload (item->packet))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * valent_transfer_timeout: (skip)
+ * @transfer: a #ValentTransfer
+ *
+ * Fail @transfer with %G_IO_ERROR_TIMED_OUT, if it is running. Unlike
+ * valent_transfer_cancel(), partial downloads are kept so they can be resumed.
+ * This is called by #ValentTransferScheduler when @transfer stalls.
+ */
+void
+valent_transfer_timeout (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+  g_autoptr (GCancellable) cancellable = NULL;
+
+  g_return_if_fail (VALENT_IS_TRANSFER (transfer));
+
+  /* The operation is only valid while the lock is held, but the cancellable
+   * is triggered after it's released */
+  g_mutex_lock (&priv->progress_lock);
+  if (priv->operation != NULL)
+    {
+      TransferOperation *op = priv->operation;
+
+      g_mutex_lock (&op->lock);
+      if (op->error == NULL)
+        op->error = g_error_new_literal (G_IO_ERROR,
+                                         G_IO_ERROR_TIMED_OUT,
+                                         "Transfer stalled");
+      g_mutex_unlock (&op->lock);
+
+      cancellable = g_object_ref (op->cancellable);
+    }
+  g_mutex_unlock (&priv->progress_lock);
+
+  if (cancellable != NULL)
+    g_cancellable_cancel (cancellable);
+}
+
+/**
+ * valent_transfer_get_transferred:
+ * @transfer: a #ValentTransfer
+ *
+ * Get the number of bytes transferred by @transfer.
+ *
+ * Returns: the number of bytes transferred
+ */
+guint64
+valent_transfer_get_transferred (ValentTransfer *transfer)
+{
+  ValentTransferPrivate *priv = valent_transfer_get_instance_private (transfer);
+  guint64 ret;
+
+  g_return_val_if_fail (VALENT_IS_TRANSFER (transfer), 0);
+
+  g_mutex_lock (&priv->progress_lock);
+  ret = priv->transferred;
+  g_mutex_unlock (&priv->progress_lock);
+
+  return ret;
+}
+
 /**
  * valent_transfer_execute:
  * @transfer: a #ValentTransfer
@@ -677,9 +2537,14 @@ valent_transfer_execute (ValentTransfer      *transfer,
                              priv->cancellable,
                              G_CONNECT_SWAPPED);
 
+  /* The scheduler decides when the transfer runs, alongside others */
+  if (priv->scheduler == NULL)
+    priv->scheduler = g_object_ref (valent_transfer_scheduler_get_default ());
+
   task = g_task_new (transfer, priv->cancellable, callback, user_data);
   g_task_set_source_tag (task, valent_transfer_execute);
-  g_task_run_in_thread (task, execute_task);
+  g_task_set_priority (task, priv->priority);
+  valent_transfer_scheduler_queue (priv->scheduler, task, execute_task);
 }
 
 /**
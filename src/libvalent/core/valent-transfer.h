@@ -37,36 +37,46 @@ struct _ValentTransferClass
   GObjectClass parent_class;
 };
 
-ValentTransfer      * valent_transfer_new            (ValentDevice         *device);
+ValentTransfer      * valent_transfer_new             (ValentDevice         *device);
 
-void                  valent_transfer_add_bytes      (ValentTransfer       *transfer,
-                                                      JsonNode             *packet,
-                                                      GBytes               *bytes);
-void                  valent_transfer_add_file       (ValentTransfer       *transfer,
-                                                      JsonNode             *packet,
-                                                      GFile                *file);
-void                  valent_transfer_add_stream     (ValentTransfer       *transfer,
-                                                      JsonNode             *packet,
-                                                      GInputStream         *source,
-                                                      GOutputStream        *target,
-                                                      gssize                size);
-GFile *               valent_transfer_cache_file     (ValentTransfer       *transfer,
-                                                      JsonNode             *packet,
-                                                      const char           *name);
+void                  valent_transfer_add_bytes       (ValentTransfer       *transfer,
+                                                       JsonNode             *packet,
+                                                       GBytes               *bytes);
+void                  valent_transfer_add_file        (ValentTransfer       *transfer,
+                                                       JsonNode             *packet,
+                                                       GFile                *file);
+void                  valent_transfer_add_stream      (ValentTransfer       *transfer,
+                                                       JsonNode             *packet,
+                                                       GInputStream         *source,
+                                                       GOutputStream        *target,
+                                                       gssize                size);
+GFile *               valent_transfer_cache_file      (ValentTransfer       *transfer,
+                                                       JsonNode             *packet,
+                                                       const char           *name);
 
-void                  valent_transfer_cancel         (ValentTransfer       *transfer);
-void                  valent_transfer_execute        (ValentTransfer       *transfer,
-                                                      GCancellable         *cancellable,
-                                                      GAsyncReadyCallback   callback,
-                                                      gpointer              user_data);
-gboolean              valent_transfer_execute_finish (ValentTransfer       *transfer,
-                                                      GAsyncResult         *result,
-                                                      GError              **error);
+void                  valent_transfer_cancel          (ValentTransfer       *transfer);
+void                  valent_transfer_execute         (ValentTransfer       *transfer,
+                                                       GCancellable         *cancellable,
+                                                       GAsyncReadyCallback   callback,
+                                                       gpointer              user_data);
+gboolean              valent_transfer_execute_finish  (ValentTransfer       *transfer,
+                                                       GAsyncResult         *result,
+                                                       GError              **error);
 
-ValentDevice        * valent_transfer_get_device     (ValentTransfer       *transfer);
-const char          * valent_transfer_get_id         (ValentTransfer       *transfer);
-void                  valent_transfer_set_id         (ValentTransfer       *transfer,
-                                                      const char           *id);
-ValentTransferState   valent_transfer_get_state      (ValentTransfer       *transfer);
+GBytes              * valent_transfer_get_bytes       (ValentTransfer       *transfer,
+                                                       JsonNode             *packet);
+ValentDevice        * valent_transfer_get_device      (ValentTransfer       *transfer);
+const char          * valent_transfer_get_id          (ValentTransfer       *transfer);
+void                  valent_transfer_set_id          (ValentTransfer       *transfer,
+                                                       const char           *id);
+int                   valent_transfer_get_priority    (ValentTransfer       *transfer);
+void                  valent_transfer_set_priority    (ValentTransfer       *transfer,
+                                                       int                   priority);
+double                valent_transfer_get_progress    (ValentTransfer       *transfer);
+guint64               valent_transfer_get_rate        (ValentTransfer       *transfer);
+gint64                valent_transfer_get_remaining   (ValentTransfer       *transfer);
+guint64               valent_transfer_get_size        (ValentTransfer       *transfer);
+ValentTransferState   valent_transfer_get_state       (ValentTransfer       *transfer);
+guint64               valent_transfer_get_transferred (ValentTransfer       *transfer);
 
 G_END_DECLS
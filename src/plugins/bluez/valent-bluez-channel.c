@@ -89,8 +89,12 @@ valent_bluez_channel_upload (ValentChannel  *channel,
   /* Choose a unique UUID? */
   uuid = g_uuid_string_random ();
 
-  /* Payload Info */
-  info = json_object_new();
+  /* Payload Info, keeping any fields set by the caller */
+  if (valent_packet_has_payload (packet))
+    info = json_object_ref (valent_packet_get_payload_info (packet));
+  else
+    info = json_object_new ();
+
   json_object_set_string_member (info, "uuid", uuid);
   valent_packet_set_payload_info (packet, info);
 
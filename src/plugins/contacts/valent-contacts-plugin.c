@@ -267,7 +267,7 @@ vcards_by_uid_cb (ValentContactStore   *store,
 
   /* Finish and send the response */
   response = valent_packet_finish (builder);
-  valent_device_queue_packet (self->device, response);
+  valent_device_queue_packet_full (self->device, response, G_PRIORITY_LOW);
 }
 
 /**
@@ -11,11 +11,34 @@
 
 #include "valent-lan-channel.h"
 #include "valent-lan-channel-service.h"
+#include "valent-lan-port-pool.h"
 #include "valent-lan-utils.h"
 
 #define DEFAULT_PORT      1716
-#define TRANSFER_PORT_MIN 1739
-#define TRANSFER_PORT_MAX 1764
+
+/* The number of auxiliary ports bound in advance for uploads */
+#define PORT_POOL_PREBIND 4
+
+/* Handshakes are limited to HANDSHAKE_MAX at a time and one per host, with at
+ * least HANDSHAKE_INTERVAL between attempts from the same host. */
+#define HANDSHAKE_MAX      8
+#define HANDSHAKE_INTERVAL (1 * G_USEC_PER_SEC)
+#define HANDSHAKE_TIMEOUT  10
+
+/* Identities from a device are ignored for CONTACT_WINDOW after the last
+ * attempt to connect to it, and while it has an open channel. After a failed
+ * attempt, the device is ignored for a delay that doubles with each failure,
+ * between CONTACT_BACKOFF_MIN and CONTACT_BACKOFF_MAX.
+ *
+ * The device ID in an identity packet is unauthenticated, so devices are
+ * tracked by their ID and address. A host claiming the ID of another device
+ * can only delay its own connections. */
+#define CONTACT_WINDOW      (5 * G_USEC_PER_SEC)
+#define CONTACT_BACKOFF_MIN (1 * G_USEC_PER_SEC)
+#define CONTACT_BACKOFF_MAX (G_GINT64_CONSTANT (300) * G_USEC_PER_SEC)
+
+/* The largest identity packet accepted from a TCP connection */
+#define IDENTITY_SIZE_MAX  (64 * 1024)
 
 
 struct _ValentLanChannelService
@@ -34,6 +57,15 @@ struct _ValentLanChannelService
   GSocketService       *listener;
   GSocket              *udp_socket4;
   GSocket              *udp_socket6;
+  ValentLanPortPool    *port_pool;
+
+  /* Handshakes */
+  GMainContext         *handshake_context;
+  GThread              *handshake_thread;
+  GHashTable           *handshake_hosts;
+  GHashTable           *contacts;
+  unsigned int          n_handshakes;
+  gboolean              handshake_stopped;
 };
 
 G_DEFINE_TYPE (ValentLanChannelService, valent_lan_channel_service, VALENT_TYPE_CHANNEL_SERVICE)
@@ -62,75 +94,599 @@ on_network_changed (GNetworkMonitor         *monitor,
 }
 
 /*
- * Incoming Connections
+ * Handshakes
  *
- * When an incoming connection is opened to the TCP listener, we are operating
- * as the client. The server expects us to:
+ * Connections are negotiated asynchronously in a dedicated thread, so that a
+ * slow or misbehaving peer only occupies a slot in the handshake table until it
+ * times out, rather than a thread. All the state below is only accessed from
+ * that thread.
+ */
+typedef struct
+{
+  gint64       last_attempt;
+  unsigned int n_active;
+} HandshakeHost;
+
+/**
+ * DeviceContact:
+ * @channel: a weak reference to the last channel opened for the device
+ * @last_attempt: the monotonic time of the last outgoing attempt
+ * @retry_after: the monotonic time before which identities are ignored
+ * @n_active: the number of outgoing handshakes in progress
+ * @n_failures: the number of consecutive failed handshakes
  *
- * 1) Accept the TCP connection
- * 2) Read the peer identity packet
- * 3) Negotiate TLS encryption (as the TLS Client)
+ * The recent history of a device at one address, used to ignore redundant
+ * identity packets.
+ */
+typedef struct
+{
+  GWeakRef     channel;
+  gint64       last_attempt;
+  gint64       retry_after;
+  unsigned int n_active;
+  unsigned int n_failures;
+} DeviceContact;
+
+static void
+device_contact_free (gpointer data)
+{
+  DeviceContact *contact = data;
+
+  g_weak_ref_clear (&contact->channel);
+  g_free (contact);
+}
+
+typedef struct
+{
+  GSocketConnection *connection;
+  GSource           *timeout;
+  gboolean           timed_out;
+  char              *device_id;
+  char              *host;
+  guint16            port;
+  JsonNode          *peer_identity;
+  char              *buffer;
+  gsize              len;
+} HandshakeData;
+
+static void
+handshake_data_free (gpointer data)
+{
+  HandshakeData *handshake = data;
+
+  g_clear_object (&handshake->connection);
+  g_clear_pointer (&handshake->timeout, g_source_unref);
+  g_clear_pointer (&handshake->device_id, g_free);
+  g_clear_pointer (&handshake->host, g_free);
+  g_clear_pointer (&handshake->peer_identity, json_node_unref);
+  g_clear_pointer (&handshake->buffer, g_free);
+  g_free (handshake);
+}
+
+/**
+ * handshake_admit:
+ * @self: a #ValentLanChannelService
+ * @host: the remote host
+ *
+ * Check if a handshake with @host can be started now and if so, reserve a slot
+ * for it. Each admitted handshake must be followed by handshake_release().
+ *
+ * Returns: %TRUE if the handshake should proceed
  */
 static gboolean
-on_connection (GThreadedSocketService *listener,
-               GSocketConnection      *connection,
-               GObject                *source_object)
+handshake_admit (ValentLanChannelService *self,
+                 const char              *host)
 {
-  ValentChannelService *service = VALENT_CHANNEL_SERVICE (source_object);
-  ValentLanChannelService *self = VALENT_LAN_CHANNEL_SERVICE (service);
-  g_autofree char *host = NULL;
-  g_autoptr (GSocketAddress) saddr = NULL;
-  GInetAddress *iaddr;
-  JsonNode *identity;
-  g_autoptr (JsonNode) peer_identity = NULL;
-  const char *device_id;
+  HandshakeHost *entry;
+  gint64 now;
+
+  if (self->handshake_stopped)
+    return FALSE;
+
+  if (self->n_handshakes >= HANDSHAKE_MAX)
+    {
+      g_debug ("Too many handshakes, ignoring %s", host);
+      return FALSE;
+    }
+
+  now = g_get_monotonic_time ();
+
+  if ((entry = g_hash_table_lookup (self->handshake_hosts, host)) == NULL)
+    {
+      GHashTableIter iter;
+      HandshakeHost *stale;
+
+      /* Drop hosts that no longer restrict anything */
+      g_hash_table_iter_init (&iter, self->handshake_hosts);
+
+      while (g_hash_table_iter_next (&iter, NULL, (void **)&stale))
+        {
+          if (stale->n_active == 0 &&
+              now - stale->last_attempt >= HANDSHAKE_INTERVAL)
+            g_hash_table_iter_remove (&iter);
+        }
+
+      entry = g_new0 (HandshakeHost, 1);
+      g_hash_table_insert (self->handshake_hosts, g_strdup (host), entry);
+    }
+  else if (entry->n_active > 0 || now - entry->last_attempt < HANDSHAKE_INTERVAL)
+    {
+      g_debug ("Rate limiting handshakes from %s", host);
+      return FALSE;
+    }
+
+  entry->last_attempt = now;
+  entry->n_active++;
+  self->n_handshakes++;
+
+  return TRUE;
+}
+
+/**
+ * handshake_release:
+ * @self: a #ValentLanChannelService
+ * @host: the remote host
+ *
+ * Release the slot reserved by handshake_admit() for @host.
+ */
+static void
+handshake_release (ValentLanChannelService *self,
+                   const char              *host)
+{
+  HandshakeHost *entry;
+
+  if ((entry = g_hash_table_lookup (self->handshake_hosts, host)) != NULL)
+    entry->n_active--;
+
+  self->n_handshakes--;
+}
+
+/**
+ * contact_is_connected:
+ * @contact: a #DeviceContact
+ *
+ * Check if the last channel opened for @contact is still open.
+ *
+ * Returns: %TRUE if connected
+ */
+static gboolean
+contact_is_connected (DeviceContact *contact)
+{
+  g_autoptr (ValentChannel) channel = NULL;
+  GIOStream *base_stream;
+
+  if ((channel = g_weak_ref_get (&contact->channel)) == NULL)
+    return FALSE;
+
+  base_stream = valent_channel_get_base_stream (channel);
+
+  return base_stream != NULL && !g_io_stream_is_closed (base_stream);
+}
+
+static inline char *
+contact_key (const char *device_id,
+             const char *host)
+{
+  return g_strdup_printf ("%s@%s", device_id, host);
+}
+
+/**
+ * contact_lookup:
+ * @self: a #ValentLanChannelService
+ * @device_id: the device ID
+ * @host: the remote host
+ *
+ * Get the #DeviceContact for @device_id at @host, creating it if necessary.
+ * Devices that have been quiet long enough to start over are dropped from the
+ * table when a new one is added.
+ *
+ * Returns: (transfer none): a #DeviceContact
+ */
+static DeviceContact *
+contact_lookup (ValentLanChannelService *self,
+                const char              *device_id,
+                const char              *host)
+{
+  g_autofree char *key = NULL;
+  DeviceContact *contact;
+  GHashTableIter iter;
+  gint64 now;
+
+  key = contact_key (device_id, host);
+
+  if ((contact = g_hash_table_lookup (self->contacts, key)) != NULL)
+    return contact;
+
+  now = g_get_monotonic_time ();
+  g_hash_table_iter_init (&iter, self->contacts);
+
+  while (g_hash_table_iter_next (&iter, NULL, (void **)&contact))
+    {
+      if (contact->n_active == 0 &&
+          now - MAX (contact->last_attempt, contact->retry_after) >= CONTACT_BACKOFF_MAX &&
+          !contact_is_connected (contact))
+        g_hash_table_iter_remove (&iter);
+    }
+
+  contact = g_new0 (DeviceContact, 1);
+  g_weak_ref_init (&contact->channel, NULL);
+  g_hash_table_insert (self->contacts, g_steal_pointer (&key), contact);
+
+  return contact;
+}
+
+/**
+ * contact_admit:
+ * @self: a #ValentLanChannelService
+ * @device_id: the device ID
+ * @host: the remote host
+ *
+ * Check if an identity packet from @device_id at @host should be answered, or
+ * if it is redundant because the device is connected, was just contacted or is
+ * backing off after a failure. Each admitted contact must be followed by
+ * contact_release().
+ *
+ * Returns: %TRUE if a connection should be opened
+ */
+static gboolean
+contact_admit (ValentLanChannelService *self,
+               const char              *device_id,
+               const char              *host)
+{
+  DeviceContact *contact;
+  gint64 now;
+
+  contact = contact_lookup (self, device_id, host);
+  now = g_get_monotonic_time ();
+
+  if (contact->n_active > 0 ||
+      (contact->last_attempt > 0 && now - contact->last_attempt < CONTACT_WINDOW) ||
+      now < contact->retry_after ||
+      contact_is_connected (contact))
+    {
+      g_debug ("Ignoring redundant identity from %s (%s)", device_id, host);
+      return FALSE;
+    }
+
+  contact->last_attempt = now;
+  contact->n_active++;
+
+  return TRUE;
+}
+
+/**
+ * contact_release:
+ * @self: a #ValentLanChannelService
+ * @device_id: the device ID
+ * @host: the remote host
+ *
+ * Release the contact reserved by contact_admit() for @device_id at @host.
+ */
+static void
+contact_release (ValentLanChannelService *self,
+                 const char              *device_id,
+                 const char              *host)
+{
+  g_autofree char *key = NULL;
+  DeviceContact *contact;
+
+  key = contact_key (device_id, host);
+
+  if ((contact = g_hash_table_lookup (self->contacts, key)) != NULL)
+    contact->n_active--;
+}
+
+/**
+ * contact_update:
+ * @self: a #ValentLanChannelService
+ * @device_id: the device ID
+ * @host: the remote host
+ * @channel: (nullable): a #ValentChannel
+ *
+ * Record the result of a handshake with @device_id at @host, in either
+ * direction. If @channel is %NULL the handshake failed and the device will be
+ * ignored at @host for an exponentially increasing delay, unless it is still
+ * connected by an earlier channel.
+ */
+static void
+contact_update (ValentLanChannelService *self,
+                const char              *device_id,
+                const char              *host,
+                ValentChannel           *channel)
+{
+  DeviceContact *contact;
+  gint64 delay;
+
+  contact = contact_lookup (self, device_id, host);
+
+  if (channel != NULL)
+    {
+      g_weak_ref_set (&contact->channel, channel);
+      contact->n_failures = 0;
+      contact->retry_after = 0;
+      return;
+    }
+
+  delay = (gint64)CONTACT_BACKOFF_MIN << MIN (contact->n_failures, 16);
+  delay = MIN (delay, CONTACT_BACKOFF_MAX);
+  contact->retry_after = g_get_monotonic_time () + delay;
+  contact->n_failures++;
+
+  g_debug ("Backing off %s (%s) for %lis after %u failures",
+           device_id,
+           host,
+           (long)(delay / G_USEC_PER_SEC),
+           contact->n_failures);
+}
+
+static gboolean
+handshake_timeout_cb (gpointer user_data)
+{
+  GTask *task = G_TASK (user_data);
+  HandshakeData *data = g_task_get_task_data (task);
+
+  data->timed_out = TRUE;
+  g_cancellable_cancel (g_task_get_cancellable (task));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+handshake_cb (ValentLanChannelService *self,
+              GAsyncResult            *result,
+              gpointer                 user_data)
+{
+  ValentChannelService *service = VALENT_CHANNEL_SERVICE (self);
+  HandshakeData *data = g_task_get_task_data (G_TASK (result));
   g_autoptr (GIOStream) tls_stream = NULL;
   g_autoptr (ValentChannel) channel = NULL;
+  g_autoptr (GError) error = NULL;
   g_autofree char *uri = NULL;
+  JsonNode *identity;
+  const char *device_id = NULL;
 
-  g_assert (VALENT_IS_CHANNEL_SERVICE (service));
-  g_assert (VALENT_IS_LAN_CHANNEL_SERVICE (self));
+  g_source_destroy (data->timeout);
+  handshake_release (self, data->host);
 
-  /* The incoming TCP connection is in response to an outgoing UDP packet, so the peer must now
-   * write its identity packet. */
-  peer_identity = valent_packet_from_stream (g_io_stream_get_input_stream (G_IO_STREAM (connection)),
-                                             self->cancellable,
-                                             NULL);
+  if (data->device_id != NULL)
+    contact_release (self, data->device_id, data->host);
 
-  if (peer_identity == NULL)
-    return TRUE;
+  if (data->peer_identity != NULL)
+    device_id = valent_identity_get_device_id (data->peer_identity);
 
-  /* Now that we have the device ID we can authorize or reject certificates.
-   * NOTE: We're the client when accepting incoming connections */
-  device_id = valent_identity_get_device_id (peer_identity);
-  tls_stream = valent_lan_encrypt_new_client (connection,
-                                              self->certificate,
-                                              device_id,
-                                              self->cancellable,
-                                              NULL);
+  tls_stream = g_task_propagate_pointer (G_TASK (result), &error);
 
   if (tls_stream == NULL)
-    return TRUE;
+    {
+      /* Cancellation by the service is not the peer's failure */
+      if (!data->timed_out &&
+          g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
 
-  /* Get the host from the connection */
-  saddr = g_socket_connection_get_remote_address (connection, NULL);
-  iaddr = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (saddr));
-  host = g_inet_address_to_string (iaddr);
+      if (data->timed_out)
+        g_debug ("Handshake timed out (%s:%u)", data->host, data->port);
+      else
+        g_debug ("Handshake failed (%s:%u): %s",
+                 data->host, data->port, error->message);
+
+      if (device_id != NULL)
+        contact_update (self, device_id, data->host, NULL);
+
+      return;
+    }
 
   /* Create the new channel */
   identity = valent_channel_service_get_identity (service);
-  uri = g_strdup_printf ("lan://%s:%u", host, self->port);
+  uri = g_strdup_printf ("lan://%s:%u", data->host, data->port);
   channel = g_object_new (VALENT_TYPE_LAN_CHANNEL,
                           "base-stream",   tls_stream,
                           "certificate",   self->certificate,
-                          "host",          host,
+                          "host",          data->host,
                           "identity",      identity,
-                          "peer-identity", peer_identity,
-                          "port",          self->port,
+                          "peer-identity", data->peer_identity,
+                          "port",          data->port,
+                          "port-pool",     self->port_pool,
                           "uri",           uri,
                           NULL);
 
+  if (device_id != NULL)
+    contact_update (self, device_id, data->host, channel);
+
   valent_channel_service_emit_channel (service, channel);
+}
+
+/**
+ * handshake_new:
+ * @self: a #ValentLanChannelService
+ * @host: the remote host
+ * @port: the remote port
+ *
+ * Create a task for a handshake admitted by handshake_admit(). The task is
+ * cancelled when the service stops, or after %HANDSHAKE_TIMEOUT seconds.
+ *
+ * Returns: (transfer full): a #GTask
+ */
+static GTask *
+handshake_new (ValentLanChannelService *self,
+               const char              *host,
+               guint16                  port)
+{
+  g_autoptr (GCancellable) cancellable = NULL;
+  GTask *task;
+  HandshakeData *data;
+
+  cancellable = g_cancellable_new ();
+  g_signal_connect_object (self->cancellable,
+                           "cancelled",
+                           G_CALLBACK (g_cancellable_cancel),
+                           cancellable,
+                           G_CONNECT_SWAPPED);
+
+  if (g_cancellable_is_cancelled (self->cancellable))
+    g_cancellable_cancel (cancellable);
+
+  data = g_new0 (HandshakeData, 1);
+  data->host = g_strdup (host);
+  data->port = port;
+
+  task = g_task_new (self, cancellable, (GAsyncReadyCallback)handshake_cb, NULL);
+  g_task_set_source_tag (task, handshake_new);
+  g_task_set_task_data (task, data, handshake_data_free);
+
+  data->timeout = g_timeout_source_new_seconds (HANDSHAKE_TIMEOUT);
+  g_task_attach_source (task, data->timeout, handshake_timeout_cb);
+
+  return task;
+}
+
+/*
+ * Incoming Connections
+ *
+ * When an incoming connection is opened to the TCP listener, we are operating
+ * as the client. The server expects us to:
+ *
+ * 1) Accept the TCP connection
+ * 2) Read the peer identity packet
+ * 3) Negotiate TLS encryption (as the TLS Client)
+ */
+static void
+incoming_encrypt_cb (GSocketConnection *connection,
+                     GAsyncResult      *result,
+                     gpointer           user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  GIOStream *tls_stream;
+  GError *error = NULL;
+
+  tls_stream = valent_lan_encrypt_new_client_finish (connection, result, &error);
+
+  if (tls_stream == NULL)
+    return g_task_return_error (task, error);
+
+  g_task_return_pointer (task, tls_stream, g_object_unref);
+}
+
+static void
+incoming_read_cb (GInputStream *stream,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  ValentLanChannelService *self = g_task_get_source_object (task);
+  HandshakeData *data = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  const char *device_id;
+  char *newline;
+  gssize n_read;
+  GError *error = NULL;
+
+  n_read = g_input_stream_read_finish (stream, result, &error);
+
+  if (n_read == -1)
+    return g_task_return_error (task, error);
+
+  if (n_read == 0)
+    return g_task_return_new_error (task,
+                                    G_IO_ERROR,
+                                    G_IO_ERROR_CONNECTION_CLOSED,
+                                    "Connection closed");
+
+  newline = memchr (data->buffer + data->len, '\n', n_read);
+  data->len += n_read;
+
+  /* Keep reading until the line-feed that terminates the identity packet */
+  if (newline == NULL)
+    {
+      if (data->len == IDENTITY_SIZE_MAX)
+        return g_task_return_new_error (task,
+                                        G_IO_ERROR,
+                                        G_IO_ERROR_MESSAGE_TOO_LARGE,
+                                        "Identity packet too large");
+
+      g_input_stream_read_async (stream,
+                                 data->buffer + data->len,
+                                 IDENTITY_SIZE_MAX - data->len,
+                                 G_PRIORITY_DEFAULT,
+                                 cancellable,
+                                 (GAsyncReadyCallback)incoming_read_cb,
+                                 g_steal_pointer (&task));
+      return;
+    }
+
+  /* The peer waits for the TLS handshake after its identity, so anything else
+   * is a protocol error. */
+  if (newline != data->buffer + data->len - 1)
+    return g_task_return_new_error (task,
+                                    G_IO_ERROR,
+                                    G_IO_ERROR_INVALID_DATA,
+                                    "Unexpected data after identity packet");
+
+  *newline = '\0';
+  data->peer_identity = valent_packet_deserialize (data->buffer, &error);
+  g_clear_pointer (&data->buffer, g_free);
+
+  if (data->peer_identity == NULL)
+    return g_task_return_error (task, error);
+
+  /* Now that we have the device ID we can authorize or reject certificates.
+   * NOTE: We're the client when accepting incoming connections */
+  device_id = valent_identity_get_device_id (data->peer_identity);
+
+  if (device_id == NULL)
+    return g_task_return_new_error (task,
+                                    G_IO_ERROR,
+                                    G_IO_ERROR_INVALID_DATA,
+                                    "Missing `deviceId` field");
+
+  valent_lan_encrypt_new_client_async (data->connection,
+                                       self->certificate,
+                                       device_id,
+                                       cancellable,
+                                       (GAsyncReadyCallback)incoming_encrypt_cb,
+                                       g_steal_pointer (&task));
+}
+
+static gboolean
+on_incoming (GSocketService    *listener,
+             GSocketConnection *connection,
+             GObject           *source_object,
+             gpointer           user_data)
+{
+  ValentLanChannelService *self = VALENT_LAN_CHANNEL_SERVICE (source_object);
+  g_autoptr (GTask) task = NULL;
+  g_autoptr (GSocketAddress) saddr = NULL;
+  g_autofree char *host = NULL;
+  GInetAddress *iaddr;
+  HandshakeData *data;
+
+  g_assert (VALENT_IS_LAN_CHANNEL_SERVICE (self));
+
+  /* Get the host from the connection */
+  saddr = g_socket_connection_get_remote_address (connection, NULL);
+
+  if (saddr == NULL)
+    return TRUE;
+
+  iaddr = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (saddr));
+  host = g_inet_address_to_string (iaddr);
+
+  if (!handshake_admit (self, host))
+    return TRUE;
+
+  /* The incoming TCP connection is in response to an outgoing UDP packet, so
+   * the peer must now write its identity packet. */
+  task = handshake_new (self, host, self->port);
+  data = g_task_get_task_data (task);
+  data->connection = g_object_ref (connection);
+  data->buffer = g_malloc (IDENTITY_SIZE_MAX);
+
+  g_input_stream_read_async (g_io_stream_get_input_stream (G_IO_STREAM (connection)),
+                             data->buffer,
+                             IDENTITY_SIZE_MAX,
+                             G_PRIORITY_DEFAULT,
+                             g_task_get_cancellable (task),
+                             (GAsyncReadyCallback)incoming_read_cb,
+                             g_steal_pointer (&task));
 
   return TRUE;
 }
@@ -188,7 +744,7 @@ peek_host (GSocket       *socket,
 }
 
 /*
- * Incoming UDP Broadcasts
+ * Outgoing Connections
  *
  * When an identity packet is received over a UDP port (usually a broadcast), we
  * are operating as the server. The client expects us to:
@@ -197,6 +753,160 @@ peek_host (GSocket       *socket,
  * 2) Write our identity packet
  * 3) Negotiate TLS encryption (as the TLS Server)
  */
+typedef struct
+{
+  ValentLanChannelService *service;
+  GCancellable            *cancellable;
+  char                    *host;
+  guint16                  port;
+  JsonNode                *peer_identity;
+} OutgoingData;
+
+static void
+outgoing_data_free (gpointer data)
+{
+  OutgoingData *outgoing = data;
+
+  g_clear_object (&outgoing->service);
+  g_clear_object (&outgoing->cancellable);
+  g_clear_pointer (&outgoing->host, g_free);
+  g_clear_pointer (&outgoing->peer_identity, json_node_unref);
+  g_free (outgoing);
+}
+
+static void
+outgoing_encrypt_cb (GSocketConnection *connection,
+                     GAsyncResult      *result,
+                     gpointer           user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  GIOStream *tls_stream;
+  GError *error = NULL;
+
+  tls_stream = valent_lan_encrypt_new_server_finish (connection, result, &error);
+
+  if (tls_stream == NULL)
+    return g_task_return_error (task, error);
+
+  g_task_return_pointer (task, tls_stream, g_object_unref);
+}
+
+static void
+outgoing_write_cb (GOutputStream *stream,
+                   GAsyncResult  *result,
+                   gpointer       user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  ValentLanChannelService *self = g_task_get_source_object (task);
+  HandshakeData *data = g_task_get_task_data (task);
+  const char *device_id;
+  GError *error = NULL;
+
+  if (!g_output_stream_write_all_finish (stream, result, NULL, &error))
+    return g_task_return_error (task, error);
+
+  g_clear_pointer (&data->buffer, g_free);
+
+  /* We're the TLS Server when responding to identity broadcasts */
+  device_id = valent_identity_get_device_id (data->peer_identity);
+  valent_lan_encrypt_new_server_async (data->connection,
+                                       self->certificate,
+                                       device_id,
+                                       g_task_get_cancellable (task),
+                                       (GAsyncReadyCallback)outgoing_encrypt_cb,
+                                       g_steal_pointer (&task));
+}
+
+static void
+outgoing_connect_cb (GSocketClient *client,
+                     GAsyncResult  *result,
+                     gpointer       user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  ValentChannelService *service = g_task_get_source_object (task);
+  HandshakeData *data = g_task_get_task_data (task);
+  GOutputStream *output_stream;
+  JsonNode *identity;
+  GError *error = NULL;
+
+  data->connection = g_socket_client_connect_to_host_finish (client,
+                                                             result,
+                                                             &error);
+
+  if (data->connection == NULL)
+    return g_task_return_error (task, error);
+
+  /* Write the local identity. Once we do this, both peers will have the ability
+   * to authenticate or reject TLS certificates.
+   */
+  identity = valent_channel_service_get_identity (service);
+  data->buffer = valent_packet_serialize (identity);
+  data->len = strlen (data->buffer);
+
+  output_stream = g_io_stream_get_output_stream (G_IO_STREAM (data->connection));
+  g_output_stream_write_all_async (output_stream,
+                                   data->buffer,
+                                   data->len,
+                                   G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (task),
+                                   (GAsyncReadyCallback)outgoing_write_cb,
+                                   g_steal_pointer (&task));
+}
+
+static gboolean
+outgoing_start (gpointer user_data)
+{
+  OutgoingData *outgoing = user_data;
+  ValentLanChannelService *self = outgoing->service;
+  g_autoptr (GSocketClient) client = NULL;
+  g_autoptr (GTask) task = NULL;
+  HandshakeData *data;
+  const char *device_id;
+
+  if (g_cancellable_is_cancelled (outgoing->cancellable))
+    return G_SOURCE_REMOVE;
+
+  device_id = valent_identity_get_device_id (outgoing->peer_identity);
+
+  if (!contact_admit (self, device_id, outgoing->host))
+    return G_SOURCE_REMOVE;
+
+  if (!handshake_admit (self, outgoing->host))
+    {
+      contact_release (self, device_id, outgoing->host);
+      return G_SOURCE_REMOVE;
+    }
+
+  task = handshake_new (self, outgoing->host, outgoing->port);
+  data = g_task_get_task_data (task);
+  data->device_id = g_strdup (device_id);
+  data->peer_identity = json_node_ref (outgoing->peer_identity);
+
+  /* Open a TCP connection to the UDP sender and defined port. Disable any use
+   * of the system proxy.
+   *
+   * https://bugs.kde.org/show_bug.cgi?id=376187
+   * https://github.com/andyholmes/gnome-shell-extension-gsconnect/issues/125
+   */
+  client = g_object_new (G_TYPE_SOCKET_CLIENT,
+                         "enable-proxy", FALSE,
+                         NULL);
+  g_socket_client_connect_to_host_async (client,
+                                         outgoing->host,
+                                         outgoing->port,
+                                         g_task_get_cancellable (task),
+                                         (GAsyncReadyCallback)outgoing_connect_cb,
+                                         g_steal_pointer (&task));
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Incoming UDP Broadcasts
+ *
+ * Identity packets are read and validated in the thread for each UDP socket,
+ * then passed to the handshake thread to open an outgoing connection.
+ */
 static gboolean
 on_packet (ValentLanChannelService  *self,
            GSocket                  *socket,
@@ -206,20 +916,14 @@ on_packet (ValentLanChannelService  *self,
 {
   ValentChannelService *service = VALENT_CHANNEL_SERVICE (self);
   g_autoptr (GError) warn = NULL;
-  g_autoptr (ValentChannel) channel = NULL;
   guint16 port;
   g_autofree char *host = NULL;
-  g_autofree char *uri = NULL;
   g_autofree char *line = NULL;
-  JsonNode *identity;
   g_autoptr (JsonNode) peer_identity = NULL;
   JsonObject *body;
   const char *device_id;
   const char *local_id;
-  g_autoptr (GSocketClient) client = NULL;
-  g_autoptr (GSocketConnection) connection = NULL;
-  GOutputStream *output_stream;
-  GIOStream *tls_stream;
+  OutgoingData *data;
 
   g_assert (VALENT_IS_CHANNEL_SERVICE (service));
   g_assert (G_IS_SOCKET (socket));
@@ -282,66 +986,19 @@ on_packet (ValentLanChannelService  *self,
 
   VALENT_DEBUG_PKT (peer_identity, "Peer Identity");
 
+  /* Hand the identity to the handshake thread */
+  data = g_new0 (OutgoingData, 1);
+  data->service = g_object_ref (self);
+  data->cancellable = g_object_ref (cancellable);
+  data->host = g_steal_pointer (&host);
+  data->port = port;
+  data->peer_identity = g_steal_pointer (&peer_identity);
 
-  /* Open a TCP connection to the UDP sender and defined port. Disable any use
-   * of the system proxy.
-   *
-   * https://bugs.kde.org/show_bug.cgi?id=376187
-   * https://github.com/andyholmes/gnome-shell-extension-gsconnect/issues/125
-   */
-  client = g_object_new (G_TYPE_SOCKET_CLIENT,
-                         "enable-proxy", FALSE,
-                         NULL);
-  connection = g_socket_client_connect_to_host (client,
-                                                host,
-                                                port,
-                                                cancellable,
-                                                &warn);
-
-  if (connection == NULL)
-    {
-      g_debug ("Error connecting (%s:%u): %s", host, port, warn->message);
-      return TRUE;
-    }
-
-  /* Write the local identity. Once we do this, both peers will have the ability
-   * to authenticate or reject TLS certificates.
-   */
-  identity = valent_channel_service_get_identity (service);
-  output_stream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
-
-  if (!valent_packet_to_stream (output_stream, identity, cancellable, error))
-    {
-      g_debug ("Error writing identity (%s:%u): %s", host, port, warn->message);
-      return TRUE;
-    }
-
-  /* We're the TLS Server when responding to identity broadcasts */
-  tls_stream = valent_lan_encrypt_new_server (connection,
-                                              self->certificate,
-                                              device_id,
-                                              cancellable,
-                                              &warn);
-
-  if (tls_stream == NULL)
-    {
-      g_debug ("Error authenticating (%s:%u): %s", host, port, warn->message);
-      return TRUE;
-    }
-
-  /* Create new channel */
-  uri = g_strdup_printf ("lan://%s:%u", host, port);
-  channel = g_object_new (VALENT_TYPE_LAN_CHANNEL,
-                          "base-stream",   tls_stream,
-                          "certificate",   self->certificate,
-                          "host",          host,
-                          "port",          port,
-                          "uri",           uri,
-                          "identity",      identity,
-                          "peer-identity", peer_identity,
-                          NULL);
-
-  valent_channel_service_emit_channel (service, channel);
+  g_main_context_invoke_full (self->handshake_context,
+                              G_PRIORITY_DEFAULT,
+                              outgoing_start,
+                              data,
+                              outgoing_data_free);
 
   return TRUE;
 }
@@ -388,6 +1045,36 @@ socket_read_loop (gpointer data)
   return NULL;
 }
 
+static gpointer
+handshake_loop (gpointer data)
+{
+  g_autoptr (ValentLanChannelService) self = VALENT_LAN_CHANNEL_SERVICE (data);
+  GMainContext *context = self->handshake_context;
+
+  g_main_context_push_thread_default (context);
+
+  /* Run until the service stops, then finish any handshakes that are still
+   * returning from cancellation. */
+  while (!self->handshake_stopped ||
+         self->n_handshakes > 0 ||
+         g_main_context_pending (context))
+    g_main_context_iteration (context, TRUE);
+
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static gboolean
+handshake_stop (gpointer data)
+{
+  ValentLanChannelService *self = VALENT_LAN_CHANNEL_SERVICE (data);
+
+  self->handshake_stopped = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
 /**
  * valent_lan_channel_service_ensure_certificate:
  * @self: a #ValentLanChannelService
@@ -464,11 +1151,16 @@ valent_lan_channel_service_tcp_setup (ValentLanChannelService  *self,
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
-  /* Create a listener and override the ::run vfunc */
-  self->listener = g_threaded_socket_service_new (10);
-  G_THREADED_SOCKET_SERVICE_GET_CLASS (self->listener)->run = on_connection;
+  /* Create a listener, accepting connections in the handshake thread */
+  self->listener = g_socket_service_new ();
+  g_signal_connect (self->listener,
+                    "incoming",
+                    G_CALLBACK (on_incoming),
+                    NULL);
 
   /* Start listening for connections */
+  g_main_context_push_thread_default (self->handshake_context);
+
   if (!g_socket_listener_add_inet_port (G_SOCKET_LISTENER (self->listener),
                                         self->port,
                                         G_OBJECT (self),
@@ -479,6 +1171,8 @@ valent_lan_channel_service_tcp_setup (ValentLanChannelService  *self,
       g_clear_object (&self->listener);
     }
 
+  g_main_context_pop_thread_default (self->handshake_context);
+
   return G_IS_SOCKET_SERVICE (self->listener);
 }
 
@@ -608,9 +1302,16 @@ valent_lan_channel_service_build_identity (ValentChannelService *service)
   if (identity != NULL)
     {
       JsonObject *body;
+      JsonNode *features;
 
       body = valent_packet_get_body (identity);
       json_object_set_int_member (body, "tcpPort", self->port);
+
+      /* Multiplexed Payloads (see ValentLanMux) */
+      features = json_object_get_member (body, "valentPayload");
+
+      if (features != NULL && JSON_NODE_HOLDS_ARRAY (features))
+        json_array_add_string_element (json_node_get_array (features), "multiplex");
     }
 }
 
@@ -714,10 +1415,21 @@ start_task (GTask        *task,
   if (!valent_lan_channel_service_ensure_certificate (self, &error))
     return g_task_return_error (task, error);
 
+  /* Auxiliary Ports, before any channel can be created */
+  self->port_pool = valent_lan_port_pool_new (VALENT_LAN_AUX_MIN,
+                                              VALENT_LAN_AUX_MAX,
+                                              PORT_POOL_PREBIND);
+
   /* TCP Listener */
   if (!valent_lan_channel_service_tcp_setup (self, cancellable, &error))
     return g_task_return_error (task, error);
 
+  /* Handshakes */
+  self->handshake_stopped = FALSE;
+  self->handshake_thread = g_thread_new ("valent-lan-handshake",
+                                         handshake_loop,
+                                         g_object_ref (self));
+
   /* UDP Socket(s) */
   if (!valent_lan_channel_service_udp_setup (self, cancellable, &error))
     return g_task_return_error (task, error);
@@ -778,6 +1490,20 @@ valent_lan_channel_service_stop (ValentChannelService *service)
   /* UDP Sockets */
   g_clear_object (&self->udp_socket4);
   g_clear_object (&self->udp_socket6);
+
+  /* Handshakes */
+  if (self->handshake_thread != NULL)
+    {
+      g_main_context_invoke (self->handshake_context, handshake_stop, self);
+      g_thread_join (g_steal_pointer (&self->handshake_thread));
+    }
+
+  /* Auxiliary Ports */
+  if (self->port_pool != NULL)
+    {
+      valent_lan_port_pool_close (self->port_pool);
+      g_clear_pointer (&self->port_pool, valent_lan_port_pool_unref);
+    }
 }
 
 
@@ -805,6 +1531,10 @@ valent_lan_channel_service_finalize (GObject *object)
   g_clear_object (&self->listener);
   g_clear_object (&self->udp_socket4);
   g_clear_object (&self->udp_socket6);
+  g_clear_pointer (&self->port_pool, valent_lan_port_pool_unref);
+  g_clear_pointer (&self->handshake_hosts, g_hash_table_unref);
+  g_clear_pointer (&self->contacts, g_hash_table_unref);
+  g_clear_pointer (&self->handshake_context, g_main_context_unref);
 
   G_OBJECT_CLASS (valent_lan_channel_service_parent_class)->finalize (object);
 }
@@ -936,6 +1666,15 @@ valent_lan_channel_service_init (ValentLanChannelService *self)
   self->monitor = g_network_monitor_get_default ();
   self->broadcast_address = NULL;
   self->port = DEFAULT_PORT;
+  self->handshake_context = g_main_context_new ();
+  self->handshake_hosts = g_hash_table_new_full (g_str_hash,
+                                                 g_str_equal,
+                                                 g_free,
+                                                 g_free);
+  self->contacts = g_hash_table_new_full (g_str_hash,
+                                          g_str_equal,
+                                          g_free,
+                                          device_contact_free);
 }
 
 /**
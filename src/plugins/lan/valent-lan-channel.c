@@ -10,22 +10,33 @@
 
 #include "valent-lan-channel.h"
 #include "valent-lan-channel-service.h"
+#include "valent-lan-mux.h"
+#include "valent-lan-port-pool.h"
 #include "valent-lan-utils.h"
 
 #define VALENT_LAN_TCP_PORT 1716
 #define VALENT_LAN_UDP_PORT 1716
-#define VALENT_LAN_AUX_MIN  1739
-#define VALENT_LAN_AUX_MAX  1764
+
+/* Payloads larger than VALENT_LAN_MUX_PAYLOAD_MAX each have their own
+ * connection, so several can run at once. Smaller payloads to a peer that
+ * supports multiplexing share one connection, and take turns on it. */
+#define VALENT_LAN_TRANSFER_LIMIT 8
+
+/* Payloads up to this size share one connection, if the peer supports it */
+#define VALENT_LAN_MUX_PAYLOAD_MAX (1024 * 1024)
 
 
 struct _ValentLanChannel
 {
-  ValentChannel    parent_instance;
+  ValentChannel      parent_instance;
+
+  GTlsCertificate   *certificate;
+  char              *description;
+  char              *host;
+  guint16            port;
 
-  GTlsCertificate *certificate;
-  char            *description;
-  char            *host;
-  guint16          port;
+  ValentLanMux      *mux;
+  ValentLanPortPool *port_pool;
 };
 
 G_DEFINE_TYPE (ValentLanChannel, valent_lan_channel, VALENT_TYPE_CHANNEL)
@@ -36,6 +47,7 @@ enum {
   PROP_HOST,
   PROP_PEER_CERTIFICATE,
   PROP_PORT,
+  PROP_PORT_POOL,
   N_PROPERTIES
 };
 
@@ -86,6 +98,56 @@ valent_lan_channel_get_verification_key (ValentChannel *channel)
   return self->description;
 }
 
+/**
+ * valent_lan_channel_get_mux:
+ * @self: a #ValentLanChannel
+ *
+ * Get the multiplexer for @self, creating it the first time it's needed.
+ *
+ * Returns: (transfer none) (nullable): a #ValentLanMux
+ */
+static ValentLanMux *
+valent_lan_channel_get_mux (ValentLanChannel *self)
+{
+  GTlsCertificate *peer_cert;
+  GIOStream *base_stream;
+
+  peer_cert = valent_lan_channel_get_peer_certificate (self);
+
+  if (self->certificate == NULL || peer_cert == NULL || self->host == NULL)
+    return NULL;
+
+  if (g_once_init_enter (&self->mux))
+    {
+      ValentLanMux *mux;
+
+      mux = valent_lan_mux_new (self->certificate,
+                                peer_cert,
+                                self->host,
+                                self->port_pool);
+      g_once_init_leave (&self->mux, mux);
+    }
+
+  /* The channel may have been closed before the multiplexer was created */
+  base_stream = valent_channel_get_base_stream (VALENT_CHANNEL (self));
+
+  if (base_stream == NULL || g_io_stream_is_closed (base_stream))
+    valent_lan_mux_close (self->mux);
+
+  return self->mux;
+}
+
+static void
+on_channel_closed (ValentChannel *channel,
+                   gpointer       user_data)
+{
+  ValentLanChannel *self = VALENT_LAN_CHANNEL (channel);
+  ValentLanMux *mux;
+
+  if ((mux = g_atomic_pointer_get (&self->mux)) != NULL)
+    valent_lan_mux_close (mux);
+}
+
 static GIOStream *
 valent_lan_channel_download (ValentChannel  *channel,
                              JsonNode       *packet,
@@ -110,6 +172,23 @@ valent_lan_channel_download (ValentChannel  *channel,
   if ((info = valent_packet_get_payload_full (packet, &size, error)) == NULL)
     return NULL;
 
+  /* Multiplexed payload */
+  if (json_object_has_member (info, "multiplexId"))
+    {
+      ValentLanMux *mux;
+
+      if ((mux = valent_lan_channel_get_mux (self)) == NULL)
+        {
+          g_set_error_literal (error,
+                               G_IO_ERROR,
+                               G_IO_ERROR_NOT_CONNECTED,
+                               "Channel not authenticated");
+          return NULL;
+        }
+
+      return valent_lan_mux_download (mux, info, cancellable, error);
+    }
+
   if ((port = valent_packet_check_int (info, "port")) == 0)
     {
       g_set_error_literal (error,
@@ -149,6 +228,32 @@ valent_lan_channel_download (ValentChannel  *channel,
   return g_steal_pointer (&tls_stream);
 }
 
+typedef struct
+{
+  ValentLanMux *mux;
+  gint64        id;
+} MuxUpload;
+
+/**
+ * mux_upload_write_cb:
+ *
+ * Fail the multiplexed upload if its packet couldn't be written, since the
+ * peer will never request the payload.
+ */
+static void
+mux_upload_write_cb (ValentChannel *channel,
+                     GAsyncResult  *result,
+                     gpointer       user_data)
+{
+  g_autofree MuxUpload *upload = user_data;
+  g_autoptr (GError) error = NULL;
+
+  if (!valent_channel_write_packet_finish (channel, result, &error))
+    valent_lan_mux_fail (upload->mux, upload->id, error);
+
+  g_object_unref (upload->mux);
+}
+
 static GIOStream *
 valent_lan_channel_upload (ValentChannel  *channel,
                            JsonNode       *packet,
@@ -162,32 +267,89 @@ valent_lan_channel_upload (ValentChannel  *channel,
   guint16 port;
   GTlsCertificate *peer_cert;
   g_autoptr (GIOStream) tls_stream = NULL;
+  gssize size;
 
   g_assert (VALENT_IS_CHANNEL (channel));
   g_assert (VALENT_IS_PACKET (packet));
   g_assert (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
   g_assert (error == NULL || *error == NULL);
 
-  /* Wait for an open port */
-  listener = g_socket_listener_new ();
-  port = VALENT_LAN_AUX_MIN;
+  /* Small payloads share a connection, if the peer supports it */
+  size = valent_packet_get_payload_size (packet);
 
-  while (port <= VALENT_LAN_AUX_MAX)
+  if (size >= 0 && size <= VALENT_LAN_MUX_PAYLOAD_MAX &&
+      valent_lan_mux_supported (valent_channel_get_peer_identity (channel)))
     {
-      if (g_socket_listener_add_inet_port (listener, port, NULL, error))
-        break;
-      else if (port < VALENT_LAN_AUX_MAX)
+      ValentLanMux *mux;
+      g_autoptr (GError) mux_error = NULL;
+      gint64 id = 0;
+
+      if (valent_packet_has_payload (packet))
+        info = json_object_ref (valent_packet_get_payload_info (packet));
+      else
+        info = json_object_new ();
+
+      if ((mux = valent_lan_channel_get_mux (self)) != NULL &&
+          (id = valent_lan_mux_listen (mux, info, &mux_error)) > 0)
         {
-          g_clear_error (error);
-          port++;
+          MuxUpload *upload;
+
+          upload = g_new0 (MuxUpload, 1);
+          upload->mux = g_object_ref (mux);
+          upload->id = id;
+
+          valent_packet_set_payload_info (packet, info);
+          valent_channel_write_packet (channel,
+                                       packet,
+                                       cancellable,
+                                       (GAsyncReadyCallback)mux_upload_write_cb,
+                                       upload);
+
+          return valent_lan_mux_accept (mux, id, cancellable, error);
         }
-      else
+
+      /* Fall back to a connection for this payload */
+      if (mux_error != NULL)
+        g_debug ("%s(): %s", G_STRFUNC, mux_error->message);
+
+      json_object_unref (info);
+    }
+
+  /* Wait for an open port */
+  if (self->port_pool != NULL)
+    {
+      listener = valent_lan_port_pool_lease (self->port_pool, &port, error);
+
+      if (listener == NULL)
         return NULL;
     }
+  else
+    {
+      listener = g_socket_listener_new ();
+      port = VALENT_LAN_AUX_MIN;
+
+      while (port <= VALENT_LAN_AUX_MAX)
+        {
+          if (g_socket_listener_add_inet_port (listener, port, NULL, error))
+            break;
+          else if (port < VALENT_LAN_AUX_MAX)
+            {
+              g_clear_error (error);
+              port++;
+            }
+          else
+            return NULL;
+        }
+    }
+
+  /* Payload Info, keeping any fields set by the caller */
+  if (valent_packet_has_payload (packet))
+    info = json_object_ref (valent_packet_get_payload_info (packet));
+  else
+    info = json_object_new ();
 
-  /* Payload Info */
-  info = json_object_new();
   json_object_set_int_member (info, "port", (gint64)port);
+  json_object_remove_member (info, "multiplexId");
   valent_packet_set_payload_info (packet, info);
 
   /* Notify the device we're ready */
@@ -196,6 +358,12 @@ valent_lan_channel_upload (ValentChannel  *channel,
   /* Wait for connection (accept) */
   connection = g_socket_listener_accept (listener, NULL, cancellable, error);
 
+  if (self->port_pool != NULL)
+    valent_lan_port_pool_release (self->port_pool,
+                                  g_steal_pointer (&listener),
+                                  port,
+                                  connection != NULL);
+
   if (connection == NULL)
     return NULL;
 
@@ -258,6 +426,11 @@ valent_lan_channel_finalize (GObject *object)
 {
   ValentLanChannel *self = VALENT_LAN_CHANNEL (object);
 
+  if (self->mux != NULL)
+    valent_lan_mux_close (self->mux);
+
+  g_clear_object (&self->mux);
+  g_clear_pointer (&self->port_pool, valent_lan_port_pool_unref);
   g_clear_object (&self->certificate);
   g_clear_pointer (&self->description, g_free);
   g_clear_pointer (&self->host, g_free);
@@ -291,6 +464,10 @@ valent_lan_channel_get_property (GObject    *object,
       g_value_set_uint (value, valent_lan_channel_get_port (self));
       break;
 
+    case PROP_PORT_POOL:
+      g_value_set_boxed (value, self->port_pool);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -318,6 +495,10 @@ valent_lan_channel_set_property (GObject      *object,
       self->port = g_value_get_uint (value);
       break;
 
+    case PROP_PORT_POOL:
+      self->port_pool = g_value_dup_boxed (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -399,6 +580,22 @@ valent_lan_channel_class_init (ValentLanChannelClass *klass)
                         G_PARAM_EXPLICIT_NOTIFY |
                         G_PARAM_STATIC_STRINGS));
 
+  /**
+   * ValentLanChannel:port-pool:
+   *
+   * The #ValentLanPortPool to lease listening sockets from when uploading, or
+   * %NULL to bind a new socket for each upload.
+   */
+  properties [PROP_PORT_POOL] =
+    g_param_spec_boxed ("port-pool",
+                        "Port Pool",
+                        "Pool of listening sockets for uploads",
+                        VALENT_TYPE_LAN_PORT_POOL,
+                        (G_PARAM_READWRITE |
+                         G_PARAM_CONSTRUCT_ONLY |
+                         G_PARAM_EXPLICIT_NOTIFY |
+                         G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_properties (object_class, N_PROPERTIES, properties);
 }
 
@@ -408,6 +605,12 @@ valent_lan_channel_init (ValentLanChannel *self)
   self->certificate = NULL;
   self->host = NULL;
   self->port = VALENT_LAN_TCP_PORT;
+
+  valent_channel_set_transfer_limit (VALENT_CHANNEL (self),
+                                     VALENT_LAN_TRANSFER_LIMIT);
+
+  /* Stop accepting auxiliary connections when the channel closes */
+  g_signal_connect (self, "closed", G_CALLBACK (on_channel_closed), NULL);
 }
 
 /**
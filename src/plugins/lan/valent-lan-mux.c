@@ -0,0 +1,1315 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#define G_LOG_DOMAIN "valent-lan-mux"
+
+#include "config.h"
+
+#include <gio/gio.h>
+#include <libvalent-core.h>
+
+#include "valent-lan-mux.h"
+#include "valent-lan-port-pool.h"
+#include "valent-lan-utils.h"
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_SIZE_MAX    (64 * 1024)
+#define DRAIN_BUFFER_SIZE 4096
+
+/* Incoming connections are limited to HANDSHAKE_MAX handshakes at a time, each
+ * of which must finish within HANDSHAKE_TIMEOUT seconds. */
+#define HANDSHAKE_MAX     2
+#define HANDSHAKE_TIMEOUT 10
+
+
+/*
+ * Multiplexed Payloads
+ *
+ * If the peer lists `multiplex` in the `valentPayload` field of its identity,
+ * small payloads share one auxiliary connection per peer, instead of a new
+ * listener, TCP connection and TLS handshake each.
+ *
+ * The uploader keeps a listener open on one auxiliary port for the lifetime of
+ * the channel, and adds `"multiplexId"` to the `payloadTransferInfo` next to
+ * the usual `"port"`. The downloader connects to that port once, and reuses
+ * the connection for later payloads sent to the same port.
+ *
+ * Payloads are sent one at a time over a connection. The downloader starts a
+ * session by writing the payload's `multiplexId` as a 64-bit big-endian
+ * integer. Both sides then exchange frames, each a 32-bit big-endian length
+ * followed by that many bytes. A zero-length frame ends the data in that
+ * direction, and the session is over once each side has sent and received one.
+ *
+ * Only the peer of the channel may connect to the listener. Connections from
+ * any other address are closed before the TLS handshake, and the handshake
+ * must present the peer certificate.
+ */
+
+/**
+ * MuxLink:
+ * @stream: a TLS encrypted #GIOStream
+ * @port: the peer's port, for outgoing links
+ * @client: whether the local device is the TLS client
+ * @active: whether a session is using the link
+ * @broken: whether the link is out of sync and must be discarded
+ *
+ * A thread-safe info struct for an auxiliary connection. The fields other than
+ * @stream, @port and @client are protected by the #ValentLanMux lock.
+ */
+typedef struct
+{
+  GIOStream *stream;
+  guint16    port;
+  gboolean   client;
+  gboolean   active;
+  gboolean   broken;
+} MuxLink;
+
+static void
+mux_link_free (gpointer data)
+{
+  MuxLink *link = data;
+
+  if (link->stream != NULL)
+    g_io_stream_close (link->stream, NULL, NULL);
+
+  g_clear_object (&link->stream);
+}
+
+static void
+mux_link_unref (gpointer data)
+{
+  g_atomic_rc_box_release_full (data, mux_link_free);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MuxLink, mux_link_unref)
+
+
+struct _ValentLanMux
+{
+  GObject          parent_instance;
+
+  GTlsCertificate   *certificate;
+  GTlsCertificate   *peer_certificate;
+  char              *host;
+  ValentLanPortPool *port_pool;
+  GCancellable      *cancellable;
+
+  GMutex             lock;
+  GCond              cond;
+  gboolean           closed;
+
+  /* Uploads */
+  GSocketListener   *listener;
+  guint16            port;
+  gint64             last_id;
+  GHashTable        *pending;
+  GHashTable        *failed;
+  unsigned int       n_handshakes;
+
+  /* Statistics */
+  unsigned int       n_links;
+  unsigned int       n_sessions;
+
+  /* Downloads */
+  MuxLink           *client;
+  gboolean           leased;
+};
+
+G_DEFINE_TYPE (ValentLanMux, valent_lan_mux, G_TYPE_OBJECT)
+
+static inline gint64 *
+pending_key (gint64 id)
+{
+  gint64 *key = g_new (gint64, 1);
+
+  *key = id;
+
+  return key;
+}
+
+static void
+pending_free (gpointer data)
+{
+  if (data != NULL)
+    g_object_unref (data);
+}
+
+static void   valent_lan_mux_release (ValentLanMux *self,
+                                      MuxLink      *link,
+                                      gboolean      broken);
+
+
+/**
+ * MuxSession:
+ * @mux: a #ValentLanMux
+ * @link: a #MuxLink
+ * @n_open: the number of streams still open
+ * @broken: whether an I/O error occurred
+ *
+ * A thread-safe info struct shared by the input and output streams of one
+ * payload. The link is released when both streams have been closed.
+ */
+typedef struct
+{
+  ValentLanMux *mux;
+  MuxLink      *link;
+  int           n_open;
+  int           broken;
+} MuxSession;
+
+static void
+mux_session_free (gpointer data)
+{
+  MuxSession *session = data;
+
+  g_clear_object (&session->mux);
+  g_clear_pointer (&session->link, mux_link_unref);
+}
+
+static void
+mux_session_unref (gpointer data)
+{
+  g_atomic_rc_box_release_full (data, mux_session_free);
+}
+
+static inline void
+mux_session_set_broken (MuxSession *session)
+{
+  g_atomic_int_set (&session->broken, TRUE);
+}
+
+static inline gboolean
+mux_session_is_broken (MuxSession *session)
+{
+  return g_atomic_int_get (&session->broken);
+}
+
+static void
+mux_session_close_stream (MuxSession *session)
+{
+  if (g_atomic_int_dec_and_test (&session->n_open))
+    {
+      valent_lan_mux_release (session->mux,
+                              session->link,
+                              mux_session_is_broken (session));
+    }
+}
+
+
+/*
+ * Framed Input
+ */
+#define VALENT_TYPE_LAN_MUX_INPUT_STREAM (valent_lan_mux_input_stream_get_type())
+
+G_DECLARE_FINAL_TYPE (ValentLanMuxInputStream, valent_lan_mux_input_stream, VALENT, LAN_MUX_INPUT_STREAM, GInputStream)
+
+struct _ValentLanMuxInputStream
+{
+  GInputStream  parent_instance;
+
+  MuxSession   *session;
+  GInputStream *base_stream;
+  gsize         remaining;
+  gboolean      eof;
+};
+
+G_DEFINE_TYPE (ValentLanMuxInputStream, valent_lan_mux_input_stream, G_TYPE_INPUT_STREAM)
+
+static gssize
+valent_lan_mux_input_stream_read (GInputStream  *stream,
+                                  void          *buffer,
+                                  gsize          count,
+                                  GCancellable  *cancellable,
+                                  GError       **error)
+{
+  ValentLanMuxInputStream *self = VALENT_LAN_MUX_INPUT_STREAM (stream);
+  gssize n_read;
+
+  if (self->eof)
+    return 0;
+
+  if (mux_session_is_broken (self->session))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                           "Multiplexed connection failed");
+      return -1;
+    }
+
+  /* Start of a frame */
+  if (self->remaining == 0)
+    {
+      guint32 header;
+      gsize header_read = 0;
+
+      if (!g_input_stream_read_all (self->base_stream,
+                                    &header,
+                                    FRAME_HEADER_SIZE,
+                                    &header_read,
+                                    cancellable,
+                                    error))
+        goto broken;
+
+      if (header_read < FRAME_HEADER_SIZE)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                               "Multiplexed connection closed");
+          goto broken;
+        }
+
+      self->remaining = GUINT32_FROM_BE (header);
+
+      if (self->remaining == 0)
+        {
+          self->eof = TRUE;
+          return 0;
+        }
+
+      if (self->remaining > FRAME_SIZE_MAX)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Invalid frame size (%"G_GSIZE_FORMAT")",
+                       self->remaining);
+          goto broken;
+        }
+    }
+
+  n_read = g_input_stream_read (self->base_stream,
+                                buffer,
+                                MIN (count, self->remaining),
+                                cancellable,
+                                error);
+
+  if (n_read == 0)
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                         "Multiplexed connection closed");
+
+  if (n_read <= 0)
+    goto broken;
+
+  self->remaining -= n_read;
+
+  return n_read;
+
+broken:
+  mux_session_set_broken (self->session);
+  return -1;
+}
+
+static gboolean
+valent_lan_mux_input_stream_close (GInputStream  *stream,
+                                   GCancellable  *cancellable,
+                                   GError       **error)
+{
+  ValentLanMuxInputStream *self = VALENT_LAN_MUX_INPUT_STREAM (stream);
+  g_autofree guint8 *buffer = NULL;
+  gboolean ret = TRUE;
+
+  /* Discard any data the caller didn't read, up to the end frame */
+  if (!self->eof && !mux_session_is_broken (self->session))
+    {
+      gssize n_read;
+
+      buffer = g_malloc (DRAIN_BUFFER_SIZE);
+
+      do
+        n_read = valent_lan_mux_input_stream_read (stream,
+                                                   buffer,
+                                                   DRAIN_BUFFER_SIZE,
+                                                   cancellable,
+                                                   error);
+      while (n_read > 0);
+
+      ret = (n_read == 0);
+    }
+
+  mux_session_close_stream (self->session);
+
+  return ret;
+}
+
+static void
+valent_lan_mux_input_stream_finalize (GObject *object)
+{
+  ValentLanMuxInputStream *self = VALENT_LAN_MUX_INPUT_STREAM (object);
+
+  g_clear_pointer (&self->session, mux_session_unref);
+
+  G_OBJECT_CLASS (valent_lan_mux_input_stream_parent_class)->finalize (object);
+}
+
+static void
+valent_lan_mux_input_stream_class_init (ValentLanMuxInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = valent_lan_mux_input_stream_finalize;
+
+  stream_class->read_fn = valent_lan_mux_input_stream_read;
+  stream_class->close_fn = valent_lan_mux_input_stream_close;
+}
+
+static void
+valent_lan_mux_input_stream_init (ValentLanMuxInputStream *self)
+{
+}
+
+
+/*
+ * Framed Output
+ */
+#define VALENT_TYPE_LAN_MUX_OUTPUT_STREAM (valent_lan_mux_output_stream_get_type())
+
+G_DECLARE_FINAL_TYPE (ValentLanMuxOutputStream, valent_lan_mux_output_stream, VALENT, LAN_MUX_OUTPUT_STREAM, GOutputStream)
+
+struct _ValentLanMuxOutputStream
+{
+  GOutputStream  parent_instance;
+
+  MuxSession    *session;
+  GOutputStream *base_stream;
+  guint8        *buffer;
+};
+
+G_DEFINE_TYPE (ValentLanMuxOutputStream, valent_lan_mux_output_stream, G_TYPE_OUTPUT_STREAM)
+
+static gssize
+valent_lan_mux_output_stream_write (GOutputStream  *stream,
+                                    const void     *buffer,
+                                    gsize           count,
+                                    GCancellable   *cancellable,
+                                    GError        **error)
+{
+  ValentLanMuxOutputStream *self = VALENT_LAN_MUX_OUTPUT_STREAM (stream);
+  gsize size;
+
+  if (mux_session_is_broken (self->session))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                           "Multiplexed connection failed");
+      return -1;
+    }
+
+  /* Send the header and data in one write, so each frame is one TLS record */
+  if (self->buffer == NULL)
+    self->buffer = g_malloc (FRAME_HEADER_SIZE + FRAME_SIZE_MAX);
+
+  size = MIN (count, FRAME_SIZE_MAX);
+  *(guint32 *)self->buffer = GUINT32_TO_BE ((guint32)size);
+  memcpy (self->buffer + FRAME_HEADER_SIZE, buffer, size);
+
+  if (!g_output_stream_write_all (self->base_stream,
+                                  self->buffer,
+                                  FRAME_HEADER_SIZE + size,
+                                  NULL,
+                                  cancellable,
+                                  error))
+    {
+      mux_session_set_broken (self->session);
+      return -1;
+    }
+
+  return size;
+}
+
+static gboolean
+valent_lan_mux_output_stream_close (GOutputStream  *stream,
+                                    GCancellable   *cancellable,
+                                    GError        **error)
+{
+  ValentLanMuxOutputStream *self = VALENT_LAN_MUX_OUTPUT_STREAM (stream);
+  guint32 header = 0;
+  gboolean ret = TRUE;
+
+  /* Send the end frame */
+  if (!mux_session_is_broken (self->session))
+    {
+      ret = g_output_stream_write_all (self->base_stream,
+                                       &header,
+                                       FRAME_HEADER_SIZE,
+                                       NULL,
+                                       cancellable,
+                                       error);
+
+      if (!ret)
+        mux_session_set_broken (self->session);
+    }
+
+  mux_session_close_stream (self->session);
+
+  return ret;
+}
+
+static void
+valent_lan_mux_output_stream_finalize (GObject *object)
+{
+  ValentLanMuxOutputStream *self = VALENT_LAN_MUX_OUTPUT_STREAM (object);
+
+  g_clear_pointer (&self->session, mux_session_unref);
+  g_clear_pointer (&self->buffer, g_free);
+
+  G_OBJECT_CLASS (valent_lan_mux_output_stream_parent_class)->finalize (object);
+}
+
+static void
+valent_lan_mux_output_stream_class_init (ValentLanMuxOutputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = valent_lan_mux_output_stream_finalize;
+
+  stream_class->write_fn = valent_lan_mux_output_stream_write;
+  stream_class->close_fn = valent_lan_mux_output_stream_close;
+}
+
+static void
+valent_lan_mux_output_stream_init (ValentLanMuxOutputStream *self)
+{
+}
+
+
+/**
+ * mux_session_new:
+ * @mux: a #ValentLanMux
+ * @link: a #MuxLink
+ *
+ * Start a session on @link, returning a stream for one payload.
+ *
+ * The caller must have marked @link as active.
+ *
+ * Returns: (transfer full): a #GIOStream
+ */
+static GIOStream *
+mux_session_new (ValentLanMux *mux,
+                 MuxLink      *link)
+{
+  MuxSession *session;
+  ValentLanMuxInputStream *input;
+  ValentLanMuxOutputStream *output;
+  GIOStream *stream;
+
+  session = g_atomic_rc_box_new0 (MuxSession);
+  session->mux = g_object_ref (mux);
+  session->link = g_atomic_rc_box_acquire (link);
+  session->n_open = 2;
+  session->broken = FALSE;
+
+  input = g_object_new (VALENT_TYPE_LAN_MUX_INPUT_STREAM, NULL);
+  input->session = g_atomic_rc_box_acquire (session);
+  input->base_stream = g_io_stream_get_input_stream (link->stream);
+
+  output = g_object_new (VALENT_TYPE_LAN_MUX_OUTPUT_STREAM, NULL);
+  output->session = session;
+  output->base_stream = g_io_stream_get_output_stream (link->stream);
+
+  stream = g_simple_io_stream_new (G_INPUT_STREAM (input),
+                                   G_OUTPUT_STREAM (output));
+  g_object_unref (input);
+  g_object_unref (output);
+
+  return stream;
+}
+
+
+/*
+ * Helpers
+ */
+static void
+on_cancelled (GCancellable *cancellable,
+              ValentLanMux *self)
+{
+  g_mutex_lock (&self->lock);
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->lock);
+}
+
+static gboolean
+valent_lan_mux_set_error (ValentLanMux  *self,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return TRUE;
+
+  if (self->closed)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                           "Multiplexed connection closed");
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * valent_lan_mux_release:
+ * @self: a #ValentLanMux
+ * @link: a #MuxLink
+ * @broken: whether the session failed
+ *
+ * Release @link after a session has ended, so it can be used for the next one.
+ *
+ * If @broken is %TRUE, the link can't be trusted to be at a frame boundary and
+ * is discarded instead.
+ */
+static void
+valent_lan_mux_release (ValentLanMux *self,
+                        MuxLink      *link,
+                        gboolean      broken)
+{
+  MuxLink *stale = NULL;
+
+  g_mutex_lock (&self->lock);
+  link->active = FALSE;
+  link->broken |= broken;
+
+  if (link->client)
+    {
+      self->leased = FALSE;
+
+      if ((link->broken || self->closed) && self->client == link)
+        stale = g_steal_pointer (&self->client);
+    }
+
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->lock);
+
+  g_clear_pointer (&stale, mux_link_unref);
+}
+
+/**
+ * valent_lan_mux_link_thread:
+ * @data: a #GSocketConnection
+ *
+ * Authenticate an incoming auxiliary connection, then serve sessions on it
+ * until it fails or the #ValentLanMux is closed.
+ *
+ * Returns: always %NULL
+ */
+static gpointer
+valent_lan_mux_link_thread (gpointer data)
+{
+  g_autoptr (GSocketConnection) connection = data;
+  g_autoptr (ValentLanMux) self = NULL;
+  g_autoptr (MuxLink) link = NULL;
+  g_autoptr (GIOStream) tls_stream = NULL;
+  g_autoptr (GError) error = NULL;
+  GSocket *socket;
+  GInputStream *input;
+
+  self = g_object_steal_data (G_OBJECT (connection), "valent-lan-mux");
+
+  /* We're the server when uploading. A peer that stalls the handshake times
+   * out, instead of holding one of the handshake slots. */
+  socket = g_socket_connection_get_socket (connection);
+  g_socket_set_timeout (socket, HANDSHAKE_TIMEOUT);
+  tls_stream = valent_lan_encrypt_server (connection,
+                                          self->certificate,
+                                          self->peer_certificate,
+                                          self->cancellable,
+                                          &error);
+  g_socket_set_timeout (socket, 0);
+
+  g_mutex_lock (&self->lock);
+  self->n_handshakes--;
+
+  if (tls_stream != NULL)
+    self->n_links++;
+  g_mutex_unlock (&self->lock);
+
+  if (tls_stream == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("%s(): %s", G_STRFUNC, error->message);
+
+      g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+      return NULL;
+    }
+
+  link = g_atomic_rc_box_new0 (MuxLink);
+  link->stream = g_steal_pointer (&tls_stream);
+  link->client = FALSE;
+  input = g_io_stream_get_input_stream (link->stream);
+
+  while (TRUE)
+    {
+      g_autoptr (GIOStream) stream = NULL;
+      gint64 id = 0;
+      gsize n_read = 0;
+      gpointer pending;
+
+      /* Wait for the downloader to request a payload */
+      if (!g_input_stream_read_all (input,
+                                    &id,
+                                    sizeof (gint64),
+                                    &n_read,
+                                    self->cancellable,
+                                    &error) ||
+          n_read < sizeof (gint64))
+        break;
+
+      id = GINT64_FROM_BE (id);
+
+      g_mutex_lock (&self->lock);
+      link->active = TRUE;
+      stream = mux_session_new (self, link);
+
+      if (g_hash_table_lookup_extended (self->pending, &id, NULL, &pending) &&
+          pending == NULL)
+        {
+          g_hash_table_insert (self->pending,
+                               pending_key (id),
+                               g_steal_pointer (&stream));
+          self->n_sessions++;
+          g_cond_broadcast (&self->cond);
+        }
+      g_mutex_unlock (&self->lock);
+
+      /* If the upload was cancelled, end the session without any data */
+      if (stream != NULL)
+        {
+          g_debug ("%s(): unknown payload %"G_GINT64_FORMAT, G_STRFUNC, id);
+          g_io_stream_close (stream, NULL, NULL);
+          g_clear_object (&stream);
+        }
+
+      /* Wait for the session to end */
+      g_mutex_lock (&self->lock);
+      while (link->active && !self->closed)
+        g_cond_wait (&self->cond, &self->lock);
+
+      if (link->broken || self->closed)
+        {
+          g_mutex_unlock (&self->lock);
+          break;
+        }
+      g_mutex_unlock (&self->lock);
+    }
+
+  if (error != NULL && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_debug ("%s(): %s", G_STRFUNC, error->message);
+
+  return NULL;
+}
+
+/**
+ * valent_lan_mux_check_peer:
+ * @self: a #ValentLanMux
+ * @connection: a #GSocketConnection
+ *
+ * Check that @connection comes from the address of the peer.
+ *
+ * Returns: %TRUE if @connection is from the peer
+ */
+static gboolean
+valent_lan_mux_check_peer (ValentLanMux      *self,
+                           GSocketConnection *connection)
+{
+  g_autoptr (GSocketAddress) address = NULL;
+  g_autoptr (GInetAddress) host = NULL;
+  GInetAddress *remote;
+
+  /* The host may be a name, which can't be compared with the address */
+  if ((host = g_inet_address_new_from_string (self->host)) == NULL)
+    return TRUE;
+
+  address = g_socket_connection_get_remote_address (connection, NULL);
+
+  if (!G_IS_INET_SOCKET_ADDRESS (address))
+    return FALSE;
+
+  remote = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (address));
+
+  return g_inet_address_equal (remote, host);
+}
+
+/**
+ * valent_lan_mux_accept_thread:
+ * @data: a #ValentLanMux
+ *
+ * Accept auxiliary connections until the #ValentLanMux is closed.
+ *
+ * Connections from other hosts, or beyond %HANDSHAKE_MAX handshakes in
+ * progress, are closed immediately.
+ *
+ * Returns: always %NULL
+ */
+static gpointer
+valent_lan_mux_accept_thread (gpointer data)
+{
+  g_autoptr (ValentLanMux) self = data;
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GError) error = NULL;
+  guint16 port;
+
+  g_mutex_lock (&self->lock);
+  listener = g_object_ref (self->listener);
+  port = self->port;
+  g_mutex_unlock (&self->lock);
+
+  while (TRUE)
+    {
+      g_autoptr (GSocketConnection) connection = NULL;
+      g_autoptr (GThread) thread = NULL;
+      gboolean admit;
+
+      connection = g_socket_listener_accept (listener,
+                                             NULL,
+                                             self->cancellable,
+                                             &error);
+
+      if (connection == NULL)
+        break;
+
+      if (!valent_lan_mux_check_peer (self, connection))
+        {
+          g_debug ("%s(): ignoring connection from another host", G_STRFUNC);
+          g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+          continue;
+        }
+
+      g_mutex_lock (&self->lock);
+      if ((admit = (self->n_handshakes < HANDSHAKE_MAX)))
+        self->n_handshakes++;
+      g_mutex_unlock (&self->lock);
+
+      if (!admit)
+        {
+          g_debug ("%s(): too many handshakes", G_STRFUNC);
+          g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+          continue;
+        }
+
+      g_object_set_data (G_OBJECT (connection),
+                         "valent-lan-mux",
+                         g_object_ref (self));
+      thread = g_thread_new ("valent-lan-mux",
+                             valent_lan_mux_link_thread,
+                             g_steal_pointer (&connection));
+    }
+
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_warning ("%s(): %s", G_STRFUNC, error->message);
+
+  /* Return the port, without reuse, so the peer can't reach the next lease */
+  g_mutex_lock (&self->lock);
+  if (self->listener == listener)
+    g_clear_object (&self->listener);
+  g_mutex_unlock (&self->lock);
+
+  if (self->port_pool != NULL)
+    valent_lan_port_pool_release (self->port_pool,
+                                  g_steal_pointer (&listener),
+                                  port,
+                                  FALSE);
+  else
+    g_socket_listener_close (listener);
+
+  return NULL;
+}
+
+
+/*
+ * GObject
+ */
+static void
+valent_lan_mux_finalize (GObject *object)
+{
+  ValentLanMux *self = VALENT_LAN_MUX (object);
+
+  g_clear_pointer (&self->client, mux_link_unref);
+  g_clear_pointer (&self->pending, g_hash_table_unref);
+  g_clear_pointer (&self->failed, g_hash_table_unref);
+  g_clear_object (&self->listener);
+  g_clear_pointer (&self->port_pool, valent_lan_port_pool_unref);
+  g_clear_object (&self->cancellable);
+  g_clear_object (&self->certificate);
+  g_clear_object (&self->peer_certificate);
+  g_clear_pointer (&self->host, g_free);
+
+  g_cond_clear (&self->cond);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (valent_lan_mux_parent_class)->finalize (object);
+}
+
+static void
+valent_lan_mux_class_init (ValentLanMuxClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = valent_lan_mux_finalize;
+}
+
+static void
+valent_lan_mux_init (ValentLanMux *self)
+{
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+
+  self->cancellable = g_cancellable_new ();
+  self->pending = g_hash_table_new_full (g_int64_hash,
+                                         g_int64_equal,
+                                         g_free,
+                                         pending_free);
+  self->failed = g_hash_table_new_full (g_int64_hash,
+                                        g_int64_equal,
+                                        g_free,
+                                        (GDestroyNotify)g_error_free);
+}
+
+/**
+ * valent_lan_mux_new:
+ * @certificate: a #GTlsCertificate
+ * @peer_certificate: a #GTlsCertificate
+ * @host: the remote address
+ * @port_pool: (nullable): a #ValentLanPortPool
+ *
+ * Create a new multiplexer for the auxiliary connections to the device at
+ * @host, authenticated with @certificate and @peer_certificate.
+ *
+ * If @port_pool is not %NULL, the listener for uploads is leased from it.
+ *
+ * Returns: (transfer full): a #ValentLanMux
+ */
+ValentLanMux *
+valent_lan_mux_new (GTlsCertificate   *certificate,
+                    GTlsCertificate   *peer_certificate,
+                    const char        *host,
+                    ValentLanPortPool *port_pool)
+{
+  ValentLanMux *self;
+
+  g_return_val_if_fail (G_IS_TLS_CERTIFICATE (certificate), NULL);
+  g_return_val_if_fail (G_IS_TLS_CERTIFICATE (peer_certificate), NULL);
+  g_return_val_if_fail (host != NULL, NULL);
+
+  self = g_object_new (VALENT_TYPE_LAN_MUX, NULL);
+  self->certificate = g_object_ref (certificate);
+  self->peer_certificate = g_object_ref (peer_certificate);
+  self->host = g_strdup (host);
+
+  if (port_pool != NULL)
+    self->port_pool = valent_lan_port_pool_ref (port_pool);
+
+  return self;
+}
+
+/**
+ * valent_lan_mux_supported:
+ * @identity: (nullable): a KDE Connect identity packet
+ *
+ * Check if the device that sent @identity supports multiplexed payloads.
+ *
+ * Returns: %TRUE if supported, %FALSE otherwise
+ */
+gboolean
+valent_lan_mux_supported (JsonNode *identity)
+{
+  JsonObject *body;
+  JsonNode *node;
+  JsonArray *features;
+
+  if (identity == NULL || (body = valent_packet_get_body (identity)) == NULL)
+    return FALSE;
+
+  if ((node = json_object_get_member (body, "valentPayload")) == NULL ||
+      !JSON_NODE_HOLDS_ARRAY (node))
+    return FALSE;
+
+  features = json_node_get_array (node);
+
+  for (unsigned int i = 0, len = json_array_get_length (features); i < len; i++)
+    {
+      JsonNode *feature = json_array_get_element (features, i);
+
+      if (json_node_get_value_type (feature) == G_TYPE_STRING &&
+          g_strcmp0 (json_node_get_string (feature), "multiplex") == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * valent_lan_mux_listen:
+ * @mux: a #ValentLanMux
+ * @info: the `payloadTransferInfo` of a packet
+ * @error: (nullable): a #GError
+ *
+ * Prepare to upload a payload, setting the `port` and `multiplexId` fields of
+ * @info. The listener is opened the first time this is called.
+ *
+ * The caller must then send the packet and call valent_lan_mux_accept().
+ *
+ * Returns: the payload id, or `0` with @error set
+ */
+gint64
+valent_lan_mux_listen (ValentLanMux  *mux,
+                       JsonObject    *info,
+                       GError       **error)
+{
+  gint64 id;
+
+  g_return_val_if_fail (VALENT_IS_LAN_MUX (mux), 0);
+  g_return_val_if_fail (info != NULL, 0);
+  g_return_val_if_fail (error == NULL || *error == NULL, 0);
+
+  g_mutex_lock (&mux->lock);
+
+  if (valent_lan_mux_set_error (mux, NULL, error))
+    {
+      g_mutex_unlock (&mux->lock);
+      return 0;
+    }
+
+  if (mux->listener == NULL)
+    {
+      g_autoptr (GSocketListener) listener = NULL;
+      g_autoptr (GThread) thread = NULL;
+      guint16 port = VALENT_LAN_AUX_MIN;
+
+      if (mux->port_pool != NULL)
+        {
+          listener = valent_lan_port_pool_lease (mux->port_pool, &port, error);
+
+          if (listener == NULL)
+            {
+              g_mutex_unlock (&mux->lock);
+              return 0;
+            }
+        }
+      else
+        {
+          listener = g_socket_listener_new ();
+
+          while (!g_socket_listener_add_inet_port (listener, port, NULL, error))
+            {
+              if (port == VALENT_LAN_AUX_MAX)
+                {
+                  g_mutex_unlock (&mux->lock);
+                  return 0;
+                }
+
+              g_clear_error (error);
+              port++;
+            }
+        }
+
+      mux->listener = g_steal_pointer (&listener);
+      mux->port = port;
+      thread = g_thread_new ("valent-lan-mux-accept",
+                             valent_lan_mux_accept_thread,
+                             g_object_ref (mux));
+    }
+
+  id = ++mux->last_id;
+  g_hash_table_insert (mux->pending, pending_key (id), NULL);
+
+  json_object_set_int_member (info, "port", (gint64)mux->port);
+  json_object_set_int_member (info, "multiplexId", id);
+
+  g_mutex_unlock (&mux->lock);
+
+  return id;
+}
+
+/**
+ * valent_lan_mux_accept:
+ * @mux: a #ValentLanMux
+ * @id: a payload id from valent_lan_mux_listen()
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Wait for the peer to request the payload @id.
+ *
+ * If the packet for @id can't be sent, valent_lan_mux_fail() should be called
+ * so this returns with that error, rather than waiting for a request that will
+ * never come.
+ *
+ * Returns: (transfer full) (nullable): a #GIOStream
+ */
+GIOStream *
+valent_lan_mux_accept (ValentLanMux  *mux,
+                       gint64         id,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  g_autoptr (GIOStream) stream = NULL;
+  gpointer key = NULL;
+  gpointer value = NULL;
+  unsigned long cancelled_id = 0;
+
+  g_return_val_if_fail (VALENT_IS_LAN_MUX (mux), NULL);
+  g_return_val_if_fail (id > 0, NULL);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  if (cancellable != NULL)
+    cancelled_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (on_cancelled),
+                                          mux, NULL);
+
+  g_mutex_lock (&mux->lock);
+  while (g_hash_table_lookup_extended (mux->pending, &id, NULL, &value) &&
+         value == NULL &&
+         !mux->closed &&
+         !g_cancellable_is_cancelled (cancellable))
+    g_cond_wait (&mux->cond, &mux->lock);
+
+  if (g_hash_table_steal_extended (mux->pending, &id, &key, &value))
+    {
+      stream = value;
+      g_free (key);
+    }
+
+  if (stream == NULL &&
+      g_hash_table_steal_extended (mux->failed, &id, &key, &value))
+    {
+      g_propagate_error (error, value);
+      g_free (key);
+    }
+  else if (stream == NULL)
+    valent_lan_mux_set_error (mux, cancellable, error);
+  g_mutex_unlock (&mux->lock);
+
+  g_cancellable_disconnect (cancellable, cancelled_id);
+
+  return g_steal_pointer (&stream);
+}
+
+/**
+ * valent_lan_mux_fail:
+ * @mux: a #ValentLanMux
+ * @id: a payload id from valent_lan_mux_listen()
+ * @error: a #GError
+ *
+ * Fail the upload of payload @id with @error, because the peer was never told
+ * about it. A thread waiting in valent_lan_mux_accept() for @id returns @error.
+ *
+ * If the peer has already requested @id, this does nothing.
+ */
+void
+valent_lan_mux_fail (ValentLanMux *mux,
+                     gint64        id,
+                     const GError *error)
+{
+  gpointer value = NULL;
+
+  g_return_if_fail (VALENT_IS_LAN_MUX (mux));
+  g_return_if_fail (id > 0);
+  g_return_if_fail (error != NULL);
+
+  g_mutex_lock (&mux->lock);
+  if (g_hash_table_lookup_extended (mux->pending, &id, NULL, &value) &&
+      value == NULL)
+    {
+      g_hash_table_remove (mux->pending, &id);
+      g_hash_table_replace (mux->failed, pending_key (id), g_error_copy (error));
+      g_cond_broadcast (&mux->cond);
+    }
+  g_mutex_unlock (&mux->lock);
+}
+
+/**
+ * valent_lan_mux_download:
+ * @mux: a #ValentLanMux
+ * @info: the `payloadTransferInfo` of a packet
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Request the payload described by @info, opening a connection to the port in
+ * @info if there isn't one already.
+ *
+ * Payloads are downloaded one at a time, so this will block until any other
+ * stream returned by this function has been closed.
+ *
+ * Returns: (transfer full) (nullable): a #GIOStream
+ */
+GIOStream *
+valent_lan_mux_download (ValentLanMux  *mux,
+                         JsonObject    *info,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_autoptr (MuxLink) link = NULL;
+  g_autoptr (MuxLink) stale = NULL;
+  unsigned long cancelled_id = 0;
+  gint64 id;
+  gint64 id_be;
+  guint16 port;
+
+  g_return_val_if_fail (VALENT_IS_LAN_MUX (mux), NULL);
+  g_return_val_if_fail (info != NULL, NULL);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  if ((port = valent_packet_check_int (info, "port")) == 0)
+    {
+      g_set_error_literal (error,
+                           VALENT_PACKET_ERROR,
+                           VALENT_PACKET_ERROR_INVALID_FIELD,
+                           "Invalid \"port\" field");
+      return NULL;
+    }
+
+  if ((id = valent_packet_check_int (info, "multiplexId")) <= 0)
+    {
+      g_set_error_literal (error,
+                           VALENT_PACKET_ERROR,
+                           VALENT_PACKET_ERROR_INVALID_FIELD,
+                           "Invalid \"multiplexId\" field");
+      return NULL;
+    }
+
+  /* Wait for the lease */
+  if (cancellable != NULL)
+    cancelled_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (on_cancelled),
+                                          mux, NULL);
+
+  g_mutex_lock (&mux->lock);
+  while (mux->leased &&
+         !mux->closed &&
+         !g_cancellable_is_cancelled (cancellable))
+    g_cond_wait (&mux->cond, &mux->lock);
+
+  if (valent_lan_mux_set_error (mux, cancellable, error))
+    {
+      g_mutex_unlock (&mux->lock);
+      g_cancellable_disconnect (cancellable, cancelled_id);
+      return NULL;
+    }
+
+  mux->leased = TRUE;
+
+  if (mux->client != NULL && mux->client->port == port && !mux->client->broken)
+    {
+      link = g_atomic_rc_box_acquire (mux->client);
+      link->active = TRUE;
+    }
+  else
+    stale = g_steal_pointer (&mux->client);
+  g_mutex_unlock (&mux->lock);
+
+  g_cancellable_disconnect (cancellable, cancelled_id);
+
+  /* Open a new connection, if necessary */
+  if (link == NULL)
+    {
+      g_autoptr (GSocketClient) client = NULL;
+      g_autoptr (GSocketConnection) connection = NULL;
+      g_autoptr (GIOStream) tls_stream = NULL;
+
+      client = g_object_new (G_TYPE_SOCKET_CLIENT,
+                             "enable-proxy", FALSE,
+                             NULL);
+      connection = g_socket_client_connect_to_host (client,
+                                                    mux->host,
+                                                    port,
+                                                    cancellable,
+                                                    error);
+
+      /* We're the client when downloading */
+      if (connection != NULL)
+        {
+          tls_stream = valent_lan_encrypt_client (connection,
+                                                  mux->certificate,
+                                                  mux->peer_certificate,
+                                                  cancellable,
+                                                  error);
+
+          if (tls_stream == NULL)
+            g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+        }
+
+      g_mutex_lock (&mux->lock);
+      if (tls_stream != NULL)
+        {
+          link = g_atomic_rc_box_new0 (MuxLink);
+          link->stream = g_steal_pointer (&tls_stream);
+          link->port = port;
+          link->client = TRUE;
+          link->active = TRUE;
+          mux->client = g_atomic_rc_box_acquire (link);
+        }
+      else
+        {
+          mux->leased = FALSE;
+          g_cond_broadcast (&mux->cond);
+        }
+      g_mutex_unlock (&mux->lock);
+
+      if (link == NULL)
+        return NULL;
+    }
+
+  /* Request the payload */
+  id_be = GINT64_TO_BE (id);
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (link->stream),
+                                  &id_be,
+                                  sizeof (gint64),
+                                  NULL,
+                                  cancellable,
+                                  error))
+    {
+      valent_lan_mux_release (mux, link, TRUE);
+      return NULL;
+    }
+
+  return mux_session_new (mux, link);
+}
+
+/**
+ * valent_lan_mux_get_stats:
+ * @mux: a #ValentLanMux
+ * @n_links: (out) (optional): the number of incoming connections authenticated
+ * @n_sessions: (out) (optional): the number of payloads requested by the peer
+ *
+ * Get the counters for uploads from @mux.
+ */
+void
+valent_lan_mux_get_stats (ValentLanMux *mux,
+                          unsigned int *n_links,
+                          unsigned int *n_sessions)
+{
+  g_return_if_fail (VALENT_IS_LAN_MUX (mux));
+
+  g_mutex_lock (&mux->lock);
+  if (n_links != NULL)
+    *n_links = mux->n_links;
+
+  if (n_sessions != NULL)
+    *n_sessions = mux->n_sessions;
+  g_mutex_unlock (&mux->lock);
+}
+
+/**
+ * valent_lan_mux_close:
+ * @mux: a #ValentLanMux
+ *
+ * Close @mux, stopping the listener and any idle connections. Open streams
+ * remain valid, and their connection is closed when they are.
+ */
+void
+valent_lan_mux_close (ValentLanMux *mux)
+{
+  g_autoptr (MuxLink) client = NULL;
+
+  g_return_if_fail (VALENT_IS_LAN_MUX (mux));
+
+  g_mutex_lock (&mux->lock);
+  mux->closed = TRUE;
+
+  if (!mux->leased)
+    client = g_steal_pointer (&mux->client);
+
+  g_cond_broadcast (&mux->cond);
+  g_mutex_unlock (&mux->lock);
+
+  g_cancellable_cancel (mux->cancellable);
+}
+
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#pragma once
+
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+
+#include "valent-lan-port-pool.h"
+
+G_BEGIN_DECLS
+
+#define VALENT_TYPE_LAN_MUX (valent_lan_mux_get_type())
+
+G_DECLARE_FINAL_TYPE (ValentLanMux, valent_lan_mux, VALENT, LAN_MUX, GObject)
+
+ValentLanMux * valent_lan_mux_new       (GTlsCertificate    *certificate,
+                                         GTlsCertificate    *peer_certificate,
+                                         const char         *host,
+                                         ValentLanPortPool  *port_pool);
+gboolean       valent_lan_mux_supported (JsonNode           *identity);
+gint64         valent_lan_mux_listen    (ValentLanMux       *mux,
+                                         JsonObject         *info,
+                                         GError            **error);
+GIOStream    * valent_lan_mux_accept    (ValentLanMux       *mux,
+                                         gint64              id,
+                                         GCancellable       *cancellable,
+                                         GError            **error);
+void           valent_lan_mux_fail      (ValentLanMux       *mux,
+                                         gint64              id,
+                                         const GError       *error);
+GIOStream    * valent_lan_mux_download  (ValentLanMux       *mux,
+                                         JsonObject         *info,
+                                         GCancellable       *cancellable,
+                                         GError            **error);
+void           valent_lan_mux_get_stats (ValentLanMux       *mux,
+                                         unsigned int       *n_links,
+                                         unsigned int       *n_sessions);
+void           valent_lan_mux_close     (ValentLanMux       *mux);
+
+G_END_DECLS
+
@@ -0,0 +1,486 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#define G_LOG_DOMAIN "valent-lan-port-pool"
+
+#include "config.h"
+
+#include <gio/gio.h>
+
+#include "valent-lan-port-pool.h"
+
+
+/*
+ * ValentLanPortPool:
+ *
+ * A pool of listening sockets for auxiliary connections, shared by the channels
+ * of a #ValentLanChannelService.
+ *
+ * Each port in the range is bound at most once while it is in use, so leasing a
+ * socket is usually a matter of taking one from the idle list, rather than
+ * probing the range with a failed bind() for every port already taken. When
+ * every port in the range is leased, an ephemeral port is used instead.
+ *
+ * An idle socket is still listening, so the kernel may queue connections for it
+ * while it waits in the pool. These can't belong to the next lease, so they are
+ * drained before the socket is leased again.
+ *
+ * Channels can outlive the service that owns the pool, so a closed pool still
+ * leases sockets, by probing the range like a channel without a pool. These are
+ * closed when they are released.
+ */
+#define PORT_POOL_SOCKETS "valent-lan-port-pool-sockets"
+
+/**
+ * PortEntry:
+ * @listener: a #GSocketListener
+ * @port: the port @listener is bound to
+ *
+ * An idle listening socket.
+ */
+typedef struct
+{
+  GSocketListener *listener;
+  guint16          port;
+} PortEntry;
+
+static void
+port_entry_free (gpointer data)
+{
+  PortEntry *entry = data;
+
+  g_socket_listener_close (entry->listener);
+  g_clear_object (&entry->listener);
+  g_free (entry);
+}
+
+struct _ValentLanPortPool
+{
+  GMutex   lock;
+  guint16  port_min;
+  guint16  port_max;
+  gboolean closed;
+
+  /* Ports in the range that have never been bound start at @cursor, while
+   * ports that were bound and then discarded are in @unbound. */
+  unsigned int cursor;
+  GQueue   unbound;
+  GQueue   idle;
+
+  /* Statistics */
+  unsigned int n_bound;
+  unsigned int n_reused;
+  unsigned int n_drained;
+};
+
+G_DEFINE_BOXED_TYPE (ValentLanPortPool, valent_lan_port_pool, valent_lan_port_pool_ref, valent_lan_port_pool_unref)
+
+
+static void
+valent_lan_port_pool_free (gpointer data)
+{
+  ValentLanPortPool *pool = data;
+
+  g_queue_clear_full (&pool->idle, port_entry_free);
+  g_queue_clear (&pool->unbound);
+  g_mutex_clear (&pool->lock);
+}
+
+static void
+on_listener_event (GSocketListener      *listener,
+                   GSocketListenerEvent  event,
+                   GSocket              *socket,
+                   GPtrArray            *sockets)
+{
+  if (event == G_SOCKET_LISTENER_LISTENED)
+    g_ptr_array_add (sockets, g_object_ref (socket));
+}
+
+/**
+ * valent_lan_port_pool_drain:
+ * @listener: a #GSocketListener
+ *
+ * Close any connections waiting in the backlog of @listener.
+ *
+ * Returns: the number of connections closed
+ */
+static unsigned int
+valent_lan_port_pool_drain (GSocketListener *listener)
+{
+  GPtrArray *sockets;
+  unsigned int n_drained = 0;
+
+  sockets = g_object_get_data (G_OBJECT (listener), PORT_POOL_SOCKETS);
+
+  if (sockets == NULL)
+    return 0;
+
+  for (unsigned int i = 0; i < sockets->len; i++)
+    {
+      GSocket *socket = g_ptr_array_index (sockets, i);
+      GSocket *stale;
+
+      g_socket_set_blocking (socket, FALSE);
+
+      while ((stale = g_socket_accept (socket, NULL, NULL)) != NULL)
+        {
+          g_socket_close (stale, NULL);
+          g_object_unref (stale);
+          n_drained++;
+        }
+
+      g_socket_set_blocking (socket, TRUE);
+    }
+
+  return n_drained;
+}
+
+/**
+ * valent_lan_port_pool_bind:
+ * @pool: a #ValentLanPortPool
+ * @port: (out): the bound port
+ *
+ * Bind a new listening socket to a port in the range of @pool, trying ports
+ * that were discarded first. Ports that fail to bind, because another process
+ * holds them, are not tried again.
+ *
+ * The sockets of the listener are kept, so they can be drained when it is
+ * leased again.
+ *
+ * The caller must hold the lock for @pool.
+ *
+ * Returns: (transfer full) (nullable): a #GSocketListener
+ */
+static GSocketListener *
+valent_lan_port_pool_bind (ValentLanPortPool *pool,
+                           guint16           *port)
+{
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GPtrArray) sockets = NULL;
+  unsigned long event_id;
+
+  listener = g_socket_listener_new ();
+  sockets = g_ptr_array_new_with_free_func (g_object_unref);
+  event_id = g_signal_connect (listener,
+                               "event",
+                               G_CALLBACK (on_listener_event),
+                               sockets);
+
+  while (!g_queue_is_empty (&pool->unbound) || pool->cursor <= pool->port_max)
+    {
+      if (!g_queue_is_empty (&pool->unbound))
+        *port = GPOINTER_TO_UINT (g_queue_pop_head (&pool->unbound));
+      else
+        *port = pool->cursor++;
+
+      if (g_socket_listener_add_inet_port (listener, *port, NULL, NULL))
+        {
+          g_clear_signal_handler (&event_id, listener);
+          g_object_set_data_full (G_OBJECT (listener),
+                                  PORT_POOL_SOCKETS,
+                                  g_steal_pointer (&sockets),
+                                  (GDestroyNotify)g_ptr_array_unref);
+          pool->n_bound++;
+
+          return g_steal_pointer (&listener);
+        }
+
+      g_ptr_array_set_size (sockets, 0);
+    }
+
+  g_clear_signal_handler (&event_id, listener);
+
+  return NULL;
+}
+
+/**
+ * valent_lan_port_pool_probe:
+ * @pool: a #ValentLanPortPool
+ * @port: (out): the bound port
+ * @error: (nullable): a #GError
+ *
+ * Bind a new listening socket to the first free port in the range of @pool,
+ * or an ephemeral port if every port in the range is taken. This does not
+ * touch the state of @pool, so the lock is not required.
+ *
+ * Returns: (transfer full) (nullable): a #GSocketListener
+ */
+static GSocketListener *
+valent_lan_port_pool_probe (ValentLanPortPool  *pool,
+                            guint16            *port,
+                            GError            **error)
+{
+  g_autoptr (GSocketListener) listener = NULL;
+
+  listener = g_socket_listener_new ();
+  *port = pool->port_min;
+
+  while (!g_socket_listener_add_inet_port (listener, *port, NULL, NULL))
+    {
+      if (*port == pool->port_max)
+        {
+          *port = g_socket_listener_add_any_inet_port (listener, NULL, error);
+          return *port != 0 ? g_steal_pointer (&listener) : NULL;
+        }
+
+      (*port)++;
+    }
+
+  return g_steal_pointer (&listener);
+}
+
+/**
+ * valent_lan_port_pool_new:
+ * @port_min: the first port in the range
+ * @port_max: the last port in the range
+ * @n_prebind: the number of sockets to bind in advance
+ *
+ * Create a new #ValentLanPortPool for the ports @port_min to @port_max,
+ * inclusive, with up to @n_prebind sockets ready to lease.
+ *
+ * Returns: (transfer full): a #ValentLanPortPool
+ */
+ValentLanPortPool *
+valent_lan_port_pool_new (guint16      port_min,
+                          guint16      port_max,
+                          unsigned int n_prebind)
+{
+  ValentLanPortPool *pool;
+
+  g_return_val_if_fail (port_min > 0 && port_min <= port_max, NULL);
+
+  pool = g_atomic_rc_box_new0 (ValentLanPortPool);
+  g_mutex_init (&pool->lock);
+  pool->port_min = port_min;
+  pool->port_max = port_max;
+  pool->cursor = port_min;
+  g_queue_init (&pool->unbound);
+  g_queue_init (&pool->idle);
+
+  for (unsigned int i = 0; i < n_prebind; i++)
+    {
+      GSocketListener *listener;
+      PortEntry *entry;
+      guint16 port;
+
+      if ((listener = valent_lan_port_pool_bind (pool, &port)) == NULL)
+        break;
+
+      entry = g_new0 (PortEntry, 1);
+      entry->listener = listener;
+      entry->port = port;
+      g_queue_push_tail (&pool->idle, entry);
+    }
+
+  return pool;
+}
+
+/**
+ * valent_lan_port_pool_lease:
+ * @pool: a #ValentLanPortPool
+ * @port: (out): the port the socket is bound to
+ * @error: (nullable): a #GError
+ *
+ * Lease a listening socket from @pool. The socket should be returned with
+ * valent_lan_port_pool_release() after accepting a connection.
+ *
+ * If @pool has been closed, a socket is bound by probing the range instead.
+ *
+ * Returns: (transfer full) (nullable): a #GSocketListener
+ */
+GSocketListener *
+valent_lan_port_pool_lease (ValentLanPortPool  *pool,
+                            guint16            *port,
+                            GError            **error)
+{
+  g_autoptr (GSocketListener) listener = NULL;
+  PortEntry *entry;
+
+  g_return_val_if_fail (VALENT_IS_LAN_PORT_POOL (pool), NULL);
+  g_return_val_if_fail (port != NULL, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  g_mutex_lock (&pool->lock);
+
+  if (pool->closed)
+    {
+      g_mutex_unlock (&pool->lock);
+      return valent_lan_port_pool_probe (pool, port, error);
+    }
+
+  if ((entry = g_queue_pop_head (&pool->idle)) != NULL)
+    {
+      unsigned int n_drained;
+
+      pool->n_reused++;
+      g_mutex_unlock (&pool->lock);
+
+      listener = g_steal_pointer (&entry->listener);
+      *port = entry->port;
+      g_free (entry);
+
+      /* Drop connections that arrived while the socket was idle */
+      if ((n_drained = valent_lan_port_pool_drain (listener)) > 0)
+        {
+          g_debug ("%s(): closed %u stale connection(s) on port %u",
+                   G_STRFUNC, n_drained, *port);
+
+          g_mutex_lock (&pool->lock);
+          pool->n_drained += n_drained;
+          g_mutex_unlock (&pool->lock);
+        }
+
+      return g_steal_pointer (&listener);
+    }
+
+  listener = valent_lan_port_pool_bind (pool, port);
+  g_mutex_unlock (&pool->lock);
+
+  /* Every port in the range is in use */
+  if (listener == NULL)
+    {
+      listener = g_socket_listener_new ();
+      *port = g_socket_listener_add_any_inet_port (listener, NULL, error);
+
+      if (*port == 0)
+        return NULL;
+    }
+
+  return g_steal_pointer (&listener);
+}
+
+/**
+ * valent_lan_port_pool_release:
+ * @pool: a #ValentLanPortPool
+ * @listener: (transfer full): a #GSocketListener
+ * @port: the port @listener is bound to
+ * @reuse: whether @listener can be leased again
+ *
+ * Return @listener to @pool, after a lease from valent_lan_port_pool_lease().
+ *
+ * If the connection was not accepted, @reuse should be %FALSE, so that a late
+ * connection meant for that lease can't be accepted by the next one.
+ */
+void
+valent_lan_port_pool_release (ValentLanPortPool *pool,
+                              GSocketListener   *listener,
+                              guint16            port,
+                              gboolean           reuse)
+{
+  g_autoptr (GSocketListener) stale = NULL;
+  gboolean in_range;
+
+  g_return_if_fail (VALENT_IS_LAN_PORT_POOL (pool));
+  g_return_if_fail (G_IS_SOCKET_LISTENER (listener));
+
+  in_range = (port >= pool->port_min && port <= pool->port_max);
+
+  g_mutex_lock (&pool->lock);
+
+  if (reuse && in_range && !pool->closed)
+    {
+      PortEntry *entry;
+
+      entry = g_new0 (PortEntry, 1);
+      entry->listener = listener;
+      entry->port = port;
+      g_queue_push_head (&pool->idle, entry);
+    }
+  else
+    {
+      stale = listener;
+
+      if (in_range && !pool->closed)
+        g_queue_push_tail (&pool->unbound, GUINT_TO_POINTER (port));
+    }
+
+  g_mutex_unlock (&pool->lock);
+
+  if (stale != NULL)
+    g_socket_listener_close (stale);
+}
+
+/**
+ * valent_lan_port_pool_close:
+ * @pool: a #ValentLanPortPool
+ *
+ * Close the idle sockets in @pool. Sockets that are leased, now or later, are
+ * closed when they are released, rather than kept for reuse.
+ */
+void
+valent_lan_port_pool_close (ValentLanPortPool *pool)
+{
+  GQueue idle = G_QUEUE_INIT;
+
+  g_return_if_fail (VALENT_IS_LAN_PORT_POOL (pool));
+
+  g_mutex_lock (&pool->lock);
+  pool->closed = TRUE;
+  idle = pool->idle;
+  g_queue_init (&pool->idle);
+  g_queue_clear (&pool->unbound);
+  g_mutex_unlock (&pool->lock);
+
+  g_queue_clear_full (&idle, port_entry_free);
+}
+
+/**
+ * valent_lan_port_pool_get_stats:
+ * @pool: a #ValentLanPortPool
+ * @n_bound: (out) (optional): the number of sockets bound in the range
+ * @n_reused: (out) (optional): the number of leases of an idle socket
+ * @n_drained: (out) (optional): the number of stale connections closed
+ *
+ * Get the counters for @pool. Leases of ephemeral ports are not counted.
+ */
+void
+valent_lan_port_pool_get_stats (ValentLanPortPool *pool,
+                                unsigned int      *n_bound,
+                                unsigned int      *n_reused,
+                                unsigned int      *n_drained)
+{
+  g_return_if_fail (VALENT_IS_LAN_PORT_POOL (pool));
+
+  g_mutex_lock (&pool->lock);
+  if (n_bound != NULL)
+    *n_bound = pool->n_bound;
+
+  if (n_reused != NULL)
+    *n_reused = pool->n_reused;
+
+  if (n_drained != NULL)
+    *n_drained = pool->n_drained;
+  g_mutex_unlock (&pool->lock);
+}
+
+/**
+ * valent_lan_port_pool_ref:
+ * @pool: a #ValentLanPortPool
+ *
+ * Increase the reference count of @pool.
+ *
+ * Returns: (transfer full): a #ValentLanPortPool
+ */
+ValentLanPortPool *
+valent_lan_port_pool_ref (ValentLanPortPool *pool)
+{
+  g_return_val_if_fail (VALENT_IS_LAN_PORT_POOL (pool), NULL);
+
+  return g_atomic_rc_box_acquire (pool);
+}
+
+/**
+ * valent_lan_port_pool_unref:
+ * @pool: a #ValentLanPortPool
+ *
+ * Decrease the reference count of @pool. When the reference count drops to 0,
+ * the idle sockets are closed and @pool is freed.
+ */
+void
+valent_lan_port_pool_unref (ValentLanPortPool *pool)
+{
+  g_return_if_fail (VALENT_IS_LAN_PORT_POOL (pool));
+
+  g_atomic_rc_box_release_full (pool, valent_lan_port_pool_free);
+}
+
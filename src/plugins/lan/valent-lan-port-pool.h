@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define VALENT_IS_LAN_PORT_POOL(ptr) (ptr != NULL)
+
+typedef struct      _ValentLanPortPool ValentLanPortPool;
+
+GType               valent_lan_port_pool_get_type (void) G_GNUC_CONST;
+
+
+#define VALENT_TYPE_LAN_PORT_POOL (valent_lan_port_pool_get_type())
+
+ValentLanPortPool * valent_lan_port_pool_new       (guint16             port_min,
+                                                    guint16             port_max,
+                                                    unsigned int        n_prebind);
+GSocketListener   * valent_lan_port_pool_lease     (ValentLanPortPool  *pool,
+                                                    guint16            *port,
+                                                    GError            **error);
+void                valent_lan_port_pool_release   (ValentLanPortPool  *pool,
+                                                    GSocketListener    *listener,
+                                                    guint16             port,
+                                                    gboolean            reuse);
+void                valent_lan_port_pool_close     (ValentLanPortPool  *pool);
+void                valent_lan_port_pool_get_stats (ValentLanPortPool  *pool,
+                                                    unsigned int       *n_bound,
+                                                    unsigned int       *n_reused,
+                                                    unsigned int       *n_drained);
+ValentLanPortPool * valent_lan_port_pool_ref       (ValentLanPortPool  *pool);
+void                valent_lan_port_pool_unref     (ValentLanPortPool  *pool);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValentLanPortPool, valent_lan_port_pool_unref)
+
+G_END_DECLS
+
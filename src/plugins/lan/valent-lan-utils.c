@@ -8,10 +8,14 @@
 #include <gio/gnetworking.h>
 #include <gio/gio.h>
 #include <json-glib/json-glib.h>
+#include <libvalent-core.h>
 #include <time.h>
 
 #include "valent-lan-utils.h"
 
+#define SESSION_FULL_HANDSHAKE "valent-lan-session-full-handshake"
+#define SESSION_OFFERED        "valent-lan-session-offered"
+
 
 /**
  * configure_socket:
@@ -92,6 +96,9 @@ certificate_from_device_id (const char       *device_id,
  * The KDE Connect protocol follows a trust-on-first-use approach to TLS, so we
  * use a dummy callback for #GTlsConnection::accept-certificate that always
  * returns %TRUE.
+ *
+ * The peer only presents a certificate during a full handshake, so the
+ * connection is also marked as such for the session cache.
  */
 static gboolean
 accept_certificate_cb (GTlsConnection       *connection,
@@ -99,6 +106,10 @@ accept_certificate_cb (GTlsConnection       *connection,
                        GTlsCertificateFlags  errors,
                        gpointer              user_data)
 {
+  g_object_set_data (G_OBJECT (connection),
+                     SESSION_FULL_HANDSHAKE,
+                     GINT_TO_POINTER (TRUE));
+
   return TRUE;
 }
 
@@ -122,33 +133,27 @@ accept_certificate (GTlsConnection  *connection,
 }
 
 /**
- * handshake_id:
- * @conn: a #GTlsConnection
+ * verify_device_id:
+ * @connection: a #GTlsConnection
  * @device_id: the device id
- * @cancellable: (nullable): a #GCancellable
  * @error: (nullable): a #GError
  *
- * Wrap g_tls_connection_handshake() to implement KDE Connect's authentication.
- *
  * Lookup the TLS certificate for @device_id and compare it with the peer
- * certificate. If the device certificate is not available, the device is
- * assumed to be unpaired and %TRUE will be returned to trust-on-first-use which
- * allows pairing to happen later over an encrypted connection.
+ * certificate of @connection, after a successful handshake. If the device
+ * certificate is not available, the device is assumed to be unpaired and %TRUE
+ * will be returned to trust-on-first-use which allows pairing to happen later
+ * over an encrypted connection.
  *
  * Returns: %TRUE if the certificate matches or it is an unpaired device.
  */
 static gboolean
-handshake_id (GTlsConnection  *connection,
-              const char      *device_id,
-              GCancellable    *cancellable,
-              GError         **error)
+verify_device_id (GTlsConnection  *connection,
+                  const char      *device_id,
+                  GError         **error)
 {
   g_autoptr (GTlsCertificate) trusted = NULL;
   GTlsCertificate *peer_cert;
 
-  if (!accept_certificate (connection, cancellable, error))
-    return FALSE;
-
   /* If the certificate existed but we failed to load it, we consider it an
    * authentication error.
    *
@@ -177,6 +182,31 @@ handshake_id (GTlsConnection  *connection,
   return TRUE;
 }
 
+/**
+ * handshake_id:
+ * @conn: a #GTlsConnection
+ * @device_id: the device id
+ * @cancellable: (nullable): a #GCancellable
+ * @error: (nullable): a #GError
+ *
+ * Wrap g_tls_connection_handshake() to implement KDE Connect's authentication.
+ *
+ * See verify_device_id().
+ *
+ * Returns: %TRUE if the certificate matches or it is an unpaired device.
+ */
+static gboolean
+handshake_id (GTlsConnection  *connection,
+              const char      *device_id,
+              GCancellable    *cancellable,
+              GError         **error)
+{
+  if (!accept_certificate (connection, cancellable, error))
+    return FALSE;
+
+  return verify_device_id (connection, device_id, error);
+}
+
 static gboolean
 handshake_certificate (GTlsConnection   *connection,
                        GTlsCertificate  *trusted,
@@ -203,6 +233,240 @@ handshake_certificate (GTlsConnection   *connection,
   return TRUE;
 }
 
+/*
+ * TLS Session Cache
+ *
+ * When Valent is the TLS client, a connection to a peer that was recently
+ * authenticated can resume the previous session instead of performing a full
+ * handshake. GIO doesn't expose session tickets directly, but a new client
+ * connection can take the session state of a previous one with
+ * g_tls_client_connection_copy_session_state().
+ *
+ * The source of that copy must be a connection that completed its handshake,
+ * and with TLS 1.3 the session ticket only arrives once it has read from the
+ * peer. The cache therefore holds the handshaked connection itself and only
+ * copies from it when the next connection is made, by which time it has been
+ * read from. A closed connection keeps its session state, but not its socket.
+ *
+ * Sessions are keyed on the device ID and the fingerprint of the certificate
+ * expected for it, so a session is never offered to a peer expected to present
+ * a different certificate. The peer certificate is still checked after every
+ * handshake, resumed or not.
+ *
+ * Only sessions with paired devices, whose certificate matched the one on
+ * file, are stored. At most %SESSION_CACHE_SIZE sessions are kept, and the
+ * oldest are pruned first.
+ *
+ * When Valent is the TLS server, resumption is handled by the TLS backend.
+ */
+#define SESSION_CACHE_LIFETIME (60 * 60 * G_USEC_PER_SEC)
+#define SESSION_CACHE_SIZE     32
+
+typedef struct
+{
+  GTlsConnection *source;
+  gint64          expires;
+} SessionEntry;
+
+static GMutex session_lock;
+static GHashTable *session_cache = NULL;
+static unsigned int session_hits = 0;
+static unsigned int session_misses = 0;
+
+static void
+session_entry_free (gpointer data)
+{
+  SessionEntry *entry = data;
+
+  g_clear_object (&entry->source);
+  g_free (entry);
+}
+
+static gboolean
+session_entry_expired (gpointer key,
+                       gpointer value,
+                       gpointer user_data)
+{
+  SessionEntry *entry = value;
+  gint64 *now = user_data;
+
+  return entry->expires <= *now;
+}
+
+/**
+ * session_cache_prune:
+ * @now: the current monotonic time
+ *
+ * Remove expired sessions, then the oldest sessions until there is room for
+ * one more. The caller must hold the session lock.
+ */
+static void
+session_cache_prune (gint64 now)
+{
+  g_hash_table_foreach_remove (session_cache, session_entry_expired, &now);
+
+  while (g_hash_table_size (session_cache) >= SESSION_CACHE_SIZE)
+    {
+      GHashTableIter iter;
+      gpointer key, value;
+      gpointer oldest = NULL;
+      gint64 oldest_expires = G_MAXINT64;
+
+      g_hash_table_iter_init (&iter, session_cache);
+
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          SessionEntry *entry = value;
+
+          if (entry->expires < oldest_expires)
+            {
+              oldest = key;
+              oldest_expires = entry->expires;
+            }
+        }
+
+      g_hash_table_remove (session_cache, oldest);
+    }
+}
+
+/**
+ * session_cache_restore:
+ * @connection: a #GTlsClientConnection
+ * @device_id: the expected device ID
+ * @certificate: (nullable): the expected peer certificate
+ *
+ * Offer the cached session for @device_id and @certificate to @connection, if
+ * one is available. This must be called before the handshake.
+ */
+static void
+session_cache_restore (GTlsConnection  *connection,
+                       const char      *device_id,
+                       GTlsCertificate *certificate)
+{
+  g_autoptr (GTlsConnection) source = NULL;
+  g_autofree char *key = NULL;
+  SessionEntry *entry = NULL;
+
+  if (device_id == NULL || certificate == NULL)
+    return;
+
+  key = g_strdup_printf ("%s/%s",
+                         device_id,
+                         valent_certificate_get_fingerprint (certificate));
+
+  g_mutex_lock (&session_lock);
+  if (session_cache != NULL)
+    entry = g_hash_table_lookup (session_cache, key);
+
+  if (entry != NULL && entry->expires > g_get_monotonic_time ())
+    source = g_object_ref (entry->source);
+  g_mutex_unlock (&session_lock);
+
+  if (source == NULL)
+    return;
+
+  g_tls_client_connection_copy_session_state (G_TLS_CLIENT_CONNECTION (connection),
+                                              G_TLS_CLIENT_CONNECTION (source));
+  g_object_set_data (G_OBJECT (connection),
+                     SESSION_OFFERED,
+                     GINT_TO_POINTER (TRUE));
+}
+
+/**
+ * session_cache_store:
+ * @connection: a #GTlsClientConnection
+ * @device_id: the device ID
+ *
+ * Store @connection as the session source for @device_id after a successful
+ * handshake, keyed on @device_id and the peer certificate, and count whether
+ * the handshake resumed a cached session.
+ *
+ * Nothing is stored unless @device_id is paired and the peer certificate is
+ * the one on file for it.
+ */
+static void
+session_cache_store (GTlsConnection *connection,
+                     const char     *device_id)
+{
+  g_autoptr (GTlsCertificate) trusted = NULL;
+  GTlsCertificate *peer_cert;
+  SessionEntry *entry;
+  gboolean resumed;
+  unsigned int hits, total;
+  char *key;
+  gint64 now;
+
+  if (device_id == NULL ||
+      (peer_cert = g_tls_connection_get_peer_certificate (connection)) == NULL)
+    return;
+
+  if (!certificate_from_device_id (device_id, &trusted, NULL) ||
+      trusted == NULL ||
+      !g_tls_certificate_is_same (trusted, peer_cert))
+    return;
+
+  /* A session was only resumed if one was offered and the peer didn't have to
+   * present its certificate */
+  resumed = g_object_get_data (G_OBJECT (connection), SESSION_OFFERED) &&
+            !g_object_get_data (G_OBJECT (connection), SESSION_FULL_HANDSHAKE);
+
+  key = g_strdup_printf ("%s/%s",
+                         device_id,
+                         valent_certificate_get_fingerprint (peer_cert));
+  now = g_get_monotonic_time ();
+
+  entry = g_new0 (SessionEntry, 1);
+  entry->source = g_object_ref (connection);
+  entry->expires = now + SESSION_CACHE_LIFETIME;
+
+  g_mutex_lock (&session_lock);
+  if (session_cache == NULL)
+    session_cache = g_hash_table_new_full (g_str_hash,
+                                           g_str_equal,
+                                           g_free,
+                                           session_entry_free);
+
+  g_hash_table_remove (session_cache, key);
+  session_cache_prune (now);
+  g_hash_table_replace (session_cache, key, entry);
+
+  if (resumed)
+    session_hits++;
+  else
+    session_misses++;
+
+  hits = session_hits;
+  total = session_hits + session_misses;
+  g_mutex_unlock (&session_lock);
+
+  g_debug ("TLS session cache: %u of %u handshakes resumed a session",
+           hits, total);
+}
+
+/**
+ * valent_lan_session_cache_get_stats:
+ * @hits: (out) (optional): the number of handshakes that resumed a session
+ * @misses: (out) (optional): the number of full handshakes
+ *
+ * Get the counters for the TLS session cache, used by client connections.
+ *
+ * Only handshakes with paired devices are counted. A miss means the peer
+ * presented its certificate, either because no session was cached or because
+ * the peer declined to resume it.
+ */
+void
+valent_lan_session_cache_get_stats (unsigned int *hits,
+                                    unsigned int *misses)
+{
+  g_mutex_lock (&session_lock);
+  if (hits != NULL)
+    *hits = session_hits;
+
+  if (misses != NULL)
+    *misses = session_misses;
+  g_mutex_unlock (&session_lock);
+}
+
 /**
  * valent_lan_encrypt_new_client:
  * @connection: a #GSocketConnection
@@ -227,6 +491,7 @@ valent_lan_encrypt_new_client (GSocketConnection  *connection,
 {
   g_autoptr (GSocketAddress) address = NULL;
   g_autoptr (GIOStream) tls_stream = NULL;
+  g_autoptr (GTlsCertificate) trusted = NULL;
 
   g_assert (G_IS_SOCKET_CONNECTION (connection));
   g_assert (G_IS_TLS_CERTIFICATE (certificate));
@@ -250,6 +515,10 @@ valent_lan_encrypt_new_client (GSocketConnection  *connection,
   if (tls_stream == NULL)
     return NULL;
 
+  /* Try to resume a session, if the device is paired */
+  if (certificate_from_device_id (device_id, &trusted, NULL))
+    session_cache_restore (G_TLS_CONNECTION (tls_stream), device_id, trusted);
+
   /* Authorize the TLS connection */
   g_tls_connection_set_certificate (G_TLS_CONNECTION (tls_stream), certificate);
 
@@ -259,6 +528,8 @@ valent_lan_encrypt_new_client (GSocketConnection  *connection,
       return NULL;
     }
 
+  session_cache_store (G_TLS_CONNECTION (tls_stream), device_id);
+
   return g_steal_pointer (&tls_stream);
 }
 
@@ -285,6 +556,7 @@ valent_lan_encrypt_client (GSocketConnection  *connection,
 {
   g_autoptr (GSocketAddress) address = NULL;
   g_autoptr (GIOStream) tls_stream = NULL;
+  const char *device_id;
 
   g_assert (G_IS_SOCKET_CONNECTION (connection));
   g_assert (G_IS_TLS_CERTIFICATE (certificate));
@@ -320,6 +592,11 @@ valent_lan_encrypt_client (GSocketConnection  *connection,
   if (tls_stream == NULL)
     return NULL;
 
+  /* Payload connections usually follow the channel's handshake closely, so
+   * they can almost always resume its session */
+  device_id = valent_certificate_get_common_name (peer_cert);
+  session_cache_restore (G_TLS_CONNECTION (tls_stream), device_id, peer_cert);
+
   /* Authorize the TLS connection */
   g_tls_connection_set_certificate (G_TLS_CONNECTION (tls_stream), certificate);
 
@@ -332,6 +609,8 @@ valent_lan_encrypt_client (GSocketConnection  *connection,
       return NULL;
     }
 
+  session_cache_store (G_TLS_CONNECTION (tls_stream), device_id);
+
   return g_steal_pointer (&tls_stream);
 }
 
@@ -447,3 +726,254 @@ valent_lan_encrypt_server (GSocketConnection  *connection,
   return g_steal_pointer (&tls_stream);
 }
 
+
+/*
+ * Asynchronous Handshakes
+ *
+ * These are the asynchronous counterparts of valent_lan_encrypt_new_client()
+ * and valent_lan_encrypt_new_server(), used when a connection is opened before
+ * the device is known, so that a slow peer doesn't hold a thread.
+ */
+typedef struct
+{
+  GIOStream     *tls_stream;
+  char          *device_id;
+  unsigned long  accept_id;
+  gboolean       client;
+} EncryptData;
+
+static void
+encrypt_data_free (gpointer data)
+{
+  EncryptData *encrypt = data;
+
+  g_clear_signal_handler (&encrypt->accept_id, encrypt->tls_stream);
+  g_clear_object (&encrypt->tls_stream);
+  g_clear_pointer (&encrypt->device_id, g_free);
+  g_free (encrypt);
+}
+
+static void
+encrypt_handshake_cb (GTlsConnection *connection,
+                      GAsyncResult   *result,
+                      gpointer        user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  EncryptData *data = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  g_clear_signal_handler (&data->accept_id, connection);
+
+  if (!g_tls_connection_handshake_finish (connection, result, &error) ||
+      !verify_device_id (connection, data->device_id, &error))
+    {
+      g_io_stream_close_async (G_IO_STREAM (connection),
+                               G_PRIORITY_DEFAULT,
+                               NULL, NULL, NULL);
+      return g_task_return_error (task, error);
+    }
+
+  if (data->client)
+    session_cache_store (connection, data->device_id);
+
+  g_task_return_pointer (task,
+                         g_steal_pointer (&data->tls_stream),
+                         g_object_unref);
+}
+
+static void
+encrypt_handshake_async (GTask     *task,
+                         GIOStream *tls_stream,
+                         gboolean   client)
+{
+  EncryptData *data = g_task_get_task_data (task);
+
+  data->tls_stream = g_object_ref (tls_stream);
+  data->client = client;
+  data->accept_id = g_signal_connect (G_OBJECT (tls_stream),
+                                      "accept-certificate",
+                                      G_CALLBACK (accept_certificate_cb),
+                                      NULL);
+
+  g_tls_connection_handshake_async (G_TLS_CONNECTION (tls_stream),
+                                    G_PRIORITY_DEFAULT,
+                                    g_task_get_cancellable (task),
+                                    (GAsyncReadyCallback)encrypt_handshake_cb,
+                                    g_object_ref (task));
+}
+
+static GTask *
+encrypt_task_new (GSocketConnection   *connection,
+                  const char          *device_id,
+                  GCancellable        *cancellable,
+                  GAsyncReadyCallback  callback,
+                  gpointer             user_data,
+                  gpointer             source_tag)
+{
+  GTask *task;
+  EncryptData *data;
+
+  data = g_new0 (EncryptData, 1);
+  data->device_id = g_strdup (device_id);
+
+  task = g_task_new (connection, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+  g_task_set_task_data (task, data, encrypt_data_free);
+
+  return task;
+}
+
+/**
+ * valent_lan_encrypt_new_client_async:
+ * @connection: a #GSocketConnection
+ * @certificate: a #GTlsCertificate
+ * @device_id: the id for the device this connection claims to be from
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback
+ * @user_data: (closure): user supplied data
+ *
+ * Asynchronous version of valent_lan_encrypt_new_client().
+ *
+ * Call valent_lan_encrypt_new_client_finish() to get the result.
+ */
+void
+valent_lan_encrypt_new_client_async (GSocketConnection   *connection,
+                                     GTlsCertificate     *certificate,
+                                     const char          *device_id,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  g_autoptr (GSocketAddress) address = NULL;
+  g_autoptr (GIOStream) tls_stream = NULL;
+  g_autoptr (GTlsCertificate) trusted = NULL;
+  GError *error = NULL;
+
+  g_assert (G_IS_SOCKET_CONNECTION (connection));
+  g_assert (G_IS_TLS_CERTIFICATE (certificate));
+  g_assert (device_id != NULL);
+  g_assert (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  task = encrypt_task_new (connection, device_id, cancellable, callback,
+                           user_data, valent_lan_encrypt_new_client_async);
+
+  /* Set socket options */
+  configure_socket (connection);
+
+  /* Client encryption is used for incoming connections */
+  address = g_socket_connection_get_remote_address (connection, &error);
+
+  if (address == NULL)
+    return g_task_return_error (task, error);
+
+  tls_stream = g_tls_client_connection_new (G_IO_STREAM (connection),
+                                            G_SOCKET_CONNECTABLE (address),
+                                            &error);
+
+  if (tls_stream == NULL)
+    return g_task_return_error (task, error);
+
+  /* Try to resume a session, if the device is paired */
+  if (certificate_from_device_id (device_id, &trusted, NULL))
+    session_cache_restore (G_TLS_CONNECTION (tls_stream), device_id, trusted);
+
+  /* Authorize the TLS connection */
+  g_tls_connection_set_certificate (G_TLS_CONNECTION (tls_stream), certificate);
+  encrypt_handshake_async (task, tls_stream, TRUE);
+}
+
+/**
+ * valent_lan_encrypt_new_client_finish:
+ * @connection: a #GSocketConnection
+ * @result: a #GAsyncResult
+ * @error: (nullable): a #GError
+ *
+ * Finish an operation started by valent_lan_encrypt_new_client_async().
+ *
+ * Returns: (transfer full): a TLS encrypted #GIOStream
+ */
+GIOStream *
+valent_lan_encrypt_new_client_finish (GSocketConnection  *connection,
+                                      GAsyncResult       *result,
+                                      GError            **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, connection), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * valent_lan_encrypt_new_server_async:
+ * @connection: a #GSocketConnection
+ * @certificate: a #GTlsCertificate
+ * @device_id: the id for the device this connection claims to be from
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback
+ * @user_data: (closure): user supplied data
+ *
+ * Asynchronous version of valent_lan_encrypt_new_server().
+ *
+ * Call valent_lan_encrypt_new_server_finish() to get the result.
+ */
+void
+valent_lan_encrypt_new_server_async (GSocketConnection   *connection,
+                                     GTlsCertificate     *certificate,
+                                     const char          *device_id,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  g_autoptr (GIOStream) tls_stream = NULL;
+  GError *error = NULL;
+
+  g_assert (G_IS_SOCKET_CONNECTION (connection));
+  g_assert (G_IS_TLS_CERTIFICATE (certificate));
+  g_assert (device_id != NULL);
+  g_assert (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  task = encrypt_task_new (connection, device_id, cancellable, callback,
+                           user_data, valent_lan_encrypt_new_server_async);
+
+  /* Set socket options */
+  configure_socket (connection);
+
+  /* Server encryption is used for responses to identity broadcasts */
+  tls_stream = g_tls_server_connection_new (G_IO_STREAM (connection),
+                                            certificate,
+                                            &error);
+
+  if (tls_stream == NULL)
+    return g_task_return_error (task, error);
+
+  g_object_set (G_TLS_SERVER_CONNECTION (tls_stream),
+                "authentication-mode", G_TLS_AUTHENTICATION_REQUIRED,
+                NULL);
+
+  /* Authorize the TLS connection */
+  encrypt_handshake_async (task, tls_stream, FALSE);
+}
+
+/**
+ * valent_lan_encrypt_new_server_finish:
+ * @connection: a #GSocketConnection
+ * @result: a #GAsyncResult
+ * @error: (nullable): a #GError
+ *
+ * Finish an operation started by valent_lan_encrypt_new_server_async().
+ *
+ * Returns: (transfer full): a TLS encrypted #GIOStream
+ */
+GIOStream *
+valent_lan_encrypt_new_server_finish (GSocketConnection  *connection,
+                                      GAsyncResult       *result,
+                                      GError            **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, connection), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
@@ -7,26 +7,51 @@
 
 G_BEGIN_DECLS
 
-GIOStream * valent_lan_encrypt_new_client      (GSocketConnection  *connection,
-                                                GTlsCertificate    *certificate,
-                                                const char         *device_id,
-                                                GCancellable       *cancellable,
-                                                GError            **error);
-GIOStream * valent_lan_encrypt_client          (GSocketConnection  *connection,
-                                                GTlsCertificate    *certificate,
-                                                GTlsCertificate    *peer_cert,
-                                                GCancellable       *cancellable,
-                                                GError            **error);
-GIOStream * valent_lan_encrypt_new_server      (GSocketConnection  *connection,
-                                                GTlsCertificate    *certificate,
-                                                const char         *device_id,
-                                                GCancellable       *cancellable,
-                                                GError            **error);
-GIOStream * valent_lan_encrypt_server          (GSocketConnection  *connection,
-                                                GTlsCertificate    *certificate,
-                                                GTlsCertificate    *peer_cert,
-                                                GCancellable       *cancellable,
-                                                GError            **error);
+/* The port range for auxiliary connections, such as payload transfers */
+#define VALENT_LAN_AUX_MIN 1739
+#define VALENT_LAN_AUX_MAX 1764
+
+GIOStream * valent_lan_encrypt_new_client        (GSocketConnection   *connection,
+                                                  GTlsCertificate     *certificate,
+                                                  const char          *device_id,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error);
+void        valent_lan_encrypt_new_client_async  (GSocketConnection   *connection,
+                                                  GTlsCertificate     *certificate,
+                                                  const char          *device_id,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data);
+GIOStream * valent_lan_encrypt_new_client_finish (GSocketConnection   *connection,
+                                                  GAsyncResult        *result,
+                                                  GError             **error);
+GIOStream * valent_lan_encrypt_client            (GSocketConnection   *connection,
+                                                  GTlsCertificate     *certificate,
+                                                  GTlsCertificate     *peer_cert,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error);
+GIOStream * valent_lan_encrypt_new_server        (GSocketConnection   *connection,
+                                                  GTlsCertificate     *certificate,
+                                                  const char          *device_id,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error);
+void        valent_lan_encrypt_new_server_async  (GSocketConnection   *connection,
+                                                  GTlsCertificate     *certificate,
+                                                  const char          *device_id,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data);
+GIOStream * valent_lan_encrypt_new_server_finish (GSocketConnection   *connection,
+                                                  GAsyncResult        *result,
+                                                  GError             **error);
+GIOStream * valent_lan_encrypt_server            (GSocketConnection   *connection,
+                                                  GTlsCertificate     *certificate,
+                                                  GTlsCertificate     *peer_cert,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error);
+
+void        valent_lan_session_cache_get_stats   (unsigned int        *hits,
+                                                  unsigned int        *misses);
 
 G_END_DECLS
 
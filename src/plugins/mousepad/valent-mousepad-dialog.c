@@ -165,7 +165,7 @@ on_key_pressed (GtkEventControllerKey *controller,
   json_builder_add_boolean_value (builder, TRUE);
 
   packet = valent_packet_finish (builder);
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 
   return TRUE;
 }
@@ -398,7 +398,7 @@ valent_mousepad_dialog_pointer_axis (ValentMousepadDialog *self,
   json_builder_add_boolean_value (builder, TRUE);
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 static void
@@ -446,7 +446,7 @@ valent_mousepad_dialog_pointer_button (ValentMousepadDialog *self,
     }
 
   if (packet != NULL)
-    valent_device_queue_packet (self->device, packet);
+    valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 static void
@@ -464,7 +464,7 @@ valent_mousepad_dialog_pointer_motion (ValentMousepadDialog *self,
   json_builder_add_double_value (builder, dy);
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 static void
@@ -478,7 +478,7 @@ valent_mousepad_dialog_pointer_press (ValentMousepadDialog *self)
   json_builder_add_boolean_value (builder, TRUE);
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 static void
@@ -492,7 +492,7 @@ valent_mousepad_dialog_pointer_release (ValentMousepadDialog *self)
   json_builder_add_boolean_value (builder, TRUE);
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 static void
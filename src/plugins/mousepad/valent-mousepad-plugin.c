@@ -301,7 +301,7 @@ valent_mousepad_plugin_mousepad_request_keyboard (ValentMousepadPlugin *self,
 
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 static void
@@ -330,7 +330,7 @@ valent_mousepad_plugin_mousepad_request_pointer (ValentMousepadPlugin *self,
 
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 static void
@@ -363,7 +363,7 @@ valent_mousepad_plugin_send_echo (ValentMousepadPlugin *self,
 
   response = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, response);
+  valent_device_queue_packet_full (self->device, response, G_PRIORITY_HIGH);
 }
 
 static void
@@ -379,7 +379,7 @@ valent_mousepad_plugin_mousepad_keyboardstate (ValentMousepadPlugin *self)
   json_builder_add_boolean_value (builder, TRUE);
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 /*
@@ -124,6 +124,7 @@ valent_mpris_plugin_send_album_art (ValentMprisPlugin *self,
 
   /* Start the transfer */
   transfer = valent_transfer_new (self->device);
+  valent_transfer_set_priority (transfer, G_PRIORITY_LOW);
   valent_transfer_set_id (transfer, requested_uri);
   valent_transfer_add_file (transfer, packet, real_file);
 
@@ -402,9 +403,19 @@ valent_mpris_plugin_send_player_info (ValentMprisPlugin *self,
       json_builder_add_double_value (builder, level);
     }
 
-  /* Send Response */
+  /* Send Response; a complete update supersedes any unsent update */
   response = valent_packet_finish (builder);
-  valent_device_queue_packet (self->device, response);
+
+  if (now_playing && volume && name != NULL)
+    {
+      g_autofree char *key = NULL;
+
+      /* Prefixed, so it can't collide with the player list */
+      key = g_strdup_printf ("player:%s", name);
+      valent_device_queue_packet_replace (self->device, response, key);
+    }
+  else
+    valent_device_queue_packet (self->device, response);
 }
 
 static void
@@ -442,7 +453,7 @@ valent_mpris_plugin_send_player_list (ValentMprisPlugin *self)
   json_builder_add_boolean_value (builder, TRUE);
 
   packet = valent_packet_finish (builder);
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_replace (self->device, packet, "playerList");
 }
 
 static void
@@ -661,6 +672,7 @@ valent_mpris_plugin_receive_album_art (ValentMprisPlugin *self,
   op->file = g_object_ref (file);
 
   transfer = valent_transfer_new (self->device);
+  valent_transfer_set_priority (transfer, G_PRIORITY_LOW);
   valent_transfer_add_file (transfer, packet, file);
   valent_transfer_execute (transfer,
                            NULL,
@@ -435,6 +435,65 @@ download_icon_task (GTask        *task,
     }
 }
 
+static void
+cache_icon_bytes_cb (GFile        *file,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+
+  if (!g_file_replace_contents_finish (file, result, NULL, &error))
+    g_debug ("Caching icon: %s", error->message);
+}
+
+/**
+ * download_icon_bytes_cb:
+ *
+ * Return the icon received into memory, and write it to the notification cache
+ * in the background if it has a `payloadHash`, so the next notification with
+ * the same icon doesn't download it again.
+ */
+static void
+download_icon_bytes_cb (ValentTransfer *transfer,
+                        GAsyncResult   *result,
+                        gpointer        user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  ValentNotificationPlugin *self = g_task_get_source_object (task);
+  JsonNode *packet = g_task_get_task_data (task);
+  JsonObject *body = valent_packet_get_body (packet);
+  g_autoptr (GBytes) bytes = NULL;
+  GError *error = NULL;
+
+  if (!valent_transfer_execute_finish (transfer, result, &error))
+    return g_task_return_error (task, error);
+
+  bytes = valent_transfer_get_bytes (transfer, packet);
+
+  if (valent_packet_check_string (body, "payloadHash") != NULL)
+    {
+      g_autoptr (GFile) file = NULL;
+      g_autoptr (GFile) cache_dir = NULL;
+
+      file = valent_notification_plugin_get_icon_file (self, packet);
+      cache_dir = g_file_get_parent (file);
+
+      if (g_mkdir_with_parents (g_file_peek_path (cache_dir), 0700) == 0)
+        g_file_replace_contents_bytes_async (file,
+                                             bytes,
+                                             NULL,
+                                             FALSE,
+                                             G_FILE_CREATE_REPLACE_DESTINATION,
+                                             NULL,
+                                             (GAsyncReadyCallback)cache_icon_bytes_cb,
+                                             NULL);
+      else
+        g_debug ("Caching icon: %s", g_strerror (errno));
+    }
+
+  g_task_return_pointer (task, g_bytes_icon_new (bytes), g_object_unref);
+}
+
 static void
 valent_notification_plugin_download_icon (ValentNotificationPlugin *self,
                                           JsonNode                 *packet,
@@ -451,6 +510,33 @@ valent_notification_plugin_download_icon (ValentNotificationPlugin *self,
   g_task_set_task_data (task,
                         json_node_ref (packet),
                         (GDestroyNotify)json_node_unref);
+
+  /* If we're in a flatpak the icon is sent as a GBytesIcon, so unless it's
+   * already cached it can be received straight into memory and cached after */
+  if (valent_in_flatpak ())
+    {
+      JsonObject *body = valent_packet_get_body (packet);
+      const char *payload_hash;
+      g_autoptr (GFile) file = NULL;
+
+      if ((payload_hash = valent_packet_check_string (body, "payloadHash")) != NULL)
+        file = valent_notification_plugin_get_icon_file (self, packet);
+
+      if (file == NULL || !g_file_query_exists (file, NULL))
+        {
+          g_autoptr (ValentTransfer) transfer = NULL;
+
+          transfer = valent_transfer_new (self->device);
+          valent_transfer_set_priority (transfer, G_PRIORITY_LOW);
+          valent_transfer_add_bytes (transfer, packet, NULL);
+          valent_transfer_execute (transfer,
+                                   cancellable,
+                                   (GAsyncReadyCallback)download_icon_bytes_cb,
+                                   g_steal_pointer (&task));
+          return;
+        }
+    }
+
   g_task_run_in_thread (task, download_icon_task);
 }
 
@@ -760,6 +846,7 @@ valent_notification_plugin_send_notification_with_icon (ValentNotificationPlugin
   g_assert (icon == NULL || G_IS_ICON (icon));
 
   transfer = valent_transfer_new (self->device);
+  valent_transfer_set_priority (transfer, G_PRIORITY_LOW);
 
   /* Try to ensure icons are sent in PNG format, since kdeconnect-android can't
    * handle SVGs which are very common */
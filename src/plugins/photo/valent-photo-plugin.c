@@ -111,6 +111,7 @@ valent_photo_plugin_handle_photo (ValentPhotoPlugin *self,
 
   /* Create a new transfer */
   transfer = valent_transfer_new (self->device);
+  valent_transfer_set_priority (transfer, G_PRIORITY_HIGH);
   valent_transfer_add_file (transfer, packet, op->file);
   valent_transfer_execute (transfer,
                            NULL,
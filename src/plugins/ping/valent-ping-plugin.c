@@ -72,7 +72,7 @@ valent_ping_plugin_send_ping (ValentPingPlugin *self,
 
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_full (self->device, packet, G_PRIORITY_HIGH);
 }
 
 /*
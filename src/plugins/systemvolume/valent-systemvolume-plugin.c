@@ -101,6 +101,7 @@ on_stream_changed (ValentMixer              *mixer,
   unsigned int volume;
   JsonBuilder *builder;
   g_autoptr (JsonNode) packet = NULL;
+  g_autofree char *key = NULL;
 
   g_assert (VALENT_IS_MIXER (mixer));
   g_assert (VALENT_IS_MIXER_STREAM (stream));
@@ -137,7 +138,10 @@ on_stream_changed (ValentMixer              *mixer,
   json_builder_add_int_value (builder, state->volume);
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  /* Only the latest update for a sink is relevant; the key is prefixed so it
+   * can't collide with the sink list */
+  key = g_strdup_printf ("sink:%s", state->name);
+  valent_device_queue_packet_replace (self->device, packet, key);
 }
 
 static void
@@ -216,7 +220,7 @@ valent_systemvolume_plugin_send_sinklist (ValentSystemvolumePlugin *self)
   json_builder_end_array (builder);
   packet = valent_packet_finish (builder);
 
-  valent_device_queue_packet (self->device, packet);
+  valent_device_queue_packet_replace (self->device, packet, "sinkList");
 }
 
 /*
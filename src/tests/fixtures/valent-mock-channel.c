@@ -127,8 +127,12 @@ valent_mock_channel_upload (ValentChannel  *channel,
         return NULL;
     }
 
-  /* Payload Info */
-  info = json_object_new();
+  /* Payload Info, keeping any fields set by the caller */
+  if (valent_packet_has_payload (packet))
+    info = json_object_ref (valent_packet_get_payload_info (packet));
+  else
+    info = json_object_new ();
+
   json_object_set_int_member (info, "port", (gint64)port);
   valent_packet_set_payload_info (packet, info);
 
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#include <libvalent-core.h>
+
+#include "valent-channel-private.h"
+
+#define BUFFER_SIZE  (512 * 1024)
+#define REFILL_SIZE  (4096)
+#define N_ITERATIONS (100)
+
+
+/*
+ * The byte-by-byte scan used before valent_channel_buffer_find_lf(), which
+ * restarts from the beginning of the line after every refill.
+ */
+static inline gsize
+find_lf_bytewise (const guint8 *buffer,
+                  gsize         start,
+                  gsize         end)
+{
+  for (gsize cursor = start; cursor < end; cursor++)
+    {
+      if G_UNLIKELY (buffer[cursor] == '\n')
+        return cursor;
+    }
+
+  return end;
+}
+
+static guint8 *
+create_line (gsize size)
+{
+  guint8 *buffer;
+
+  buffer = g_malloc (size);
+
+  for (gsize i = 0; i < size - 1; i++)
+    buffer[i] = 'a' + (i % 26);
+
+  buffer[size - 1] = '\n';
+
+  return buffer;
+}
+
+static void
+test_channel_buffer_find_lf (void)
+{
+  g_autofree guint8 *buffer = NULL;
+  gsize size = 256;
+
+  buffer = create_line (size);
+
+  /* Check every alignment of start and LF position against the reference */
+  for (gsize lf = 0; lf < size; lf++)
+    {
+      memset (buffer, 'a', size);
+      buffer[lf] = '\n';
+
+      for (gsize start = 0; start < size; start++)
+        {
+          for (gsize end = start; end <= size; end += 7)
+            {
+              g_assert_cmpuint (valent_channel_buffer_find_lf (buffer, start, end),
+                                ==,
+                                find_lf_bytewise (buffer, start, end));
+            }
+        }
+    }
+
+  /* No LF */
+  memset (buffer, 'a', size);
+  g_assert_cmpuint (valent_channel_buffer_find_lf (buffer, 0, size), ==, size);
+  g_assert_cmpuint (valent_channel_buffer_find_lf (buffer, size, size), ==, size);
+}
+
+typedef gsize (*FindLfFunc) (const guint8 *buffer,
+                             gsize         start,
+                             gsize         end);
+
+/*
+ * Time N_ITERATIONS passes over a line that arrives in REFILL_SIZE chunks,
+ * scanning with @find_lf after each refill. If @resume is %TRUE, each scan
+ * starts where the last one stopped, otherwise it starts from 0.
+ */
+static double
+benchmark_scan (const guint8 *buffer,
+                FindLfFunc    find_lf,
+                gboolean      resume,
+                gsize        *result)
+{
+  g_autoptr (GTimer) timer = NULL;
+
+  timer = g_timer_new ();
+
+  for (unsigned int n = 0; n < N_ITERATIONS; n++)
+    {
+      gsize scan = 0;
+
+      for (gsize end = REFILL_SIZE; end <= BUFFER_SIZE; end += REFILL_SIZE)
+        {
+          scan = find_lf (buffer, resume ? scan : 0, end);
+          *result += scan;
+        }
+    }
+
+  return g_timer_elapsed (timer, NULL);
+}
+
+static void
+test_channel_buffer_benchmark (void)
+{
+  g_autofree guint8 *buffer = NULL;
+  double baseline, resume_time, vector_time, combined_time;
+  gsize result = 0;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Run with `-m perf` to benchmark");
+      return;
+    }
+
+  buffer = create_line (BUFFER_SIZE);
+
+  /* The byte loop rescanning from 0 after each refill is the baseline for each
+   * change, measured alone and then together. */
+  baseline = benchmark_scan (buffer, find_lf_bytewise, FALSE, &result);
+  resume_time = benchmark_scan (buffer, find_lf_bytewise, TRUE, &result);
+  vector_time = benchmark_scan (buffer, valent_channel_buffer_find_lf, FALSE, &result);
+  combined_time = benchmark_scan (buffer, valent_channel_buffer_find_lf, TRUE, &result);
+
+  g_assert_cmpuint (result, >, 0);
+  g_test_message ("baseline: %.3fs", baseline);
+  g_test_message ("resume only: %.3fs (%.1fx)",
+                  resume_time, baseline / resume_time);
+  g_test_message ("vectorized only: %.3fs (%.1fx)",
+                  vector_time, baseline / vector_time);
+  g_test_message ("resume and vectorized: %.3fs (%.1fx)",
+                  combined_time, baseline / combined_time);
+  g_test_minimized_result (vector_time, "%u x %u KiB line, vectorized: %.3fs",
+                           N_ITERATIONS, BUFFER_SIZE / 1024, vector_time);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/core/channel-buffer/find-lf",
+                   test_channel_buffer_find_lf);
+
+  g_test_add_func ("/core/channel-buffer/benchmark",
+                   test_channel_buffer_benchmark);
+
+  return g_test_run ();
+}
+
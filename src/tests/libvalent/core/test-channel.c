@@ -0,0 +1,1005 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#include <gio/gio.h>
+#include <libvalent-core.h>
+#include <libvalent-test.h>
+
+#include "valent-channel-private.h"
+
+
+typedef struct
+{
+  GMainLoop     *loop;
+  ValentChannel *channel;
+  ValentChannel *endpoint;
+  JsonNode      *identity;
+  JsonNode      *packets;
+} ChannelFixture;
+
+static inline JsonNode *
+get_packet (ChannelFixture *fixture,
+            const char     *name)
+{
+  return json_object_get_member (json_node_get_object (fixture->packets), name);
+}
+
+static void
+on_socket (GSocketListener *listener,
+           GAsyncResult    *result,
+           ChannelFixture  *fixture)
+{
+  g_autoptr (GSocketConnection) base_stream = NULL;
+
+  base_stream = g_socket_listener_accept_finish (listener, result, NULL, NULL);
+
+  fixture->endpoint = g_object_new (VALENT_TYPE_CHANNEL,
+                                    "base-stream",   base_stream,
+                                    "identity",      fixture->identity,
+                                    "peer-identity", fixture->identity,
+                                    NULL);
+}
+
+static void
+channel_fixture_set_up (ChannelFixture *fixture,
+                        gconstpointer   user_data)
+{
+  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GSocketClient) client = NULL;
+  g_autoptr (GSocketAddress) addr = NULL;
+  g_autoptr (GSocketConnection) conn = NULL;
+  const char *compression = user_data;
+  guint port = 2716;
+
+  fixture->loop = g_main_loop_new (NULL, FALSE);
+
+  /* Load the fixture packets */
+  parser = json_parser_new ();
+  json_parser_load_from_file (parser, TEST_DATA_DIR"/core.json", NULL);
+  fixture->packets = json_parser_steal_root (parser);
+
+  /* Both channels advertise compression, if the test uses it */
+  fixture->identity = json_node_copy (get_packet (fixture, "identity"));
+
+  if (compression != NULL)
+    {
+      JsonArray *methods = json_array_new ();
+
+      json_array_add_string_element (methods, compression);
+      json_object_set_array_member (valent_packet_get_body (fixture->identity),
+                                    "valentCompression",
+                                    methods);
+    }
+
+  /* Connect a pair of channels */
+  listener = g_socket_listener_new ();
+
+  while (!g_socket_listener_add_inet_port (listener, port, NULL, NULL))
+    port++;
+
+  g_socket_listener_accept_async (listener,
+                                  NULL,
+                                  (GAsyncReadyCallback)on_socket,
+                                  fixture);
+
+  client = g_object_new (G_TYPE_SOCKET_CLIENT,
+                         "enable-proxy", FALSE,
+                         NULL);
+  addr = g_inet_socket_address_new_from_string ("127.0.0.1", port);
+  conn = g_socket_client_connect (client,
+                                  G_SOCKET_CONNECTABLE (addr),
+                                  NULL,
+                                  NULL);
+
+  fixture->channel = g_object_new (VALENT_TYPE_CHANNEL,
+                                   "base-stream",   conn,
+                                   "identity",      fixture->identity,
+                                   "peer-identity", fixture->identity,
+                                   NULL);
+
+  while (fixture->endpoint == NULL)
+    g_main_context_iteration (NULL, FALSE);
+}
+
+static void
+channel_fixture_tear_down (ChannelFixture *fixture,
+                           gconstpointer   user_data)
+{
+  g_clear_object (&fixture->endpoint);
+  v_assert_finalize_object (fixture->channel);
+
+  g_clear_pointer (&fixture->identity, json_node_unref);
+  g_clear_pointer (&fixture->packets, json_node_unref);
+  g_clear_pointer (&fixture->loop, g_main_loop_unref);
+}
+
+static void
+read_packet_cb (ValentChannel  *channel,
+                GAsyncResult   *result,
+                JsonNode      **packet_out)
+{
+  g_autoptr (GError) error = NULL;
+
+  *packet_out = valent_channel_read_packet_finish (channel, result, &error);
+  g_assert_no_error (error);
+}
+
+static JsonNode *
+echo_packet (ChannelFixture *fixture,
+             JsonNode       *packet)
+{
+  JsonNode *received = NULL;
+
+  valent_channel_write_packet (fixture->endpoint, packet, NULL, NULL, NULL);
+  valent_channel_read_packet (fixture->channel,
+                              NULL,
+                              (GAsyncReadyCallback)read_packet_cb,
+                              &received);
+
+  while (received == NULL)
+    g_main_context_iteration (NULL, FALSE);
+
+  return received;
+}
+
+static JsonNode *
+create_data_packet (const char *data)
+{
+  JsonBuilder *builder;
+
+  builder = valent_packet_start ("kdeconnect.mock.echo");
+  json_builder_set_member_name (builder, "data");
+  json_builder_add_string_value (builder, data);
+
+  return valent_packet_finish (builder);
+}
+
+static void
+test_channel_write_compressed (ChannelFixture *fixture,
+                               gconstpointer   user_data)
+{
+  g_autoptr (JsonNode) packet = NULL;
+  g_autoptr (JsonNode) received = NULL;
+  g_autoptr (GString) line = NULL;
+  g_autofree char *data = NULL;
+  GInputStream *input;
+  char c = '\0';
+
+  data = g_strnfill (64 * 1024, 'a');
+  packet = create_data_packet (data);
+
+  /* Large packets are sent as a single compressed line */
+  valent_channel_write_packet (fixture->endpoint, packet, NULL, NULL, NULL);
+
+  input = g_io_stream_get_input_stream (valent_channel_get_base_stream (fixture->channel));
+  line = g_string_new (NULL);
+
+  while (c != '\n')
+    {
+      g_assert_cmpint (g_input_stream_read (input, &c, 1, NULL, NULL), ==, 1);
+      g_string_append_c (line, c);
+    }
+
+  g_assert_cmpint (line->str[0], ==, '~');
+  g_assert_cmpuint (line->len, <, strlen (data));
+
+  /* ...and decompressed by the peer */
+  received = echo_packet (fixture, packet);
+  v_assert_packet_type (received, "kdeconnect.mock.echo");
+  g_assert_cmpstr (json_object_get_string_member (valent_packet_get_body (received), "data"),
+                   ==,
+                   data);
+
+  /* Small packets are sent as-is */
+  g_clear_pointer (&received, json_node_unref);
+  received = echo_packet (fixture, get_packet (fixture, "test-echo"));
+  v_assert_packet_type (received, "kdeconnect.mock.echo");
+}
+
+static void
+test_channel_compressed_large (ChannelFixture *fixture,
+                               gconstpointer   user_data)
+{
+  g_autoptr (GString) data = NULL;
+
+  /* A packet that grows the compression buffers well past their limit, with
+   * enough entropy that it doesn't compress to a trivial size */
+  data = g_string_sized_new (4 * 1024 * 1024);
+
+  while (data->len < 4 * 1024 * 1024)
+    g_string_append_printf (data, "%08x", g_random_int ());
+
+  /* Packets before and after the buffers are released arrive intact */
+  for (unsigned int i = 0; i < 3; i++)
+    {
+      g_autoptr (JsonNode) large = NULL;
+      g_autoptr (JsonNode) small = NULL;
+      g_autoptr (JsonNode) received = NULL;
+      g_autofree char *small_data = NULL;
+
+      large = create_data_packet (data->str);
+      received = echo_packet (fixture, large);
+      g_assert_cmpstr (json_object_get_string_member (valent_packet_get_body (received), "data"),
+                       ==,
+                       data->str);
+      g_clear_pointer (&received, json_node_unref);
+
+      small_data = g_strnfill (8 * 1024, 'b');
+      small = create_data_packet (small_data);
+      received = echo_packet (fixture, small);
+      g_assert_cmpstr (json_object_get_string_member (valent_packet_get_body (received), "data"),
+                       ==,
+                       small_data);
+    }
+}
+
+static void
+on_closed (ValentChannel *channel,
+           gboolean      *closed)
+{
+  *closed = TRUE;
+}
+
+static void
+test_channel_closed (ChannelFixture *fixture,
+                     gconstpointer   user_data)
+{
+  gboolean closed = FALSE;
+
+  g_signal_connect (fixture->channel,
+                    "closed",
+                    G_CALLBACK (on_closed),
+                    &closed);
+
+  g_assert_true (valent_channel_close (fixture->channel, NULL, NULL));
+  g_assert_true (closed);
+
+  /* Closing a closed channel doesn't emit the signal again */
+  closed = FALSE;
+  g_assert_true (valent_channel_close (fixture->channel, NULL, NULL));
+  g_assert_false (closed);
+}
+
+static void
+read_packets_cb (ValentChannel  *channel,
+                 GAsyncResult   *result,
+                 ChannelFixture *fixture)
+{
+  g_autoptr (GPtrArray) packets = NULL;
+  g_autoptr (GError) error = NULL;
+  unsigned int *n_packets;
+
+  packets = valent_channel_read_packets_finish (channel, result, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (packets->len, >, 0);
+  g_assert_cmpuint (packets->len, <=, 2);
+
+  for (unsigned int i = 0; i < packets->len; i++)
+    v_assert_packet_type (g_ptr_array_index (packets, i), "kdeconnect.mock.echo");
+
+  n_packets = g_object_get_data (G_OBJECT (channel), "n-packets");
+  *n_packets -= packets->len;
+
+  if (*n_packets == 0)
+    g_main_loop_quit (fixture->loop);
+  else
+    valent_channel_read_packets (channel,
+                                 2,
+                                 NULL,
+                                 (GAsyncReadyCallback)read_packets_cb,
+                                 fixture);
+}
+
+static void
+test_channel_read_packets (ChannelFixture *fixture,
+                           gconstpointer   user_data)
+{
+  JsonNode *packet = get_packet (fixture, "test-echo");
+  unsigned int n_packets = 5;
+
+  for (unsigned int i = 0; i < n_packets; i++)
+    valent_channel_write_packet (fixture->endpoint, packet, NULL, NULL, NULL);
+
+  g_object_set_data (G_OBJECT (fixture->channel), "n-packets", &n_packets);
+  valent_channel_read_packets (fixture->channel,
+                               2,
+                               NULL,
+                               (GAsyncReadyCallback)read_packets_cb,
+                               fixture);
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (n_packets, ==, 0);
+  g_object_set_data (G_OBJECT (fixture->channel), "n-packets", NULL);
+}
+
+static void
+write_packets_cb (ValentChannel  *channel,
+                  GAsyncResult   *result,
+                  ChannelFixture *fixture)
+{
+  g_autoptr (GError) error = NULL;
+  unsigned int *n_packets;
+
+  valent_channel_write_packet_finish (channel, result, &error);
+  g_assert_no_error (error);
+
+  n_packets = g_object_get_data (G_OBJECT (channel), "n-packets");
+  *n_packets -= 1;
+
+  if (*n_packets == 0)
+    g_main_loop_quit (fixture->loop);
+}
+
+static void
+write_closed_cb (ValentChannel  *channel,
+                 GAsyncResult   *result,
+                 ChannelFixture *fixture)
+{
+  g_autoptr (GError) error = NULL;
+
+  g_assert_false (valent_channel_write_packet_finish (channel, result, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED);
+
+  g_main_loop_quit (fixture->loop);
+}
+
+static void
+test_channel_write_packets (ChannelFixture *fixture,
+                            gconstpointer   user_data)
+{
+  JsonNode *packet = get_packet (fixture, "test-echo");
+  unsigned int n_written = 5;
+  unsigned int n_read = 5;
+
+  /* A burst of packets is written and completed in order */
+  g_object_set_data (G_OBJECT (fixture->endpoint), "n-packets", &n_written);
+
+  for (unsigned int i = 0; i < 5; i++)
+    {
+      valent_channel_write_packet (fixture->endpoint,
+                                   packet,
+                                   NULL,
+                                   (GAsyncReadyCallback)write_packets_cb,
+                                   fixture);
+    }
+
+  g_main_loop_run (fixture->loop);
+  g_assert_cmpuint (n_written, ==, 0);
+  g_object_set_data (G_OBJECT (fixture->endpoint), "n-packets", NULL);
+
+  g_object_set_data (G_OBJECT (fixture->channel), "n-packets", &n_read);
+  valent_channel_read_packets (fixture->channel,
+                               2,
+                               NULL,
+                               (GAsyncReadyCallback)read_packets_cb,
+                               fixture);
+  g_main_loop_run (fixture->loop);
+  g_assert_cmpuint (n_read, ==, 0);
+  g_object_set_data (G_OBJECT (fixture->channel), "n-packets", NULL);
+
+  /* Packets written after the channel is closed fail */
+  g_assert_true (valent_channel_close (fixture->endpoint, NULL, NULL));
+  valent_channel_write_packet (fixture->endpoint,
+                               packet,
+                               NULL,
+                               (GAsyncReadyCallback)write_closed_cb,
+                               fixture);
+  g_main_loop_run (fixture->loop);
+}
+
+typedef struct
+{
+  GMainLoop    *loop;
+  unsigned int  n_pending;
+  unsigned int  n_written;
+  unsigned int  n_cancelled;
+} CancelState;
+
+static void
+write_cancelled_cb (ValentChannel *channel,
+                    GAsyncResult  *result,
+                    CancelState   *state)
+{
+  g_autoptr (GError) error = NULL;
+
+  if (valent_channel_write_packet_finish (channel, result, &error))
+    state->n_written++;
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    state->n_cancelled++;
+  else
+    g_assert_no_error (error);
+
+  if (--state->n_pending == 0)
+    g_main_loop_quit (state->loop);
+}
+
+static gboolean
+cancel_timeout_cb (gpointer data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (data));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_channel_write_cancelled (ChannelFixture *fixture,
+                              gconstpointer   user_data)
+{
+  g_autoptr (GCancellable) cancellable = NULL;
+  g_autoptr (JsonNode) bulk = NULL;
+  g_autofree char *data = NULL;
+  JsonBuilder *builder;
+  unsigned int n_bulk = 256;
+  CancelState state = {
+    .loop = fixture->loop,
+    .n_pending = n_bulk,
+  };
+
+  /* Queue more than the socket can buffer (~4MiB), without reading */
+  data = g_strnfill (16 * 1024, 'a');
+  builder = valent_packet_start ("kdeconnect.mock.bulk");
+  json_builder_set_member_name (builder, "data");
+  json_builder_add_string_value (builder, data);
+  bulk = valent_packet_finish (builder);
+
+  cancellable = g_cancellable_new ();
+
+  for (unsigned int i = 0; i < n_bulk; i++)
+    {
+      valent_channel_write_packet (fixture->endpoint,
+                                   bulk,
+                                   cancellable,
+                                   (GAsyncReadyCallback)write_cancelled_cb,
+                                   &state);
+    }
+
+  /* Cancelling the packets interrupts the blocked write */
+  g_timeout_add (100, cancel_timeout_cb, cancellable);
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (state.n_written + state.n_cancelled, ==, n_bulk);
+  g_assert_cmpuint (state.n_cancelled, >, 0);
+}
+
+static void
+test_channel_write_cancelled_partial (ChannelFixture *fixture,
+                                      gconstpointer   user_data)
+{
+  g_autoptr (GCancellable) cancellable = NULL;
+  g_autoptr (JsonNode) blocker = NULL;
+  g_autofree char *data = NULL;
+  JsonBuilder *builder;
+  CancelState state = {
+    .loop = fixture->loop,
+    .n_pending = 1,
+  };
+
+  /* A packet larger than the socket can buffer, without reading */
+  data = g_strnfill (32 * 1024 * 1024, 'a');
+  builder = valent_packet_start ("kdeconnect.mock.blocker");
+  json_builder_set_member_name (builder, "data");
+  json_builder_add_string_value (builder, data);
+  blocker = valent_packet_finish (builder);
+
+  cancellable = g_cancellable_new ();
+  valent_channel_write_packet (fixture->endpoint,
+                               blocker,
+                               cancellable,
+                               (GAsyncReadyCallback)write_cancelled_cb,
+                               &state);
+
+  /* Cancelling the packet interrupts the write after part of the line */
+  g_timeout_add (100, cancel_timeout_cb, cancellable);
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (state.n_cancelled, ==, 1);
+
+  /* The framing is broken, so the channel no longer accepts packets */
+  valent_channel_write_packet (fixture->endpoint,
+                               get_packet (fixture, "test-echo"),
+                               NULL,
+                               (GAsyncReadyCallback)write_closed_cb,
+                               fixture);
+  g_main_loop_run (fixture->loop);
+}
+
+static void
+write_timeout_cb (ValentChannel  *channel,
+                  GAsyncResult   *result,
+                  ChannelFixture *fixture)
+{
+  g_autoptr (GError) error = NULL;
+
+  g_assert_false (valent_channel_write_packet_finish (channel, result, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+
+  g_main_loop_quit (fixture->loop);
+}
+
+static void
+test_channel_write_timeout (ChannelFixture *fixture,
+                            gconstpointer   user_data)
+{
+  g_autoptr (JsonNode) blocker = NULL;
+  g_autofree char *data = NULL;
+  JsonBuilder *builder;
+
+  if (!g_test_slow ())
+    {
+      g_test_skip ("Run with `-m slow` to test write timeouts");
+      return;
+    }
+
+  /* A peer that stops reading can't hold a writer indefinitely */
+  data = g_strnfill (32 * 1024 * 1024, 'a');
+  builder = valent_packet_start ("kdeconnect.mock.blocker");
+  json_builder_set_member_name (builder, "data");
+  json_builder_add_string_value (builder, data);
+  blocker = valent_packet_finish (builder);
+
+  valent_channel_write_packet (fixture->endpoint,
+                               blocker,
+                               NULL,
+                               (GAsyncReadyCallback)write_timeout_cb,
+                               fixture);
+  g_main_loop_run (fixture->loop);
+
+  /* The channel no longer accepts packets */
+  valent_channel_write_packet (fixture->endpoint,
+                               get_packet (fixture, "test-echo"),
+                               NULL,
+                               (GAsyncReadyCallback)write_closed_cb,
+                               fixture);
+  g_main_loop_run (fixture->loop);
+}
+
+typedef struct
+{
+  GMainLoop    *loop;
+  unsigned int  n_packets;
+  unsigned int  n_read;
+  unsigned int  echo_index;
+  unsigned int  bulk_index;
+} PriorityState;
+
+static void
+read_priority_cb (ValentChannel *channel,
+                  GAsyncResult  *result,
+                  PriorityState *state)
+{
+  g_autoptr (GPtrArray) packets = NULL;
+  g_autoptr (GError) error = NULL;
+
+  packets = valent_channel_read_packets_finish (channel, result, &error);
+  g_assert_no_error (error);
+
+  for (unsigned int i = 0; i < packets->len; i++)
+    {
+      JsonNode *packet = g_ptr_array_index (packets, i);
+      const char *type = valent_packet_get_type (packet);
+
+      state->n_read++;
+
+      if (g_strcmp0 (type, "kdeconnect.mock.echo") == 0)
+        state->echo_index = state->n_read;
+      else if (g_strcmp0 (type, "kdeconnect.mock.bulk") == 0 &&
+               state->bulk_index == 0)
+        state->bulk_index = state->n_read;
+    }
+
+  if (state->n_read == state->n_packets)
+    g_main_loop_quit (state->loop);
+  else
+    valent_channel_read_packets (channel,
+                                 16,
+                                 NULL,
+                                 (GAsyncReadyCallback)read_priority_cb,
+                                 state);
+}
+
+static void
+test_channel_write_priority (ChannelFixture *fixture,
+                             gconstpointer   user_data)
+{
+  JsonNode *echo = get_packet (fixture, "test-echo");
+  g_autoptr (JsonNode) blocker = NULL;
+  g_autoptr (JsonNode) bulk = NULL;
+  g_autofree char *data = NULL;
+  JsonBuilder *builder;
+  unsigned int n_bulk = 64;
+  PriorityState state = {
+    .loop = fixture->loop,
+    .n_packets = 1 + n_bulk + 1,
+  };
+
+  /* Block the writer with a packet larger than the socket can buffer, so the
+   * packets queued after it are all waiting when the next batch is taken */
+  data = g_strnfill (32 * 1024 * 1024, 'a');
+  builder = valent_packet_start ("kdeconnect.mock.blocker");
+  json_builder_set_member_name (builder, "data");
+  json_builder_add_string_value (builder, data);
+  blocker = valent_packet_finish (builder);
+  g_clear_pointer (&data, g_free);
+
+  valent_channel_write_packet_full (fixture->endpoint,
+                                    blocker,
+                                    G_PRIORITY_HIGH,
+                                    NULL,
+                                    NULL,
+                                    NULL);
+
+  /* Queue a backlog of bulk packets, then one interactive packet */
+  data = g_strnfill (16 * 1024, 'a');
+  builder = valent_packet_start ("kdeconnect.mock.bulk");
+  json_builder_set_member_name (builder, "data");
+  json_builder_add_string_value (builder, data);
+  bulk = valent_packet_finish (builder);
+
+  for (unsigned int i = 0; i < n_bulk; i++)
+    {
+      valent_channel_write_packet_full (fixture->endpoint,
+                                        bulk,
+                                        G_PRIORITY_LOW,
+                                        NULL,
+                                        NULL,
+                                        NULL);
+    }
+
+  valent_channel_write_packet_full (fixture->endpoint,
+                                    echo,
+                                    G_PRIORITY_HIGH,
+                                    NULL,
+                                    NULL,
+                                    NULL);
+
+  valent_channel_read_packets (fixture->channel,
+                               16,
+                               NULL,
+                               (GAsyncReadyCallback)read_priority_cb,
+                               &state);
+  g_main_loop_run (fixture->loop);
+
+  /* The interactive packet is written next, ahead of the whole backlog */
+  g_assert_cmpuint (state.n_read, ==, state.n_packets);
+  g_assert_cmpuint (state.echo_index, ==, 2);
+  g_assert_cmpuint (state.bulk_index, ==, 3);
+}
+
+typedef struct
+{
+  GMainLoop    *loop;
+  unsigned int  n_pending;
+  unsigned int  n_written;
+  unsigned int  n_blocked;
+  unsigned int  n_replaced;
+  unsigned int  n_notify;
+  gint64        last_written;
+} QueueState;
+
+static void
+write_queue_cb (ValentChannel *channel,
+                GAsyncResult  *result,
+                QueueState    *state)
+{
+  g_autoptr (GError) error = NULL;
+
+  if (valent_channel_write_packet_finish (channel, result, &error))
+    state->n_written++;
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+    state->n_blocked++;
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    state->n_replaced++;
+  else
+    g_assert_no_error (error);
+
+  if (--state->n_pending == 0)
+    g_main_loop_quit (state->loop);
+}
+
+static void
+on_queue_length (ValentChannel *channel,
+                 GParamSpec    *pspec,
+                 QueueState    *state)
+{
+  /* Notifications are emitted in the main context, not a writer thread */
+  g_assert_true (g_main_context_is_owner (g_main_context_default ()));
+  state->n_notify++;
+}
+
+static void
+read_queue_cb (ValentChannel *channel,
+               GAsyncResult  *result,
+               QueueState    *state)
+{
+  g_autoptr (GPtrArray) packets = NULL;
+  g_autoptr (GError) error = NULL;
+
+  packets = valent_channel_read_packets_finish (channel, result, &error);
+  g_assert_no_error (error);
+
+  for (unsigned int i = 0; i < packets->len; i++)
+    {
+      JsonObject *body = valent_packet_get_body (g_ptr_array_index (packets, i));
+
+      state->last_written = json_object_get_int_member (body, "value");
+      state->n_pending--;
+    }
+
+  if (state->n_pending == 0)
+    g_main_loop_quit (state->loop);
+  else
+    valent_channel_read_packets (channel,
+                                 16,
+                                 NULL,
+                                 (GAsyncReadyCallback)read_queue_cb,
+                                 state);
+}
+
+static void
+test_channel_write_queue (ChannelFixture *fixture,
+                          gconstpointer   user_data)
+{
+  QueueState state = { .loop = fixture->loop, };
+  unsigned int n_packets = 100;
+  unsigned int limit = 0;
+
+  g_signal_connect (fixture->endpoint,
+                    "notify::queue-length",
+                    G_CALLBACK (on_queue_length),
+                    &state);
+
+  /* Packets written while the queue is full fail */
+  g_object_set (fixture->endpoint, "queue-limit", 1, NULL);
+  g_object_get (fixture->endpoint, "queue-limit", &limit, NULL);
+  g_assert_cmpuint (limit, ==, 1);
+
+  state.n_pending = n_packets;
+
+  for (unsigned int i = 0; i < n_packets; i++)
+    {
+      g_autoptr (JsonNode) packet = NULL;
+      JsonBuilder *builder;
+
+      builder = valent_packet_start ("kdeconnect.mock.echo");
+      json_builder_set_member_name (builder, "value");
+      json_builder_add_int_value (builder, i);
+      packet = valent_packet_finish (builder);
+
+      valent_channel_write_packet (fixture->endpoint,
+                                   packet,
+                                   NULL,
+                                   (GAsyncReadyCallback)write_queue_cb,
+                                   &state);
+    }
+
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (state.n_written + state.n_blocked, ==, n_packets);
+  g_assert_cmpuint (state.n_written, >, 0);
+  g_assert_cmpuint (state.n_replaced, ==, 0);
+  g_assert_cmpuint (state.n_notify, >, 0);
+  g_assert_cmpuint (valent_channel_get_queue_length (fixture->endpoint), ==, 0);
+
+  state.n_pending = state.n_written;
+  valent_channel_read_packets (fixture->channel,
+                               16,
+                               NULL,
+                               (GAsyncReadyCallback)read_queue_cb,
+                               &state);
+  g_main_loop_run (fixture->loop);
+
+  /* Unsent packets with the same key are replaced by newer packets */
+  valent_channel_set_queue_limit (fixture->endpoint, 1024);
+  memset (&state, 0, sizeof (QueueState));
+  state.loop = fixture->loop;
+  state.n_pending = n_packets;
+
+  for (unsigned int i = 0; i < n_packets; i++)
+    {
+      g_autoptr (JsonNode) packet = NULL;
+      JsonBuilder *builder;
+
+      builder = valent_packet_start ("kdeconnect.mock.echo");
+      json_builder_set_member_name (builder, "value");
+      json_builder_add_int_value (builder, i);
+      packet = valent_packet_finish (builder);
+
+      valent_channel_write_packet_replace (fixture->endpoint,
+                                           packet,
+                                           "mock-key",
+                                           NULL,
+                                           (GAsyncReadyCallback)write_queue_cb,
+                                           &state);
+    }
+
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (state.n_written + state.n_replaced, ==, n_packets);
+  g_assert_cmpuint (state.n_written, >, 0);
+  g_assert_cmpuint (state.n_blocked, ==, 0);
+
+  /* The latest packet is always written */
+  state.n_pending = state.n_written;
+  valent_channel_read_packets (fixture->channel,
+                               16,
+                               NULL,
+                               (GAsyncReadyCallback)read_queue_cb,
+                               &state);
+  g_main_loop_run (fixture->loop);
+  g_assert_cmpint (state.last_written, ==, n_packets - 1);
+
+  g_signal_handlers_disconnect_by_data (fixture->endpoint, &state);
+}
+
+typedef struct
+{
+  GMainLoop    *loop;
+  GArray       *values;
+  unsigned int  n_packets;
+} ReplaceState;
+
+static void
+read_replace_cb (ValentChannel *channel,
+                 GAsyncResult  *result,
+                 ReplaceState  *state)
+{
+  g_autoptr (GPtrArray) packets = NULL;
+  g_autoptr (GError) error = NULL;
+
+  packets = valent_channel_read_packets_finish (channel, result, &error);
+  g_assert_no_error (error);
+
+  for (unsigned int i = 0; i < packets->len; i++)
+    {
+      JsonObject *body = valent_packet_get_body (g_ptr_array_index (packets, i));
+      gint64 value = json_object_get_int_member_with_default (body, "value", -1);
+
+      g_array_append_val (state->values, value);
+    }
+
+  if (state->values->len == state->n_packets)
+    g_main_loop_quit (state->loop);
+  else
+    valent_channel_read_packets (channel,
+                                 16,
+                                 NULL,
+                                 (GAsyncReadyCallback)read_replace_cb,
+                                 state);
+}
+
+static void
+test_channel_write_replace (ChannelFixture *fixture,
+                            gconstpointer   user_data)
+{
+  g_autoptr (JsonNode) blocker = NULL;
+  g_autofree char *data = NULL;
+  JsonBuilder *builder;
+  ReplaceState state = {
+    .loop = fixture->loop,
+    .n_packets = 3,
+  };
+  gint64 expected[] = { -1, 2, 1 };
+
+  /* Hold the writer, so the packets below are all queued together */
+  data = g_strnfill (32 * 1024 * 1024, 'a');
+  builder = valent_packet_start ("kdeconnect.mock.blocker");
+  json_builder_set_member_name (builder, "data");
+  json_builder_add_string_value (builder, data);
+  blocker = valent_packet_finish (builder);
+
+  valent_channel_write_packet_full (fixture->endpoint,
+                                    blocker,
+                                    G_PRIORITY_HIGH,
+                                    NULL,
+                                    NULL,
+                                    NULL);
+
+  /* A packet that replaces another keeps its position in the queue */
+  for (unsigned int i = 0; i < 3; i++)
+    {
+      g_autoptr (JsonNode) packet = NULL;
+
+      builder = valent_packet_start ("kdeconnect.mock.echo");
+      json_builder_set_member_name (builder, "value");
+      json_builder_add_int_value (builder, i);
+      packet = valent_packet_finish (builder);
+
+      if (i == 1)
+        valent_channel_write_packet (fixture->endpoint, packet, NULL, NULL, NULL);
+      else
+        valent_channel_write_packet_replace (fixture->endpoint,
+                                             packet,
+                                             "mock-key",
+                                             NULL,
+                                             NULL,
+                                             NULL);
+    }
+
+  state.values = g_array_new (FALSE, FALSE, sizeof (gint64));
+  valent_channel_read_packets (fixture->channel,
+                               16,
+                               NULL,
+                               (GAsyncReadyCallback)read_replace_cb,
+                               &state);
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpmem (state.values->data, state.values->len * sizeof (gint64),
+                   expected, sizeof (expected));
+  g_clear_pointer (&state.values, g_array_unref);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add ("/core/channel/write-compressed",
+              ChannelFixture, "deflate",
+              channel_fixture_set_up,
+              test_channel_write_compressed,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/compressed-large",
+              ChannelFixture, "deflate",
+              channel_fixture_set_up,
+              test_channel_compressed_large,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/closed",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_closed,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/read-packets",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_read_packets,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/write-packets",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_write_packets,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/write-cancelled",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_write_cancelled,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/write-cancelled-partial",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_write_cancelled_partial,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/write-timeout",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_write_timeout,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/write-priority",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_write_priority,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/write-queue",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_write_queue,
+              channel_fixture_tear_down);
+
+  g_test_add ("/core/channel/write-replace",
+              ChannelFixture, NULL,
+              channel_fixture_set_up,
+              test_channel_write_replace,
+              channel_fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -392,6 +392,7 @@ test_handle_packet (DeviceFixture *fixture,
                     gconstpointer  user_data)
 {
   JsonNode *packet = get_packet (fixture, "test-echo");
+  g_autoptr (JsonNode) malformed = NULL;
 
   valent_device_set_channel (fixture->device, fixture->channel);
   g_assert_true (valent_device_get_connected (fixture->device));
@@ -417,6 +418,15 @@ test_handle_packet (DeviceFixture *fixture,
                               (GAsyncReadyCallback)handle_unavailable_cb,
                               fixture);
   g_main_loop_run (fixture->loop);
+
+  /* Malformed packets are logged and dropped */
+  malformed = json_from_string ("{\"id\":0,\"type\":\"kdeconnect.mock.echo\"}", NULL);
+
+  g_test_expect_message ("valent-device",
+                         G_LOG_LEVEL_WARNING,
+                         "*malformed*");
+  valent_device_handle_packet (fixture->device, malformed);
+  g_test_assert_expected_messages ();
 }
 
 static void
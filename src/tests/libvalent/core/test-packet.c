@@ -3,6 +3,8 @@
 
 #include <libvalent-core.h>
 
+#include "valent-packet-private.h"
+
 
 static void
 test_packet_builder (void)
@@ -48,6 +50,54 @@ test_packet_serializing (void)
   g_free (packet_str);
 }
 
+static void
+test_packet_serialize_to_buffer (void)
+{
+  g_autoptr (GByteArray) buffer = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (GError) error = NULL;
+  JsonNode *packet;
+  JsonNode *result;
+  JsonNode *member;
+  const char *packet_str;
+
+  packet_str = "{\"id\":1234,\"type\":\"kdeconnect.mock\",\"body\":{"
+               "\"string\":\"quote \\\" slash \\\\ tab \\t nl \\n \\u0001 é\","
+               "\"int\":-42,\"double\":1.5,\"integral\":1.0,\"exponent\":1e+100,"
+               "\"bool\":true,\"null\":null,"
+               "\"array\":[1,\"two\",{\"three\":[]}],\"object\":{}}}";
+
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, packet_str, -1, &error);
+  g_assert_no_error (error);
+  packet = json_parser_get_root (parser);
+
+  /* Members are written in order, without whitespace */
+  buffer = g_byte_array_new ();
+  valent_packet_serialize_to_buffer (packet, buffer);
+  g_assert_cmpuint (buffer->len, ==, strlen (packet_str) + 1);
+  g_assert_cmpmem (buffer->data, buffer->len - 1, packet_str, strlen (packet_str));
+  g_assert_cmpint (buffer->data[buffer->len - 1], ==, '\n');
+
+  /* Packets are appended to the buffer */
+  valent_packet_serialize_to_buffer (packet, buffer);
+  g_assert_cmpuint (buffer->len, ==, (strlen (packet_str) + 1) * 2);
+
+  /* The output round-trips */
+  json_parser_load_from_data (parser,
+                              (const char *)buffer->data,
+                              strlen (packet_str),
+                              &error);
+  g_assert_no_error (error);
+  result = json_parser_get_root (parser);
+  g_assert_true (valent_packet_is_valid (result));
+  g_assert_cmpint (valent_packet_get_id (result), ==, 1234);
+
+  /* Integral doubles are still parsed as doubles */
+  member = json_object_get_member (valent_packet_get_body (result), "integral");
+  g_assert_cmpuint (json_node_get_value_type (member), ==, G_TYPE_DOUBLE);
+}
+
 static void
 test_packet_streaming (void)
 {
@@ -108,6 +158,109 @@ test_packet_payloads (void)
   g_assert_cmpint (valent_packet_get_payload_size (packet), ==, 84);
 }
 
+static void
+test_packet_view (void)
+{
+  g_autoptr (JsonParser) parser = NULL;
+  ValentPacketView view;
+  const char *packet_str;
+  GError *error = NULL;
+
+  parser = json_parser_new ();
+
+  /* Packet with payload */
+  packet_str = "{\"id\":1234,\"type\":\"kdeconnect.mock\",\"body\":{},"
+               "\"payloadSize\":42,\"payloadTransferInfo\":{\"port\":1739}}";
+  json_parser_load_from_data (parser, packet_str, -1, NULL);
+
+  g_assert_true (valent_packet_view_init (&view, json_parser_get_root (parser), &error));
+  g_assert_no_error (error);
+  g_assert_true (view.packet == json_parser_get_root (parser));
+  g_assert_cmpstr (view.type, ==, "kdeconnect.mock");
+
+  /* Stringified `id` field, without payload */
+  packet_str = "{\"id\":\"1234\",\"type\":\"kdeconnect.identity\",\"body\":{}}";
+  json_parser_load_from_data (parser, packet_str, -1, NULL);
+
+  g_assert_true (valent_packet_view_init (&view, json_parser_get_root (parser), &error));
+  g_assert_no_error (error);
+  g_assert_cmpstr (view.type, ==, "kdeconnect.identity");
+
+  /* Invalid packets */
+  packet_str = "{\"id\":0,\"type\":\"kdeconnect.mock\"}";
+  json_parser_load_from_data (parser, packet_str, -1, NULL);
+
+  g_assert_false (valent_packet_view_init (&view, json_parser_get_root (parser), &error));
+  g_assert_error (error, VALENT_PACKET_ERROR, VALENT_PACKET_ERROR_MALFORMED);
+  g_clear_error (&error);
+
+  packet_str = "{\"id\":[],\"type\":\"kdeconnect.mock\",\"body\":{}}";
+  json_parser_load_from_data (parser, packet_str, -1, NULL);
+
+  g_assert_false (valent_packet_view_init (&view, json_parser_get_root (parser), &error));
+  g_assert_error (error, VALENT_PACKET_ERROR, VALENT_PACKET_ERROR_MALFORMED);
+  g_clear_error (&error);
+
+  packet_str = "{\"id\":0,\"type\":42,\"body\":{}}";
+  json_parser_load_from_data (parser, packet_str, -1, NULL);
+
+  g_assert_false (valent_packet_view_init (&view, json_parser_get_root (parser), &error));
+  g_assert_error (error, VALENT_PACKET_ERROR, VALENT_PACKET_ERROR_MALFORMED);
+  g_clear_error (&error);
+
+  packet_str = "[]";
+  json_parser_load_from_data (parser, packet_str, -1, NULL);
+
+  g_assert_false (valent_packet_view_init (&view, json_parser_get_root (parser), &error));
+  g_assert_error (error, VALENT_PACKET_ERROR, VALENT_PACKET_ERROR_MALFORMED);
+  g_clear_error (&error);
+}
+
+static void
+test_packet_peek_header (void)
+{
+  ValentPacketHeader header;
+  const char *packet_str;
+
+  /* Top-level fields, ignoring the body */
+  packet_str = "{\"id\":1234,\"type\":\"kdeconnect.mock\","
+               "\"body\":{\"type\":\"nested\",\"list\":[1,{\"s\":\"}\"}]},"
+               "\"payloadSize\":42}";
+  g_assert_true (valent_packet_peek_header (packet_str, strlen (packet_str), &header));
+  g_assert_cmpstr (header.type, ==, "kdeconnect.mock");
+  g_assert_cmpint (header.id, ==, 1234);
+  g_assert_cmpint (header.payload_size, ==, 42);
+
+  /* Stringified `id` field, missing `payloadSize` */
+  packet_str = "{ \"id\" : \"1234\", \"type\" : \"kdeconnect.identity\", \"body\" : {} }";
+  g_assert_true (valent_packet_peek_header (packet_str, strlen (packet_str), &header));
+  g_assert_cmpstr (header.type, ==, "kdeconnect.identity");
+  g_assert_cmpint (header.id, ==, 0);
+  g_assert_cmpint (header.payload_size, ==, -1);
+
+  /* Escaped `type` field */
+  packet_str = "{\"id\":0,\"type\":\"kdeconnect\\u002emock\",\"body\":{}}";
+  g_assert_false (valent_packet_peek_header (packet_str, strlen (packet_str), &header));
+
+  /* Missing `type` field */
+  packet_str = "{\"id\":0,\"body\":{}}";
+  g_assert_false (valent_packet_peek_header (packet_str, strlen (packet_str), &header));
+
+  /* Malformed packets */
+  packet_str = "[{\"type\":\"kdeconnect.mock\"}]";
+  g_assert_false (valent_packet_peek_header (packet_str, strlen (packet_str), &header));
+
+  packet_str = "{\"id\":0,\"type\":\"kdeconnect.mock\"";
+  g_assert_false (valent_packet_peek_header (packet_str, strlen (packet_str), &header));
+
+  /* Numbers must not be read past the end of the data */
+  packet_str = "{\"type\":\"kdeconnect.mock\",\"id\":12345678}";
+  g_assert_false (valent_packet_peek_header (packet_str, strlen (packet_str) - 5, &header));
+
+  packet_str = "{\"type\":\"kdeconnect.mock\",\"id\":123456789012345678901234}";
+  g_assert_false (valent_packet_peek_header (packet_str, strlen (packet_str), &header));
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -120,11 +273,20 @@ main (int   argc,
   g_test_add_func ("/core/packet/serializing",
                    test_packet_serializing);
 
+  g_test_add_func ("/core/packet/serialize-to-buffer",
+                   test_packet_serialize_to_buffer);
+
   g_test_add_func ("/core/packet/streaming",
                    test_packet_streaming);
 
   g_test_add_func ("/core/packet/payloads",
                    test_packet_payloads);
 
+  g_test_add_func ("/core/packet/view",
+                   test_packet_view);
+
+  g_test_add_func ("/core/packet/peek-header",
+                   test_packet_peek_header);
+
   return g_test_run ();
 }
@@ -5,6 +5,11 @@
 #include <libvalent-core.h>
 #include <libvalent-test.h>
 
+#define N_QUEUES     (500)
+#define N_CONCURRENT (8)
+#define N_PRODUCERS  (4)
+#define N_SUBMIT     (25000)
+
 
 typedef struct
 {
@@ -197,6 +202,342 @@ test_task_queue_dispose (TaskQueueFixture *fixture,
   g_main_loop_run (fixture->loop);
 }
 
+static int n_running = 0;
+static int n_running_max = 0;
+
+static void
+task_concurrent_func (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  int running = g_atomic_int_add (&n_running, 1) + 1;
+  int running_max;
+
+  while ((running_max = g_atomic_int_get (&n_running_max)) < running &&
+         !g_atomic_int_compare_and_exchange (&n_running_max, running_max, running))
+    continue;
+
+  g_usleep (50 * G_TIME_SPAN_MILLISECOND);
+  g_atomic_int_add (&n_running, -1);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+task_barrier_func (GTask        *task,
+                   gpointer      source_object,
+                   gpointer      task_data,
+                   GCancellable *cancellable)
+{
+  /* All concurrent tasks queued before a barrier must have completed */
+  g_assert_cmpint (g_atomic_int_get (&n_running), ==, 0);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+test_task_queue_concurrent (TaskQueueFixture *fixture,
+                            gconstpointer     user_data)
+{
+  GTask *task;
+
+  fixture->n_tasks = 0;
+
+  /* Two groups of concurrent tasks, each followed by a barrier */
+  for (unsigned int n = 0; n < 2; n++)
+    {
+      for (unsigned int i = 0; i < N_CONCURRENT; i++)
+        {
+          task = g_task_new (NULL, NULL, task_success_cb, fixture);
+          valent_task_queue_run_concurrent (fixture->queue, task, task_concurrent_func);
+          g_clear_object (&task);
+        }
+
+      task = g_task_new (NULL, NULL, task_success_cb, fixture);
+      valent_task_queue_run (fixture->queue, task, task_barrier_func);
+      g_clear_object (&task);
+
+      fixture->n_tasks += N_CONCURRENT + 1;
+    }
+
+  /* Close task (return success, expect success) */
+  task = g_task_new (NULL, NULL, task_success_cb, fixture);
+  valent_task_queue_run_close (fixture->queue, task, task_barrier_func);
+  g_clear_object (&task);
+
+  fixture->n_tasks += 1;
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpint (n_running, ==, 0);
+  g_assert_cmpint (n_running_max, >, 1);
+}
+
+/*
+ * Read a `VmRSS:` or `Threads:` style field from `/proc/self/status`
+ */
+static gint64
+read_proc_status (const char *field)
+{
+  g_autofree char *contents = NULL;
+  g_auto (GStrv) lines = NULL;
+  gint64 value = -1;
+
+  if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    return -1;
+
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (unsigned int i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], field))
+        {
+          value = g_ascii_strtoll (lines[i] + strlen (field), NULL, 10);
+          break;
+        }
+    }
+
+  return value;
+}
+
+static void
+test_task_queue_shared (TaskQueueFixture *fixture,
+                        gconstpointer     user_data)
+{
+  g_autoptr (GPtrArray) queues = NULL;
+  gint64 threads_before, threads_after;
+  gint64 rss_before, rss_after;
+  GTask *task;
+
+  threads_before = read_proc_status ("Threads:");
+  rss_before = read_proc_status ("VmRSS:");
+
+  if (threads_before < 0 || rss_before < 0)
+    {
+      g_test_skip ("/proc/self/status not available");
+      return;
+    }
+
+  /* Each queue gets a task, so every queue borrows a worker at least once */
+  queues = g_ptr_array_new_with_free_func ((GDestroyNotify)valent_task_queue_unref);
+  fixture->n_tasks = N_QUEUES;
+
+  for (unsigned int i = 0; i < N_QUEUES; i++)
+    {
+      ValentTaskQueue *queue = valent_task_queue_new ();
+
+      task = g_task_new (NULL, NULL, task_success_cb, fixture);
+      valent_task_queue_run (queue, task, task_success_func);
+      g_clear_object (&task);
+
+      g_ptr_array_add (queues, queue);
+    }
+
+  threads_after = read_proc_status ("Threads:");
+  rss_after = read_proc_status ("VmRSS:");
+
+  g_test_message ("%u queues: %"G_GINT64_FORMAT" threads (+%"G_GINT64_FORMAT"), "
+                  "RSS %"G_GINT64_FORMAT" kB (+%"G_GINT64_FORMAT" kB)",
+                  N_QUEUES,
+                  threads_after, threads_after - threads_before,
+                  rss_after, rss_after - rss_before);
+
+  /* Queues share a bounded pool of workers, rather than a thread each */
+  g_assert_cmpint (threads_after - threads_before, <, N_QUEUES / 10);
+
+  g_main_loop_run (fixture->loop);
+}
+
+/*
+ * Benchmark
+ *
+ * The submission path used before the per-lane inboxes; each push takes the
+ * queue lock and does a sorted insert, contending with the consumer thread.
+ */
+typedef struct
+{
+  GTask *task;
+  int    priority;
+} ReferenceClosure;
+
+static void
+task_return_func (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  g_task_return_boolean (task, TRUE);
+}
+
+static int
+reference_sort (gconstpointer a,
+                gconstpointer b,
+                gpointer      user_data)
+{
+  const ReferenceClosure *closure1 = a;
+  const ReferenceClosure *closure2 = b;
+
+  return closure1->priority - closure2->priority;
+}
+
+static gpointer
+reference_loop (gpointer data)
+{
+  GAsyncQueue *tasks = data;
+  ReferenceClosure *closure;
+
+  while ((closure = g_async_queue_pop (tasks)) && closure->task != NULL)
+    {
+      task_return_func (closure->task, NULL, NULL, NULL);
+      g_object_unref (closure->task);
+      g_free (closure);
+    }
+
+  g_free (closure);
+
+  return NULL;
+}
+
+typedef struct
+{
+  GAsyncQueue     *reference;
+  ValentTaskQueue *queue;
+  GTask          **tasks;
+  gint64          *latency;
+} BenchmarkProducer;
+
+static gpointer
+benchmark_producer (gpointer data)
+{
+  BenchmarkProducer *producer = data;
+
+  for (unsigned int i = 0; i < N_SUBMIT; i++)
+    {
+      GTask *task = producer->tasks[i];
+      gint64 begin = g_get_monotonic_time ();
+
+      if (producer->reference != NULL)
+        {
+          ReferenceClosure *closure = g_new0 (ReferenceClosure, 1);
+
+          closure->task = g_object_ref (task);
+          closure->priority = g_task_get_priority (task);
+          g_async_queue_push_sorted (producer->reference,
+                                     closure,
+                                     reference_sort,
+                                     NULL);
+        }
+      else
+        {
+          valent_task_queue_run (producer->queue, task, task_return_func);
+        }
+
+      producer->latency[i] = g_get_monotonic_time () - begin;
+    }
+
+  return NULL;
+}
+
+static int
+latency_sort (gconstpointer a,
+              gconstpointer b)
+{
+  const gint64 *latency1 = a;
+  const gint64 *latency2 = b;
+
+  return (*latency1 > *latency2) - (*latency1 < *latency2);
+}
+
+static double
+benchmark_run (TaskQueueFixture *fixture,
+               GAsyncQueue      *reference)
+{
+  BenchmarkProducer producers[N_PRODUCERS] = { 0, };
+  GThread *threads[N_PRODUCERS] = { NULL, };
+  g_autofree gint64 *latency = NULL;
+  g_autoptr (GTimer) timer = NULL;
+  double elapsed;
+
+  latency = g_new0 (gint64, N_PRODUCERS * N_SUBMIT);
+  fixture->n_tasks = N_PRODUCERS * N_SUBMIT;
+
+  /* Create the tasks up front, so only submission is measured */
+  for (unsigned int n = 0; n < N_PRODUCERS; n++)
+    {
+      producers[n].reference = reference;
+      producers[n].queue = fixture->queue;
+      producers[n].tasks = g_new0 (GTask *, N_SUBMIT);
+      producers[n].latency = &latency[n * N_SUBMIT];
+
+      for (unsigned int i = 0; i < N_SUBMIT; i++)
+        {
+          GTask *task = g_task_new (NULL, NULL, task_success_cb, fixture);
+
+          g_task_set_priority (task, (i % 8 == 0)
+                                     ? G_PRIORITY_HIGH
+                                     : G_PRIORITY_DEFAULT);
+          producers[n].tasks[i] = task;
+        }
+    }
+
+  timer = g_timer_new ();
+
+  for (unsigned int n = 0; n < N_PRODUCERS; n++)
+    threads[n] = g_thread_new ("benchmark-producer", benchmark_producer, &producers[n]);
+
+  for (unsigned int n = 0; n < N_PRODUCERS; n++)
+    g_thread_join (threads[n]);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+
+  for (unsigned int n = 0; n < N_PRODUCERS; n++)
+    {
+      for (unsigned int i = 0; i < N_SUBMIT; i++)
+        g_object_unref (producers[n].tasks[i]);
+      g_free (producers[n].tasks);
+    }
+
+  g_main_loop_run (fixture->loop);
+
+  qsort (latency, N_PRODUCERS * N_SUBMIT, sizeof (gint64), latency_sort);
+  g_test_message ("%s: %.0f tasks/s, p50 %"G_GINT64_FORMAT"µs, "
+                  "p99 %"G_GINT64_FORMAT"µs, max %"G_GINT64_FORMAT"µs",
+                  (reference != NULL) ? "GAsyncQueue" : "ValentTaskQueue",
+                  (N_PRODUCERS * N_SUBMIT) / elapsed,
+                  latency[(N_PRODUCERS * N_SUBMIT) / 2],
+                  latency[(N_PRODUCERS * N_SUBMIT) * 99 / 100],
+                  latency[(N_PRODUCERS * N_SUBMIT) - 1]);
+
+  return elapsed;
+}
+
+static void
+test_task_queue_benchmark (TaskQueueFixture *fixture,
+                           gconstpointer     user_data)
+{
+  g_autoptr (GAsyncQueue) reference = NULL;
+  GThread *thread = NULL;
+  double elapsed;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Run with `-m perf` to benchmark");
+      return;
+    }
+
+  /* Reference implementation; a closure with no task stops the consumer */
+  reference = g_async_queue_new ();
+  thread = g_thread_new ("benchmark-consumer", reference_loop, reference);
+  benchmark_run (fixture, reference);
+  g_async_queue_push (reference, g_new0 (ReferenceClosure, 1));
+  g_thread_join (thread);
+
+  /* ValentTaskQueue */
+  elapsed = benchmark_run (fixture, NULL);
+  g_test_minimized_result (elapsed, "%u x %u tasks: %.3fs",
+                           N_PRODUCERS, N_SUBMIT, elapsed);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -233,6 +574,24 @@ main (int   argc,
               test_task_queue_dispose,
               task_queue_fixture_tear_down);
 
+  g_test_add ("/core/task-queue/concurrent",
+              TaskQueueFixture, NULL,
+              task_queue_fixture_set_up,
+              test_task_queue_concurrent,
+              task_queue_fixture_tear_down);
+
+  g_test_add ("/core/task-queue/benchmark",
+              TaskQueueFixture, NULL,
+              task_queue_fixture_set_up,
+              test_task_queue_benchmark,
+              task_queue_fixture_tear_down);
+
+  g_test_add ("/core/task-queue/shared",
+              TaskQueueFixture, NULL,
+              task_queue_fixture_set_up,
+              test_task_queue_shared,
+              task_queue_fixture_tear_down);
+
   return g_test_run ();
 }
 
@@ -0,0 +1,1140 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
+
+#include "config.h"
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <libvalent-core.h>
+#include <libvalent-test.h>
+
+#include "valent-device-private.h"
+#include "valent-transfer-private.h"
+
+#define BUFFER_SIZE  (1024 * 1024)
+#define PAYLOAD_SIZE (64 * 1024 * 1024)
+#define N_ITERATIONS (5)
+#define N_ITEMS      (8)
+
+/* The interval transfers report progress at, in valent-transfer.c */
+#define PROGRESS_INTERVAL (G_USEC_PER_SEC / 4)
+
+
+typedef struct
+{
+  GSocketConnection *connection;
+  gsize              size;
+  gsize              chunk_size;
+  gulong             delay;
+} UploadData;
+
+static GSocketConnection *create_connection (GSocketConnection **endpoint);
+static GSocketConnection *create_download   (gsize               size,
+                                             gsize               chunk_size,
+                                             gulong              delay,
+                                             GThread           **thread);
+
+/*
+ * A channel whose downloads record how many of them are running at once, and
+ * whose uploads can only be written with sendfile()
+ */
+#define TEST_TYPE_CHANNEL (test_channel_get_type ())
+
+G_DECLARE_FINAL_TYPE (TestChannel, test_channel, TEST, CHANNEL, ValentChannel)
+
+struct _TestChannel
+{
+  ValentChannel  parent_instance;
+};
+
+G_DEFINE_TYPE (TestChannel, test_channel, VALENT_TYPE_CHANNEL)
+
+static int n_downloads = 0;
+static int max_downloads = 0;
+
+static ValentTransfer *cancel_transfer = NULL;
+static GSocketConnection *stalled_endpoint = NULL;
+
+static GIOStream *
+test_channel_download (ValentChannel  *channel,
+                       JsonNode       *packet,
+                       GCancellable   *cancellable,
+                       GError        **error)
+{
+  g_autoptr (GByteArray) data = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GInputStream) source = NULL;
+  g_autoptr (GOutputStream) target = NULL;
+  JsonObject *info;
+  gint64 offset;
+  gint64 size;
+  int n_active;
+  int n_max;
+
+  n_active = g_atomic_int_add (&n_downloads, 1) + 1;
+
+  do
+    n_max = g_atomic_int_get (&max_downloads);
+  while (n_active > n_max &&
+         !g_atomic_int_compare_and_exchange (&max_downloads, n_max, n_active));
+
+  /* Hold the download open long enough for the others to start */
+  g_usleep (G_USEC_PER_SEC / 20);
+  g_atomic_int_add (&n_downloads, -1);
+
+  /* A stalled payload is a connection that nothing is ever written to */
+  info = valent_packet_get_payload_info (packet);
+
+  if (json_object_get_boolean_member_with_default (info, "testStall", FALSE))
+    return G_IO_STREAM (create_connection (&stalled_endpoint));
+
+  /* A slow payload is written in small chunks, with a delay between them */
+  if (json_object_has_member (info, "testDelay"))
+    {
+      GSocketConnection *connection;
+      GThread *thread;
+
+      connection = create_download (valent_packet_get_payload_size (packet),
+                                    json_object_get_int_member (info, "testChunk"),
+                                    json_object_get_int_member (info, "testDelay"),
+                                    &thread);
+      g_thread_unref (thread);
+
+      return G_IO_STREAM (connection);
+    }
+
+  /* A resumable payload starts with the offset the uploader will send from,
+   * and the test may ask for only half of the payload to be sent */
+  offset = json_object_get_int_member_with_default (info, "testOffset", 0);
+  size = valent_packet_get_payload_size (packet);
+
+  if (json_object_get_boolean_member_with_default (info, "testTruncate", FALSE))
+    size /= 2;
+
+  data = g_byte_array_new ();
+
+  if (json_object_get_boolean_member_with_default (info, "resume", FALSE))
+    {
+      guint64 offset_be = GUINT64_TO_BE ((guint64)offset);
+
+      g_byte_array_append (data, (const guint8 *)&offset_be, sizeof (guint64));
+    }
+
+  g_byte_array_set_size (data, data->len + (size - offset));
+  bytes = g_byte_array_free_to_bytes (g_steal_pointer (&data));
+
+  source = g_memory_input_stream_new_from_bytes (bytes);
+  target = g_memory_output_stream_new_resizable ();
+
+  if (cancel_transfer != NULL)
+    valent_transfer_cancel (cancel_transfer);
+
+  return g_simple_io_stream_new (source, target);
+}
+
+static GThread *upload_reader = NULL;
+
+static gpointer
+upload_reader_thread (gpointer data)
+{
+  g_autoptr (GSocketConnection) connection = data;
+  GByteArray *received;
+  GInputStream *stream;
+  guint8 buffer[4096];
+  gssize n_read;
+
+  received = g_byte_array_new ();
+  stream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+
+  while ((n_read = g_input_stream_read (stream, buffer, sizeof (buffer), NULL, NULL)) > 0)
+    g_byte_array_append (received, buffer, n_read);
+
+  return received;
+}
+
+static GIOStream *
+test_channel_upload (ValentChannel  *channel,
+                     JsonNode       *packet,
+                     GCancellable   *cancellable,
+                     GError        **error)
+{
+  g_autoptr (GSocketConnection) connection = NULL;
+  GSocketConnection *endpoint = NULL;
+
+  connection = create_connection (&endpoint);
+  upload_reader = g_thread_new ("upload-reader", upload_reader_thread, endpoint);
+
+  /* Writes to the output stream now fail, but the socket stays open */
+  g_output_stream_close (g_io_stream_get_output_stream (G_IO_STREAM (connection)),
+                         NULL,
+                         NULL);
+
+  return G_IO_STREAM (g_steal_pointer (&connection));
+}
+
+static void
+test_channel_class_init (TestChannelClass *klass)
+{
+  ValentChannelClass *channel_class = VALENT_CHANNEL_CLASS (klass);
+
+  channel_class->download = test_channel_download;
+  channel_class->upload = test_channel_upload;
+}
+
+static void
+test_channel_init (TestChannel *self)
+{
+}
+
+static guint8 *
+create_payload (gsize size)
+{
+  guint8 *payload;
+
+  payload = g_malloc (size);
+
+  for (gsize i = 0; i < size; i++)
+    payload[i] = (guint8)(i * 7 + (i >> 12));
+
+  return payload;
+}
+
+static gpointer
+upload_thread (gpointer data)
+{
+  UploadData *upload = data;
+  g_autofree guint8 *chunk = NULL;
+  GOutputStream *stream;
+  gsize remaining = upload->size;
+
+  chunk = create_payload (BUFFER_SIZE);
+  stream = g_io_stream_get_output_stream (G_IO_STREAM (upload->connection));
+
+  while (remaining > 0)
+    {
+      gsize n_write = MIN (remaining, upload->chunk_size);
+
+      g_assert_true (g_output_stream_write_all (stream, chunk, n_write,
+                                                NULL, NULL, NULL));
+      remaining -= n_write;
+
+      if (upload->delay > 0 && remaining > 0)
+        g_usleep (upload->delay);
+    }
+
+  g_io_stream_close (G_IO_STREAM (upload->connection), NULL, NULL);
+  g_object_unref (upload->connection);
+  g_free (upload);
+
+  return NULL;
+}
+
+/*
+ * Open a loopback connection, returning the local end and setting @endpoint to
+ * the remote end.
+ */
+static GSocketConnection *
+create_connection (GSocketConnection **endpoint)
+{
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GSocketClient) client = NULL;
+  g_autoptr (GSocketAddress) addr = NULL;
+  g_autoptr (GSocketConnection) connection = NULL;
+  guint16 port;
+
+  listener = g_socket_listener_new ();
+  port = g_socket_listener_add_any_inet_port (listener, NULL, NULL);
+  g_assert_cmpuint (port, >, 0);
+
+  client = g_object_new (G_TYPE_SOCKET_CLIENT,
+                         "enable-proxy", FALSE,
+                         NULL);
+  addr = g_inet_socket_address_new_from_string ("127.0.0.1", port);
+  connection = g_socket_client_connect (client,
+                                        G_SOCKET_CONNECTABLE (addr),
+                                        NULL,
+                                        NULL);
+  g_assert_nonnull (connection);
+
+  *endpoint = g_socket_listener_accept (listener, NULL, NULL, NULL);
+  g_assert_nonnull (*endpoint);
+
+  return g_steal_pointer (&connection);
+}
+
+/*
+ * Open a loopback connection and send @size bytes from the other end, in
+ * chunks of @chunk_size bytes with @delay microseconds between them.
+ */
+static GSocketConnection *
+create_download (gsize     size,
+                 gsize     chunk_size,
+                 gulong    delay,
+                 GThread **thread)
+{
+  GSocketConnection *connection;
+  UploadData *upload;
+
+  g_assert (chunk_size > 0 && chunk_size <= BUFFER_SIZE);
+
+  upload = g_new0 (UploadData, 1);
+  connection = create_connection (&upload->connection);
+  upload->size = size;
+  upload->chunk_size = chunk_size;
+  upload->delay = delay;
+
+  *thread = g_thread_new ("upload", upload_thread, upload);
+
+  return connection;
+}
+
+/*
+ * Create a device, connected by a #TestChannel.
+ */
+static ValentDevice *
+create_device (JsonNode           *identity,
+               ValentChannel     **channel,
+               GSocketConnection **endpoint)
+{
+  g_autoptr (GSocketConnection) connection = NULL;
+  ValentDevice *device;
+
+  connection = create_connection (endpoint);
+  *channel = g_object_new (TEST_TYPE_CHANNEL,
+                           "base-stream",   connection,
+                           "identity",      identity,
+                           "peer-identity", identity,
+                           NULL);
+
+  device = g_object_new (VALENT_TYPE_DEVICE,
+                         "id", "test-device",
+                         NULL);
+  valent_device_set_channel (device, *channel);
+
+  return device;
+}
+
+static void
+execute_cb (ValentTransfer  *transfer,
+            GAsyncResult    *result,
+            GAsyncResult   **result_out)
+{
+  *result_out = g_object_ref (result);
+}
+
+static gboolean
+execute_transfer (ValentTransfer  *transfer,
+                  GError         **error)
+{
+  g_autoptr (GAsyncResult) result = NULL;
+
+  valent_transfer_execute (transfer,
+                           NULL,
+                           (GAsyncReadyCallback)execute_cb,
+                           &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, FALSE);
+
+  return valent_transfer_execute_finish (transfer, result, error);
+}
+
+static void
+count_progress (gsize    n_bytes,
+                gpointer user_data)
+{
+  gsize *total = user_data;
+
+  *total += n_bytes;
+}
+
+static void
+test_transfer_pipe (void)
+{
+  g_autofree guint8 *payload = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GInputStream) source = NULL;
+  g_autoptr (GOutputStream) target = NULL;
+  g_autoptr (GBytes) result = NULL;
+  g_autoptr (GError) error = NULL;
+  gsize size = 3 * BUFFER_SIZE + 123;
+  goffset transferred = 0;
+  gsize progress = 0;
+  gboolean ret;
+
+  payload = create_payload (size);
+  bytes = g_bytes_new (payload, size);
+
+  /* Several full buffers and a partial one */
+  source = g_memory_input_stream_new_from_bytes (bytes);
+  target = g_memory_output_stream_new_resizable ();
+  ret = valent_transfer_pipe (source,
+                              target,
+                              BUFFER_SIZE,
+                              count_progress,
+                              &progress,
+                              &transferred,
+                              NULL,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpint (transferred, ==, size);
+  g_assert_cmpuint (progress, ==, size);
+
+  g_output_stream_close (target, NULL, NULL);
+  result = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (target));
+  g_assert_true (g_bytes_equal (bytes, result));
+
+  /* Write errors are propagated */
+  g_clear_object (&source);
+  g_clear_object (&target);
+  source = g_memory_input_stream_new_from_bytes (bytes);
+  target = g_memory_output_stream_new (g_malloc (BUFFER_SIZE), BUFFER_SIZE, NULL, g_free);
+  transferred = 0;
+
+  ret = valent_transfer_pipe (source,
+                              target,
+                              BUFFER_SIZE / 2,
+                              NULL,
+                              NULL,
+                              &transferred,
+                              NULL,
+                              &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE);
+  g_assert_false (ret);
+  g_assert_cmpint (transferred, ==, BUFFER_SIZE);
+}
+
+static void
+scheduled_task_func (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  GCancellable *release = task_data;
+
+  while (!g_cancellable_is_cancelled (release) &&
+         !g_cancellable_is_cancelled (cancellable))
+    g_usleep (1000);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/*
+ * Queue a task for a transfer with @device, which runs until it is released
+ * with release_task().
+ */
+static GTask *
+schedule_task (ValentTransferScheduler *scheduler,
+               ValentDevice            *device,
+               int                      priority,
+               gboolean                 download,
+               GCancellable            *cancellable)
+{
+  g_autoptr (ValentTransfer) transfer = NULL;
+  g_autoptr (JsonNode) packet = NULL;
+  GTask *task;
+
+  transfer = valent_transfer_new (device);
+  valent_transfer_set_priority (transfer, priority);
+  packet = valent_packet_finish (valent_packet_start ("kdeconnect.mock.transfer"));
+
+  if (download)
+    {
+      valent_packet_set_payload_info (packet, json_object_new ());
+      valent_packet_set_payload_size (packet, 1);
+      valent_transfer_add_bytes (transfer, packet, NULL);
+    }
+  else
+    {
+      g_autoptr (GBytes) bytes = g_bytes_new_static ("a", 1);
+
+      valent_transfer_add_bytes (transfer, packet, bytes);
+    }
+
+  task = g_task_new (transfer, cancellable, NULL, NULL);
+  g_task_set_task_data (task, g_cancellable_new (), g_object_unref);
+  valent_transfer_scheduler_queue (scheduler, task, scheduled_task_func);
+
+  return task;
+}
+
+static void
+release_task (GTask *task)
+{
+  g_cancellable_cancel (g_task_get_task_data (task));
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, FALSE);
+}
+
+#define v_assert_task_state(task, cmp)                                                 \
+  g_assert_cmpuint (valent_transfer_get_state (g_task_get_source_object (task)), ==, cmp)
+
+static void
+test_transfer_scheduler (void)
+{
+  g_autoptr (ValentTransferScheduler) scheduler = NULL;
+  g_autoptr (ValentDevice) device_a = NULL;
+  g_autoptr (ValentDevice) device_b = NULL;
+  g_autoptr (GTask) a1 = NULL;
+  g_autoptr (GTask) a2 = NULL;
+  g_autoptr (GTask) a3 = NULL;
+  g_autoptr (GTask) a4 = NULL;
+  g_autoptr (GTask) a5 = NULL;
+  g_autoptr (GTask) b1 = NULL;
+  g_autoptr (GTask) d1 = NULL;
+  g_autoptr (GCancellable) cancellable = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GTimer) timer = NULL;
+  unsigned int max_active;
+  unsigned int max_device_active;
+  unsigned int stall_timeout;
+  guint64 max_rate;
+
+  g_assert_true (VALENT_IS_TRANSFER_SCHEDULER (valent_transfer_scheduler_get_default ()));
+  g_assert_true (valent_transfer_scheduler_get_default () == valent_transfer_scheduler_get_default ());
+
+  /* A private scheduler, so the default is left as it is */
+  scheduler = g_object_new (VALENT_TYPE_TRANSFER_SCHEDULER, NULL);
+
+  /* GListModel */
+  g_assert_true (g_list_model_get_item_type (G_LIST_MODEL (scheduler)) == VALENT_TYPE_TRANSFER);
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (scheduler)), ==, 0);
+  g_assert_null (g_list_model_get_item (G_LIST_MODEL (scheduler), 0));
+
+  /* Properties */
+  g_object_set (scheduler,
+                "max-active",        2,
+                "max-device-active", 2,
+                "max-rate",          (guint64)BUFFER_SIZE,
+                "stall-timeout",     0,
+                NULL);
+  g_object_get (scheduler,
+                "max-active",        &max_active,
+                "max-device-active", &max_device_active,
+                "max-rate",          &max_rate,
+                "stall-timeout",     &stall_timeout,
+                NULL);
+  g_assert_cmpuint (max_active, ==, 2);
+  g_assert_cmpuint (max_device_active, ==, 2);
+  g_assert_cmpuint (max_rate, ==, BUFFER_SIZE);
+  g_assert_cmpuint (stall_timeout, ==, 0);
+
+  device_a = g_object_new (VALENT_TYPE_DEVICE, "id", "device-a", NULL);
+  device_b = g_object_new (VALENT_TYPE_DEVICE, "id", "device-b", NULL);
+
+  /* No more than max-active uploads run at once */
+  a1 = schedule_task (scheduler, device_a, G_PRIORITY_DEFAULT, FALSE, NULL);
+  a2 = schedule_task (scheduler, device_a, G_PRIORITY_DEFAULT, FALSE, NULL);
+  a3 = schedule_task (scheduler, device_a, G_PRIORITY_DEFAULT, FALSE, NULL);
+  v_assert_task_state (a1, VALENT_TRANSFER_STATE_ACTIVE);
+  v_assert_task_state (a2, VALENT_TRANSFER_STATE_ACTIVE);
+  v_assert_task_state (a3, VALENT_TRANSFER_STATE_NONE);
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (scheduler)), ==, 3);
+
+  /* Downloads don't wait behind uploads */
+  d1 = schedule_task (scheduler, device_b, G_PRIORITY_DEFAULT, TRUE, NULL);
+  v_assert_task_state (d1, VALENT_TRANSFER_STATE_ACTIVE);
+
+  /* A transfer with a higher priority runs first, even if queued later */
+  a4 = schedule_task (scheduler, device_a, G_PRIORITY_HIGH, FALSE, NULL);
+  v_assert_task_state (a4, VALENT_TRANSFER_STATE_NONE);
+
+  release_task (a1);
+  v_assert_task_state (a1, VALENT_TRANSFER_STATE_COMPLETE);
+  v_assert_task_state (a4, VALENT_TRANSFER_STATE_ACTIVE);
+  v_assert_task_state (a3, VALENT_TRANSFER_STATE_NONE);
+
+  /* A device with fewer running transfers goes first, even if queued later */
+  release_task (d1);
+  b1 = schedule_task (scheduler, device_b, G_PRIORITY_DEFAULT, FALSE, NULL);
+  v_assert_task_state (b1, VALENT_TRANSFER_STATE_NONE);
+
+  release_task (a2);
+  v_assert_task_state (b1, VALENT_TRANSFER_STATE_ACTIVE);
+  v_assert_task_state (a3, VALENT_TRANSFER_STATE_NONE);
+
+  /* No more than max-device-active run for one device, even with free slots */
+  valent_transfer_scheduler_set_max_device_active (scheduler, 1);
+  valent_transfer_scheduler_set_max_active (scheduler, 4);
+  v_assert_task_state (a3, VALENT_TRANSFER_STATE_NONE);
+
+  release_task (a4);
+  v_assert_task_state (a3, VALENT_TRANSFER_STATE_ACTIVE);
+
+  /* A waiting transfer that is cancelled completes without waiting for a slot */
+  cancellable = g_cancellable_new ();
+  a5 = schedule_task (scheduler, device_a, G_PRIORITY_DEFAULT, FALSE, cancellable);
+  v_assert_task_state (a5, VALENT_TRANSFER_STATE_NONE);
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (scheduler)), ==, 3);
+
+  g_cancellable_cancel (cancellable);
+
+  while (!g_task_get_completed (a5))
+    g_main_context_iteration (NULL, FALSE);
+
+  g_assert_false (g_task_propagate_boolean (a5, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  v_assert_task_state (a5, VALENT_TRANSFER_STATE_COMPLETE);
+  v_assert_task_state (a3, VALENT_TRANSFER_STATE_ACTIVE);
+  v_assert_task_state (b1, VALENT_TRANSFER_STATE_ACTIVE);
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (scheduler)), ==, 2);
+
+  release_task (a3);
+  release_task (b1);
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (scheduler)), ==, 0);
+
+  /* Moving two seconds of data should take at least a second, after the burst
+   * and the first block */
+  timer = g_timer_new ();
+
+  for (unsigned int i = 0; i < 8; i++)
+    valent_transfer_scheduler_throttle (scheduler, BUFFER_SIZE / 4, NULL);
+
+  g_assert_cmpfloat (g_timer_elapsed (timer, NULL), >=, 0.9);
+
+  /* No limit */
+  valent_transfer_scheduler_set_max_rate (scheduler, 0);
+  g_timer_start (timer);
+
+  for (unsigned int i = 0; i < 8; i++)
+    valent_transfer_scheduler_throttle (scheduler, BUFFER_SIZE, NULL);
+
+  g_assert_cmpfloat (g_timer_elapsed (timer, NULL), <, 0.1);
+}
+
+static void
+test_transfer_stalled (void)
+{
+  ValentTransferScheduler *scheduler;
+  g_autoptr (ValentDevice) device = NULL;
+  g_autoptr (ValentChannel) channel = NULL;
+  g_autoptr (GSocketConnection) endpoint = NULL;
+  g_autoptr (JsonNode) packets = NULL;
+  g_autoptr (ValentTransfer) transfer = NULL;
+  g_autoptr (JsonNode) packet = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GTimer) timer = NULL;
+  JsonObject *info;
+  unsigned int stall_timeout;
+
+  packets = valent_test_load_json (TEST_DATA_DIR"/core.json");
+  device = create_device (json_object_get_member (json_node_get_object (packets), "identity"),
+                          &channel,
+                          &endpoint);
+
+  scheduler = valent_transfer_scheduler_get_default ();
+  stall_timeout = valent_transfer_scheduler_get_stall_timeout (scheduler);
+  valent_transfer_scheduler_set_stall_timeout (scheduler, 1);
+
+  /* A download that never makes progress fails once the timeout passes */
+  packet = valent_packet_finish (valent_packet_start ("kdeconnect.mock.transfer"));
+  info = json_object_new ();
+  json_object_set_boolean_member (info, "testStall", TRUE);
+  valent_packet_set_payload_info (packet, info);
+  valent_packet_set_payload_size (packet, BUFFER_SIZE);
+
+  transfer = valent_transfer_new (device);
+  valent_transfer_add_bytes (transfer, packet, NULL);
+
+  timer = g_timer_new ();
+  g_assert_false (execute_transfer (transfer, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+  g_assert_cmpfloat (g_timer_elapsed (timer, NULL), >=, 1.0);
+
+  valent_transfer_scheduler_set_stall_timeout (scheduler, stall_timeout);
+  g_clear_object (&stalled_endpoint);
+  valent_device_set_channel (device, NULL);
+}
+
+static void
+test_transfer_limit (void)
+{
+  g_autoptr (ValentDevice) device = NULL;
+  g_autoptr (ValentChannel) channel = NULL;
+  g_autoptr (GSocketConnection) endpoint = NULL;
+  g_autoptr (JsonNode) packets = NULL;
+  JsonNode *identity;
+  unsigned int transfer_limit;
+
+  packets = valent_test_load_json (TEST_DATA_DIR"/core.json");
+  identity = json_object_get_member (json_node_get_object (packets), "identity");
+  device = create_device (identity, &channel, &endpoint);
+
+  /* Properties */
+  g_assert_cmpuint (valent_channel_get_transfer_limit (channel), ==, 1);
+
+  g_object_set (channel, "transfer-limit", 4, NULL);
+  g_object_get (channel, "transfer-limit", &transfer_limit, NULL);
+  g_assert_cmpuint (transfer_limit, ==, 4);
+
+  /* Items run one at a time by default, or up to the limit at once */
+  for (unsigned int limit = 1; limit <= 4; limit += 3)
+    {
+      g_autoptr (ValentTransfer) transfer = NULL;
+      g_autoptr (GPtrArray) items = NULL;
+      g_autoptr (GError) error = NULL;
+
+      valent_channel_set_transfer_limit (channel, limit);
+      g_atomic_int_set (&max_downloads, 0);
+
+      transfer = valent_transfer_new (device);
+      items = g_ptr_array_new_with_free_func ((GDestroyNotify)json_node_unref);
+
+      for (unsigned int i = 0; i < N_ITEMS; i++)
+        {
+          JsonNode *packet;
+
+          packet = valent_packet_finish (valent_packet_start ("kdeconnect.mock.transfer"));
+          valent_packet_set_payload_info (packet, json_object_new ());
+          valent_packet_set_payload_size (packet, BUFFER_SIZE + i);
+          valent_transfer_add_bytes (transfer, packet, NULL);
+          g_ptr_array_add (items, packet);
+        }
+
+      execute_transfer (transfer, &error);
+      g_assert_no_error (error);
+
+      if (limit == 1)
+        g_assert_cmpint (g_atomic_int_get (&max_downloads), ==, 1);
+      else
+        g_assert_cmpint (g_atomic_int_get (&max_downloads), >, 1);
+
+      g_assert_cmpint (g_atomic_int_get (&max_downloads), <=, limit);
+      g_assert_cmpuint (valent_transfer_get_transferred (transfer), ==,
+                        valent_transfer_get_size (transfer));
+
+      for (unsigned int i = 0; i < items->len; i++)
+        {
+          g_autoptr (GBytes) bytes = NULL;
+
+          bytes = valent_transfer_get_bytes (transfer, g_ptr_array_index (items, i));
+          g_assert_nonnull (bytes);
+          g_assert_cmpuint (g_bytes_get_size (bytes), ==, BUFFER_SIZE + i);
+        }
+    }
+
+  valent_device_set_channel (device, NULL);
+}
+
+static gboolean
+download_file (ValentDevice  *device,
+               GFile         *file,
+               gint64         size,
+               gint64         offset,
+               gboolean       truncate,
+               gboolean       cancel,
+               GError       **error)
+{
+  g_autoptr (ValentTransfer) transfer = NULL;
+  g_autoptr (JsonNode) packet = NULL;
+  JsonObject *info;
+  gboolean ret;
+
+  packet = valent_packet_finish (valent_packet_start ("kdeconnect.mock.transfer"));
+  info = json_object_new ();
+  json_object_set_boolean_member (info, "resume", TRUE);
+  json_object_set_int_member (info, "testOffset", offset);
+  json_object_set_boolean_member (info, "testTruncate", truncate);
+  valent_packet_set_payload_info (packet, info);
+  valent_packet_set_payload_size (packet, size);
+
+  transfer = valent_transfer_new (device);
+  valent_transfer_add_file (transfer, packet, file);
+
+  if (cancel)
+    cancel_transfer = transfer;
+
+  ret = execute_transfer (transfer, error);
+  cancel_transfer = NULL;
+
+  return ret;
+}
+
+static gint64
+query_size (GFile *file)
+{
+  g_autoptr (GFileInfo) info = NULL;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE,
+                            NULL,
+                            NULL);
+
+  return info != NULL ? g_file_info_get_size (info) : -1;
+}
+
+static void
+test_transfer_resume (void)
+{
+  g_autoptr (ValentDevice) device = NULL;
+  g_autoptr (ValentChannel) channel = NULL;
+  g_autoptr (GSocketConnection) endpoint = NULL;
+  g_autoptr (JsonNode) packets = NULL;
+  g_autoptr (GFile) file = NULL;
+  g_autoptr (GFile) part = NULL;
+  g_autoptr (GFile) sidecar = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *contents = NULL;
+  gint64 size = 2 * BUFFER_SIZE;
+
+  packets = valent_test_load_json (TEST_DATA_DIR"/core.json");
+  device = create_device (json_object_get_member (json_node_get_object (packets), "identity"),
+                          &channel,
+                          &endpoint);
+
+  dir = g_dir_make_tmp ("valent-transfer-XXXXXX", NULL);
+  file = g_file_new_build_filename (dir, "payload.bin", NULL);
+  part = g_file_new_build_filename (dir, "payload.bin.part", NULL);
+  sidecar = g_file_new_build_filename (dir, "payload.bin.part.json", NULL);
+
+  /* An interrupted download keeps the partial file, and the sidecar records
+   * the offset, but not the packet id */
+  g_assert_false (download_file (device, file, size, 0, TRUE, FALSE, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+  g_clear_error (&error);
+
+  g_assert_false (g_file_query_exists (file, NULL));
+  g_assert_cmpint (query_size (part), ==, size / 2);
+  g_assert_true (g_file_load_contents (sidecar, NULL, &contents, NULL, NULL, NULL));
+  g_assert_nonnull (strstr (contents, "\"offset\":1048576"));
+  g_assert_null (strstr (contents, "\"id\""));
+
+  /* Resuming moves the complete file into place and removes the others */
+  g_assert_true (download_file (device, file, size, size / 2, FALSE, FALSE, &error));
+  g_assert_no_error (error);
+
+  g_assert_cmpint (query_size (file), ==, size);
+  g_assert_false (g_file_query_exists (part, NULL));
+  g_assert_false (g_file_query_exists (sidecar, NULL));
+  g_assert_true (g_file_delete (file, NULL, NULL));
+
+  /* Cancelling a resumed download removes the partial file */
+  g_assert_false (download_file (device, file, size, 0, TRUE, FALSE, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+  g_clear_error (&error);
+  g_assert_true (g_file_query_exists (part, NULL));
+
+  g_assert_false (download_file (device, file, size, size / 2, FALSE, TRUE, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&error);
+
+  g_assert_false (g_file_query_exists (file, NULL));
+  g_assert_false (g_file_query_exists (part, NULL));
+  g_assert_false (g_file_query_exists (sidecar, NULL));
+
+  g_rmdir (dir);
+  valent_device_set_channel (device, NULL);
+}
+
+static void
+test_transfer_sendfile (void)
+{
+  g_autoptr (ValentDevice) device = NULL;
+  g_autoptr (ValentChannel) channel = NULL;
+  g_autoptr (GSocketConnection) endpoint = NULL;
+  g_autoptr (JsonNode) packets = NULL;
+  g_autoptr (ValentTransfer) transfer = NULL;
+  g_autoptr (JsonNode) packet = NULL;
+  g_autoptr (GFile) file = NULL;
+  g_autoptr (GFileIOStream) tmp = NULL;
+  g_autoptr (GByteArray) received = NULL;
+  g_autofree guint8 *payload = NULL;
+  g_autoptr (GError) error = NULL;
+  gsize size = 3 * BUFFER_SIZE + 123;
+
+#if !defined (HAVE_SENDFILE) || !defined (__linux__)
+  g_test_skip ("sendfile() is not supported");
+  return;
+#endif
+
+  packets = valent_test_load_json (TEST_DATA_DIR"/core.json");
+  device = create_device (json_object_get_member (json_node_get_object (packets), "identity"),
+                          &channel,
+                          &endpoint);
+
+  payload = create_payload (size);
+  file = g_file_new_tmp ("valent-transfer-XXXXXX", &tmp, NULL);
+  g_io_stream_close (G_IO_STREAM (tmp), NULL, NULL);
+  g_assert_true (g_file_replace_contents (file,
+                                          (const char *)payload,
+                                          size,
+                                          NULL,
+                                          FALSE,
+                                          G_FILE_CREATE_NONE,
+                                          NULL,
+                                          NULL,
+                                          NULL));
+
+  /* The test channel closes the output stream of the connection before
+   * returning it, so the upload only succeeds if the file is sent with
+   * sendfile() */
+  packet = valent_packet_finish (valent_packet_start ("kdeconnect.mock.transfer"));
+  transfer = valent_transfer_new (device);
+  valent_transfer_add_file (transfer, packet, file);
+  execute_transfer (transfer, &error);
+  g_assert_no_error (error);
+
+  received = g_thread_join (g_steal_pointer (&upload_reader));
+  g_assert_cmpuint (received->len, ==, size);
+  g_assert_cmpmem (received->data, received->len, payload, size);
+
+  g_file_delete (file, NULL, NULL);
+  valent_device_set_channel (device, NULL);
+}
+
+typedef struct
+{
+  gint64  time;
+  guint64 size;
+  guint64 transferred;
+  guint64 rate;
+  gint64  remaining;
+  double  progress;
+} ProgressSample;
+
+static void
+on_transferred (ValentTransfer *transfer,
+                GParamSpec     *pspec,
+                GArray         *samples)
+{
+  ProgressSample sample = {
+    .time        = g_get_monotonic_time (),
+    .size        = valent_transfer_get_size (transfer),
+    .transferred = valent_transfer_get_transferred (transfer),
+    .rate        = valent_transfer_get_rate (transfer),
+    .remaining   = valent_transfer_get_remaining (transfer),
+    .progress    = valent_transfer_get_progress (transfer),
+  };
+
+  g_array_append_val (samples, sample);
+}
+
+static void
+test_transfer_progress (void)
+{
+  g_autoptr (ValentDevice) device = NULL;
+  g_autoptr (ValentChannel) channel = NULL;
+  g_autoptr (GSocketConnection) endpoint = NULL;
+  g_autoptr (JsonNode) packets = NULL;
+  g_autoptr (ValentTransfer) transfer = NULL;
+  g_autoptr (JsonNode) packet = NULL;
+  g_autoptr (GArray) samples = NULL;
+  g_autoptr (GError) error = NULL;
+  JsonObject *info;
+  ProgressSample *last = NULL;
+  guint64 size = 32 * 32 * 1024;
+  guint64 expected_rate;
+  gint64 begin, elapsed;
+  unsigned int n_rated = 0;
+
+  packets = valent_test_load_json (TEST_DATA_DIR"/core.json");
+  device = create_device (json_object_get_member (json_node_get_object (packets), "identity"),
+                          &channel,
+                          &endpoint);
+
+  /* 32 chunks of 32 KiB, 30ms apart, so the transfer takes about a second and
+   * reports progress several times along the way */
+  packet = valent_packet_finish (valent_packet_start ("kdeconnect.mock.transfer"));
+  info = json_object_new ();
+  json_object_set_int_member (info, "testChunk", 32 * 1024);
+  json_object_set_int_member (info, "testDelay", 30 * 1000);
+  valent_packet_set_payload_info (packet, info);
+  valent_packet_set_payload_size (packet, size);
+
+  transfer = valent_transfer_new (device);
+  valent_transfer_add_bytes (transfer, packet, NULL);
+
+  samples = g_array_new (FALSE, TRUE, sizeof (ProgressSample));
+  g_signal_connect (transfer,
+                    "notify::transferred",
+                    G_CALLBACK (on_transferred),
+                    samples);
+
+  begin = g_get_monotonic_time ();
+  execute_transfer (transfer, &error);
+  g_assert_no_error (error);
+  elapsed = g_get_monotonic_time () - begin;
+
+  /* Let any pending notifications through */
+  while (g_main_context_iteration (NULL, FALSE))
+    continue;
+
+  g_signal_handlers_disconnect_by_data (transfer, samples);
+
+  /* Progress only moves forward, and the size is known throughout */
+  g_assert_cmpuint (samples->len, >=, 3);
+  expected_rate = size * G_USEC_PER_SEC / elapsed;
+
+  for (unsigned int i = 0; i < samples->len; i++)
+    {
+      ProgressSample *sample = &g_array_index (samples, ProgressSample, i);
+
+      g_assert_cmpuint (sample->size, ==, size);
+      g_assert_cmpuint (sample->transferred, <=, size);
+      g_assert_cmpfloat (sample->progress, >=, 0.0);
+      g_assert_cmpfloat (sample->progress, <=, 1.0);
+
+      if (last != NULL)
+        {
+          g_assert_cmpuint (sample->transferred, >=, last->transferred);
+          g_assert_cmpfloat (sample->progress, >=, last->progress);
+        }
+
+      /* The rate is close to the real one, and the remaining time follows
+       * from it; without a rate, the remaining time is unknown */
+      if (sample->rate > 0)
+        {
+          g_assert_cmpuint (sample->rate, >=, expected_rate / 4);
+          g_assert_cmpuint (sample->rate, <=, expected_rate * 4);
+          g_assert_cmpint (sample->remaining, >=, 0);
+          g_assert_cmpint (sample->remaining, <=,
+                           (elapsed * 4) / G_USEC_PER_SEC + 1);
+          n_rated++;
+        }
+      else
+        {
+          g_assert_cmpint (sample->remaining, ==, -1);
+        }
+
+      last = sample;
+    }
+
+  g_assert_cmpuint (n_rated, >, 0);
+  g_assert_cmpuint (last->transferred, ==, size);
+  g_assert_cmpfloat (last->progress, ==, 1.0);
+  g_assert_cmpint (last->remaining, ==, 0);
+
+  /* Notifications are throttled, rather than sent for each of the reads, with
+   * some slack for the forced notifications when the transfer starts and the
+   * item completes */
+  g_assert_cmpuint (samples->len, <=, elapsed / PROGRESS_INTERVAL + 3);
+
+  valent_device_set_channel (device, NULL);
+}
+
+static void
+test_transfer_benchmark (void)
+{
+  g_autoptr (GFile) file = NULL;
+  g_autoptr (GFileIOStream) tmp = NULL;
+  g_autoptr (GTimer) timer = NULL;
+  double splice_time = 0.0, pipe_time = 0.0;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Run with `-m perf` to benchmark");
+      return;
+    }
+
+  file = g_file_new_tmp ("valent-transfer-XXXXXX", &tmp, NULL);
+  g_io_stream_close (G_IO_STREAM (tmp), NULL, NULL);
+  timer = g_timer_new ();
+
+  for (unsigned int n = 0; n < N_ITERATIONS; n++)
+    {
+      g_autoptr (GSocketConnection) connection = NULL;
+      g_autoptr (GFileOutputStream) target = NULL;
+      GInputStream *source;
+      GThread *thread;
+      gssize n_spliced;
+
+      /* GIO's default splice, as used before */
+      connection = create_download (PAYLOAD_SIZE, &thread);
+      source = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+      target = g_file_replace (file, NULL, FALSE,
+                               G_FILE_CREATE_REPLACE_DESTINATION,
+                               NULL, NULL);
+
+      g_timer_start (timer);
+      n_spliced = g_output_stream_splice (G_OUTPUT_STREAM (target),
+                                          source,
+                                          (G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                           G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET),
+                                          NULL,
+                                          NULL);
+      splice_time += g_timer_elapsed (timer, NULL);
+
+      g_assert_cmpint (n_spliced, ==, PAYLOAD_SIZE);
+      g_thread_join (thread);
+    }
+
+  for (unsigned int n = 0; n < N_ITERATIONS; n++)
+    {
+      g_autoptr (GSocketConnection) connection = NULL;
+      g_autoptr (GFileOutputStream) target = NULL;
+      GInputStream *source;
+      GThread *thread;
+      goffset transferred = 0;
+
+      /* Preallocated, double-buffered writes */
+      connection = create_download (PAYLOAD_SIZE, &thread);
+      source = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+      target = g_file_replace (file, NULL, FALSE,
+                               G_FILE_CREATE_REPLACE_DESTINATION,
+                               NULL, NULL);
+
+      g_timer_start (timer);
+      valent_transfer_preallocate (G_OUTPUT_STREAM (target), 0, PAYLOAD_SIZE);
+      g_assert_true (valent_transfer_pipe (source,
+                                           G_OUTPUT_STREAM (target),
+                                           BUFFER_SIZE,
+                                           NULL,
+                                           NULL,
+                                           &transferred,
+                                           NULL,
+                                           NULL));
+      g_output_stream_close (G_OUTPUT_STREAM (target), NULL, NULL);
+      pipe_time += g_timer_elapsed (timer, NULL);
+
+      g_assert_cmpint (transferred, ==, PAYLOAD_SIZE);
+      g_input_stream_close (source, NULL, NULL);
+      g_thread_join (thread);
+    }
+
+  g_file_delete (file, NULL, NULL);
+
+  g_test_message ("splice: %.1f MiB/s, pipelined: %.1f MiB/s",
+                  N_ITERATIONS * (PAYLOAD_SIZE / 1048576.0) / splice_time,
+                  N_ITERATIONS * (PAYLOAD_SIZE / 1048576.0) / pipe_time);
+  g_test_minimized_result (pipe_time, "%u x %u MiB download: %.3fs",
+                           N_ITERATIONS, PAYLOAD_SIZE / 1048576, pipe_time);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add_func ("/core/transfer/pipe",
+                   test_transfer_pipe);
+
+  g_test_add_func ("/core/transfer/scheduler",
+                   test_transfer_scheduler);
+
+  g_test_add_func ("/core/transfer/stalled",
+                   test_transfer_stalled);
+
+  g_test_add_func ("/core/transfer/limit",
+                   test_transfer_limit);
+
+  g_test_add_func ("/core/transfer/resume",
+                   test_transfer_resume);
+
+  g_test_add_func ("/core/transfer/sendfile",
+                   test_transfer_sendfile);
+
+  g_test_add_func ("/core/transfer/progress",
+                   test_transfer_progress);
+
+  g_test_add_func ("/core/transfer/benchmark",
+                   test_transfer_benchmark);
+
+  return g_test_run ();
+}
+
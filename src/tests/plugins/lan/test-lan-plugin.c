@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 // SPDX-FileCopyrightText: 2021 Andy Holmes <andrew.g.r.holmes@gmail.com>
 
+#include "config.h"
+
 #include <gio/gio.h>
 #include <gio/gunixinputstream.h>
 #include <libvalent-core.h>
@@ -9,10 +11,18 @@
 #include "valent-lan-utils.h"
 #include "valent-lan-channel.h"
 #include "valent-lan-channel-service.h"
+#include "valent-lan-mux.h"
+#include "valent-lan-port-pool.h"
 
 #define ENDPOINT_PORT 3716
 #define SERVICE_PORT  2716
 
+#define N_UPLOADS     50
+#define N_MUX_UPLOADS 3
+
+/* The window the service ignores repeated identities from a device for */
+#define CONTACT_WINDOW_MS 5000
+
 typedef struct
 {
   GMainLoop            *loop;
@@ -56,26 +66,33 @@ create_socket (void)
   return socket;
 }
 
-static void
-connect_endpoint (LanBackendFixture *fixture)
+static GTlsCertificate *
+create_certificate (const char *common_name)
 {
+  GTlsCertificate *certificate;
   GError *error = NULL;
   g_autofree char *base_path = NULL;
   g_autofree char *cert_path = NULL;
   g_autofree char *key_path = NULL;
 
-  /* TLS Certificate */
   base_path = g_dir_make_tmp ("XXXXXX.valent", NULL);
   cert_path = g_build_filename (base_path, "certificate.pem", NULL);
   key_path = g_build_filename (base_path, "private.pem", NULL);
 
-  valent_certificate_generate (key_path, cert_path, "endpoint", &error);
+  valent_certificate_generate (key_path, cert_path, common_name, &error);
   g_assert_no_error (error);
 
-  fixture->certificate = g_tls_certificate_new_from_files (cert_path,
-                                                           key_path,
-                                                           &error);
+  certificate = g_tls_certificate_new_from_files (cert_path, key_path, &error);
   g_assert_no_error (error);
+
+  return certificate;
+}
+
+static void
+connect_endpoint (LanBackendFixture *fixture)
+{
+  /* TLS Certificate */
+  fixture->certificate = create_certificate ("endpoint");
 }
 
 static void
@@ -110,9 +127,12 @@ lan_service_fixture_tear_down (LanBackendFixture *fixture,
   g_clear_pointer (&fixture->loop, g_main_loop_unref);
 
   v_assert_finalize_object (fixture->service);
-  g_assert_finalize_object (fixture->channel);
 
-  g_assert_finalize_object (fixture->endpoint);
+  if (fixture->channel != NULL)
+    g_assert_finalize_object (fixture->channel);
+
+  if (fixture->endpoint != NULL)
+    g_assert_finalize_object (fixture->endpoint);
   g_assert_finalize_object (fixture->certificate);
   g_assert_finalize_object (fixture->socket);
 
@@ -271,14 +291,60 @@ connect_to_host_cb (GSocketClient     *client,
 }
 
 static void
-test_lan_service_incoming_broadcast (LanBackendFixture *fixture,
-                                     gconstpointer      user_data)
+identify_endpoint (LanBackendFixture *fixture)
 {
   GError *error = NULL;
   g_autoptr (GSocketAddress) address = NULL;
   JsonNode *identity;
   g_autofree char *identity_json = NULL;
 
+  address = g_inet_socket_address_new_from_string ("127.0.0.1", SERVICE_PORT);
+  identity = json_object_get_member (json_node_get_object (fixture->packets),
+                                     "identity");
+  identity_json = valent_packet_serialize (identity);
+
+  g_socket_send_to (fixture->socket,
+                    address,
+                    identity_json,
+                    strlen (identity_json),
+                    NULL,
+                    &error);
+  g_assert_no_error (error);
+}
+
+/*
+ * Open a connection to the service from another loopback address, that never
+ * writes an identity packet.
+ */
+static GSocketConnection *
+connect_stalled (void)
+{
+  g_autoptr (GSocketClient) client = NULL;
+  g_autoptr (GSocketAddress) local_address = NULL;
+  GSocketConnection *connection;
+  GError *error = NULL;
+
+  local_address = g_inet_socket_address_new_from_string ("127.0.0.2", 0);
+  client = g_object_new (G_TYPE_SOCKET_CLIENT,
+                         "enable-proxy",  FALSE,
+                         "local-address", local_address,
+                         NULL);
+  connection = g_socket_client_connect_to_host (client,
+                                                "127.0.0.1",
+                                                SERVICE_PORT,
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+
+  return connection;
+}
+
+static void
+test_lan_service_incoming_broadcast (LanBackendFixture *fixture,
+                                     gconstpointer      user_data)
+{
+  g_autoptr (GSocketConnection) stalled = NULL;
+
   /* Start the service */
   valent_channel_service_start (fixture->service,
                                 NULL,
@@ -286,29 +352,279 @@ test_lan_service_incoming_broadcast (LanBackendFixture *fixture,
                                 fixture);
   g_main_loop_run (fixture->loop);
 
+  /* A peer that never completes its handshake shouldn't block others */
+  if (user_data != NULL)
+    stalled = connect_stalled ();
+
   /* Wait for the TCP connection */
   accept_connection (fixture);
 
   /* Identify the mock endpoint to the service */
+  identify_endpoint (fixture);
+
+  g_signal_connect (fixture->service,
+                    "channel",
+                    G_CALLBACK (on_channel),
+                    fixture);
+  g_main_loop_run (fixture->loop);
+
+  valent_channel_service_stop (fixture->service);
+}
+
+static void
+redundant_accept_cb (GSocketListener   *listener,
+                     GAsyncResult      *result,
+                     LanBackendFixture *fixture)
+{
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GError) error = NULL;
+
+  /* The service should not connect again while the channel is open */
+  connection = g_socket_listener_accept_finish (listener, result, NULL, &error);
+  g_assert_null (connection);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  g_main_loop_quit (fixture->loop);
+}
+
+static gboolean
+cancel_timeout_cb (gpointer data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (data));
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+quit_timeout_cb (gpointer data)
+{
+  LanBackendFixture *fixture = data;
+
+  g_main_loop_quit (fixture->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_lan_service_redundant_identity (LanBackendFixture *fixture,
+                                     gconstpointer      user_data)
+{
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GCancellable) cancellable = NULL;
+  GError *error = NULL;
+
+  /* Start the service and connect the mock endpoint */
+  valent_channel_service_start (fixture->service,
+                                NULL,
+                                (GAsyncReadyCallback)start_cb,
+                                fixture);
+  g_main_loop_run (fixture->loop);
+
+  accept_connection (fixture);
+  identify_endpoint (fixture);
+
+  g_signal_connect (fixture->service,
+                    "channel",
+                    G_CALLBACK (on_channel),
+                    fixture);
+  g_main_loop_run (fixture->loop);
+
+  /* Wait out the per-host rate limit, then identify again while the channel is
+   * still open. Inside the contact window, the identity is redundant because
+   * the device was just contacted... */
+  g_timeout_add (1500, quit_timeout_cb, fixture);
+  g_main_loop_run (fixture->loop);
+
+  cancellable = g_cancellable_new ();
+  listener = g_socket_listener_new ();
+
+  if (!g_socket_listener_add_inet_port (listener, ENDPOINT_PORT, NULL, &error))
+    g_assert_no_error (error);
+
+  g_socket_listener_accept_async (listener,
+                                  cancellable,
+                                  (GAsyncReadyCallback)redundant_accept_cb,
+                                  fixture);
+
+  identify_endpoint (fixture);
+  identify_endpoint (fixture);
+
+  /* ...and after it, because the channel is still connected */
+  g_timeout_add (CONTACT_WINDOW_MS, quit_timeout_cb, fixture);
+  g_main_loop_run (fixture->loop);
+
+  identify_endpoint (fixture);
+  identify_endpoint (fixture);
+
+  g_timeout_add (500, cancel_timeout_cb, cancellable);
+  g_main_loop_run (fixture->loop);
+
+  g_socket_listener_close (listener);
+  valent_channel_service_stop (fixture->service);
+}
+
+typedef struct
+{
+  LanBackendFixture *fixture;
+  GCancellable      *cancellable;
+  unsigned int       n_accepted;
+  unsigned int       timeout_id;
+} BackoffData;
+
+static void
+failing_accept_cb (GSocketListener *listener,
+                   GAsyncResult    *result,
+                   BackoffData     *backoff)
+{
+  g_autoptr (GSocketConnection) connection = NULL;
+
+  connection = g_socket_listener_accept_finish (listener, result, NULL, NULL);
+
+  if (connection == NULL)
+    return;
+
+  /* Fail the handshake by closing the connection */
+  g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+  backoff->n_accepted++;
+
+  g_socket_listener_accept_async (listener,
+                                  backoff->cancellable,
+                                  (GAsyncReadyCallback)failing_accept_cb,
+                                  backoff);
+  g_main_loop_quit (backoff->fixture->loop);
+}
+
+static gboolean
+backoff_timeout_cb (gpointer data)
+{
+  BackoffData *backoff = data;
+
+  backoff->timeout_id = 0;
+  g_main_loop_quit (backoff->fixture->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Wait up to @timeout_ms for the service to connect, returning the number of
+ * connections it opened.
+ */
+static unsigned int
+backoff_wait (BackoffData  *backoff,
+              unsigned int  timeout_ms)
+{
+  unsigned int n_accepted = backoff->n_accepted;
+
+  backoff->timeout_id = g_timeout_add (timeout_ms, backoff_timeout_cb, backoff);
+  g_main_loop_run (backoff->fixture->loop);
+  g_clear_handle_id (&backoff->timeout_id, g_source_remove);
+
+  return backoff->n_accepted - n_accepted;
+}
+
+/*
+ * Send the endpoint's identity to the service from @local_host.
+ */
+static void
+identify_endpoint_from (LanBackendFixture *fixture,
+                        const char        *local_host)
+{
+  g_autoptr (GSocket) socket = NULL;
+  g_autoptr (GSocketAddress) local_address = NULL;
+  g_autoptr (GSocketAddress) address = NULL;
+  g_autofree char *identity_json = NULL;
+  JsonNode *identity;
+  GError *error = NULL;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4,
+                         G_SOCKET_TYPE_DATAGRAM,
+                         G_SOCKET_PROTOCOL_UDP,
+                         &error);
+  g_assert_no_error (error);
+
+  local_address = g_inet_socket_address_new_from_string (local_host, 0);
+  g_socket_bind (socket, local_address, FALSE, &error);
+  g_assert_no_error (error);
+
   address = g_inet_socket_address_new_from_string ("127.0.0.1", SERVICE_PORT);
   identity = json_object_get_member (json_node_get_object (fixture->packets),
                                      "identity");
   identity_json = valent_packet_serialize (identity);
 
-  g_socket_send_to (fixture->socket,
+  g_socket_send_to (socket,
                     address,
                     identity_json,
                     strlen (identity_json),
                     NULL,
                     &error);
   g_assert_no_error (error);
+}
 
-  g_signal_connect (fixture->service,
-                    "channel",
-                    G_CALLBACK (on_channel),
-                    fixture);
+static void
+test_lan_service_contact_backoff (LanBackendFixture *fixture,
+                                  gconstpointer      user_data)
+{
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GCancellable) cancellable = NULL;
+  BackoffData backoff = { fixture, NULL, 0, 0 };
+  GError *error = NULL;
+
+  valent_channel_service_start (fixture->service,
+                                NULL,
+                                (GAsyncReadyCallback)start_cb,
+                                fixture);
   g_main_loop_run (fixture->loop);
 
+  /* The endpoint closes every connection before the handshake */
+  cancellable = g_cancellable_new ();
+  backoff.cancellable = cancellable;
+  listener = g_socket_listener_new ();
+
+  if (!g_socket_listener_add_inet_port (listener, ENDPOINT_PORT, NULL, &error))
+    g_assert_no_error (error);
+
+  g_socket_listener_accept_async (listener,
+                                  cancellable,
+                                  (GAsyncReadyCallback)failing_accept_cb,
+                                  &backoff);
+
+  /* The first identity is answered, and the handshake fails */
+  identify_endpoint_from (fixture, "127.0.0.1");
+  g_assert_cmpuint (backoff_wait (&backoff, 2000), ==, 1);
+  g_assert_cmpuint (backoff_wait (&backoff, 250), ==, 0);
+
+  /* The device is ignored at that address... */
+  identify_endpoint_from (fixture, "127.0.0.1");
+  g_assert_cmpuint (backoff_wait (&backoff, 500), ==, 0);
+
+  /* ...but another host claiming the same ID doesn't share its backoff */
+  identify_endpoint_from (fixture, "127.0.0.2");
+  g_assert_cmpuint (backoff_wait (&backoff, 2000), ==, 1);
+  g_assert_cmpuint (backoff_wait (&backoff, 250), ==, 0);
+
+  /* The delay doubles with each failure (1s, 2s, 4s, 8s), so only the fourth
+   * failure backs off past the contact window */
+  if (g_test_slow ())
+    {
+      for (unsigned int i = 2; i <= 4; i++)
+        {
+          g_assert_cmpuint (backoff_wait (&backoff, CONTACT_WINDOW_MS), ==, 0);
+          identify_endpoint_from (fixture, "127.0.0.1");
+          g_assert_cmpuint (backoff_wait (&backoff, 2000), ==, 1);
+          g_assert_cmpuint (backoff_wait (&backoff, 250), ==, 0);
+        }
+
+      g_assert_cmpuint (backoff_wait (&backoff, CONTACT_WINDOW_MS + 500), ==, 0);
+      identify_endpoint_from (fixture, "127.0.0.1");
+      g_assert_cmpuint (backoff_wait (&backoff, 500), ==, 0);
+
+      g_assert_cmpuint (backoff_wait (&backoff, 2500), ==, 0);
+      identify_endpoint_from (fixture, "127.0.0.1");
+      g_assert_cmpuint (backoff_wait (&backoff, 2000), ==, 1);
+    }
+
+  g_cancellable_cancel (cancellable);
+  g_socket_listener_close (listener);
   valent_channel_service_stop (fixture->service);
 }
 
@@ -381,6 +697,14 @@ accept_upload_cb (ValentChannel *channel,
   size = valent_packet_get_payload_size (packet);
   g_assert_cmpint (size, >, -1);
 
+  /* The service advertises multiplexed payloads, but the endpoint doesn't */
+  if (GPOINTER_TO_INT (user_data))
+    g_assert_true (json_object_has_member (valent_packet_get_payload_info (packet),
+                                           "multiplexId"));
+  else
+    g_assert_false (json_object_has_member (valent_packet_get_payload_info (packet),
+                                            "multiplexId"));
+
   stream = valent_channel_download (channel, packet, NULL, &error);
   g_assert_no_error (error);
 
@@ -443,6 +767,7 @@ test_lan_service_channel (LanBackendFixture *fixture,
   /* Properties */
   verification_key = valent_channel_get_verification_key (fixture->channel);
   g_assert_nonnull (verification_key);
+  g_assert_cmpuint (valent_channel_get_transfer_limit (fixture->channel), >, 1);
 
   g_object_get (fixture->channel,
                 "certificate",      &certificate,
@@ -479,10 +804,606 @@ test_lan_service_channel (LanBackendFixture *fixture,
   valent_test_upload (fixture->channel, packet, file, &error);
   g_assert_no_error (error);
 
+  /* Multiplexed transfers share one connection */
+  for (unsigned int i = 0; i < 3; i++)
+    {
+      valent_channel_read_packet (fixture->channel,
+                                  NULL,
+                                  (GAsyncReadyCallback)accept_upload_cb,
+                                  GINT_TO_POINTER (TRUE));
+      valent_test_upload (fixture->endpoint, packet, file, &error);
+      g_assert_no_error (error);
+    }
 
   valent_channel_service_stop (fixture->service);
 }
 
+typedef struct
+{
+  ValentChannel *channel;
+  JsonNode      *packet;
+  GFile         *file;
+  gint64         latency;
+  gssize         transferred;
+  GError        *error;
+  int           *n_pending;
+} TransferData;
+
+static void
+transfer_data_free (gpointer data)
+{
+  TransferData *transfer = data;
+
+  g_clear_pointer (&transfer->packet, json_node_unref);
+  g_clear_object (&transfer->file);
+  g_clear_error (&transfer->error);
+  g_free (transfer);
+}
+
+static gpointer
+upload_thread (gpointer data)
+{
+  TransferData *transfer = data;
+  g_autoptr (GIOStream) stream = NULL;
+  g_autoptr (GFileInputStream) source = NULL;
+  gint64 begin;
+
+  source = g_file_read (transfer->file, NULL, &transfer->error);
+
+  if (source != NULL)
+    {
+      /* The time to set up the connection, before any data is written */
+      begin = g_get_monotonic_time ();
+      stream = valent_channel_upload (transfer->channel,
+                                      transfer->packet,
+                                      NULL,
+                                      &transfer->error);
+      transfer->latency = g_get_monotonic_time () - begin;
+    }
+
+  if (stream != NULL)
+    transfer->transferred = g_output_stream_splice (g_io_stream_get_output_stream (stream),
+                                                    G_INPUT_STREAM (source),
+                                                    (G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                                     G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET),
+                                                    NULL,
+                                                    &transfer->error);
+
+  g_atomic_int_add (transfer->n_pending, -1);
+
+  return NULL;
+}
+
+static gpointer
+download_thread (gpointer data)
+{
+  TransferData *transfer = data;
+  g_autoptr (GIOStream) stream = NULL;
+  g_autoptr (GOutputStream) target = NULL;
+
+  stream = valent_channel_download (transfer->channel,
+                                    transfer->packet,
+                                    NULL,
+                                    &transfer->error);
+
+  if (stream != NULL)
+    {
+      target = g_memory_output_stream_new_resizable ();
+      transfer->transferred = g_output_stream_splice (target,
+                                                      g_io_stream_get_input_stream (stream),
+                                                      (G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                                       G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET),
+                                                      NULL,
+                                                      &transfer->error);
+    }
+
+  g_atomic_int_add (transfer->n_pending, -1);
+
+  return NULL;
+}
+
+typedef struct
+{
+  GPtrArray *downloads;
+  GPtrArray *threads;
+  int        n_pending;
+} ConcurrentState;
+
+static void
+read_concurrent_cb (ValentChannel   *channel,
+                    GAsyncResult    *result,
+                    ConcurrentState *state)
+{
+  TransferData *download;
+  GError *error = NULL;
+
+  download = g_new0 (TransferData, 1);
+  download->channel = channel;
+  download->packet = valent_channel_read_packet_finish (channel, result, &error);
+  download->n_pending = &state->n_pending;
+  g_assert_no_error (error);
+
+  /* The endpoint doesn't support multiplexing, so each has its own port */
+  g_assert_false (json_object_has_member (valent_packet_get_payload_info (download->packet),
+                                          "multiplexId"));
+
+  g_ptr_array_add (state->downloads, download);
+  g_ptr_array_add (state->threads,
+                   g_thread_new ("download", download_thread, download));
+
+  if (state->downloads->len < N_UPLOADS)
+    valent_channel_read_packet (channel,
+                                NULL,
+                                (GAsyncReadyCallback)read_concurrent_cb,
+                                state);
+}
+
+static int
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+  const TransferData *upload_a = *(const TransferData **)a;
+  const TransferData *upload_b = *(const TransferData **)b;
+
+  return (upload_a->latency > upload_b->latency) -
+         (upload_a->latency < upload_b->latency);
+}
+
+/*
+ * Start %N_UPLOADS uploads from the service channel at once, download each one
+ * from the endpoint as its packet arrives, and wait for all of them. Returns
+ * the median time to set up a connection, in microseconds.
+ */
+static gint64
+upload_concurrent (LanBackendFixture *fixture,
+                   GFile             *file)
+{
+  g_autoptr (GPtrArray) uploads = NULL;
+  g_autoptr (GFileInfo) file_info = NULL;
+  ConcurrentState state = { 0, };
+  JsonNode *packet;
+  gint64 median;
+  gint64 max;
+  GError *error = NULL;
+
+  file_info = g_file_query_info (file, "standard::size", 0, NULL, &error);
+  g_assert_no_error (error);
+
+  packet = json_object_get_member (json_node_get_object (fixture->packets),
+                                   "transfer");
+  uploads = g_ptr_array_new_with_free_func (transfer_data_free);
+  state.downloads = g_ptr_array_new_with_free_func (transfer_data_free);
+  state.threads = g_ptr_array_new ();
+  state.n_pending = N_UPLOADS * 2;
+
+  valent_channel_read_packet (fixture->endpoint,
+                              NULL,
+                              (GAsyncReadyCallback)read_concurrent_cb,
+                              &state);
+
+  for (unsigned int i = 0; i < N_UPLOADS; i++)
+    {
+      TransferData *upload;
+
+      upload = g_new0 (TransferData, 1);
+      upload->channel = fixture->channel;
+      upload->packet = json_node_copy (packet);
+      upload->file = g_object_ref (file);
+      upload->n_pending = &state.n_pending;
+      valent_packet_set_payload_size (upload->packet,
+                                      g_file_info_get_size (file_info));
+
+      g_ptr_array_add (uploads, upload);
+      g_ptr_array_add (state.threads,
+                       g_thread_new ("upload", upload_thread, upload));
+    }
+
+  while (g_atomic_int_get (&state.n_pending) > 0)
+    g_main_context_iteration (NULL, FALSE);
+
+  for (unsigned int i = 0; i < state.threads->len; i++)
+    g_thread_join (g_ptr_array_index (state.threads, i));
+
+  for (unsigned int i = 0; i < N_UPLOADS; i++)
+    {
+      TransferData *upload = g_ptr_array_index (uploads, i);
+      TransferData *download = g_ptr_array_index (state.downloads, i);
+
+      g_assert_no_error (upload->error);
+      g_assert_no_error (download->error);
+      g_assert_cmpint (upload->transferred, ==, g_file_info_get_size (file_info));
+      g_assert_cmpint (download->transferred, ==, g_file_info_get_size (file_info));
+    }
+
+  g_ptr_array_sort (uploads, compare_latency);
+  median = ((TransferData *)g_ptr_array_index (uploads, N_UPLOADS / 2))->latency;
+  max = ((TransferData *)g_ptr_array_index (uploads, N_UPLOADS - 1))->latency;
+  g_test_message ("Connection setup for %u concurrent uploads: "
+                  "median %.2fms, max %.2fms",
+                  N_UPLOADS, median / 1000.0, max / 1000.0);
+
+  g_clear_pointer (&state.threads, g_ptr_array_unref);
+  g_clear_pointer (&state.downloads, g_ptr_array_unref);
+
+  return median;
+}
+
+static void
+test_lan_service_port_pool (LanBackendFixture *fixture,
+                            gconstpointer      user_data)
+{
+  g_autoptr (ValentLanPortPool) pool = NULL;
+  g_autoptr (GFile) file = NULL;
+  JsonNode *packet;
+  unsigned int n_bound, n_reused;
+  unsigned int n_bound_after, n_reused_after;
+  gint64 median;
+  GError *error = NULL;
+
+  /* Start the service and connect the mock endpoint */
+  valent_channel_service_start (fixture->service,
+                                NULL,
+                                (GAsyncReadyCallback)start_cb,
+                                fixture);
+  g_main_loop_run (fixture->loop);
+
+  accept_connection (fixture);
+  identify_endpoint (fixture);
+
+  g_signal_connect (fixture->service,
+                    "channel",
+                    G_CALLBACK (on_channel),
+                    fixture);
+  g_main_loop_run (fixture->loop);
+
+  /* The pool is created before the channel, so every channel gets it */
+  g_object_get (fixture->channel, "port-pool", &pool, NULL);
+  g_assert_nonnull (pool);
+
+  /* The endpoint doesn't support multiplexing, so each upload leases a
+   * listener. Binding is bounded by the port range, however many uploads run
+   * at once, and the setup latency stays low. */
+  file = g_file_new_for_path (TEST_DATA_DIR"image.png");
+  median = upload_concurrent (fixture, file);
+  g_assert_cmpint (median, <, G_USEC_PER_SEC);
+
+  valent_lan_port_pool_get_stats (pool, &n_bound, &n_reused, NULL);
+  g_assert_cmpuint (n_bound, <=, VALENT_LAN_AUX_MAX - VALENT_LAN_AUX_MIN + 1);
+  g_assert_cmpuint (n_reused, >, 0);
+
+  /* Listeners returned by the first round are reused by the second, without
+   * binding the range again */
+  median = upload_concurrent (fixture, file);
+  g_assert_cmpint (median, <, G_USEC_PER_SEC);
+
+  valent_lan_port_pool_get_stats (pool, &n_bound_after, &n_reused_after, NULL);
+  g_assert_cmpuint (n_bound_after, ==, n_bound);
+  g_assert_cmpuint (n_reused_after - n_reused, >=, n_bound);
+
+  /* Uploads still work after the service has closed the pool */
+  valent_channel_service_stop (fixture->service);
+
+  packet = json_object_get_member (json_node_get_object (fixture->packets),
+                                   "transfer");
+  valent_channel_read_packet (fixture->endpoint,
+                              NULL,
+                              (GAsyncReadyCallback)accept_upload_cb,
+                              NULL);
+  valent_test_upload (fixture->channel, packet, file, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_lan_port_pool (void)
+{
+  g_autoptr (ValentLanPortPool) pool = NULL;
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GSocketClient) client = NULL;
+  g_autoptr (GSocketConnection) stale = NULL;
+  unsigned int n_bound, n_reused, n_drained;
+  guint16 port, reused_port;
+  char c;
+  GError *error = NULL;
+
+  pool = valent_lan_port_pool_new (VALENT_LAN_AUX_MIN, VALENT_LAN_AUX_MAX, 1);
+  valent_lan_port_pool_get_stats (pool, &n_bound, &n_reused, &n_drained);
+  g_assert_cmpuint (n_bound, ==, 1);
+  g_assert_cmpuint (n_reused, ==, 0);
+  g_assert_cmpuint (n_drained, ==, 0);
+
+  /* Released sockets are leased again, without binding */
+  listener = valent_lan_port_pool_lease (pool, &port, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (port, >=, VALENT_LAN_AUX_MIN);
+  g_assert_cmpuint (port, <=, VALENT_LAN_AUX_MAX);
+  valent_lan_port_pool_release (pool, g_steal_pointer (&listener), port, TRUE);
+
+  /* A connection made while the socket is idle is closed by the next lease */
+  client = g_object_new (G_TYPE_SOCKET_CLIENT,
+                         "enable-proxy", FALSE,
+                         NULL);
+  stale = g_socket_client_connect_to_host (client, "127.0.0.1", port,
+                                           NULL, &error);
+  g_assert_no_error (error);
+
+  listener = valent_lan_port_pool_lease (pool, &reused_port, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (reused_port, ==, port);
+
+  g_assert_cmpint (g_input_stream_read (g_io_stream_get_input_stream (G_IO_STREAM (stale)),
+                                        &c, 1, NULL, NULL), <=, 0);
+  valent_lan_port_pool_release (pool, g_steal_pointer (&listener), port, TRUE);
+
+  valent_lan_port_pool_get_stats (pool, &n_bound, &n_reused, &n_drained);
+  g_assert_cmpuint (n_bound, ==, 1);
+  g_assert_cmpuint (n_reused, ==, 2);
+  g_assert_cmpuint (n_drained, ==, 1);
+
+  /* Once closed, the pool probes for a port and doesn't keep the socket */
+  valent_lan_port_pool_close (pool);
+  listener = valent_lan_port_pool_lease (pool, &port, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (listener);
+  valent_lan_port_pool_release (pool, g_steal_pointer (&listener), port, TRUE);
+
+  listener = valent_lan_port_pool_lease (pool, &port, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (listener);
+  valent_lan_port_pool_release (pool, g_steal_pointer (&listener), port, TRUE);
+
+  valent_lan_port_pool_get_stats (pool, &n_bound, &n_reused, &n_drained);
+  g_assert_cmpuint (n_bound, ==, 1);
+  g_assert_cmpuint (n_reused, ==, 2);
+}
+
+typedef struct
+{
+  ValentLanMux *mux;
+  gint64        id;
+  const char   *data;
+  GError       *error;
+} MuxUploadData;
+
+static gpointer
+mux_upload_thread (gpointer data)
+{
+  MuxUploadData *upload = data;
+  g_autoptr (GIOStream) stream = NULL;
+
+  stream = valent_lan_mux_accept (upload->mux, upload->id, NULL, &upload->error);
+
+  if (stream != NULL &&
+      g_output_stream_write_all (g_io_stream_get_output_stream (stream),
+                                 upload->data,
+                                 strlen (upload->data),
+                                 NULL,
+                                 NULL,
+                                 &upload->error))
+    g_io_stream_close (stream, NULL, &upload->error);
+
+  return NULL;
+}
+
+static void
+test_lan_mux (void)
+{
+  g_autoptr (GTlsCertificate) certificate = NULL;
+  g_autoptr (GTlsCertificate) peer_certificate = NULL;
+  g_autoptr (ValentLanMux) uploader = NULL;
+  g_autoptr (ValentLanMux) downloader = NULL;
+  g_autoptr (JsonObject) info = NULL;
+  g_autoptr (GIOStream) stream = NULL;
+  g_autoptr (GError) write_error = NULL;
+  unsigned int n_links, n_sessions;
+  gint64 id;
+  GError *error = NULL;
+
+  certificate = create_certificate ("uploader");
+  peer_certificate = create_certificate ("downloader");
+  uploader = valent_lan_mux_new (certificate, peer_certificate, "127.0.0.1", NULL);
+  downloader = valent_lan_mux_new (peer_certificate, certificate, "127.0.0.1", NULL);
+
+  /* Several payloads are sent over the one connection */
+  for (unsigned int i = 0; i < N_MUX_UPLOADS; i++)
+    {
+      g_autoptr (JsonObject) payload_info = NULL;
+      g_autoptr (GIOStream) payload = NULL;
+      g_autoptr (GOutputStream) target = NULL;
+      g_autoptr (GThread) thread = NULL;
+      g_autofree char *data = NULL;
+      MuxUploadData upload = { 0, };
+
+      /* Larger than one frame */
+      data = g_strnfill (100 * 1024 + i, 'a' + i);
+
+      payload_info = json_object_new ();
+      upload.mux = uploader;
+      upload.id = valent_lan_mux_listen (uploader, payload_info, &error);
+      upload.data = data;
+      g_assert_no_error (error);
+      g_assert_cmpint (upload.id, >, 0);
+
+      thread = g_thread_new ("mux-upload", mux_upload_thread, &upload);
+
+      payload = valent_lan_mux_download (downloader, payload_info, NULL, &error);
+      g_assert_no_error (error);
+
+      target = g_memory_output_stream_new_resizable ();
+      g_output_stream_splice (target,
+                              g_io_stream_get_input_stream (payload),
+                              (G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                               G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET),
+                              NULL,
+                              &error);
+      g_assert_no_error (error);
+      g_io_stream_close (payload, NULL, NULL);
+
+      g_thread_join (g_steal_pointer (&thread));
+      g_assert_no_error (upload.error);
+
+      g_assert_cmpmem (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (target)),
+                       g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (target)),
+                       data,
+                       strlen (data));
+    }
+
+  valent_lan_mux_get_stats (uploader, &n_links, &n_sessions);
+  g_assert_cmpuint (n_links, ==, 1);
+  g_assert_cmpuint (n_sessions, ==, N_MUX_UPLOADS);
+
+  /* An upload whose packet couldn't be sent fails, instead of waiting */
+  info = json_object_new ();
+  id = valent_lan_mux_listen (uploader, info, &error);
+  g_assert_no_error (error);
+
+  write_error = g_error_new_literal (G_IO_ERROR,
+                                     G_IO_ERROR_WOULD_BLOCK,
+                                     "Channel queue is full");
+  valent_lan_mux_fail (uploader, id, write_error);
+
+  stream = valent_lan_mux_accept (uploader, id, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+  g_assert_null (stream);
+  g_clear_error (&error);
+
+  valent_lan_mux_close (downloader);
+  valent_lan_mux_close (uploader);
+}
+
+typedef struct
+{
+  GSocketListener *listener;
+  GTlsCertificate *certificate;
+  GTlsCertificate *peer_certificate;
+  GError          *error;
+} SessionServerData;
+
+static gpointer
+session_server_thread (gpointer data)
+{
+  SessionServerData *server = data;
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GIOStream) stream = NULL;
+
+  connection = g_socket_listener_accept (server->listener,
+                                         NULL,
+                                         NULL,
+                                         &server->error);
+
+  if (connection == NULL)
+    return NULL;
+
+  stream = valent_lan_encrypt_server (connection,
+                                      server->certificate,
+                                      server->peer_certificate,
+                                      NULL,
+                                      &server->error);
+
+  if (stream == NULL)
+    return NULL;
+
+  /* With TLS 1.3, the client only gets a session ticket once it reads */
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (stream),
+                                  "ping", 4, NULL,
+                                  NULL,
+                                  &server->error))
+    return NULL;
+
+  return g_steal_pointer (&stream);
+}
+
+static void
+test_lan_session_cache (void)
+{
+  g_autoptr (GTlsCertificate) certificate = NULL;
+  g_autoptr (GTlsCertificate) peer_certificate = NULL;
+  g_autoptr (GSocketListener) listener = NULL;
+  g_autoptr (GSocketClient) client = NULL;
+  g_autoptr (GPtrArray) streams = NULL;
+  g_autofree char *peer_pem = NULL;
+  g_autofree char *peer_dir = NULL;
+  g_autofree char *peer_path = NULL;
+  SessionServerData server = { 0, };
+  unsigned int hits, misses;
+  unsigned int hits_before, misses_before;
+  guint16 port;
+  GError *error = NULL;
+
+  certificate = create_certificate ("session-client");
+  peer_certificate = create_certificate ("session-server");
+
+  /* Sessions are only cached for paired devices */
+  peer_dir = g_build_filename (g_get_user_config_dir (),
+                               PACKAGE_NAME,
+                               valent_certificate_get_common_name (peer_certificate),
+                               NULL);
+  peer_path = g_build_filename (peer_dir, "certificate.pem", NULL);
+  g_object_get (peer_certificate, "certificate-pem", &peer_pem, NULL);
+  g_assert_cmpint (g_mkdir_with_parents (peer_dir, 0700), ==, 0);
+  g_file_set_contents (peer_path, peer_pem, -1, &error);
+  g_assert_no_error (error);
+
+  listener = g_socket_listener_new ();
+  port = g_socket_listener_add_any_inet_port (listener, NULL, &error);
+  g_assert_no_error (error);
+
+  server.listener = listener;
+  server.certificate = peer_certificate;
+  server.peer_certificate = certificate;
+
+  client = g_socket_client_new ();
+  streams = g_ptr_array_new_with_free_func (g_object_unref);
+  valent_lan_session_cache_get_stats (&hits_before, &misses_before);
+
+  /* Connect twice; the second connection resumes the first one's session.
+   * Criticals are fatal, so misusing the TLS backend fails the test too. */
+  for (unsigned int i = 0; i < 2; i++)
+    {
+      g_autoptr (GSocketConnection) connection = NULL;
+      g_autoptr (GIOStream) stream = NULL;
+      g_autoptr (GThread) thread = NULL;
+      GIOStream *server_stream;
+      char buf[4] = { 0, };
+
+      thread = g_thread_new ("session-server", session_server_thread, &server);
+
+      connection = g_socket_client_connect_to_host (client,
+                                                    "127.0.0.1",
+                                                    port,
+                                                    NULL,
+                                                    &error);
+      g_assert_no_error (error);
+
+      stream = valent_lan_encrypt_client (connection,
+                                          certificate,
+                                          peer_certificate,
+                                          NULL,
+                                          &error);
+      g_assert_no_error (error);
+
+      g_input_stream_read_all (g_io_stream_get_input_stream (stream),
+                               buf, sizeof (buf), NULL,
+                               NULL,
+                               &error);
+      g_assert_no_error (error);
+      g_assert_cmpmem (buf, sizeof (buf), "ping", 4);
+
+      server_stream = g_thread_join (g_steal_pointer (&thread));
+      g_assert_no_error (server.error);
+      g_ptr_array_add (streams, server_stream);
+      g_ptr_array_add (streams, g_steal_pointer (&stream));
+
+      valent_lan_session_cache_get_stats (&hits, &misses);
+      g_assert_cmpuint (hits, ==, hits_before + i);
+      g_assert_cmpuint (misses, ==, misses_before + 1);
+    }
+
+  for (unsigned int i = 0; i < streams->len; i++)
+    g_io_stream_close (g_ptr_array_index (streams, i), NULL, NULL);
+
+  g_socket_listener_close (listener);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -495,6 +1416,24 @@ main (int   argc,
               test_lan_service_incoming_broadcast,
               lan_service_fixture_tear_down);
 
+  g_test_add ("/backends/lan-backend/stalled-handshake",
+              LanBackendFixture, GUINT_TO_POINTER (TRUE),
+              lan_service_fixture_set_up,
+              test_lan_service_incoming_broadcast,
+              lan_service_fixture_tear_down);
+
+  g_test_add ("/backends/lan-backend/redundant-identity",
+              LanBackendFixture, NULL,
+              lan_service_fixture_set_up,
+              test_lan_service_redundant_identity,
+              lan_service_fixture_tear_down);
+
+  g_test_add ("/backends/lan-backend/contact-backoff",
+              LanBackendFixture, NULL,
+              lan_service_fixture_set_up,
+              test_lan_service_contact_backoff,
+              lan_service_fixture_tear_down);
+
   g_test_add ("/backends/lan-backend/outgoing-broadcast",
               LanBackendFixture, NULL,
               lan_service_fixture_set_up,
@@ -507,5 +1446,20 @@ main (int   argc,
               test_lan_service_channel,
               lan_service_fixture_tear_down);
 
+  g_test_add ("/backends/lan-backend/channel-port-pool",
+              LanBackendFixture, NULL,
+              lan_service_fixture_set_up,
+              test_lan_service_port_pool,
+              lan_service_fixture_tear_down);
+
+  g_test_add_func ("/backends/lan-backend/port-pool",
+                   test_lan_port_pool);
+
+  g_test_add_func ("/backends/lan-backend/mux",
+                   test_lan_mux);
+
+  g_test_add_func ("/backends/lan-backend/session-cache",
+                   test_lan_session_cache);
+
   return g_test_run ();
 }